@@ -31,6 +31,7 @@
 #include "../tests/common/simplethread.h"
 #include "../tests/common/systemtime.h"
 #include "cpuid.h"
+#include "perfcounters.h"
 
 using namespace moodycamel;
 
@@ -59,6 +60,8 @@ enum benchmark_type_t
 	bench_empty_dequeue,
 	bench_enqueue_dequeue_pairs,
 	bench_heavy_concurrent,
+	bench_large_bulk,
+	bench_skewed_producers,
 	
 	BENCHMARK_TYPE_COUNT
 };
@@ -80,7 +83,9 @@ const char BENCHMARK_SHORT_NAMES[BENCHMARK_TYPE_COUNT][32] = {
 	"mpsc",
 	"empty_dequeue",
 	"enqueue_dequeue_pairs",
-	"heavy_concurrent"
+	"heavy_concurrent",
+	"large_bulk",
+	"skewed_producers"
 };
 
 const char BENCHMARK_NAMES[BENCHMARK_TYPE_COUNT][64] = {
@@ -100,7 +105,9 @@ const char BENCHMARK_NAMES[BENCHMARK_TYPE_COUNT][64] = {
 	"multi-producer, single-consumer",
 	"dequeue from empty",
 	"enqueue-dequeue pairs",
-	"heavy concurrent"
+	"heavy concurrent",
+	"large items in bulk",
+	"skewed producer rates"
 };
 
 const char BENCHMARK_DESCS[BENCHMARK_TYPE_COUNT][256] = {
@@ -120,7 +127,9 @@ const char BENCHMARK_DESCS[BENCHMARK_TYPE_COUNT][256] = {
 	"Measures the average speed of dequeueing with only one consumer, but multiple producers",
 	"Measures the average speed of attempting to dequeue from an empty queue\n  (that eight separate threads had at one point enqueued to)",
 	"Measures the average operation speed with each thread doing an enqueue\n  followed by a dequeue",
-	"Measures the average operation speed with many threads under heavy load"
+	"Measures the average operation speed with many threads under heavy load",
+	"Measures the average speed of enqueueing and then dequeueing large (256-byte) items in bulk,\n  with a large block size",
+	"Measures the average operation speed when half the threads are producers whose output\n  drops off geometrically (each produces half as much as the previous one), and half are consumers"
 };
 
 const char BENCHMARK_SINGLE_THREAD_NOTES[BENCHMARK_TYPE_COUNT][256] = {
@@ -140,6 +149,8 @@ const char BENCHMARK_SINGLE_THREAD_NOTES[BENCHMARK_TYPE_COUNT][256] = {
 	"",
 	"No contention -- measures raw failed dequeue speed on empty queue",
 	"No contention -- measures speed of immediately dequeueing the item that was just enqueued",
+	"",
+	"",
 	""
 };
 
@@ -161,6 +172,8 @@ int BENCHMARK_THREADS_MEASURED[BENCHMARK_TYPE_COUNT] = {
 	0,
 	0,
 	0,
+	0,
+	0,
 };
 
 int BENCHMARK_THREADS[BENCHMARK_TYPE_COUNT][9] = {
@@ -181,6 +194,8 @@ int BENCHMARK_THREADS[BENCHMARK_TYPE_COUNT][9] = {
 	{ 1, 2, 8, 32,  0,  0,  0,  0, 0 },
 	{ 1, 2, 4,  8, 32,  0,  0,  0, 0 },
 	{ 2, 3, 4,  8, 12, 16, 32, 48, 0 },
+	{ 1, 2, 4,  8,  0,  0,  0,  0, 0 },
+	{ 2, 4, 8, 16,  0,  0,  0,  0, 0 },
 };
 
 enum queue_id_t
@@ -192,6 +207,8 @@ enum queue_id_t
 	queue_simplelockfree,
 	queue_lockbased,
 	queue_std,
+	queue_moodycamel_ConcurrentQueue_prefetch,
+	queue_moodycamel_ConcurrentQueue_adaptive,
 	
 	QUEUE_COUNT
 };
@@ -204,6 +221,8 @@ const char QUEUE_NAMES[QUEUE_COUNT][64] = {
 	"SimpleLockFreeQueue",
 	"LockBasedQueue",
 	"std::queue",
+	"moodycamel::ConcurrentQueue (prefetching)",
+	"moodycamel::ConcurrentQueue (adaptive rotation)",
 };
 
 const char QUEUE_SUMMARY_NOTES[QUEUE_COUNT][128] = {
@@ -214,6 +233,8 @@ const char QUEUE_SUMMARY_NOTES[QUEUE_COUNT][128] = {
 	"",
 	"",
 	"single thread only",
+	"bulk only",
+	"balanced, mpsc, heavy_concurrent and skewed_producers only",
 };
 
 const bool QUEUE_TOKEN_SUPPORT[QUEUE_COUNT] = {
@@ -224,6 +245,8 @@ const bool QUEUE_TOKEN_SUPPORT[QUEUE_COUNT] = {
 	false,
 	false,
 	false,
+	true,
+	true,
 };
 
 const int QUEUE_MAX_THREADS[QUEUE_COUNT] = {
@@ -234,16 +257,20 @@ const int QUEUE_MAX_THREADS[QUEUE_COUNT] = {
 	-1,
 	-1,
 	1,
+	-1,
+	-1,
 };
 
 const bool QUEUE_BENCH_SUPPORT[QUEUE_COUNT][BENCHMARK_TYPE_COUNT] = {
-	{ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 },
-	{ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 },
-	{ 1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 1 },
-	{ 1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 1 },
-	{ 1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 1 },
-	{ 1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 1 },
-	{ 0, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0 },
+	{ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 },
+	{ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1 },
+	{ 1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 1, 0, 1 },
+	{ 1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 1, 0, 1 },
+	{ 1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 1, 0, 1 },
+	{ 1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 1, 0, 1 },
+	{ 0, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0 },
+	{ 0, 0, 0, 1, 1, 0, 1, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 1, 0 },
+	{ 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 0, 1 },
 };
 
 
@@ -256,10 +283,44 @@ struct Traits : public moodycamel::ConcurrentQueueDefaultTraits
 	static const size_t BLOCK_SIZE = 64;
 };
 
+struct PrefetchTraits : public Traits
+{
+	static const bool PREFETCH_NEXT_BLOCK = true;
+};
+
+struct AdaptiveRotationTraits : public Traits
+{
+	static const bool ADAPTIVE_CONSUMER_ROTATION = true;
+};
+
+// Large items and large blocks are where prefetching the next block
+// during bulk operations is expected to matter most
+struct LargeItem
+{
+	std::uint64_t payload[32];
+};
+
+struct LargeItemTraits : public Traits
+{
+	static const size_t BLOCK_SIZE = 256;
+};
+
+struct LargeItemPrefetchTraits : public LargeItemTraits
+{
+	static const bool PREFETCH_NEXT_BLOCK = true;
+};
+
+// Maps each benchmarked queue to its large-item equivalent (if it has one)
+template<typename TQueue> struct LargeItemQueue { typedef void type; };
+template<> struct LargeItemQueue<moodycamel::ConcurrentQueue<int, Traits>> { typedef moodycamel::ConcurrentQueue<LargeItem, LargeItemTraits> type; };
+template<> struct LargeItemQueue<moodycamel::ConcurrentQueue<int, PrefetchTraits>> { typedef moodycamel::ConcurrentQueue<LargeItem, LargeItemPrefetchTraits> type; };
+
 
 typedef std::uint64_t counter_t;
 
 const counter_t BULK_BATCH_SIZE = 2300;
+const counter_t LARGE_BULK_BATCH_SIZE = 1000;
+const counter_t LARGE_BULK_BATCHES_PER_ROUND = 16;		// Caps what each thread has enqueued at once (to about 4MB)
 
 struct BenchmarkResult
 {
@@ -295,6 +356,81 @@ counter_t adjustForThreads(counter_t suggestedOps, int nthreads)
 }
 
 
+// Every thread enqueues maxOps batches of large items and dequeues as many, in rounds of up to
+// LARGE_BULK_BATCHES_PER_ROUND batches enqueued then dequeued. Returns the total time taken by
+// all threads, in ms
+template<typename TLargeQueue>
+double runLargeItemBulkBenchmark(int nthreads, bool useTokens, counter_t maxOps)
+{
+	TLargeQueue q;
+	std::vector<SimpleThread> threads(nthreads);
+	std::vector<double> timings(nthreads);
+	std::atomic<int> ready(0);
+	for (int tid = 0; tid != nthreads; ++tid) {
+		threads[tid] = SimpleThread([&](int id) {
+			std::vector<LargeItem> items(LARGE_BULK_BATCH_SIZE);
+			for (counter_t i = 0; i != LARGE_BULK_BATCH_SIZE; ++i) {
+				items[i].payload[0] = i;
+			}
+			typename TLargeQueue::producer_token_t prodTok(q);
+			typename TLargeQueue::consumer_token_t consTok(q);
+			ready.fetch_add(1, std::memory_order_relaxed);
+			while (ready.load(std::memory_order_relaxed) != nthreads)
+				continue;
+			
+			auto start = getSystemTime();
+			for (counter_t done = 0; done != maxOps; ) {
+				counter_t batches = std::min(maxOps - done, LARGE_BULK_BATCHES_PER_ROUND);
+				for (counter_t i = 0; i != batches; ++i) {
+					if (useTokens) {
+						q.enqueue_bulk(prodTok, items.data(), items.size());
+					}
+					else {
+						q.enqueue_bulk(items.data(), items.size());
+					}
+				}
+				for (counter_t i = 0; i != batches; ++i) {
+					if (useTokens) {
+						q.try_dequeue_bulk(consTok, items.data(), items.size());
+					}
+					else {
+						q.try_dequeue_bulk(items.data(), items.size());
+					}
+				}
+				done += batches;
+			}
+			timings[id] = getTimeDelta(start);
+		}, tid);
+	}
+	double result = 0;
+	for (int tid = 0; tid != nthreads; ++tid) {
+		threads[tid].join();
+		result += timings[tid];
+	}
+	return result;
+}
+
+template<>
+double runLargeItemBulkBenchmark<void>(int, bool, counter_t)
+{
+	return 0;
+}
+
+template<typename TLargeQueue>
+counter_t determineMaxOpsForLargeItemBulkBenchmark(int nthreads)
+{
+	return adjustForThreads(rampUpToMeasurableNumberOfMaxOps([](counter_t ops) {
+		return runLargeItemBulkBenchmark<TLargeQueue>(1, true, ops);
+	}, 1), nthreads);
+}
+
+template<>
+counter_t determineMaxOpsForLargeItemBulkBenchmark<void>(int)
+{
+	return 0;
+}
+
+
 template<typename TQueue>
 counter_t determineMaxOpsForBenchmark(benchmark_type_t benchmark, int nthreads, bool useTokens, unsigned int randSeed)
 {
@@ -400,7 +536,8 @@ counter_t determineMaxOpsForBenchmark(benchmark_type_t benchmark, int nthreads,
 		}), nthreads);
 	}
 	
-	case bench_heavy_concurrent: {
+	case bench_heavy_concurrent:
+	case bench_skewed_producers: {
 		return adjustForThreads(rampUpToMeasurableNumberOfMaxOps([](counter_t ops) {
 			TQueue q;
 			int item;
@@ -413,6 +550,10 @@ counter_t determineMaxOpsForBenchmark(benchmark_type_t benchmark, int nthreads,
 		}), nthreads);
 	}
 	
+	case bench_large_bulk: {
+		return determineMaxOpsForLargeItemBulkBenchmark<typename LargeItemQueue<TQueue>::type>(nthreads);
+	}
+	
 	default:
 		assert(false && "Every benchmark type must be handled here!");
 		return 0;
@@ -1620,6 +1761,80 @@ double runBenchmark(benchmark_type_t benchmark, int nthreads, bool useTokens, un
 		break;
 	}
 	
+	case bench_large_bulk: {
+		// Measures the average speed of enqueueing and then dequeueing large items in bulk
+		out_opCount = maxOps * LARGE_BULK_BATCH_SIZE * 2 * nthreads;
+		result = runLargeItemBulkBenchmark<typename LargeItemQueue<TQueue>::type>(nthreads, useTokens, maxOps);
+		break;
+	}
+	
+	case bench_skewed_producers: {
+		// Measures the average operation speed with producers of very different rates
+		TQueue q;
+		int producers = nthreads / 2;
+		counter_t totalItems = 0;
+		for (int tid = 0; tid != producers; ++tid) {
+			totalItems += std::max<counter_t>(maxOps >> std::min(tid, 16), 1);
+		}
+		out_opCount = totalItems * 2;
+		std::vector<SimpleThread> threads(nthreads);
+		std::vector<double> timings(nthreads);
+		std::atomic<int> ready(0);
+		std::atomic<counter_t> dequeued(0);
+		for (int tid = 0; tid != nthreads; ++tid) {
+			threads[tid] = SimpleThread([&](int id) {
+				ready.fetch_add(1, std::memory_order_relaxed);
+				while (ready.load(std::memory_order_relaxed) != nthreads)
+					continue;
+				
+				auto start = getSystemTime();
+				if (id < producers) {
+					counter_t count = std::max<counter_t>(maxOps >> std::min(id, 16), 1);
+					if (useTokens) {
+						typename TQueue::producer_token_t prodTok(q);
+						for (counter_t i = 0; i != count; ++i) {
+							q.enqueue(prodTok, i);
+						}
+					}
+					else {
+						for (counter_t i = 0; i != count; ++i) {
+							q.enqueue(i);
+						}
+					}
+				}
+				else {
+					// Successes are only published every so often (and on every failure),
+					// so that the bookkeeping doesn't dominate
+					int item;
+					counter_t local = 0;
+					typename TQueue::consumer_token_t consTok(q);
+					while (true) {
+						if (useTokens ? q.try_dequeue(consTok, item) : q.try_dequeue(item)) {
+							if (++local == 256) {
+								dequeued.fetch_add(local, std::memory_order_relaxed);
+								local = 0;
+							}
+						}
+						else {
+							dequeued.fetch_add(local, std::memory_order_relaxed);
+							local = 0;
+							if (dequeued.load(std::memory_order_relaxed) == totalItems) {
+								break;
+							}
+						}
+					}
+				}
+				timings[id] = getTimeDelta(start);
+			}, tid);
+		}
+		result = 0;
+		for (int tid = 0; tid != nthreads; ++tid) {
+			threads[tid].join();
+			result += timings[tid];
+		}
+		break;
+	}
+	
 	default:
 		assert(false && "Every benchmark type must be handled here!");
 		result = 0;
@@ -1739,6 +1954,31 @@ static const char* pretty(double num)
 	return buf;
 }
 
+#ifdef MOODYCAMEL_CYCLE_ACCOUNTING
+// Prints where the moodycamel queues spent their time since the cycle stats were last
+// reset, step by step: the average ticks per timed call of each step, and how many
+// ticks it accounts for per operation (of all the given operations). The calibrated
+// cost of the timing itself has already been taken off.
+// Not thread safe.
+static void printCycleStats(int indent, moodycamel::CycleStats const& stats, double operations)
+{
+	struct { const char* name; moodycamel::CyclePhaseStats phase; } phases[] = {
+		{ "Implicit hash lookup", stats.implicitHashLookup },
+		{ "Block index lookup", stats.blockIndexLookup },
+		{ "Free list pop", stats.freeListPop },
+		{ "Element construction", stats.elementConstruction },
+		{ "Tail publish", stats.tailPublish },
+	};
+	for (auto const& p : phases) {
+		if (p.phase.calls != 0) {
+			sayf(indent, "%-20s  Ticks/call: %7s  Ticks/op: %7s  Calls: %7s\n", p.name, pretty(safe_divide((double)p.phase.ticks, (double)p.phase.calls)),
+				pretty(safe_divide((double)p.phase.ticks, operations)), pretty((double)p.phase.calls));
+		}
+	}
+	sayf(indent, "(Timing overhead taken off each call: %s ticks)\n", pretty((double)stats.overheadTicks));
+}
+#endif
+
 void printBenchmarkNames()
 {
 	std::printf("   Supported benchmarks are:\n");
@@ -1860,6 +2100,17 @@ int main(int argc, char** argv)
 	sayf(4, "'Ops/s/t': Operations per second per thread (inverse of 'Avg')\n");
 	sayf(4, "Operations include those that fail (e.g. because the queue is empty).\n");
 	sayf(4, "Each logical enqueue/dequeue counts as an individual operation when in bulk.\n");
+	
+	// Hardware counters are read around each whole benchmark run (so including its setup),
+	// and summed over all the threads
+	HwCounters hwCounters;
+	if (hwCounters.anyAvailable()) {
+		sayf(4, "'Cycles/op', 'Cache misses/op', 'LLC misses/op', 'Branch misses/op':\n");
+		sayf(4, "           Hardware counters per operation (all threads, user space only)\n");
+	}
+	else {
+		sayf(4, "Note: Hardware counters unavailable (perf_event_open: %s)\n", hwCounters.error());
+	}
 	sayf(0, "\n");
 	
 	
@@ -1984,6 +2235,12 @@ int main(int argc, char** argv)
 					case queue_std:
 						maxOps = determineMaxOpsForBenchmark<StdQueueWrapper<int>>((benchmark_type_t)benchmark, nthreads, (bool)useTokens, seed);
 						break;
+					case queue_moodycamel_ConcurrentQueue_prefetch:
+						maxOps = determineMaxOpsForBenchmark<moodycamel::ConcurrentQueue<int, PrefetchTraits>>((benchmark_type_t)benchmark, nthreads, (bool)useTokens, seed);
+						break;
+					case queue_moodycamel_ConcurrentQueue_adaptive:
+						maxOps = determineMaxOpsForBenchmark<moodycamel::ConcurrentQueue<int, AdaptiveRotationTraits>>((benchmark_type_t)benchmark, nthreads, (bool)useTokens, seed);
+						break;
 					default:
 						assert(false && "There should be a case here for every queue in the benchmarks!");
 					}
@@ -1991,10 +2248,15 @@ int main(int argc, char** argv)
 					
 					int maxThreads = QUEUE_MAX_THREADS[queue];
 					std::vector<BenchmarkResult> results(ITERATIONS);
+					double hwTotals[HW_COUNTER_COUNT] = { 0 };
+#ifdef MOODYCAMEL_CYCLE_ACCOUNTING
+					moodycamel::reset_cycle_stats();
+#endif
 					for (int i = 0; i < ITERATIONS; ++i) {
 						double elapsed;
 						counter_t ops = 0;
 						
+						hwCounters.start();
 						switch ((queue_id_t)queue) {
 						case queue_moodycamel_ConcurrentQueue:
 							elapsed = runBenchmark<moodycamel::ConcurrentQueue<int, Traits>>((benchmark_type_t)benchmark, nthreads, (bool)useTokens, seed, maxOps, maxThreads, ops);
@@ -2017,9 +2279,16 @@ int main(int argc, char** argv)
 						case queue_std:
 							elapsed = runBenchmark<StdQueueWrapper<int>>((benchmark_type_t)benchmark, nthreads, (bool)useTokens, seed, maxOps, maxThreads, ops);
 							break;
+						case queue_moodycamel_ConcurrentQueue_prefetch:
+							elapsed = runBenchmark<moodycamel::ConcurrentQueue<int, PrefetchTraits>>((benchmark_type_t)benchmark, nthreads, (bool)useTokens, seed, maxOps, maxThreads, ops);
+							break;
+						case queue_moodycamel_ConcurrentQueue_adaptive:
+							elapsed = runBenchmark<moodycamel::ConcurrentQueue<int, AdaptiveRotationTraits>>((benchmark_type_t)benchmark, nthreads, (bool)useTokens, seed, maxOps, maxThreads, ops);
+							break;
 						default:
 							assert(false && "There should be a case here for every queue in the benchmarks!");
 						}
+						hwCounters.stop(hwTotals);
 
 						results[i].elapsedTime = elapsed;
 						results[i].operations = ops;
@@ -2056,6 +2325,21 @@ int main(int argc, char** argv)
 					if (nthreads == 1 && BENCHMARK_SINGLE_THREAD_NOTES[benchmark][0] != '\0') {
 						sayf(indent + 7, "^ Note: %s\n", BENCHMARK_SINGLE_THREAD_NOTES[benchmark]);
 					}
+					
+					double allOps = 0;
+					for (int i = 0; i != ITERATIONS; ++i) {
+						allOps += (double)results[i].operations;
+					}
+					if (hwCounters.anyAvailable()) {
+						const char* perOp[HW_COUNTER_COUNT];
+						for (int c = 0; c != HW_COUNTER_COUNT; ++c) {
+							perOp[c] = hwCounters.available((hw_counter_t)c) ? pretty(safe_divide(hwTotals[c], allOps)) : "n/a";
+						}
+						sayf(indent + 7, "Cycles/op: %7s  Cache misses/op: %7s  LLC misses/op: %7s  Branch misses/op: %7s\n", perOp[hw_cycles], perOp[hw_cache_misses], perOp[hw_llc_misses], perOp[hw_branch_misses]);
+					}
+#ifdef MOODYCAMEL_CYCLE_ACCOUNTING
+					printCycleStats(indent + 7, moodycamel::cycle_stats(), allOps);
+#endif
 				}
 				
 				opsst = 0;
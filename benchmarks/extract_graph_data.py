@@ -5,34 +5,53 @@
 # performance graphs for enqueuing and dequeueing.
 # The x-axis of the graph is meant to be the number of threads (first column), with
 # the y-axis representing thousands of operations/second/thread (one column per queue).
+# When the benchmarks could read the hardware counters, a third CSV file per graph
+# (e.g. enqueue_counters.csv) has the counters per operation of each queue and thread count.
 
 import sys
 import re
 
 
-def extract(bench, log, data, hasBulk = True):
+COUNTER_NAMES = [ 'Cycles', 'Cache misses', 'LLC misses', 'Branch misses' ]
+
+
+def parse_pretty(value):
+	# Undoes the benchmarks' pretty() formatting (e.g. '1.50k' or '0.2500m')
+	multipliers = { 'k': 1e3, 'M': 1e6, 'G': 1e9, 'm': 1e-3, 'u': 1e-6, 'n': 1e-9 }
+	if value[-1] in multipliers:
+		return float(value[:-1]) * multipliers[value[-1]]
+	return float(value)
+
+
+def extract(bench, log, data, counters, hasBulk = True):
 	# data = { thread_count: [ locked, boost, tbb, moodycamel, moodycamel_tok, moodycamel_bulk ], ... }
+	# counters = [ [ thread_count, queue, cycles, cache_misses, llc_misses, branch_misses ], ... ] (per operation)
 	
-	def do_extract(bench, queue_header):
+	def do_extract(bench, queue_header, queue_name):
 		block = re.search(r'^' + bench + r':.*?' + queue_header + r'\s*(.*?)\s*^\s*Operations per second', log, re.S | re.M | re.I).group(1)
 		for threads, opsst in re.findall(r'^\s*(\d+)\s+thread.*?([0-9\.]+[kMG]?\s*$)', block, re.M | re.I):
 			threads = int(threads)
-			multiplier = 1
-			if opsst[-1] in 'kMG':
-				multiplier = { 'k': 1000, 'M': 1000000, 'G': 1000000000 }[opsst[-1]]
-				opsst = opsst[:-1]
-			opsst = int(float(opsst) * multiplier)
+			opsst = int(parse_pretty(opsst.strip()))
 			if threads not in data:
 				data[threads] = []
 			data[threads].append(opsst)
+		
+		# The counters line (if any) follows its thread count's line (and note)
+		for threads, line in re.findall(r'^\s*(\d+)\s+threads?:[^\n]*\n(?:\s*\^ Note:[^\n]*\n)?\s*(Cycles/op:[^\n]*)', block, re.M | re.I):
+			values = dict(re.findall(r'([A-Za-z][A-Za-z ]*)/op:\s*(\S+)', line))
+			row = [ int(threads), queue_name ]
+			for name in COUNTER_NAMES:
+				value = values.get(name, 'n/a')
+				row.append('' if value == 'n/a' else parse_pretty(value))
+			counters.append(row)
 	
-	do_extract(bench, 'LockBasedQueue')
-	do_extract(bench, 'boost::lockfree::queue')
-	do_extract(bench, 'tbb::concurrent_queue')
-	do_extract(bench, 'Without tokens')
-	do_extract(bench, 'With tokens')
+	do_extract(bench, 'LockBasedQueue', 'std::queue + std::mutex')
+	do_extract(bench, 'boost::lockfree::queue', 'boost::lockfree::queue')
+	do_extract(bench, 'tbb::concurrent_queue', 'tbb::concurrent_queue')
+	do_extract(bench, 'Without tokens', 'moodycamel::ConcurrentQueue (no tokens)')
+	do_extract(bench, 'With tokens', 'moodycamel::ConcurrentQueue')
 	if hasBulk:
-		do_extract(bench + ' bulk', 'With tokens')
+		do_extract(bench + ' bulk', 'With tokens', 'moodycamel::ConcurrentQueue (bulk)')
 
 
 def write_csv(data, path, hasBulk = True):
@@ -45,6 +64,18 @@ def write_csv(data, path, hasBulk = True):
 			f.write('\n')
 
 
+def write_counters_csv(counters, path):
+	if len(counters) == 0:
+		return
+	with open(path, 'w') as f:
+		f.write('threads,queue,' + ','.join('"' + name + '/op"' for name in COUNTER_NAMES) + '\n')
+		for row in sorted(counters, key = lambda row: row[0]):
+			f.write(str(row[0]) + ',"' + row[1] + '"')
+			for value in row[2:]:
+				f.write(',' + str(value))
+			f.write('\n')
+
+
 try:
 	filename = 'benchmarks.log' if len(sys.argv) < 2 else sys.argv[1]
 	with open(filename, 'r') as f:
@@ -52,16 +83,22 @@ try:
 		log = pieces[-1]
 		
 		enq_data = { }
-		extract('only enqueue', log, enq_data)
+		enq_counters = [ ]
+		extract('only enqueue', log, enq_data, enq_counters)
 		
 		deq_data = { }
-		extract('only dequeue', log, deq_data)
+		deq_counters = [ ]
+		extract('only dequeue', log, deq_data, deq_counters)
 		
 		heavy_data = { }
-		extract('heavy concurrent', log, heavy_data, False)
+		heavy_counters = [ ]
+		extract('heavy concurrent', log, heavy_data, heavy_counters, False)
 		
 		write_csv(enq_data, 'enqueue.csv')
 		write_csv(deq_data, 'dequeue.csv')
 		write_csv(heavy_data, 'heavy.csv', False)
+		write_counters_csv(enq_counters, 'enqueue_counters.csv')
+		write_counters_csv(deq_counters, 'dequeue_counters.csv')
+		write_counters_csv(heavy_counters, 'heavy_counters.csv')
 except IOError:
 	print 'Usage: ' + sys.argv[0] + ' path/to/benchmarks.log'
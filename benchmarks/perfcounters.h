@@ -0,0 +1,144 @@
+// Part of the moodycamel::ConcurrentQueue benchmarks; distributed under the same
+// simplified BSD license as the rest of this repository (see the LICENSE.md file
+// that should have come with this file).
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#define MOODYCAMEL_HAS_PERF_EVENTS
+#endif
+
+namespace moodycamel
+{
+	enum hw_counter_t
+	{
+		hw_cycles,
+		hw_cache_misses,
+		hw_llc_misses,
+		hw_branch_misses,
+
+		HW_COUNTER_COUNT
+	};
+
+	// Hardware performance counters for the whole process (including threads created
+	// while they're running), read with perf_event_open on Linux. Only user-space
+	// events are counted, which most perf_event_paranoid settings allow; counters that
+	// can't be opened anyway (no permission, no PMU in a VM, unsupported event, other
+	// platforms) simply read as unavailable.
+	// Not thread safe.
+	class HwCounters
+	{
+	public:
+		HwCounters()
+			: leader(-1), openError(0)
+		{
+			for (int i = 0; i != HW_COUNTER_COUNT; ++i) {
+				fds[i] = -1;
+			}
+#ifdef MOODYCAMEL_HAS_PERF_EVENTS
+			// All in one group, so that they're scheduled (and multiplexed) together
+			static const std::uint32_t types[HW_COUNTER_COUNT] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE };
+			static const std::uint64_t configs[HW_COUNTER_COUNT] = {
+				PERF_COUNT_HW_CPU_CYCLES,
+				PERF_COUNT_HW_CACHE_MISSES,
+				PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+				PERF_COUNT_HW_BRANCH_MISSES
+			};
+			for (int i = 0; i != HW_COUNTER_COUNT; ++i) {
+				perf_event_attr attr;
+				std::memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = types[i];
+				attr.config = configs[i];
+				attr.disabled = leader == -1 ? 1 : 0;		// The rest follow the leader
+				attr.inherit = 1;
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+				fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+				if (fds[i] == -1) {
+					if (openError == 0) {
+						openError = errno;
+					}
+				}
+				else if (leader == -1) {
+					leader = fds[i];
+				}
+			}
+#endif
+		}
+
+		~HwCounters()
+		{
+#ifdef MOODYCAMEL_HAS_PERF_EVENTS
+			for (int i = 0; i != HW_COUNTER_COUNT; ++i) {
+				if (fds[i] != -1) {
+					close(fds[i]);
+				}
+			}
+#endif
+		}
+
+		inline bool available(hw_counter_t counter) const { return fds[counter] != -1; }
+
+		bool anyAvailable() const
+		{
+			for (int i = 0; i != HW_COUNTER_COUNT; ++i) {
+				if (fds[i] != -1) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Why the first counter that couldn't be opened couldn't be (0 if they all could)
+		const char* error() const
+		{
+			return openError == 0 ? "" : std::strerror(openError);
+		}
+
+		// Zeroes the counters and starts counting
+		void start()
+		{
+#ifdef MOODYCAMEL_HAS_PERF_EVENTS
+			if (leader != -1) {
+				ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+				ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+			}
+#endif
+		}
+
+		// Stops counting, and adds what was counted since start to totals (scaled up
+		// for the time the counters weren't scheduled because of multiplexing)
+		void stop(double (&totals)[HW_COUNTER_COUNT])
+		{
+#ifdef MOODYCAMEL_HAS_PERF_EVENTS
+			if (leader == -1) {
+				return;
+			}
+			ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+			for (int i = 0; i != HW_COUNTER_COUNT; ++i) {
+				std::uint64_t values[3];		// value, time enabled, time running
+				if (fds[i] != -1 && read(fds[i], values, sizeof(values)) == (ssize_t)sizeof(values) && values[2] != 0) {
+					totals[i] += (double)values[0] * ((double)values[1] / (double)values[2]);
+				}
+			}
+#else
+			(void)totals;
+#endif
+		}
+
+	private:
+		int fds[HW_COUNTER_COUNT];
+		int leader;
+		int openError;
+	};
+}
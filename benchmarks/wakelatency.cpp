@@ -0,0 +1,107 @@
+// Part of the moodycamel::ConcurrentQueue benchmarks; distributed under the same
+// simplified BSD license as the rest of this repository (see the LICENSE.md file
+// that should have come with this file).
+
+// Measures wake-to-run latency of the semaphores (wait strategies) that
+// BlockingConcurrentQueue can wait on: one thread signals a semaphore another
+// thread is blocked on, and the time until the waiter is actually running
+// again is recorded.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include "../blockingconcurrentqueue.h"
+#include "../tests/common/simplethread.h"
+
+using namespace moodycamel::details::mpmc_sema;
+
+
+static std::int64_t nowNanos()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Gives the other thread time to get back to sleep before it's woken up again
+static void busyWait(std::int64_t nanos)
+{
+	auto end = nowNanos() + nanos;
+	while (nowNanos() < end)
+		continue;
+}
+
+// Ping-pongs between two threads, each blocking on its own semaphore (constructed
+// with the given arguments); returns the wake-to-run latencies observed by the
+// thread being woken, in nanoseconds
+template<typename TSema, typename... Args>
+std::vector<std::int64_t> measureWakeLatency(int rounds, Args... args)
+{
+	TSema ping(args...), pong(args...);
+	std::atomic<std::int64_t> signalledAt(0);
+	std::vector<std::int64_t> latencies(rounds);
+
+	SimpleThread sleeper([&]() {
+		for (int i = 0; i != rounds; ++i) {
+			ping.wait();
+			latencies[i] = nowNanos() - signalledAt.load(std::memory_order_relaxed);
+			pong.signal();
+		}
+	});
+	for (int i = 0; i != rounds; ++i) {
+		busyWait(20000);
+		signalledAt.store(nowNanos(), std::memory_order_relaxed);
+		ping.signal();
+		pong.wait();
+	}
+	sleeper.join();
+
+	std::sort(latencies.begin(), latencies.end());
+	return latencies;
+}
+
+// Also reports the CPU time burned per wakeup (by both threads, including the
+// busy-waiting between rounds), which is where spinning before sleeping shows up
+template<typename TSema, typename... Args>
+void report(const char* name, int rounds, Args... args)
+{
+	auto cpuStart = std::clock();
+	auto latencies = measureWakeLatency<TSema>(rounds, args...);
+	double cpuPerRound = (double)(std::clock() - cpuStart) / CLOCKS_PER_SEC / rounds;
+	double sum = 0;
+	for (auto latency : latencies) {
+		sum += (double)latency;
+	}
+	std::printf("%-24s  Avg: %8.2fus  Median: %8.2fus  99th: %8.2fus  Max: %8.2fus  CPU: %8.2fus\n", name,
+		sum / rounds / 1000.0, latencies[rounds / 2] / 1000.0, latencies[rounds * 99 / 100] / 1000.0, latencies.back() / 1000.0, cpuPerRound * 1000000.0);
+}
+
+int main(int argc, char** argv)
+{
+	int rounds = 20000;
+	if (argc > 1) {
+		rounds = std::max(std::atoi(argv[1]), 1);
+	}
+
+	std::printf("Wake-to-run latency over %d wakeups:\n", rounds);
+#if defined(__unix__) && !defined(__MACH__)
+	report<PosixSemaphore>("sem_t", rounds);
+#endif
+#ifdef MOODYCAMEL_USE_FUTEX
+	report<FutexSemaphore>("futex", rounds);
+#endif
+#ifdef MOODYCAMEL_HAS_EVENTFD
+	report<EventFdSemaphore>("eventfd", rounds);
+#endif
+	report<moodycamel::CondVarWaitStrategy<>>("condvar", rounds);
+	report<moodycamel::SpinYieldWaitStrategy>("spin-yield", rounds);
+	report<moodycamel::BusySpinWaitStrategy>("busy-spin", rounds);
+	report<LightweightSemaphore>("Lightweight (adaptive)", rounds, 0, 10000, true);
+	report<LightweightSemaphore>("Lightweight (fixed spin)", rounds, 0, 10000, false);
+	report<LightweightSemaphore>("Lightweight (no spin)", rounds, 0, 0, false);
+	return 0;
+}
@@ -12,6 +12,13 @@
 #include <memory>
 #include <chrono>
 #include <ctime>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <emmintrin.h>		// for _mm_pause
+#endif
 
 #if defined(_WIN32)
 // Avoid including windows.h in a header; we only need a handful of
@@ -30,6 +37,32 @@ extern "C" {
 #include <mach/mach.h>
 #elif defined(__unix__)
 #include <semaphore.h>
+// On Linux, threads are put to sleep with futexes directly rather than through sem_t
+// (define MOODYCAMEL_NO_FUTEX to use the POSIX semaphore instead)
+#if defined(__linux__) && !defined(MOODYCAMEL_NO_FUTEX)
+#define MOODYCAMEL_USE_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+// An eventfd-based semaphore is available as a wait strategy on Linux, for consumers
+// that sleep in an epoll loop rather than on the queue itself
+#if defined(__linux__)
+#define MOODYCAMEL_HAS_EVENTFD
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <system_error>
+#endif
+#endif
+
+// C++20 coroutines can wait on a BlockingConcurrentQueue without blocking their
+// thread (see async_dequeue); define MOODYCAMEL_NO_COROUTINES to leave that out
+#if defined(__cpp_impl_coroutine) && defined(__has_include) && !defined(MOODYCAMEL_NO_COROUTINES)
+#if __has_include(<coroutine>)
+#define MOODYCAMEL_HAS_COROUTINES
+#include <coroutine>
+#endif
 #endif
 
 namespace moodycamel
@@ -168,22 +201,22 @@ namespace details
 		//---------------------------------------------------------
 		// Semaphore (POSIX, Linux)
 		//---------------------------------------------------------
-		class Semaphore
+		class PosixSemaphore
 		{
 		private:
 			sem_t m_sema;
 
-			Semaphore(const Semaphore& other) MOODYCAMEL_DELETE_FUNCTION;
-			Semaphore& operator=(const Semaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+			PosixSemaphore(const PosixSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+			PosixSemaphore& operator=(const PosixSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
 
 		public:
-			Semaphore(int initialCount = 0)
+			PosixSemaphore(int initialCount = 0)
 			{
 				assert(initialCount >= 0);
 				sem_init(&m_sema, 0, initialCount);
 			}
 
-			~Semaphore()
+			~PosixSemaphore()
 			{
 				sem_destroy(&m_sema);
 			}
@@ -241,37 +274,442 @@ namespace details
 				}
 			}
 		};
+
+#ifdef MOODYCAMEL_USE_FUTEX
+		//---------------------------------------------------------
+		// Semaphore (Linux futex)
+		// The count itself is the futex word: waiters sleep on it while it's
+		// zero, and signalers only make a system call if someone is asleep.
+		//---------------------------------------------------------
+		class FutexSemaphore
+		{
+		private:
+			std::atomic<int> m_count;
+			std::atomic<int> m_sleepers;
+			
+			FutexSemaphore(const FutexSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+			FutexSemaphore& operator=(const FutexSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+			
+			static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex word must be a plain int");
+			
+			// Sleeps as long as the count is still zero (or until the relative timeout expires,
+			// a signal arrives, or a spurious wakeup occurs -- callers re-check either way)
+			void sleep_while_empty(struct timespec const* timeout)
+			{
+				m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+				syscall(SYS_futex, reinterpret_cast<int*>(&m_count), FUTEX_WAIT_PRIVATE, 0, timeout, nullptr, 0);
+				m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+			}
+		
+		public:
+			FutexSemaphore(int initialCount = 0) : m_count(initialCount), m_sleepers(0)
+			{
+				assert(initialCount >= 0);
+			}
+			
+			void wait()
+			{
+				while (!try_wait())
+				{
+					sleep_while_empty(nullptr);
+				}
+			}
+			
+			bool try_wait()
+			{
+				int oldCount = m_count.load(std::memory_order_relaxed);
+				while (oldCount > 0)
+				{
+					if (m_count.compare_exchange_weak(oldCount, oldCount - 1, std::memory_order_acquire, std::memory_order_relaxed))
+						return true;
+				}
+				return false;
+			}
+			
+			bool timed_wait(std::uint64_t usecs)
+			{
+				// FUTEX_WAIT timeouts are relative (and measured against CLOCK_MONOTONIC),
+				// so the remaining time is recomputed after every wakeup
+				const std::uint64_t nsecs_in_1_sec = 1000000000;
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				std::uint64_t deadline = (std::uint64_t)now.tv_sec * nsecs_in_1_sec + (std::uint64_t)now.tv_nsec + usecs * 1000;
+				while (!try_wait())
+				{
+					clock_gettime(CLOCK_MONOTONIC, &now);
+					std::uint64_t nsecs = (std::uint64_t)now.tv_sec * nsecs_in_1_sec + (std::uint64_t)now.tv_nsec;
+					if (nsecs >= deadline)
+						return false;
+					struct timespec remaining;
+					remaining.tv_sec = (time_t)((deadline - nsecs) / nsecs_in_1_sec);
+					remaining.tv_nsec = (long)((deadline - nsecs) % nsecs_in_1_sec);
+					sleep_while_empty(&remaining);
+				}
+				return true;
+			}
+			
+			void signal(int count = 1)
+			{
+				m_count.fetch_add(count, std::memory_order_seq_cst);
+				if (m_sleepers.load(std::memory_order_seq_cst) > 0)
+				{
+					syscall(SYS_futex, reinterpret_cast<int*>(&m_count), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+				}
+			}
+		};
+		
+		typedef FutexSemaphore Semaphore;
+#else
+		typedef PosixSemaphore Semaphore;
+#endif
+
+#ifdef MOODYCAMEL_HAS_EVENTFD
+		//---------------------------------------------------------
+		// Semaphore (Linux eventfd)
+		// The count lives in an eventfd (in semaphore mode), so besides being
+		// waited on directly, it can be watched with epoll, poll or select
+		// along with other file descriptors; it's readable while positive.
+		//---------------------------------------------------------
+		class EventFdSemaphore
+		{
+		private:
+			int m_fd;
+			
+			EventFdSemaphore(const EventFdSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+			EventFdSemaphore& operator=(const EventFdSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+			
+			// Waits until the eventfd is readable (or the timeout, in milliseconds, expires;
+			// -1 means no timeout). Callers re-check the count either way.
+			void poll_readable(int timeout_msecs)
+			{
+				struct pollfd pfd;
+				pfd.fd = m_fd;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				int rc;
+				do {
+					rc = poll(&pfd, 1, timeout_msecs);
+				} while (rc == -1 && errno == EINTR);
+			}
+		
+		public:
+			// Throws std::system_error if the eventfd can't be created (e.g. when the process
+			// is out of file descriptors); with exceptions disabled, fd() is -1 instead, and
+			// the semaphore must not be used.
+			EventFdSemaphore(int initialCount = 0) : m_fd(eventfd((unsigned int)initialCount, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC))
+			{
+				assert(initialCount >= 0);
+				if (m_fd == -1) {
+					MOODYCAMEL_THROW(std::system_error(errno, std::system_category(), "eventfd"));
+				}
+			}
+			
+			~EventFdSemaphore()
+			{
+				if (m_fd != -1)
+					close(m_fd);
+			}
+			
+			int fd() const
+			{
+				return m_fd;
+			}
+			
+			void wait()
+			{
+				while (!try_wait())
+				{
+					poll_readable(-1);
+				}
+			}
+			
+			bool try_wait()
+			{
+				eventfd_t value;
+				int rc;
+				do {
+					rc = eventfd_read(m_fd, &value);
+				} while (rc == -1 && errno == EINTR);
+				return rc == 0;
+			}
+			
+			bool timed_wait(std::uint64_t usecs)
+			{
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(usecs);
+				while (!try_wait())
+				{
+					auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count();
+					if (remaining <= 0)
+						return false;
+					auto msecs = (remaining + 999) / 1000;
+					poll_readable(msecs < 0x7FFFFFFF ? (int)msecs : 0x7FFFFFFF);
+				}
+				return true;
+			}
+			
+			void signal(int count = 1)
+			{
+				if (count <= 0)
+					return;
+				int rc;
+				do {
+					rc = eventfd_write(m_fd, (eventfd_t)count);
+				} while (rc == -1 && errno == EINTR);
+				// EAGAIN means the count would overflow, i.e. far more signals are pending
+				// than there could ever be waiters to take them; no wakeup is lost by
+				// dropping these. Anything else means the eventfd is unusable.
+				assert(rc == 0 || errno == EAGAIN);
+				(void)rc;
+			}
+		};
+#endif
 #else
 #error Unsupported platform! (No semaphore wrapper available)
 #endif
 
+		//---------------------------------------------------------
+		// Spinning helpers
+		//---------------------------------------------------------
+		// Tells the CPU we're in a spin-wait loop (saves power, and on hyperthreaded
+		// cores leaves more of the pipeline to the sibling thread)
+		static inline void cpu_relax()
+		{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+			__builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+			_mm_pause();
+#elif defined(__GNUC__) && (defined(__aarch64__) || defined(__arm__))
+			__asm__ __volatile__("yield");
+#endif
+			std::atomic_signal_fence(std::memory_order_acquire);	 // Prevent the compiler from collapsing the loop.
+		}
+		
+		// Backoff for the i-th failed attempt of a spin-wait. Most attempts go straight on to
+		// the next, so that a spin costs about one look at whatever is being waited on (for
+		// a consumer, one pass of empty_approx over the producers); every so often the CPU is
+		// paused, and once in a long while the rest of the timeslice is given up, in case
+		// whoever we're waiting for needs this core to make progress.
+		static inline void spin_backoff(int i)
+		{
+			if ((i & 4095) == 4095)
+				std::this_thread::yield();
+			else if ((i & 63) == 63)
+				cpu_relax();
+			else
+				std::atomic_signal_fence(std::memory_order_acquire);	 // Prevent the compiler from collapsing the loop.
+		}
+		
+		// How many times a waiter spins before it goes to sleep. When adaptive, the
+		// budget starts out at the maximum and follows how spinning has been paying off.
+		class SpinBudget
+		{
+		private:
+			int m_maxSpins;
+			bool m_adaptive;
+			std::atomic<int> m_budget;
+		
+		public:
+			SpinBudget(int maxSpins, bool adaptive) : m_maxSpins(maxSpins), m_adaptive(adaptive), m_budget(maxSpins)
+			{
+				assert(maxSpins >= 0);
+			}
+			
+			// How many times to spin before sleeping, this time around
+			int get() const
+			{
+				return m_adaptive ? m_budget.load(std::memory_order_relaxed) : m_maxSpins;
+			}
+			
+			// Feeds the outcome of a wait back into the spin budget: spinning that only paid off
+			// late in the budget (or just barely didn't) suggests a longer budget would help,
+			// while having to sleep anyway means the spinning was wasted. Races between waiters
+			// updating the budget are harmless, it's only a heuristic.
+			void record(int budget, int spins, bool slept)
+			{
+				if (!m_adaptive)
+					return;
+				const int minSpins = m_maxSpins < 64 ? m_maxSpins : 64;
+				if (slept)
+				{
+					if (budget > minSpins)
+						m_budget.store(budget / 2 > minSpins ? budget / 2 : minSpins, std::memory_order_relaxed);
+				}
+				else if (spins >= budget / 2 && budget < m_maxSpins)
+				{
+					m_budget.store(budget < m_maxSpins / 2 ? budget * 2 : m_maxSpins, std::memory_order_relaxed);
+				}
+			}
+		};
+		
+		//---------------------------------------------------------
+		// Semaphores that never put the thread to sleep
+		//---------------------------------------------------------
+		// Polls the count, either pausing the CPU between attempts (busy-spin) or
+		// yielding the rest of the timeslice (spin-yield)
+		template<bool Yield>
+		class PollingSemaphore
+		{
+		private:
+			std::atomic<int> m_count;
+			
+			PollingSemaphore(const PollingSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+			PollingSemaphore& operator=(const PollingSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+			
+			static inline void backoff()
+			{
+				if (Yield)
+					std::this_thread::yield();
+				else
+					cpu_relax();
+			}
+		
+		public:
+			PollingSemaphore(int initialCount = 0) : m_count(initialCount)
+			{
+				assert(initialCount >= 0);
+			}
+			
+			void wait()
+			{
+				while (!try_wait())
+				{
+					backoff();
+				}
+			}
+			
+			bool try_wait()
+			{
+				int oldCount = m_count.load(std::memory_order_relaxed);
+				while (oldCount > 0)
+				{
+					if (m_count.compare_exchange_weak(oldCount, oldCount - 1, std::memory_order_acquire, std::memory_order_relaxed))
+						return true;
+				}
+				return false;
+			}
+			
+			bool timed_wait(std::uint64_t usecs)
+			{
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(usecs);
+				while (!try_wait())
+				{
+					if (std::chrono::steady_clock::now() >= deadline)
+						return false;
+					backoff();
+				}
+				return true;
+			}
+			
+			void signal(int count = 1)
+			{
+				m_count.fetch_add(count, std::memory_order_release);
+			}
+		};
+		
+		//---------------------------------------------------------
+		// Semaphore (mutex + condition variable)
+		// Works with any mutex and condition variable types that have the
+		// same interface as the standard ones (e.g. those of a fiber library)
+		//---------------------------------------------------------
+		template<typename Mutex, typename CondVar>
+		class CondVarSemaphore
+		{
+		private:
+			Mutex m_mutex;
+			CondVar m_cond;
+			int m_count;
+			
+			CondVarSemaphore(const CondVarSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+			CondVarSemaphore& operator=(const CondVarSemaphore& other) MOODYCAMEL_DELETE_FUNCTION;
+		
+		public:
+			CondVarSemaphore(int initialCount = 0) : m_count(initialCount)
+			{
+				assert(initialCount >= 0);
+			}
+			
+			void wait()
+			{
+				std::unique_lock<Mutex> lock(m_mutex);
+				while (m_count == 0)
+				{
+					m_cond.wait(lock);
+				}
+				--m_count;
+			}
+			
+			bool try_wait()
+			{
+				std::unique_lock<Mutex> lock(m_mutex);
+				if (m_count == 0)
+					return false;
+				--m_count;
+				return true;
+			}
+			
+			bool timed_wait(std::uint64_t usecs)
+			{
+				std::unique_lock<Mutex> lock(m_mutex);
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(usecs);
+				while (m_count == 0)
+				{
+					if (m_cond.wait_until(lock, deadline) == std::cv_status::timeout && m_count == 0)
+						return false;
+				}
+				--m_count;
+				return true;
+			}
+			
+			void signal(int count = 1)
+			{
+				{
+					std::unique_lock<Mutex> lock(m_mutex);
+					m_count += count;
+				}
+				if (count == 1)
+					m_cond.notify_one();
+				else
+					m_cond.notify_all();
+			}
+		};
+		
 		//---------------------------------------------------------
 		// LightweightSemaphore
+		// Spins on an atomic count first, and only falls back on the
+		// underlying semaphore (the wait strategy) when it has to wait
 		//---------------------------------------------------------
-		class LightweightSemaphore
+		template<typename WaitStrategy>
+		class BasicLightweightSemaphore
 		{
 		public:
 			typedef std::make_signed<std::size_t>::type ssize_t;
 
 		private:
 			std::atomic<ssize_t> m_count;
-			Semaphore m_sema;
+			WaitStrategy m_sema;
+			SpinBudget m_spinBudget;
 
 			bool waitWithPartialSpinning(std::int64_t timeout_usecs = -1)
 			{
 				ssize_t oldCount;
-				// Is there a better way to set the initial spin count?
-				// If we lower it to 1000, testBenaphore becomes 15x slower on my Core i7-5930K Windows PC,
-				// as threads start hitting the kernel semaphore.
-				int spin = 10000;
-				while (--spin >= 0)
+				// The spin budget starts out at MAX_SEMA_SPINS (10000 by default). Lowering that to
+				// 1000 made testBenaphore 15x slower on a Core i7-5930K Windows PC, as threads start
+				// hitting the kernel semaphore; adaptive spinning only backs off once spinning has
+				// actually been observed not to pay off.
+				int budget = m_spinBudget.get();
+				int spin = 0;
+				for (; spin < budget; ++spin)
 				{
 					oldCount = m_count.load(std::memory_order_relaxed);
 					if ((oldCount > 0) && m_count.compare_exchange_strong(oldCount, oldCount - 1, std::memory_order_acquire, std::memory_order_relaxed))
+					{
+						m_spinBudget.record(budget, spin, false);
 						return true;
-					std::atomic_signal_fence(std::memory_order_acquire);	 // Prevent the compiler from collapsing the loop.
+					}
+					spin_backoff(spin);
 				}
 				oldCount = m_count.fetch_sub(1, std::memory_order_acquire);
+				m_spinBudget.record(budget, spin, oldCount <= 0);
 				if (oldCount > 0)
 					return true;
 				if (timeout_usecs < 0)
@@ -300,19 +738,24 @@ namespace details
 			{
 				assert(max > 0);
 				ssize_t oldCount;
-				int spin = 10000;
-				while (--spin >= 0)
+				int budget = m_spinBudget.get();
+				int spin = 0;
+				for (; spin < budget; ++spin)
 				{
 					oldCount = m_count.load(std::memory_order_relaxed);
 					if (oldCount > 0)
 					{
 						ssize_t newCount = oldCount > max ? oldCount - max : 0;
 						if (m_count.compare_exchange_strong(oldCount, newCount, std::memory_order_acquire, std::memory_order_relaxed))
+						{
+							m_spinBudget.record(budget, spin, false);
 							return oldCount - newCount;
+						}
 					}
-					std::atomic_signal_fence(std::memory_order_acquire);
+					spin_backoff(spin);
 				}
 				oldCount = m_count.fetch_sub(1, std::memory_order_acquire);
+				m_spinBudget.record(budget, spin, oldCount <= 0);
 				if (oldCount <= 0)
 				{
 					if (timeout_usecs < 0)
@@ -335,7 +778,10 @@ namespace details
 			}
 
 		public:
-			LightweightSemaphore(ssize_t initialCount = 0) : m_count(initialCount)
+			// maxSpins and adaptiveSpinning control how long waiters spin before sleeping
+			// (see MAX_SEMA_SPINS and ADAPTIVE_SEMA_SPINNING in ConcurrentQueueDefaultTraits)
+			BasicLightweightSemaphore(ssize_t initialCount = 0, int maxSpins = 10000, bool adaptiveSpinning = true)
+				: m_count(initialCount), m_spinBudget(maxSpins, adaptiveSpinning)
 			{
 				assert(initialCount >= 0);
 			}
@@ -410,38 +856,850 @@ namespace details
 				return count > 0 ? count : 0;
 			}
 		};
-	}	// end namespace mpmc_sema
-}	// end namespace details
-
+		
+		typedef BasicLightweightSemaphore<Semaphore> LightweightSemaphore;
+		
+		//---------------------------------------------------------
+		// EventCount
+		// Lets threads wait for a condition (e.g. "the queue is non-empty") to
+		// become true, without whoever makes it true having to write to any shared
+		// state unless somebody is actually asleep: waiters register themselves
+		// before they park and check the condition once more, while notifiers only
+		// load the number of registered waiters, and signal the underlying
+		// semaphore (the wait strategy) only if it isn't zero.
+		//---------------------------------------------------------
+		template<typename WaitStrategy>
+		class BasicEventCount
+		{
+		public:
+			typedef std::make_signed<std::size_t>::type ssize_t;
 
-// This is a blocking version of the queue. It has an almost identical interface to
-// the normal non-blocking version, with the addition of various wait_dequeue() methods
-// and the removal of producer-specific dequeue methods.
-template<typename T, typename Traits = ConcurrentQueueDefaultTraits>
-class BlockingConcurrentQueue
-{
-private:
-	typedef ::moodycamel::ConcurrentQueue<T, Traits> ConcurrentQueue;
-	typedef details::mpmc_sema::LightweightSemaphore LightweightSemaphore;
+#ifdef MOODYCAMEL_HAS_COROUTINES
+			// A waiter that doesn't block a thread (e.g. a suspended coroutine): rather than
+			// through the wait strategy, it's woken by having its wake function called
+			struct AsyncWaiter
+			{
+				AsyncWaiter* next;
+				void (*wake)(AsyncWaiter*);
+			};
 
-public:
-	typedef typename ConcurrentQueue::producer_token_t producer_token_t;
-	typedef typename ConcurrentQueue::consumer_token_t consumer_token_t;
-	
-	typedef typename ConcurrentQueue::index_t index_t;
-	typedef typename ConcurrentQueue::size_t size_t;
-	typedef typename std::make_signed<size_t>::type ssize_t;
-	
-	static const size_t BLOCK_SIZE = ConcurrentQueue::BLOCK_SIZE;
-	static const size_t EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD = ConcurrentQueue::EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD;
-	static const size_t EXPLICIT_INITIAL_INDEX_SIZE = ConcurrentQueue::EXPLICIT_INITIAL_INDEX_SIZE;
-	static const size_t IMPLICIT_INITIAL_INDEX_SIZE = ConcurrentQueue::IMPLICIT_INITIAL_INDEX_SIZE;
-	static const size_t INITIAL_IMPLICIT_PRODUCER_HASH_SIZE = ConcurrentQueue::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE;
-	static const std::uint32_t EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE = ConcurrentQueue::EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE;
-	static const size_t MAX_SUBQUEUE_SIZE = ConcurrentQueue::MAX_SUBQUEUE_SIZE;
-	
-public:
-	// Creates a queue with at least `capacity` element slots; note that the
+#endif
+		private:
+			// Waiters that are parked (or about to be) and haven't been claimed by a notify yet
+			std::atomic<ssize_t> m_waiters;
+			WaitStrategy m_sema;
+			SpinBudget m_spinBudget;
+			bool m_wakeAll;
+			bool m_mixedWaiters;
+			bool m_externalWaiterArmed;
+			// A notifier claimed the external waiter's registration, and the signal it sent
+			// (or is about to send) for it hasn't been taken back yet
+			bool m_externalSignalOwed;
+			std::int64_t m_maxSleepUsecs;
+			// Threads in wait() that have registered (claimed or not) and haven't left yet, and
+			// how many elements they're after in total; lets notify() wake only as many of them
+			// as it takes to cover what was enqueued
+			std::atomic<ssize_t> m_sleepers;
+			std::atomic<ssize_t> m_sleepersDemand;
+			// Waiters woken by notifies that woke fewer of them than they had elements for,
+			// that haven't checked in yet (see checkIn)
+			std::atomic<ssize_t> m_shortfallWakes;
+			// With mixedWaiters, the threads sleeping in wait(), each on a wait strategy of
+			// its own, along with what they're waiting for (see wakeInterested)
+			struct Interest
+			{
+				Interest* next;
+				Interest* prev;
+				bool (*pending)(void*);
+				void* pendingData;
+				WaitStrategy* sema;
+				bool woken;
+			};
+			std::atomic<ssize_t> m_interests;
+			std::mutex m_interestsLock;
+			Interest* m_interestsHead;
+			Interest* m_interestsTail;
+#ifdef MOODYCAMEL_HAS_COROUTINES
+			std::atomic<ssize_t> m_asyncWaiters;
+			std::mutex m_asyncWaitersLock;
+			AsyncWaiter* m_asyncWaitersHead;
+			AsyncWaiter* m_asyncWaitersTail;
+#endif
+			
+			BasicEventCount(const BasicEventCount& other) MOODYCAMEL_DELETE_FUNCTION;
+			BasicEventCount& operator=(const BasicEventCount& other) MOODYCAMEL_DELETE_FUNCTION;
+			
+			void prepareWait()
+			{
+				m_waiters.fetch_add(1, std::memory_order_relaxed);
+				// Pairs with the fence in notify(): either the notifier sees us registered,
+				// or we see whatever it made true before notifying
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			}
+			
+			// Returns true if a signal sent for us had to be taken back, i.e. if we were woken
+			// after all (and so must check in)
+			bool cancelWait()
+			{
+				ssize_t waiters = m_waiters.load(std::memory_order_relaxed);
+				while (waiters > 0)
+				{
+					if (m_waiters.compare_exchange_weak(waiters, waiters - 1, std::memory_order_relaxed, std::memory_order_relaxed))
+						return false;
+				}
+				// A notifier already claimed our registration, so the semaphore has been (or is
+				// just about to be) signalled on our behalf; take that signal back so that it
+				// doesn't spuriously wake the next waiter
+				m_sema.wait();
+				return true;
+			}
+			
+			// To be called by every waiter that a notify woke (i.e. that got a signal), once
+			// it has consumed what it's going to. When a notify wakes fewer waiters than it
+			// has elements for, counting on each of them to take several, they may end up
+			// taking fewer than that; so the last of them to check in (or of whoever was woken
+			// meanwhile) sees whether pending() says anything's left, and if so wakes another
+			// waiter, which checks in in turn, and so on until it's all been taken. Waiters
+			// that never slept don't come through here at all.
+			template<typename P>
+			void checkIn(P&& pending, ssize_t demand)
+			{
+				ssize_t wakes = m_shortfallWakes.load(std::memory_order_relaxed);
+				while (wakes > 0)
+				{
+					if (m_shortfallWakes.compare_exchange_weak(wakes, wakes - 1, std::memory_order_relaxed, std::memory_order_relaxed))
+					{
+						if (wakes == 1 && pending())
+							passOnWake(demand);
+						return;
+					}
+				}
+			}
+			
+			// Wakes one more waiter for the leftovers of a short notify (see checkIn), as one
+			// that was woken by it itself; or, failing that, up to demand async waiters
+			void passOnWake(ssize_t demand)
+			{
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				ssize_t waiters = m_waiters.load(std::memory_order_relaxed);
+				while (waiters > 0)
+				{
+					if (m_waiters.compare_exchange_weak(waiters, waiters - 1, std::memory_order_relaxed, std::memory_order_relaxed))
+					{
+						m_shortfallWakes.fetch_add(1, std::memory_order_relaxed);
+						MOODYCAMEL_PROBE3(sema_wake, this, 1, demand);
+						m_sema.signal(1);
+						return;
+					}
+				}
+#ifdef MOODYCAMEL_HAS_COROUTINES
+				if (m_asyncWaiters.load(std::memory_order_relaxed) > 0)
+					wakeAsyncWaiters(demand);
+#else
+				(void)demand;
+#endif
+			}
+			
+			// How many waiters it takes to consume count elements, going by what the
+			// waiters asked for on average
+			ssize_t waitersCovering(ssize_t count) const
+			{
+				ssize_t sleepers = m_sleepers.load(std::memory_order_relaxed);
+				if (sleepers <= 0)
+					return count;
+				ssize_t demand = m_sleepersDemand.load(std::memory_order_relaxed) / sleepers;
+				if (demand <= 1)
+					return count;
+				return (count + demand - 1) / demand;
+			}
+			
+			template<typename P>
+			static bool callPending(void* pending)
+			{
+				return (*static_cast<P*>(pending))();
+			}
+			
+			void addInterest(Interest* interest)
+			{
+				{
+					std::lock_guard<std::mutex> guard(m_interestsLock);
+					interest->next = nullptr;
+					interest->prev = m_interestsTail;
+					interest->woken = false;
+					if (m_interestsTail != nullptr)
+						m_interestsTail->next = interest;
+					else
+						m_interestsHead = interest;
+					m_interestsTail = interest;
+					m_interests.fetch_add(1, std::memory_order_relaxed);
+				}
+				// Pairs with the fence in notify(), like in prepareWait()
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			}
+			
+			void unlinkInterest(Interest* interest)
+			{
+				if (interest->prev != nullptr)
+					interest->prev->next = interest->next;
+				else
+					m_interestsHead = interest->next;
+				if (interest->next != nullptr)
+					interest->next->prev = interest->prev;
+				else
+					m_interestsTail = interest->prev;
+				m_interests.fetch_sub(1, std::memory_order_relaxed);
+			}
+			
+			// Returns false if a notifier got to the interest first (and so signalled its
+			// wait strategy, or is just about to)
+			bool removeInterest(Interest* interest)
+			{
+				std::lock_guard<std::mutex> guard(m_interestsLock);
+				if (interest->woken)
+					return false;
+				unlinkInterest(interest);
+				return true;
+			}
+			
+			// Takes the signal a notifier sent to a waiter's own wait strategy. The notifier
+			// signals with the lock held, so once the waiter has had the lock too, the wait
+			// strategy is done with and can go.
+			static void takeWake(WaitStrategy& sema, std::mutex& lock)
+			{
+				sema.wait();
+				std::lock_guard<std::mutex> guard(lock);
+			}
+			
+			// Wakes up to count of the threads sleeping with mixedWaiters whose pending() says
+			// there's something for them, in the order they went to sleep in. Since each one
+			// sleeps on a wait strategy of its own, the wake can't go astray to a waiter that's
+			// waiting for something else.
+			void wakeInterested(ssize_t count)
+			{
+				std::lock_guard<std::mutex> guard(m_interestsLock);
+				for (Interest* interest = m_interestsHead; interest != nullptr && count > 0; )
+				{
+					Interest* next = interest->next;
+					if (interest->pending(interest->pendingData))
+					{
+						unlinkInterest(interest);
+						interest->woken = true;
+						MOODYCAMEL_PROBE3(sema_wake, this, 1, count);
+						interest->sema->signal(1);
+						--count;
+					}
+					interest = next;
+				}
+			}
+
+#ifdef MOODYCAMEL_HAS_COROUTINES
+			// Wakes up to count async waiters (or all of them, if constructed with wakeAll or
+			// mixedWaiters), in the order they were added in
+			void wakeAsyncWaiters(ssize_t count)
+			{
+				AsyncWaiter* woken = nullptr;
+				AsyncWaiter** wokenTail = &woken;
+				{
+					std::lock_guard<std::mutex> guard(m_asyncWaitersLock);
+					for (; m_asyncWaitersHead != nullptr && (count > 0 || m_wakeAll || m_mixedWaiters); --count)
+					{
+						*wokenTail = m_asyncWaitersHead;
+						wokenTail = &m_asyncWaitersHead->next;
+						m_asyncWaitersHead = m_asyncWaitersHead->next;
+						m_asyncWaiters.fetch_sub(1, std::memory_order_relaxed);
+					}
+					*wokenTail = nullptr;
+					if (m_asyncWaitersHead == nullptr)
+						m_asyncWaitersTail = nullptr;
+				}
+				while (woken != nullptr)
+				{
+					// Waking a waiter can add it right back, so its link is read first
+					AsyncWaiter* next = woken->next;
+					woken->wake(woken);
+					woken = next;
+				}
+			}
+
+#endif
+		public:
+			// maxSpins and adaptiveSpinning control how long waiters spin before sleeping
+			// (see MAX_SEMA_SPINS and ADAPTIVE_SEMA_SPINNING in ConcurrentQueueDefaultTraits).
+			// Notifying normally wakes one waiter per unit of count, which assumes that any
+			// waiter can make use of any unit; if waiters wait for different things, wakeAll
+			// must be set so that no waiter misses a wakeup that was meant for it. If
+			// maxSleepUsecs is positive, waiters wake up at least that often to look again
+			// by themselves (see notifyIfWaiting). mixedWaiters is the alternative to wakeAll
+			// for waiters that only use waitWithRecheck: each thread then sleeps on a wait
+			// strategy of its own (so WaitStrategy must be default-constructible), and notify()
+			// only wakes as many as there are elements among those whose pending() is true.
+			// The shared wait strategy is then only slept on by an external waiter (see
+			// consumeOrArm), and async waiters are still woken all at once.
+			BasicEventCount(int maxSpins = 10000, bool adaptiveSpinning = true, bool wakeAll = false, std::int64_t maxSleepUsecs = -1, bool mixedWaiters = false)
+				: m_waiters(0), m_spinBudget(maxSpins, adaptiveSpinning), m_wakeAll(wakeAll), m_mixedWaiters(mixedWaiters), m_externalWaiterArmed(false), m_externalSignalOwed(false), m_maxSleepUsecs(maxSleepUsecs),
+				  m_sleepers(0), m_sleepersDemand(0), m_shortfallWakes(0), m_interests(0), m_interestsHead(nullptr), m_interestsTail(nullptr)
+#ifdef MOODYCAMEL_HAS_COROUTINES
+				, m_asyncWaiters(0), m_asyncWaitersHead(nullptr), m_asyncWaitersTail(nullptr)
+#endif
+			{
+				assert(maxSleepUsecs != 0);
+				assert(!mixedWaiters || (!wakeAll && maxSleepUsecs < 0));
+			}
+			
+			// Calls tryConsume() until it returns true, spinning and then sleeping between
+			// attempts. If timeout_usecs is non-negative, gives up (returning false) once
+			// it has elapsed without tryConsume() succeeding. demand is how many elements
+			// tryConsume() takes at most, at least as far as notify() should assume when
+			// working out how many waiters to wake (see checkIn).
+			template<typename F>
+			bool wait(F&& tryConsume, std::int64_t timeout_usecs = -1, ssize_t demand = 1)
+			{
+				assert(!m_mixedWaiters);
+				return waitFor<false>(std::forward<F>(tryConsume), []() { return false; }, timeout_usecs, demand);
+			}
+			
+			// Like wait(), for a tryConsume() that can fail spuriously -- as try_dequeue can,
+			// while another consumer is backing out of its claim on the last element. pending()
+			// must tell, without failing spuriously itself, whether there's anything left for
+			// tryConsume() to take; a waiter only goes (back) to sleep once it says there isn't,
+			// so that a notify isn't spent on a waiter that then sleeps through its element.
+			// pending() should also be cheaper than tryConsume(), since it's what the waiter
+			// spins on: tryConsume() is only called while spinning once pending() says there's
+			// something to take.
+			template<typename F, typename P>
+			bool waitWithRecheck(F&& tryConsume, P&& pending, std::int64_t timeout_usecs = -1, ssize_t demand = 1)
+			{
+				return waitFor<true>(std::forward<F>(tryConsume), std::forward<P>(pending), timeout_usecs, demand);
+			}
+		
+		private:
+			template<bool SpinOnPending, typename F, typename P>
+			bool waitFor(F&& tryConsume, P&& pending, std::int64_t timeout_usecs, ssize_t demand)
+			{
+				if (tryConsume())
+					return true;
+				
+				// Counted from before spinning, so that the spinning doesn't extend the timeout
+				auto deadline = timeout_usecs >= 0 ? std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_usecs) : std::chrono::steady_clock::time_point();
+				int budget = m_spinBudget.get();
+				int spin = 0;
+				for (; spin < budget; ++spin)
+				{
+					spin_backoff(spin);
+					if ((!SpinOnPending || pending()) && tryConsume())
+					{
+						m_spinBudget.record(budget, spin, false);
+						return true;
+					}
+					if (timeout_usecs >= 0 && (spin & 255) == 255 && std::chrono::steady_clock::now() >= deadline)
+						break;
+				}
+				
+				if (m_mixedWaiters)
+					return sleepMixed(tryConsume, pending, timeout_usecs, deadline, budget, spin);
+				
+				bool slept = false;
+				m_sleepers.fetch_add(1, std::memory_order_relaxed);
+				m_sleepersDemand.fetch_add(demand, std::memory_order_relaxed);
+				bool consumed;
+				while (true)
+				{
+					prepareWait();
+					if (tryConsume())
+					{
+						if (cancelWait())
+							checkIn(pending, demand);
+						m_spinBudget.record(budget, spin, slept);
+						consumed = true;
+						break;
+					}
+					if (pending())
+					{
+						// tryConsume() failed spuriously; try again rather than sleeping through it
+						if (cancelWait())
+							checkIn(pending, demand);
+						cpu_relax();
+						continue;
+					}
+					if (!slept)
+						m_spinBudget.record(budget, spin, true);
+					slept = true;
+					MOODYCAMEL_PROBE2(sema_park, this, timeout_usecs);
+					if (timeout_usecs < 0 && m_maxSleepUsecs < 0)
+						m_sema.wait();
+					else
+					{
+						std::int64_t remaining = timeout_usecs < 0 ? m_maxSleepUsecs : static_cast<std::int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count());
+						bool dozing = m_maxSleepUsecs >= 0 && (timeout_usecs < 0 || remaining > m_maxSleepUsecs);
+						if (dozing)
+							remaining = m_maxSleepUsecs;
+						if (remaining <= 0 || !m_sema.timed_wait((std::uint64_t)remaining))
+						{
+							MOODYCAMEL_PROBE2(sema_unpark, this, 1);
+							bool woken = cancelWait();
+							if (dozing)
+							{
+								// Not timed out, just looking again in case notifyIfWaiting() missed us
+								consumed = tryConsume();
+								if (woken)
+									checkIn(pending, demand);
+								if (consumed)
+									break;
+								continue;
+							}
+							// Whatever's left is taken rather than left behind, since a notify
+							// meant for it may have been spent on us
+							while (!(consumed = tryConsume()) && pending())
+								cpu_relax();
+							if (woken)
+								checkIn(pending, demand);
+							break;
+						}
+					}
+					MOODYCAMEL_PROBE2(sema_unpark, this, 0);
+					// Checks in whether or not someone else got there first
+					consumed = tryConsume();
+					checkIn(pending, demand);
+					if (consumed)
+						break;
+				}
+				m_sleepersDemand.fetch_sub(demand, std::memory_order_relaxed);
+				m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+				return consumed;
+			}
+			
+			// The sleeping half of waitFor with mixedWaiters: registers the waiter's pending()
+			// and its own wait strategy, so that only a notify with something for it wakes it
+			template<typename F, typename P>
+			bool sleepMixed(F& tryConsume, P& pending, std::int64_t timeout_usecs, std::chrono::steady_clock::time_point deadline, int budget, int spin)
+			{
+				WaitStrategy sema;
+				Interest interest;
+				interest.pending = &callPending<typename std::remove_reference<P>::type>;
+				interest.pendingData = const_cast<void*>(static_cast<void const*>(&pending));
+				interest.sema = &sema;
+				bool slept = false;
+				while (true)
+				{
+					addInterest(&interest);
+					bool consumed = tryConsume();
+					if (consumed || pending())
+					{
+						// Either way, not sleeping after all (tryConsume() may have failed spuriously)
+						if (!removeInterest(&interest))
+							takeWake(sema, m_interestsLock);
+						if (consumed)
+						{
+							m_spinBudget.record(budget, spin, slept);
+							return true;
+						}
+						cpu_relax();
+						continue;
+					}
+					if (!slept)
+						m_spinBudget.record(budget, spin, true);
+					slept = true;
+					MOODYCAMEL_PROBE2(sema_park, this, timeout_usecs);
+					if (timeout_usecs < 0)
+						sema.wait();
+					else
+					{
+						std::int64_t remaining = static_cast<std::int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count());
+						if (remaining <= 0 || !sema.timed_wait((std::uint64_t)remaining))
+						{
+							MOODYCAMEL_PROBE2(sema_unpark, this, 1);
+							if (removeInterest(&interest))
+							{
+								// Timed out; whatever's left is taken rather than left behind
+								bool consumed;
+								while (!(consumed = tryConsume()) && pending())
+									cpu_relax();
+								return consumed;
+							}
+							takeWake(sema, m_interestsLock);
+							if (tryConsume())
+								return true;
+							continue;
+						}
+					}
+					MOODYCAMEL_PROBE2(sema_unpark, this, 0);
+					{
+						// See takeWake
+						std::lock_guard<std::mutex> guard(m_interestsLock);
+					}
+					if (tryConsume())
+						return true;
+				}
+			}
+		
+		public:
+			// For a waiter that sleeps somewhere other than in wait() -- e.g. in epoll_wait, on
+			// an eventfd that the wait strategy signals. Calls tryConsume(), and if it fails,
+			// leaves the waiter registered (armed) so that the next notify signals the wait
+			// strategy; returns what tryConsume() returned. It doesn't arm while pending()
+			// says there's still something to consume (tryConsume() can fail spuriously), but
+			// retries instead. The signal meant for the previous call's registration, if any,
+			// is taken back first -- without blocking, since the caller is an event loop: if
+			// the notifier that claimed it hasn't sent it yet, it's left for the next call to
+			// take back (and meanwhile wakes the loop, so there is a next call). There can only
+			// be one such waiter per event count, and its calls must not overlap.
+			template<typename F, typename P>
+			bool consumeOrArm(F&& tryConsume, P&& pending)
+			{
+				bool disarmed = disarmExternalWaiter(pending);
+				while (true)
+				{
+					if (tryConsume())
+						return true;
+					if (!disarmed)
+					{
+						// Still owed a signal, which is as good as being armed
+						return false;
+					}
+					prepareWait();
+					m_externalWaiterArmed = true;
+					if (tryConsume())
+					{
+						disarmExternalWaiter(pending);
+						return true;
+					}
+					if (!pending())
+						return false;
+					disarmed = disarmExternalWaiter(pending);
+					cpu_relax();
+				}
+			}
+			
+			// Takes the external waiter's registration back, if it's armed, and the signal a
+			// notifier sent for it, if there is one (checking in for it); returns false if
+			// that signal hasn't been sent yet (it's left owed)
+			template<typename P>
+			bool disarmExternalWaiter(P&& pending)
+			{
+				if (m_externalWaiterArmed)
+				{
+					m_externalWaiterArmed = false;
+					ssize_t waiters = m_waiters.load(std::memory_order_relaxed);
+					while (true)
+					{
+						if (waiters <= 0)
+						{
+							m_externalSignalOwed = true;
+							break;
+						}
+						if (m_waiters.compare_exchange_weak(waiters, waiters - 1, std::memory_order_relaxed, std::memory_order_relaxed))
+							break;
+					}
+				}
+				if (m_externalSignalOwed)
+				{
+					if (!m_sema.try_wait())
+						return false;
+					m_externalSignalOwed = false;
+					checkIn(pending, 1);
+				}
+				return true;
+			}
+			
+			WaitStrategy& waitStrategy()
+			{
+				return m_sema;
+			}
+			
+			// Like notify(), but when there's no sign of anyone waiting, returns right away,
+			// without the fence that notify() needs to be sure not to miss a waiter that's
+			// just registering. Only for event counts whose waiters never sleep for longer
+			// than maxSleepUsecs at a time (see the constructor), so that one that was
+			// missed finds out soon enough anyway.
+			void notifyIfWaiting(ssize_t count = 1)
+			{
+				assert(m_maxSleepUsecs > 0);
+#ifdef MOODYCAMEL_HAS_COROUTINES
+				if (m_asyncWaiters.load(std::memory_order_relaxed) > 0)
+				{
+					notify(count);
+					return;
+				}
+#endif
+				if (m_waiters.load(std::memory_order_relaxed) > 0)
+					notify(count);
+			}
+			
+			// Wakes enough waiters to consume count elements (or all of them, if constructed
+			// with wakeAll), if there are any. Without wakeAll, that's one waiter per element,
+			// unless the waiters asked for more than one element each on average (see wait());
+			// with mixedWaiters, it's one per element among those waiting for something that's
+			// there. Must be called after making true whatever the waiters are waiting for.
+			void notify(ssize_t count = 1)
+			{
+				assert(count >= 0);
+				if (count == 0)
+					return;
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+#ifdef MOODYCAMEL_HAS_COROUTINES
+				if (m_asyncWaiters.load(std::memory_order_relaxed) > 0)
+					wakeAsyncWaiters(count);
+#endif
+				if (m_mixedWaiters && m_interests.load(std::memory_order_relaxed) > 0)
+					wakeInterested(count);
+				ssize_t waiters = m_waiters.load(std::memory_order_relaxed);
+				if (waiters <= 0)
+					return;
+				ssize_t needed = count > 1 && !m_wakeAll ? waitersCovering(count) : count;
+				while (waiters > 0)
+				{
+					ssize_t toWake = waiters < needed || m_wakeAll ? waiters : needed;
+					if (m_waiters.compare_exchange_weak(waiters, waiters - toWake, std::memory_order_relaxed, std::memory_order_relaxed))
+					{
+						if (toWake < waiters && toWake < count)
+							m_shortfallWakes.fetch_add(toWake, std::memory_order_relaxed);
+						if (toWake > 0)
+						{
+							MOODYCAMEL_PROBE3(sema_wake, this, toWake, count);
+							m_sema.signal((int)toWake);
+						}
+						return;
+					}
+				}
+			}
+			
+#ifdef MOODYCAMEL_HAS_COROUTINES
+			// Registers an async waiter, whose wake function will be called (once) by a
+			// later notify. Like a thread that's about to sleep, the waiter must check
+			// the condition it's waiting for once more after this; if it's already true,
+			// it may have been missed, so the waiter must take itself back off with
+			// removeAsyncWaiter and see to it itself.
+			void addAsyncWaiter(AsyncWaiter* waiter)
+			{
+				{
+					std::lock_guard<std::mutex> guard(m_asyncWaitersLock);
+					waiter->next = nullptr;
+					if (m_asyncWaitersTail != nullptr)
+						m_asyncWaitersTail->next = waiter;
+					else
+						m_asyncWaitersHead = waiter;
+					m_asyncWaitersTail = waiter;
+					m_asyncWaiters.fetch_add(1, std::memory_order_relaxed);
+				}
+				// Pairs with the fence in notify(), like in prepareWait()
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			}
+			
+			// Unregisters an async waiter that hasn't been woken yet; returns false if it was
+			// too late for that (a notify has claimed it, and its wake function is or will
+			// be called)
+			bool removeAsyncWaiter(AsyncWaiter* waiter)
+			{
+				std::lock_guard<std::mutex> guard(m_asyncWaitersLock);
+				AsyncWaiter* prev = nullptr;
+				for (AsyncWaiter* it = m_asyncWaitersHead; it != nullptr; prev = it, it = it->next)
+				{
+					if (it != waiter)
+						continue;
+					if (prev != nullptr)
+						prev->next = it->next;
+					else
+						m_asyncWaitersHead = it->next;
+					if (m_asyncWaitersTail == it)
+						m_asyncWaitersTail = prev;
+					m_asyncWaiters.fetch_sub(1, std::memory_order_relaxed);
+					return true;
+				}
+				return false;
+			}
+
+#endif
+			// The number of waiters that are (about to go) to sleep
+			ssize_t waitersApprox() const
+			{
+				return m_waiters.load(std::memory_order_relaxed);
+			}
+		};
+	}	// end namespace mpmc_sema
+}	// end namespace details
+
+
+// Wait strategies for BlockingConcurrentQueue, i.e. how a thread that has to wait
+// for an element is put on hold once it has given up spinning (see MAX_SEMA_SPINS).
+// The default puts it to sleep on a kernel semaphore (a futex on Linux).
+typedef details::mpmc_sema::Semaphore KernelWaitStrategy;
+#ifdef MOODYCAMEL_USE_FUTEX
+typedef details::mpmc_sema::FutexSemaphore FutexWaitStrategy;
+#endif
+#ifdef MOODYCAMEL_HAS_COROUTINES
+// The default executor for coroutines resumed by BlockingConcurrentQueue::async_dequeue:
+// resumes them right away, on the thread of whoever enqueued the element they get. Any
+// other callable that takes a nullary function object and (eventually) calls it can be
+// used instead, e.g. to have it run on a thread pool.
+struct InlineExecutor
+{
+	template<typename F>
+	void operator()(F&& f) const
+	{
+		std::forward<F>(f)();
+	}
+};
+
+#endif
+#ifdef MOODYCAMEL_HAS_EVENTFD
+// Sleeps on an eventfd, which can also be watched from an epoll loop (see
+// BlockingConcurrentQueue::drain)
+typedef details::mpmc_sema::EventFdSemaphore EventFdWaitStrategy;
+#endif
+// Never sleeps; for consumers on dedicated (e.g. isolated busy-poll) cores
+typedef details::mpmc_sema::PollingSemaphore<false> BusySpinWaitStrategy;
+// Never sleeps, but yields the rest of its timeslice between polls
+typedef details::mpmc_sema::PollingSemaphore<true> SpinYieldWaitStrategy;
+// Sleeps on a condition variable. The mutex and condition variable types can be
+// swapped for those of a user-space scheduler (e.g. a fiber library) so that only
+// the fiber, and not the whole thread, is blocked.
+template<typename Mutex = std::mutex, typename CondVar = std::condition_variable>
+class CondVarWaitStrategy : public details::mpmc_sema::CondVarSemaphore<Mutex, CondVar>
+{
+};
+
+// Any other class can serve as a wait strategy (e.g. to hook into a scheduler that
+// has its own way of parking and resuming tasks), provided it's a counting semaphore
+// with a default constructor (initial count of zero) and the following methods:
+//     void wait();                            // Waits until the count is positive, then decrements it
+//     bool try_wait();                        // Decrements the count if it's positive, without waiting
+//     bool timed_wait(std::uint64_t usecs);   // Like wait(), but gives up (returning false) after usecs microseconds
+//     void signal(int count);                 // Increments the count by count, releasing that many waiters
+// All of them must be thread-safe.
+
+
+// A notifier that several BlockingConcurrentQueues can share, so that a thread can
+// wait for an element to show up in any one of them (see wait_dequeue_any). Queues
+// constructed with a notifier signal it instead of a notifier of their own, so it
+// must outlive them. Since threads waiting on it may be waiting on different sets
+// of queues, each sleeps on a wait strategy of its own (which WaitStrategy must be
+// default-constructible for), so that an enqueue can wake just one that's waiting
+// on that queue rather than whichever thread is first in line; coroutines waiting
+// on it are all resumed, though.
+template<typename WaitStrategy = KernelWaitStrategy>
+class BlockingQueueNotifier
+{
+public:
+	// maxSpins and adaptiveSpinning control how long waiters spin before sleeping
+	// (see MAX_SEMA_SPINS and ADAPTIVE_SEMA_SPINNING in ConcurrentQueueDefaultTraits).
+	// Since the queues sharing a notifier can each have different traits, their own
+	// spin settings don't apply to waiting on it; the defaults here are the default
+	// traits', so pass the queues' Traits::MAX_SEMA_SPINS and ADAPTIVE_SEMA_SPINNING
+	// to match queues with customized ones.
+	explicit BlockingQueueNotifier(int maxSpins = ConcurrentQueueDefaultTraits::MAX_SEMA_SPINS, bool adaptiveSpinning = ConcurrentQueueDefaultTraits::ADAPTIVE_SEMA_SPINNING)
+		: eventCount(maxSpins, adaptiveSpinning, false, -1, true)
+	{
+	}
+	
+	// Blocks the current thread until there's something to dequeue from any of
+	// the given queues (which must all have been constructed with this notifier),
+	// then dequeues it. The queues are tried in the order they're given in, so
+	// earlier ones take priority. Returns the index of the queue the item was
+	// dequeued from.
+	// Never allocates. Thread-safe.
+	template<typename U, typename... Queues>
+	int wait_dequeue_any(U& item, Queues&... queues)
+	{
+		int index = -1;
+		eventCount.waitWithRecheck([&]() { return (index = try_dequeue_any(item, 0, queues...)) >= 0; }, [&]() { return !all_empty(queues...); });
+		return index;
+	}
+	
+	// Blocks the current thread until either there's something to dequeue from
+	// any of the given queues (which must all have been constructed with this
+	// notifier) or the timeout (specified in microseconds) expires. The queues
+	// are tried in the order they're given in, so earlier ones take priority.
+	// Returns the index of the queue the item was dequeued from, or -1 without
+	// setting `item` if the timeout expires.
+	// Using a negative timeout indicates an indefinite timeout.
+	// Never allocates. Thread-safe.
+	template<typename U, typename... Queues>
+	int wait_dequeue_any_timed(U& item, std::int64_t timeout_usecs, Queues&... queues)
+	{
+		int index = -1;
+		eventCount.waitWithRecheck([&]() { return (index = try_dequeue_any(item, 0, queues...)) >= 0; }, [&]() { return !all_empty(queues...); }, timeout_usecs);
+		return index;
+	}
+	
+	// Blocks the current thread until either there's something to dequeue from
+	// any of the given queues or the timeout expires. Returns the index of the
+	// queue the item was dequeued from, or -1 without setting `item` if the
+	// timeout expires.
+	// Never allocates. Thread-safe.
+	template<typename U, typename Rep, typename Period, typename... Queues>
+	int wait_dequeue_any_timed(U& item, std::chrono::duration<Rep, Period> const& timeout, Queues&... queues)
+	{
+		return wait_dequeue_any_timed(item, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count(), queues...);
+	}
+
+private:
+	template<typename U>
+	static inline int try_dequeue_any(U&, int)
+	{
+		return -1;
+	}
+	
+	template<typename U, typename Queue, typename... Queues>
+	static inline int try_dequeue_any(U& item, int index, Queue& queue, Queues&... rest)
+	{
+		return queue.try_dequeue(item) ? index : try_dequeue_any(item, index + 1, rest...);
+	}
+	
+	static inline bool all_empty()
+	{
+		return true;
+	}
+	
+	template<typename Queue, typename... Queues>
+	static inline bool all_empty(Queue& queue, Queues&... rest)
+	{
+		return queue.empty_approx() && all_empty(rest...);
+	}
+
+private:
+	template<typename T, typename Traits, typename WS> friend class BlockingConcurrentQueue;
+	
+	details::mpmc_sema::BasicEventCount<WaitStrategy> eventCount;
+};
+
+
+// This is a blocking version of the queue. It has an almost identical interface to
+// the normal non-blocking version, with the addition of various wait_dequeue() methods
+// and the removal of producer-specific dequeue methods. How waiting threads are put
+// on hold is determined by the WaitStrategy (see above).
+template<typename T, typename Traits = ConcurrentQueueDefaultTraits, typename WaitStrategy = KernelWaitStrategy>
+class BlockingConcurrentQueue
+{
+private:
+	typedef ::moodycamel::ConcurrentQueue<T, Traits> ConcurrentQueue;
+	typedef details::mpmc_sema::BasicEventCount<WaitStrategy> EventCount;
+
+public:
+	typedef typename ConcurrentQueue::producer_token_t producer_token_t;
+	typedef typename ConcurrentQueue::consumer_token_t consumer_token_t;
+	
+	typedef typename ConcurrentQueue::index_t index_t;
+	typedef typename ConcurrentQueue::size_t size_t;
+	typedef typename std::make_signed<size_t>::type ssize_t;
+	typedef typename ConcurrentQueue::Stats Stats;
+	typedef typename ConcurrentQueue::ContentionStats ContentionStats;
+	typedef typename ConcurrentQueue::ProducerInfo ProducerInfo;
+	typedef typename ConcurrentQueue::watermark_callback_t watermark_callback_t;
+	
+	static const size_t BLOCK_SIZE = ConcurrentQueue::BLOCK_SIZE;
+	static const size_t EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD = ConcurrentQueue::EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD;
+	static const size_t EXPLICIT_INITIAL_INDEX_SIZE = ConcurrentQueue::EXPLICIT_INITIAL_INDEX_SIZE;
+	static const size_t IMPLICIT_INITIAL_INDEX_SIZE = ConcurrentQueue::IMPLICIT_INITIAL_INDEX_SIZE;
+	static const size_t INITIAL_IMPLICIT_PRODUCER_HASH_SIZE = ConcurrentQueue::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE;
+	static const std::uint32_t EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE = ConcurrentQueue::EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE;
+	static const bool ADAPTIVE_CONSUMER_ROTATION = ConcurrentQueue::ADAPTIVE_CONSUMER_ROTATION;
+	static const bool PREFETCH_NEXT_BLOCK = ConcurrentQueue::PREFETCH_NEXT_BLOCK;
+	static const size_t MAX_SUBQUEUE_SIZE = ConcurrentQueue::MAX_SUBQUEUE_SIZE;
+	static const int MAX_SEMA_SPINS = static_cast<int>(Traits::MAX_SEMA_SPINS);
+	static const bool ADAPTIVE_SEMA_SPINNING = static_cast<bool>(Traits::ADAPTIVE_SEMA_SPINNING);
+	
+public:
+	// Creates a queue with at least `capacity` element slots; note that the
 	// actual number of elements that can be inserted without additional memory
 	// allocation depends on the number of producers and the block size (e.g. if
 	// the block size is equal to `capacity`, only a single block will be allocated
@@ -452,21 +1710,48 @@ public:
 	// includes making the memory effects of construction visible, possibly with a
 	// memory barrier).
 	explicit BlockingConcurrentQueue(size_t capacity = 6 * BLOCK_SIZE)
-		: inner(capacity), sema(create<LightweightSemaphore>(), &BlockingConcurrentQueue::template destroy<LightweightSemaphore>)
+		: inner(capacity), eventCount(create<EventCount>((int)Traits::MAX_SEMA_SPINS, (bool)Traits::ADAPTIVE_SEMA_SPINNING), &BlockingConcurrentQueue::template destroy<EventCount>), spaceEventCount(create_space_event_count(), &BlockingConcurrentQueue::template destroy<EventCount>)
 	{
 		assert(reinterpret_cast<ConcurrentQueue*>((BlockingConcurrentQueue*)1) == &((BlockingConcurrentQueue*)1)->inner && "BlockingConcurrentQueue must have ConcurrentQueue as its first member");
-		if (!sema) {
+		if (!eventCount || !spaceEventCount) {
 			MOODYCAMEL_THROW(std::bad_alloc());
 		}
+		listen_for_room();
 	}
 	
 	BlockingConcurrentQueue(size_t minCapacity, size_t maxExplicitProducers, size_t maxImplicitProducers)
-		: inner(minCapacity, maxExplicitProducers, maxImplicitProducers), sema(create<LightweightSemaphore>(), &BlockingConcurrentQueue::template destroy<LightweightSemaphore>)
+		: inner(minCapacity, maxExplicitProducers, maxImplicitProducers), eventCount(create<EventCount>((int)Traits::MAX_SEMA_SPINS, (bool)Traits::ADAPTIVE_SEMA_SPINNING), &BlockingConcurrentQueue::template destroy<EventCount>), spaceEventCount(create_space_event_count(), &BlockingConcurrentQueue::template destroy<EventCount>)
+	{
+		assert(reinterpret_cast<ConcurrentQueue*>((BlockingConcurrentQueue*)1) == &((BlockingConcurrentQueue*)1)->inner && "BlockingConcurrentQueue must have ConcurrentQueue as its first member");
+		if (!eventCount || !spaceEventCount) {
+			MOODYCAMEL_THROW(std::bad_alloc());
+		}
+		listen_for_room();
+	}
+	
+	// Creates a queue that signals the given notifier, which can be shared with other
+	// queues, rather than one of its own; this allows waiting on all of them at once
+	// (see BlockingQueueNotifier::wait_dequeue_any). The notifier must outlive the queue.
+	// Otherwise the same as the first constructor above (not thread safe).
+	BlockingConcurrentQueue(size_t capacity, BlockingQueueNotifier<WaitStrategy>& notifier)
+		: inner(capacity), eventCount(&notifier.eventCount, &BlockingConcurrentQueue::detach), spaceEventCount(create_space_event_count(), &BlockingConcurrentQueue::template destroy<EventCount>)
+	{
+		assert(reinterpret_cast<ConcurrentQueue*>((BlockingConcurrentQueue*)1) == &((BlockingConcurrentQueue*)1)->inner && "BlockingConcurrentQueue must have ConcurrentQueue as its first member");
+		if (!spaceEventCount) {
+			MOODYCAMEL_THROW(std::bad_alloc());
+		}
+		listen_for_room();
+	}
+	
+	// Like the constructor above, but sized like the second one (not thread safe)
+	BlockingConcurrentQueue(size_t minCapacity, size_t maxExplicitProducers, size_t maxImplicitProducers, BlockingQueueNotifier<WaitStrategy>& notifier)
+		: inner(minCapacity, maxExplicitProducers, maxImplicitProducers), eventCount(&notifier.eventCount, &BlockingConcurrentQueue::detach), spaceEventCount(create_space_event_count(), &BlockingConcurrentQueue::template destroy<EventCount>)
 	{
 		assert(reinterpret_cast<ConcurrentQueue*>((BlockingConcurrentQueue*)1) == &((BlockingConcurrentQueue*)1)->inner && "BlockingConcurrentQueue must have ConcurrentQueue as its first member");
-		if (!sema) {
+		if (!spaceEventCount) {
 			MOODYCAMEL_THROW(std::bad_alloc());
 		}
+		listen_for_room();
 	}
 	
 	// Disable copying and copy assignment
@@ -480,7 +1765,7 @@ public:
 	// used with the destination queue (i.e. semantically they are moved along
 	// with the queue itself).
 	BlockingConcurrentQueue(BlockingConcurrentQueue&& other) MOODYCAMEL_NOEXCEPT
-		: inner(std::move(other.inner)), sema(std::move(other.sema))
+		: inner(std::move(other.inner)), eventCount(std::move(other.eventCount)), spaceEventCount(std::move(other.spaceEventCount))
 	{ }
 	
 	inline BlockingConcurrentQueue& operator=(BlockingConcurrentQueue&& other) MOODYCAMEL_NOEXCEPT
@@ -506,7 +1791,8 @@ private:
 		}
 		
 		inner.swap(other.inner);
-		sema.swap(other.sema);
+		eventCount.swap(other.eventCount);
+		spaceEventCount.swap(other.spaceEventCount);
 		return *this;
 	}
 	
@@ -519,7 +1805,7 @@ public:
 	inline bool enqueue(T const& item)
 	{
 		if ((details::likely)(inner.enqueue(item))) {
-			sema->signal();
+			eventCount->notify();
 			return true;
 		}
 		return false;
@@ -533,7 +1819,7 @@ public:
 	inline bool enqueue(T&& item)
 	{
 		if ((details::likely)(inner.enqueue(std::move(item)))) {
-			sema->signal();
+			eventCount->notify();
 			return true;
 		}
 		return false;
@@ -546,7 +1832,7 @@ public:
 	inline bool enqueue(producer_token_t const& token, T const& item)
 	{
 		if ((details::likely)(inner.enqueue(token, item))) {
-			sema->signal();
+			eventCount->notify();
 			return true;
 		}
 		return false;
@@ -559,7 +1845,7 @@ public:
 	inline bool enqueue(producer_token_t const& token, T&& item)
 	{
 		if ((details::likely)(inner.enqueue(token, std::move(item)))) {
-			sema->signal();
+			eventCount->notify();
 			return true;
 		}
 		return false;
@@ -575,127 +1861,484 @@ public:
 	inline bool enqueue_bulk(It itemFirst, size_t count)
 	{
 		if ((details::likely)(inner.enqueue_bulk(std::forward<It>(itemFirst), count))) {
-			sema->signal((LightweightSemaphore::ssize_t)(ssize_t)count);
+			eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues several items using an explicit producer token.
+	// Allocates memory if required. Only fails if memory allocation fails
+	// (or Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
+	// Note: Use std::make_move_iterator if the elements should be moved
+	// instead of copied.
+	// Thread-safe.
+	template<typename It>
+	inline bool enqueue_bulk(producer_token_t const& token, It itemFirst, size_t count)
+	{
+		if ((details::likely)(inner.enqueue_bulk(token, std::forward<It>(itemFirst), count))) {
+			eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
 			return true;
 		}
-		return false;
+		return false;
+	}
+	
+	// Enqueues a single item (by copying it).
+	// Does not allocate memory. Fails if not enough room to enqueue (or implicit
+	// production is disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE
+	// is 0).
+	// Thread-safe.
+	inline bool try_enqueue(T const& item)
+	{
+		if (inner.try_enqueue(item)) {
+			eventCount->notify();
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues a single item (by moving it, if possible).
+	// Does not allocate memory (except for one-time implicit producer).
+	// Fails if not enough room to enqueue (or implicit production is
+	// disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0).
+	// Thread-safe.
+	inline bool try_enqueue(T&& item)
+	{
+		if (inner.try_enqueue(std::move(item))) {
+			eventCount->notify();
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues a single item (by copying it) using an explicit producer token.
+	// Does not allocate memory. Fails if not enough room to enqueue.
+	// Thread-safe.
+	inline bool try_enqueue(producer_token_t const& token, T const& item)
+	{
+		if (inner.try_enqueue(token, item)) {
+			eventCount->notify();
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues a single item (by moving it, if possible) using an explicit producer token.
+	// Does not allocate memory. Fails if not enough room to enqueue.
+	// Thread-safe.
+	inline bool try_enqueue(producer_token_t const& token, T&& item)
+	{
+		if (inner.try_enqueue(token, std::move(item))) {
+			eventCount->notify();
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues several items.
+	// Does not allocate memory (except for one-time implicit producer).
+	// Fails if not enough room to enqueue (or implicit production is
+	// disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0).
+	// Note: Use std::make_move_iterator if the elements should be moved
+	// instead of copied.
+	// Thread-safe.
+	template<typename It>
+	inline bool try_enqueue_bulk(It itemFirst, size_t count)
+	{
+		if (inner.try_enqueue_bulk(std::forward<It>(itemFirst), count)) {
+			eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues several items using an explicit producer token.
+	// Does not allocate memory. Fails if not enough room to enqueue.
+	// Note: Use std::make_move_iterator if the elements should be moved
+	// instead of copied.
+	// Thread-safe.
+	template<typename It>
+	inline bool try_enqueue_bulk(producer_token_t const& token, It itemFirst, size_t count)
+	{
+		if (inner.try_enqueue_bulk(token, std::forward<It>(itemFirst), count)) {
+			eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues a single item, constructing it in place from the given arguments.
+	// Allocates memory if required. Only fails if memory allocation fails (or implicit
+	// production is disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0,
+	// or Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
+	// Thread-safe.
+	template<typename... Args>
+	inline typename std::enable_if<!details::is_first_producer_token<Args...>::value, bool>::type emplace(Args&&... args)
+	{
+		if (inner.emplace(std::forward<Args>(args)...)) {
+			eventCount->notify();
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues a single item using an explicit producer token, constructing it in
+	// place from the given arguments.
+	// Allocates memory if required. Only fails if memory allocation fails (or
+	// Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
+	// Thread-safe.
+	template<typename... Args>
+	inline bool emplace(producer_token_t const& token, Args&&... args)
+	{
+		if (inner.emplace(token, std::forward<Args>(args)...)) {
+			eventCount->notify();
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues a single item, constructing it in place from the given arguments.
+	// Does not allocate memory (except for one-time implicit producer).
+	// Fails if not enough room to enqueue (or implicit production is
+	// disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0).
+	// Thread-safe.
+	template<typename... Args>
+	inline typename std::enable_if<!details::is_first_producer_token<Args...>::value, bool>::type try_emplace(Args&&... args)
+	{
+		if (inner.try_emplace(std::forward<Args>(args)...)) {
+			eventCount->notify();
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues a single item using an explicit producer token, constructing it in
+	// place from the given arguments.
+	// Does not allocate memory. Fails if not enough room to enqueue.
+	// Thread-safe.
+	template<typename... Args>
+	inline bool try_emplace(producer_token_t const& token, Args&&... args)
+	{
+		if (inner.try_emplace(token, std::forward<Args>(args)...)) {
+			eventCount->notify();
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues count items, each one constructed from the result of calling make().
+	// Allocates memory if required. Only fails if memory allocation fails (or
+	// implicit production is disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE
+	// is 0, or Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
+	// Thread-safe.
+	template<typename F>
+	inline bool enqueue_bulk_generate(size_t count, F&& make)
+	{
+		if (inner.enqueue_bulk_generate(count, std::forward<F>(make))) {
+			eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues count items using an explicit producer token, each one constructed
+	// from the result of calling make().
+	// Allocates memory if required. Only fails if memory allocation fails
+	// (or Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
+	// Thread-safe.
+	template<typename F>
+	inline bool enqueue_bulk_generate(producer_token_t const& token, size_t count, F&& make)
+	{
+		if (inner.enqueue_bulk_generate(token, count, std::forward<F>(make))) {
+			eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues count items, each one constructed from the result of calling make().
+	// Does not allocate memory (except for one-time implicit producer).
+	// Fails if not enough room to enqueue (or implicit production is
+	// disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0).
+	// Thread-safe.
+	template<typename F>
+	inline bool try_enqueue_bulk_generate(size_t count, F&& make)
+	{
+		if (inner.try_enqueue_bulk_generate(count, std::forward<F>(make))) {
+			eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
+			return true;
+		}
+		return false;
+	}
+	
+	// Enqueues count items using an explicit producer token, each one constructed
+	// from the result of calling make().
+	// Does not allocate memory. Fails if not enough room to enqueue.
+	// Thread-safe.
+	template<typename F>
+	inline bool try_enqueue_bulk_generate(producer_token_t const& token, size_t count, F&& make)
+	{
+		if (inner.try_enqueue_bulk_generate(token, count, std::forward<F>(make))) {
+			eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
+			return true;
+		}
+		return false;
+	}
+	
+	
+	// Enqueues a single item (by copying it), blocking the current thread while
+	// there's no room for it (i.e. while try_enqueue would fail) until consumers
+	// make some.
+	// Does not allocate memory (except for one-time implicit producer). Blocks
+	// forever if implicit production is disabled because
+	// Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0.
+	// Thread-safe.
+	inline void wait_enqueue(T const& item)
+	{
+		spaceEventCount->wait([&]() { return inner.try_enqueue(item); });
+		eventCount->notify();
+	}
+	
+	// Enqueues a single item (by moving it, if possible), blocking the current
+	// thread while there's no room for it until consumers make some.
+	// Does not allocate memory (except for one-time implicit producer). Blocks
+	// forever if implicit production is disabled because
+	// Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0.
+	// Thread-safe.
+	inline void wait_enqueue(T&& item)
+	{
+		spaceEventCount->wait([&]() { return inner.try_enqueue(std::move(item)); });
+		eventCount->notify();
+	}
+	
+	// Enqueues a single item (by copying it) using an explicit producer token,
+	// blocking the current thread while there's no room for it until consumers
+	// make some.
+	// Does not allocate memory. Thread-safe.
+	inline void wait_enqueue(producer_token_t const& token, T const& item)
+	{
+		spaceEventCount->wait([&]() { return inner.try_enqueue(token, item); });
+		eventCount->notify();
+	}
+	
+	// Enqueues a single item (by moving it, if possible) using an explicit producer
+	// token, blocking the current thread while there's no room for it until
+	// consumers make some.
+	// Does not allocate memory. Thread-safe.
+	inline void wait_enqueue(producer_token_t const& token, T&& item)
+	{
+		spaceEventCount->wait([&]() { return inner.try_enqueue(token, std::move(item)); });
+		eventCount->notify();
+	}
+	
+	// Enqueues a single item (by copying it), blocking the current thread while
+	// there's no room for it until either consumers make some or the timeout
+	// (specified in microseconds) expires. Returns false without enqueueing
+	// the item if the timeout expires.
+	// Using a negative timeout indicates an indefinite timeout.
+	// Does not allocate memory (except for one-time implicit producer).
+	// Thread-safe.
+	inline bool wait_enqueue_timed(T const& item, std::int64_t timeout_usecs)
+	{
+		if (!spaceEventCount->wait([&]() { return inner.try_enqueue(item); }, timeout_usecs)) {
+			return false;
+		}
+		eventCount->notify();
+		return true;
+	}
+	
+	// Enqueues a single item (by moving it, if possible), blocking the current
+	// thread while there's no room for it until either consumers make some or
+	// the timeout (specified in microseconds) expires. Returns false without
+	// enqueueing (or moving) the item if the timeout expires.
+	// Using a negative timeout indicates an indefinite timeout.
+	// Does not allocate memory (except for one-time implicit producer).
+	// Thread-safe.
+	inline bool wait_enqueue_timed(T&& item, std::int64_t timeout_usecs)
+	{
+		if (!spaceEventCount->wait([&]() { return inner.try_enqueue(std::move(item)); }, timeout_usecs)) {
+			return false;
+		}
+		eventCount->notify();
+		return true;
+	}
+	
+	// Enqueues a single item (by copying it) using an explicit producer token,
+	// blocking the current thread while there's no room for it until either
+	// consumers make some or the timeout (specified in microseconds) expires.
+	// Returns false without enqueueing the item if the timeout expires.
+	// Using a negative timeout indicates an indefinite timeout.
+	// Does not allocate memory. Thread-safe.
+	inline bool wait_enqueue_timed(producer_token_t const& token, T const& item, std::int64_t timeout_usecs)
+	{
+		if (!spaceEventCount->wait([&]() { return inner.try_enqueue(token, item); }, timeout_usecs)) {
+			return false;
+		}
+		eventCount->notify();
+		return true;
 	}
 	
-	// Enqueues several items using an explicit producer token.
-	// Allocates memory if required. Only fails if memory allocation fails
-	// (or Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
-	// Note: Use std::make_move_iterator if the elements should be moved
-	// instead of copied.
-	// Thread-safe.
-	template<typename It>
-	inline bool enqueue_bulk(producer_token_t const& token, It itemFirst, size_t count)
+	// Enqueues a single item (by moving it, if possible) using an explicit producer
+	// token, blocking the current thread while there's no room for it until either
+	// consumers make some or the timeout (specified in microseconds) expires.
+	// Returns false without enqueueing (or moving) the item if the timeout expires.
+	// Using a negative timeout indicates an indefinite timeout.
+	// Does not allocate memory. Thread-safe.
+	inline bool wait_enqueue_timed(producer_token_t const& token, T&& item, std::int64_t timeout_usecs)
 	{
-		if ((details::likely)(inner.enqueue_bulk(token, std::forward<It>(itemFirst), count))) {
-			sema->signal((LightweightSemaphore::ssize_t)(ssize_t)count);
-			return true;
+		if (!spaceEventCount->wait([&]() { return inner.try_enqueue(token, std::move(item)); }, timeout_usecs)) {
+			return false;
 		}
-		return false;
+		eventCount->notify();
+		return true;
 	}
 	
-	// Enqueues a single item (by copying it).
-	// Does not allocate memory. Fails if not enough room to enqueue (or implicit
-	// production is disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE
-	// is 0).
+	// Enqueues a single item (by copying it), blocking the current thread while
+	// there's no room for it until either consumers make some or the timeout
+	// expires. Returns false without enqueueing the item if the timeout expires.
+	// Does not allocate memory (except for one-time implicit producer).
 	// Thread-safe.
-	inline bool try_enqueue(T const& item)
+	template<typename Rep, typename Period>
+	inline bool wait_enqueue_timed(T const& item, std::chrono::duration<Rep, Period> const& timeout)
 	{
-		if (inner.try_enqueue(item)) {
-			sema->signal();
-			return true;
-		}
-		return false;
+		return wait_enqueue_timed(item, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
 	}
 	
-	// Enqueues a single item (by moving it, if possible).
+	// Enqueues a single item (by moving it, if possible), blocking the current
+	// thread while there's no room for it until either consumers make some or
+	// the timeout expires. Returns false without enqueueing (or moving) the item
+	// if the timeout expires.
 	// Does not allocate memory (except for one-time implicit producer).
-	// Fails if not enough room to enqueue (or implicit production is
-	// disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0).
 	// Thread-safe.
-	inline bool try_enqueue(T&& item)
+	template<typename Rep, typename Period>
+	inline bool wait_enqueue_timed(T&& item, std::chrono::duration<Rep, Period> const& timeout)
 	{
-		if (inner.try_enqueue(std::move(item))) {
-			sema->signal();
-			return true;
-		}
-		return false;
+		return wait_enqueue_timed(std::move(item), std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
 	}
 	
-	// Enqueues a single item (by copying it) using an explicit producer token.
-	// Does not allocate memory. Fails if not enough room to enqueue.
+	// Enqueues a single item (by copying it) using an explicit producer token,
+	// blocking the current thread while there's no room for it until either
+	// consumers make some or the timeout expires. Returns false without
+	// enqueueing the item if the timeout expires.
+	// Does not allocate memory. Thread-safe.
+	template<typename Rep, typename Period>
+	inline bool wait_enqueue_timed(producer_token_t const& token, T const& item, std::chrono::duration<Rep, Period> const& timeout)
+	{
+		return wait_enqueue_timed(token, item, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+	}
+	
+	// Enqueues a single item (by moving it, if possible) using an explicit producer
+	// token, blocking the current thread while there's no room for it until either
+	// consumers make some or the timeout expires. Returns false without enqueueing
+	// (or moving) the item if the timeout expires.
+	// Does not allocate memory. Thread-safe.
+	template<typename Rep, typename Period>
+	inline bool wait_enqueue_timed(producer_token_t const& token, T&& item, std::chrono::duration<Rep, Period> const& timeout)
+	{
+		return wait_enqueue_timed(token, std::move(item), std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+	}
+	
+	// Enqueues several items, blocking the current thread until there's room for
+	// all of them at once (bulk enqueues are all-or-nothing, so this blocks forever
+	// if count is more than the queue can ever hold).
+	// Does not allocate memory (except for one-time implicit producer).
+	// Note: Use std::make_move_iterator if the elements should be moved
+	// instead of copied.
 	// Thread-safe.
-	inline bool try_enqueue(producer_token_t const& token, T const& item)
+	template<typename It>
+	inline void wait_enqueue_bulk(It itemFirst, size_t count)
 	{
-		if (inner.try_enqueue(token, item)) {
-			sema->signal();
-			return true;
-		}
-		return false;
+		spaceEventCount->wait([&]() { return inner.try_enqueue_bulk(itemFirst, count); });
+		eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
 	}
 	
-	// Enqueues a single item (by moving it, if possible) using an explicit producer token.
-	// Does not allocate memory. Fails if not enough room to enqueue.
+	// Enqueues several items using an explicit producer token, blocking the current
+	// thread until there's room for all of them at once (bulk enqueues are
+	// all-or-nothing, so this blocks forever if count is more than the queue can
+	// ever hold).
+	// Does not allocate memory.
+	// Note: Use std::make_move_iterator if the elements should be moved
+	// instead of copied.
 	// Thread-safe.
-	inline bool try_enqueue(producer_token_t const& token, T&& item)
+	template<typename It>
+	inline void wait_enqueue_bulk(producer_token_t const& token, It itemFirst, size_t count)
 	{
-		if (inner.try_enqueue(token, std::move(item))) {
-			sema->signal();
-			return true;
-		}
-		return false;
+		spaceEventCount->wait([&]() { return inner.try_enqueue_bulk(token, itemFirst, count); });
+		eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
 	}
 	
-	// Enqueues several items.
+	// Enqueues several items, blocking the current thread until either there's
+	// room for all of them at once or the timeout (specified in microseconds)
+	// expires. Returns false without enqueueing anything if the timeout expires.
+	// Using a negative timeout indicates an indefinite timeout.
 	// Does not allocate memory (except for one-time implicit producer).
-	// Fails if not enough room to enqueue (or implicit production is
-	// disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0).
 	// Note: Use std::make_move_iterator if the elements should be moved
 	// instead of copied.
 	// Thread-safe.
 	template<typename It>
-	inline bool try_enqueue_bulk(It itemFirst, size_t count)
+	inline bool wait_enqueue_bulk_timed(It itemFirst, size_t count, std::int64_t timeout_usecs)
 	{
-		if (inner.try_enqueue_bulk(std::forward<It>(itemFirst), count)) {
-			sema->signal((LightweightSemaphore::ssize_t)(ssize_t)count);
-			return true;
+		if (!spaceEventCount->wait([&]() { return inner.try_enqueue_bulk(itemFirst, count); }, timeout_usecs)) {
+			return false;
 		}
-		return false;
+		eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
+		return true;
 	}
 	
-	// Enqueues several items using an explicit producer token.
-	// Does not allocate memory. Fails if not enough room to enqueue.
+	// Enqueues several items using an explicit producer token, blocking the current
+	// thread until either there's room for all of them at once or the timeout
+	// (specified in microseconds) expires. Returns false without enqueueing
+	// anything if the timeout expires.
+	// Using a negative timeout indicates an indefinite timeout.
+	// Does not allocate memory.
 	// Note: Use std::make_move_iterator if the elements should be moved
 	// instead of copied.
 	// Thread-safe.
 	template<typename It>
-	inline bool try_enqueue_bulk(producer_token_t const& token, It itemFirst, size_t count)
+	inline bool wait_enqueue_bulk_timed(producer_token_t const& token, It itemFirst, size_t count, std::int64_t timeout_usecs)
 	{
-		if (inner.try_enqueue_bulk(token, std::forward<It>(itemFirst), count)) {
-			sema->signal((LightweightSemaphore::ssize_t)(ssize_t)count);
-			return true;
+		if (!spaceEventCount->wait([&]() { return inner.try_enqueue_bulk(token, itemFirst, count); }, timeout_usecs)) {
+			return false;
 		}
-		return false;
+		eventCount->notify((typename EventCount::ssize_t)(ssize_t)count);
+		return true;
+	}
+	
+	// Enqueues several items, blocking the current thread until either there's
+	// room for all of them at once or the timeout expires. Returns false
+	// without enqueueing anything if the timeout expires.
+	// Does not allocate memory (except for one-time implicit producer).
+	// Thread-safe.
+	template<typename It, typename Rep, typename Period>
+	inline bool wait_enqueue_bulk_timed(It itemFirst, size_t count, std::chrono::duration<Rep, Period> const& timeout)
+	{
+		return wait_enqueue_bulk_timed(itemFirst, count, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+	}
+	
+	// Enqueues several items using an explicit producer token, blocking the current
+	// thread until either there's room for all of them at once or the timeout
+	// expires. Returns false without enqueueing anything if the timeout expires.
+	// Does not allocate memory.
+	// Thread-safe.
+	template<typename It, typename Rep, typename Period>
+	inline bool wait_enqueue_bulk_timed(producer_token_t const& token, It itemFirst, size_t count, std::chrono::duration<Rep, Period> const& timeout)
+	{
+		return wait_enqueue_bulk_timed(token, itemFirst, count, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
 	}
 	
 	
 	// Attempts to dequeue from the queue.
 	// Returns false if all producer streams appeared empty at the time they
 	// were checked (so, the queue is likely but not guaranteed to be empty).
+	// This goes straight to the inner ConcurrentQueue, so like its try_dequeue it
+	// can also fail spuriously while elements are present (e.g. while another
+	// consumer backs out of its claim on the last element of a producer); use
+	// wait_dequeue_timed with a timeout of 0 if that matters.
 	// Never allocates. Thread-safe.
 	template<typename U>
 	inline bool try_dequeue(U& item)
 	{
-		if (sema->tryWait()) {
-			while (!inner.try_dequeue(item)) {
-				continue;
-			}
-			return true;
-		}
-		return false;
+		return inner.try_dequeue(item);
 	}
 	
 	// Attempts to dequeue from the queue using an explicit consumer token.
@@ -705,13 +2348,7 @@ public:
 	template<typename U>
 	inline bool try_dequeue(consumer_token_t& token, U& item)
 	{
-		if (sema->tryWait()) {
-			while (!inner.try_dequeue(token, item)) {
-				continue;
-			}
-			return true;
-		}
-		return false;
+		return inner.try_dequeue(token, item);
 	}
 	
 	// Attempts to dequeue several elements from the queue.
@@ -722,12 +2359,7 @@ public:
 	template<typename It>
 	inline size_t try_dequeue_bulk(It itemFirst, size_t max)
 	{
-		size_t count = 0;
-		max = (size_t)sema->tryWaitMany((LightweightSemaphore::ssize_t)(ssize_t)max);
-		while (count != max) {
-			count += inner.template try_dequeue_bulk<It&>(itemFirst, max - count);
-		}
-		return count;
+		return inner.try_dequeue_bulk(itemFirst, max);
 	}
 	
 	// Attempts to dequeue several elements from the queue using an explicit consumer token.
@@ -738,12 +2370,7 @@ public:
 	template<typename It>
 	inline size_t try_dequeue_bulk(consumer_token_t& token, It itemFirst, size_t max)
 	{
-		size_t count = 0;
-		max = (size_t)sema->tryWaitMany((LightweightSemaphore::ssize_t)(ssize_t)max);
-		while (count != max) {
-			count += inner.template try_dequeue_bulk<It&>(token, itemFirst, max - count);
-		}
-		return count;
+		return inner.try_dequeue_bulk(token, itemFirst, max);
 	}
 	
 	
@@ -754,10 +2381,7 @@ public:
 	template<typename U>
 	inline void wait_dequeue(U& item)
 	{
-		sema->wait();
-		while (!inner.try_dequeue(item)) {
-			continue;
-		}
+		eventCount->waitWithRecheck([&]() { return inner.try_dequeue(item); }, not_empty());
 	}
 
 	// Blocks the current thread until either there's something to dequeue
@@ -770,12 +2394,9 @@ public:
 	template<typename U>
 	inline bool wait_dequeue_timed(U& item, std::int64_t timeout_usecs)
 	{
-		if (!sema->wait(timeout_usecs)) {
+		if (!eventCount->waitWithRecheck([&]() { return inner.try_dequeue(item); }, not_empty(), timeout_usecs)) {
 			return false;
 		}
-		while (!inner.try_dequeue(item)) {
-			continue;
-		}
 		return true;
 	}
     
@@ -795,10 +2416,7 @@ public:
 	template<typename U>
 	inline void wait_dequeue(consumer_token_t& token, U& item)
 	{
-		sema->wait();
-		while (!inner.try_dequeue(token, item)) {
-			continue;
-		}
+		eventCount->waitWithRecheck([&]() { return inner.try_dequeue(token, item); }, not_empty());
 	}
 	
 	// Blocks the current thread until either there's something to dequeue
@@ -811,12 +2429,9 @@ public:
 	template<typename U>
 	inline bool wait_dequeue_timed(consumer_token_t& token, U& item, std::int64_t timeout_usecs)
 	{
-		if (!sema->wait(timeout_usecs)) {
+		if (!eventCount->waitWithRecheck([&]() { return inner.try_dequeue(token, item); }, not_empty(), timeout_usecs)) {
 			return false;
 		}
-		while (!inner.try_dequeue(token, item)) {
-			continue;
-		}
 		return true;
 	}
     
@@ -839,10 +2454,7 @@ public:
 	inline size_t wait_dequeue_bulk(It itemFirst, size_t max)
 	{
 		size_t count = 0;
-		max = (size_t)sema->waitMany((LightweightSemaphore::ssize_t)(ssize_t)max);
-		while (count != max) {
-			count += inner.template try_dequeue_bulk<It&>(itemFirst, max - count);
-		}
+		eventCount->waitWithRecheck([&]() { return (count = inner.try_dequeue_bulk(itemFirst, max)) != 0; }, not_empty(), -1, wake_demand(max));
 		return count;
 	}
 	
@@ -857,10 +2469,7 @@ public:
 	inline size_t wait_dequeue_bulk_timed(It itemFirst, size_t max, std::int64_t timeout_usecs)
 	{
 		size_t count = 0;
-		max = (size_t)sema->waitMany((LightweightSemaphore::ssize_t)(ssize_t)max, timeout_usecs);
-		while (count != max) {
-			count += inner.template try_dequeue_bulk<It&>(itemFirst, max - count);
-		}
+		eventCount->waitWithRecheck([&]() { return (count = inner.try_dequeue_bulk(itemFirst, max)) != 0; }, not_empty(), timeout_usecs, wake_demand(max));
 		return count;
 	}
     
@@ -884,10 +2493,7 @@ public:
 	inline size_t wait_dequeue_bulk(consumer_token_t& token, It itemFirst, size_t max)
 	{
 		size_t count = 0;
-		max = (size_t)sema->waitMany((LightweightSemaphore::ssize_t)(ssize_t)max);
-		while (count != max) {
-			count += inner.template try_dequeue_bulk<It&>(token, itemFirst, max - count);
-		}
+		eventCount->waitWithRecheck([&]() { return (count = inner.try_dequeue_bulk(token, itemFirst, max)) != 0; }, not_empty(), -1, wake_demand(max));
 		return count;
 	}
 	
@@ -902,10 +2508,7 @@ public:
 	inline size_t wait_dequeue_bulk_timed(consumer_token_t& token, It itemFirst, size_t max, std::int64_t timeout_usecs)
 	{
 		size_t count = 0;
-		max = (size_t)sema->waitMany((LightweightSemaphore::ssize_t)(ssize_t)max, timeout_usecs);
-		while (count != max) {
-			count += inner.template try_dequeue_bulk<It&>(token, itemFirst, max - count);
-		}
+		eventCount->waitWithRecheck([&]() { return (count = inner.try_dequeue_bulk(token, itemFirst, max)) != 0; }, not_empty(), timeout_usecs, wake_demand(max));
 		return count;
 	}
 	
@@ -920,16 +2523,243 @@ public:
         return wait_dequeue_bulk_timed<It&>(token, itemFirst, max, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
     }
 	
+	// Dequeues elements until at least minItems (and at most maxItems) have been
+	// dequeued, or until the linger timeout (specified in microseconds) expires,
+	// whichever comes first; i.e., waits for a batch of a minimum size, but only
+	// for so long. Returns the number of items actually dequeued, which is less
+	// than minItems only if the linger timeout expired (and can be 0).
+	// Using a negative timeout indicates an indefinite timeout.
+	// Never allocates. Thread-safe.
+	template<typename It>
+	inline size_t wait_dequeue_bulk_min(It itemFirst, size_t minItems, size_t maxItems, std::int64_t linger_usecs)
+	{
+		assert(minItems <= maxItems);
+		size_t count = 0;
+		eventCount->waitWithRecheck([&]() {
+			count += inner.template try_dequeue_bulk<It&>(itemFirst, maxItems - count);
+			return count >= minItems;
+		}, not_empty(), linger_usecs, wake_demand(maxItems));
+		return count;
+	}
+	
+	// Dequeues elements until at least minItems (and at most maxItems) have been
+	// dequeued, or until the linger timeout expires, whichever comes first.
+	// Returns the number of items actually dequeued, which is less than minItems
+	// only if the linger timeout expired (and can be 0).
+	// Never allocates. Thread-safe.
+	template<typename It, typename Rep, typename Period>
+	inline size_t wait_dequeue_bulk_min(It itemFirst, size_t minItems, size_t maxItems, std::chrono::duration<Rep, Period> const& linger)
+	{
+		return wait_dequeue_bulk_min<It&>(itemFirst, minItems, maxItems, std::chrono::duration_cast<std::chrono::microseconds>(linger).count());
+	}
+	
+	// Dequeues elements using an explicit consumer token until at least minItems
+	// (and at most maxItems) have been dequeued, or until the linger timeout
+	// (specified in microseconds) expires, whichever comes first.
+	// Returns the number of items actually dequeued, which is less than minItems
+	// only if the linger timeout expired (and can be 0).
+	// Using a negative timeout indicates an indefinite timeout.
+	// Never allocates. Thread-safe.
+	template<typename It>
+	inline size_t wait_dequeue_bulk_min(consumer_token_t& token, It itemFirst, size_t minItems, size_t maxItems, std::int64_t linger_usecs)
+	{
+		assert(minItems <= maxItems);
+		size_t count = 0;
+		eventCount->waitWithRecheck([&]() {
+			count += inner.template try_dequeue_bulk<It&>(token, itemFirst, maxItems - count);
+			return count >= minItems;
+		}, not_empty(), linger_usecs, wake_demand(maxItems));
+		return count;
+	}
+	
+	// Dequeues elements using an explicit consumer token until at least minItems
+	// (and at most maxItems) have been dequeued, or until the linger timeout
+	// expires, whichever comes first.
+	// Returns the number of items actually dequeued, which is less than minItems
+	// only if the linger timeout expired (and can be 0).
+	// Never allocates. Thread-safe.
+	template<typename It, typename Rep, typename Period>
+	inline size_t wait_dequeue_bulk_min(consumer_token_t& token, It itemFirst, size_t minItems, size_t maxItems, std::chrono::duration<Rep, Period> const& linger)
+	{
+		return wait_dequeue_bulk_min<It&>(token, itemFirst, minItems, maxItems, std::chrono::duration_cast<std::chrono::microseconds>(linger).count());
+	}
+	
+	
+#ifdef MOODYCAMEL_HAS_COROUTINES
+	// Awaitable versions of wait_dequeue and wait_dequeue_bulk (C++20) -- e.g.
+	// `co_await q.async_dequeue(item);` -- that suspend the awaiting coroutine rather
+	// than blocking its thread. Once something's been enqueued, the coroutine dequeues
+	// it via the given executor (see InlineExecutor), and is resumed there if it got
+	// an element (otherwise it goes back to waiting). Suspended coroutines can't be
+	// cancelled, so the queue must outlive them.
+	// Never allocates (except for the executor's own allocations). Thread-safe.
+	template<typename U, typename Executor = InlineExecutor>
+	inline auto async_dequeue(U& item, Executor executor = Executor())
+	{
+		auto tryDequeue = [this, &item]() { return (size_t)(inner.try_dequeue(item) ? 1 : 0); };
+		return AsyncDequeueAwaiter<decltype(tryDequeue), Executor, void>(*this, tryDequeue, executor);
+	}
+	
+	template<typename U, typename Executor = InlineExecutor>
+	inline auto async_dequeue(consumer_token_t& token, U& item, Executor executor = Executor())
+	{
+		auto tryDequeue = [this, &token, &item]() { return (size_t)(inner.try_dequeue(token, item) ? 1 : 0); };
+		return AsyncDequeueAwaiter<decltype(tryDequeue), Executor, void>(*this, tryDequeue, executor);
+	}
+	
+	// The number of elements dequeued (at least one, at most max) is the result of the co_await
+	template<typename It, typename Executor = InlineExecutor>
+	inline auto async_dequeue_bulk(It itemFirst, size_t max, Executor executor = Executor())
+	{
+		auto tryDequeue = [this, itemFirst, max]() { return inner.try_dequeue_bulk(itemFirst, max); };
+		return AsyncDequeueAwaiter<decltype(tryDequeue), Executor, size_t>(*this, tryDequeue, executor);
+	}
+	
+	template<typename It, typename Executor = InlineExecutor>
+	inline auto async_dequeue_bulk(consumer_token_t& token, It itemFirst, size_t max, Executor executor = Executor())
+	{
+		auto tryDequeue = [this, &token, itemFirst, max]() { return inner.try_dequeue_bulk(token, itemFirst, max); };
+		return AsyncDequeueAwaiter<decltype(tryDequeue), Executor, size_t>(*this, tryDequeue, executor);
+	}
+
+
+#endif
+	// For consumers that sleep in an event loop (epoll, poll or select) instead of in
+	// wait_dequeue: dequeues up to max elements, and if the queue runs dry first, arms
+	// it so that the next enqueue signals the wait strategy -- with EventFdWaitStrategy,
+	// this makes the eventfd (see notification_fd) readable, waking up the loop; the
+	// next call to drain resets it. Returns the number of elements dequeued. If that's
+	// max, the queue isn't armed, and drain should be called again (rather than going
+	// back to waiting on the eventfd) to get the rest.
+	// Only one thread may use drain on a given queue (though others may still dequeue
+	// from it in other ways).
+	// Never allocates.
+	template<typename It>
+	inline size_t drain(It itemFirst, size_t max)
+	{
+		size_t count = 0;
+		eventCount->consumeOrArm([&]() {
+			count += inner.template try_dequeue_bulk<It&>(itemFirst, max - count);
+			return count == max;
+		}, not_empty());
+		return count;
+	}
+	
+	// Returns the file descriptor of the eventfd the queue's consumers wait on, which
+	// becomes readable when a queue armed by drain gets something to dequeue.
+	// Only available when the wait strategy is EventFdWaitStrategy. If the eventfd
+	// couldn't be created, the constructor throws std::system_error; with exceptions
+	// disabled, this returns -1 instead, and the queue must not be used.
+	// Thread-safe.
+	inline int notification_fd() const
+	{
+		return eventCount->waitStrategy().fd();
+	}
+	
 	
 	// Returns an estimate of the total number of elements currently in the queue. This
 	// estimate is only accurate if the queue has completely stabilized before it is called
 	// (i.e. all enqueue and dequeue operations have completed and their memory effects are
 	// visible on the calling thread, and no further operations start while this method is
-	// being called).
+	// being called). Like try_dequeue, this goes straight to the inner ConcurrentQueue
+	// and knows nothing of waiting consumers.
 	// Thread-safe.
 	inline size_t size_approx() const
 	{
-		return (size_t)sema->availableApprox();
+		return inner.size_approx();
+	}
+	
+	// Returns true if the queue appeared empty at the time it was checked (see
+	// ConcurrentQueue::empty_approx).
+	// Thread-safe.
+	inline bool empty_approx() const
+	{
+		return inner.empty_approx();
+	}
+	
+	// Returns a snapshot of the queue's memory use and (block-level) occupancy, read
+	// from counters that are cheap to scrape periodically (see ConcurrentQueue::stats).
+	// Thread-safe.
+	inline Stats stats() const
+	{
+		return inner.stats();
+	}
+	
+	// Returns how long (in microseconds, approximately) the given percentile of the
+	// sampled elements sat in the queue, or 0 if nothing's been sampled (see
+	// ConcurrentQueue::residency_percentile and Traits::RESIDENCY_SAMPLE_INTERVAL).
+	// Thread-safe.
+	inline double residency_percentile(double percentile) const
+	{
+		return inner.residency_percentile(percentile);
+	}
+	
+	// Returns the number of residencies sampled so far (or since the last reset).
+	// Thread-safe.
+	inline std::uint64_t residency_samples() const
+	{
+		return inner.residency_samples();
+	}
+	
+	// Forgets the residencies sampled so far.
+	// Thread-safe.
+	inline void reset_residency_samples()
+	{
+		inner.reset_residency_samples();
+	}
+	
+	// Returns how often the queue's lock-free paths have had to retry so far (all
+	// zeros unless MOODYCAMEL_CONTENTION_COUNTERS is defined; see
+	// ConcurrentQueue::contention_stats).
+	// Thread-safe.
+	inline ContentionStats contention_stats() const
+	{
+		return inner.contention_stats();
+	}
+	
+	// Has callback(userData, high, approxSize) called when the queue fills up to the high
+	// watermark and when it drains back down to the low one, alternately, from within
+	// the enqueue or dequeue that crossed it (see ConcurrentQueue::set_watermarks).
+	// Returns false if memory for the bookkeeping couldn't be allocated.
+	// Not thread-safe: no other operations may be in progress.
+	inline bool set_watermarks(size_t high, size_t low, watermark_callback_t callback, void* userData = nullptr)
+	{
+		return inner.set_watermarks(high, low, callback, userData);
+	}
+	
+	// Calls f(ProducerInfo const&) with a snapshot of each producer's backlog, block
+	// count and last activity, and returns how many there were (see
+	// ConcurrentQueue::for_each_producer). Doesn't lock anything.
+	// Thread-safe.
+	template<typename F>
+	inline size_t for_each_producer(F&& f) const
+	{
+		return inner.for_each_producer(std::forward<F>(f));
+	}
+	
+	// Calls f(T const&) on up to max of the oldest elements enqueued with the given
+	// token without dequeueing them, and returns how many (see
+	// ConcurrentQueue::peek_oldest). Only safe for a single consumer.
+	template<typename F>
+	inline size_t peek_oldest(producer_token_t const& producer, size_t max, F&& f) const
+	{
+		return inner.peek_oldest(producer, max, std::forward<F>(f));
+	}
+	
+	// Returns the oldest element enqueued with the given token without dequeueing
+	// it, or nullptr if there isn't one. Only safe for a single consumer.
+	inline T const* front(producer_token_t const& producer) const
+	{
+		return inner.front(producer);
+	}
+	
+	// Best-effort copy of up to max elements, without dequeueing them, for
+	// trivially copyable element types (see ConcurrentQueue::snapshot).
+	// Safe to call concurrently with enqueues, but not with dequeues.
+	template<typename OutputIt>
+	inline size_t snapshot(OutputIt out, size_t max) const
+	{
+		return inner.snapshot(out, max);
 	}
 	
 	
@@ -950,11 +2780,23 @@ private:
 		return p != nullptr ? new (p) U : nullptr;
 	}
 	
-	template<typename U, typename A1>
-	static inline U* create(A1&& a1)
+	template<typename U, typename A1, typename... Args>
+	static inline U* create(A1&& a1, Args&&... args)
 	{
 		auto p = (Traits::malloc)(sizeof(U));
-		return p != nullptr ? new (p) U(std::forward<A1>(a1)) : nullptr;
+		if (p == nullptr) {
+			return nullptr;
+		}
+		U* result = nullptr;
+		MOODYCAMEL_TRY {
+			result = new (p) U(std::forward<A1>(a1), std::forward<Args>(args)...);
+		}
+		MOODYCAMEL_CATCH (...) {
+			// e.g. an EventFdWaitStrategy that couldn't get its eventfd
+			(Traits::free)(p);
+			MOODYCAMEL_RETHROW;
+		}
+		return result;
 	}
 	
 	template<typename U>
@@ -966,14 +2808,141 @@ private:
 		(Traits::free)(p);
 	}
 	
+	// For the notifier of a queue that shares someone else's
+	static inline void detach(EventCount*)
+	{
+	}
+	
+	// Producers waiting for room each wait for something of their own (one of their
+	// blocks emptying out, or any block being freed), hence wakeAll. Since they're only
+	// told about room with notifyIfWaiting, they also look again every millisecond.
+	static inline EventCount* create_space_event_count()
+	{
+		return create<EventCount>((int)Traits::MAX_SEMA_SPINS, (bool)Traits::ADAPTIVE_SEMA_SPINNING, true, (std::int64_t)1000);
+	}
+	
+	// Has the inner queue tell the producers waiting for room whenever dequeueing frees
+	// up a block (rather than after every dequeue, since there's no room to be had for
+	// a producer short of a whole block); with nobody waiting, that costs next to nothing
+	inline void listen_for_room()
+	{
+		inner.blockFreedCallback = &BlockingConcurrentQueue::on_block_freed;
+		inner.blockFreedUserData = spaceEventCount.get();
+	}
+	
+	static void on_block_freed(void* spaceEventCount)
+	{
+		static_cast<EventCount*>(spaceEventCount)->notifyIfWaiting();
+	}
+	
+	// What waiting consumers check before going to sleep, since a failed try_dequeue can
+	// be spurious (see BasicEventCount::waitWithRecheck); empty_approx never misses an
+	// element that's there to be dequeued
+	struct NotEmpty
+	{
+		ConcurrentQueue const* queue;
+		
+		inline bool operator()() const { return !queue->empty_approx(); }
+	};
+	
+	inline NotEmpty not_empty() const
+	{
+		NotEmpty check = { &inner };
+		return check;
+	}
+	
+	// How many elements a consumer waiting to dequeue up to max of them at once is
+	// counted on to take (see BULK_WAKE_BATCH_SIZE)
+	static inline typename EventCount::ssize_t wake_demand(size_t max)
+	{
+		size_t batch = Traits::BULK_WAKE_BATCH_SIZE == 0 || max < Traits::BULK_WAKE_BATCH_SIZE ? max : Traits::BULK_WAKE_BATCH_SIZE;
+		return (typename EventCount::ssize_t)(ssize_t)(batch > 0 ? batch : 1);
+	}
+	
+#ifdef MOODYCAMEL_HAS_COROUTINES
+	// What async_dequeue returns. TryDequeue returns the number of elements it dequeued.
+	template<typename TryDequeue, typename Executor, typename Result>
+	class AsyncDequeueAwaiter : private EventCount::AsyncWaiter
+	{
+	public:
+		AsyncDequeueAwaiter(BlockingConcurrentQueue& queue, TryDequeue tryDequeue, Executor executor)
+			: queue(&queue), tryDequeue(std::move(tryDequeue)), executor(std::move(executor)), dequeued(0)
+		{
+		}
+		
+		bool await_ready()
+		{
+			return (dequeued = tryDequeue()) != 0;
+		}
+		
+		bool await_suspend(std::coroutine_handle<> awaiting)
+		{
+			handle = awaiting;
+			this->wake = &AsyncDequeueAwaiter::on_wake;
+			return !wait();
+		}
+		
+		Result await_resume() const
+		{
+			return static_cast<Result>(dequeued);
+		}
+	
+	private:
+		// Registers to be woken; returns true instead if it got something to dequeue
+		// after all, in which case it's up to the caller to resume the coroutine
+		bool wait()
+		{
+			// As soon as we're registered, we can be woken, dequeue and resume (and be
+			// destroyed along with the coroutine frame) on another thread, so nothing
+			// after that can touch this unless we manage to unregister again first
+			BlockingConcurrentQueue* q = queue;
+			EventCount* eventCount = q->eventCount.get();
+			while (true) {
+				eventCount->addAsyncWaiter(this);
+				if (q->inner.empty_approx() || !eventCount->removeAsyncWaiter(this)) {
+					return false;
+				}
+				// Something was enqueued before we got registered, and whoever enqueued it
+				// may not have seen us; we've taken ourselves back off, so see to it here
+				// (rather than through notify(), which could recurse right back into us
+				// on this stack, and would wake blocked threads too)
+				if ((dequeued = tryDequeue()) != 0) {
+					return true;
+				}
+				details::mpmc_sema::cpu_relax();
+			}
+		}
+		
+		static void on_wake(typename EventCount::AsyncWaiter* waiter)
+		{
+			AsyncDequeueAwaiter* self = static_cast<AsyncDequeueAwaiter*>(waiter);
+			Executor executor(self->executor);
+			executor([self]() {
+				if ((self->dequeued = self->tryDequeue()) != 0 || self->wait()) {
+					self->handle.resume();
+				}
+			});
+		}
+	
+	private:
+		BlockingConcurrentQueue* queue;
+		TryDequeue tryDequeue;
+		Executor executor;
+		size_t dequeued;
+		std::coroutine_handle<> handle;
+	};
+
+#endif
+
 private:
 	ConcurrentQueue inner;
-	std::unique_ptr<LightweightSemaphore, void (*)(LightweightSemaphore*)> sema;
+	std::unique_ptr<EventCount, void (*)(EventCount*)> eventCount;
+	std::unique_ptr<EventCount, void (*)(EventCount*)> spaceEventCount;		// For producers waiting for room in the queue (each one in its own sub-queue, hence woken all at once)
 };
 
 
-template<typename T, typename Traits>
-inline void swap(BlockingConcurrentQueue<T, Traits>& a, BlockingConcurrentQueue<T, Traits>& b) MOODYCAMEL_NOEXCEPT
+template<typename T, typename Traits, typename WaitStrategy>
+inline void swap(BlockingConcurrentQueue<T, Traits, WaitStrategy>& a, BlockingConcurrentQueue<T, Traits, WaitStrategy>& b) MOODYCAMEL_NOEXCEPT
 {
 	a.swap(b);
 }
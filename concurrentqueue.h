@@ -62,13 +62,16 @@
 #include <cstddef>              // for max_align_t
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>		// for std::memcpy
 #include <type_traits>
 #include <algorithm>
 #include <utility>
+#include <iterator>		// for std::move_iterator
 #include <limits>
 #include <climits>		// for CHAR_BIT
 #include <array>
 #include <thread>		// partly for __WINPTHREADS_VERSION if on MinGW-w64 w/ POSIX threading
+#include <chrono>		// for residency sampling
 
 // Platform-specific definitions of a numeric thread ID type and an invalid value
 namespace moodycamel { namespace details {
@@ -214,6 +217,15 @@ namespace moodycamel { namespace details {
 #endif
 #endif
 
+// VS2013 doesn't support alignas either, but has its own equivalent.
+#ifndef MOODYCAMEL_ALIGNAS
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define MOODYCAMEL_ALIGNAS(alignment) __declspec(align(alignment))
+#else
+#define MOODYCAMEL_ALIGNAS(alignment) alignas(alignment)
+#endif
+#endif
+
 // Compiler-specific likely/unlikely hints
 namespace moodycamel { namespace details {
 #if defined(__GNUC__)
@@ -225,6 +237,184 @@ namespace moodycamel { namespace details {
 #endif
 } }
 
+// Compiler-specific software prefetch hints (no-ops where unsupported)
+#if !defined(__GNUC__) && defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#include <intrin.h>		// for __rdtsc
+#endif
+namespace moodycamel { namespace details {
+#if defined(__GNUC__)
+	static inline void prefetch_for_read(void const* ptr) { __builtin_prefetch(ptr, 0, 3); }
+	static inline void prefetch_for_write(void const* ptr) { __builtin_prefetch(ptr, 1, 3); }
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	static inline void prefetch_for_read(void const* ptr) { _mm_prefetch(static_cast<char const*>(ptr), _MM_HINT_T0); }
+	static inline void prefetch_for_write(void const* ptr) { _mm_prefetch(static_cast<char const*>(ptr), _MM_HINT_T0); }
+#else
+	static inline void prefetch_for_read(void const*) { }
+	static inline void prefetch_for_write(void const*) { }
+#endif
+} }
+
+// Optional USDT (user-level statically defined tracing) probes, for attaching bpftrace,
+// perf or SystemTap to a live process; define MOODYCAMEL_USDT_PROBES (with <sys/sdt.h>
+// from SystemTap available) to compile them in. Probes nobody is tracing cost a nop
+// each. All probes belong to the "moodycamel" provider, and their first argument is
+// the queue (or, for the semaphore probes, the event count) they fired in:
+//   block_requisition(queue, blocksInUse)           A producer took a block
+//   block_alloc(queue, blocksAllocated)             ... which had to be allocated
+//   block_index_grow(queue, producer, entries, bytes)
+//   implicit_producer_create(queue, producer, recycled, producers)
+//   dequeue_failed(queue, max)                      A try_dequeue* found nothing
+//   sema_park(eventCount, timeoutUsecs)             A blocking consumer went to sleep
+//   sema_unpark(eventCount, timedOut)               ... and woke up again
+//   sema_wake(eventCount, woken, count)             A notify woke sleeping consumers
+#ifdef MOODYCAMEL_USDT_PROBES
+#include <sys/sdt.h>
+#define MOODYCAMEL_PROBE2(name, a, b) DTRACE_PROBE2(moodycamel, name, a, b)
+#define MOODYCAMEL_PROBE3(name, a, b, c) DTRACE_PROBE3(moodycamel, name, a, b, c)
+#define MOODYCAMEL_PROBE4(name, a, b, c, d) DTRACE_PROBE4(moodycamel, name, a, b, c, d)
+#else
+#define MOODYCAMEL_PROBE2(name, a, b) do { } while (false)
+#define MOODYCAMEL_PROBE3(name, a, b, c) do { } while (false)
+#define MOODYCAMEL_PROBE4(name, a, b, c, d) do { } while (false)
+#endif
+
+// Timestamps and histograms for residency sampling (see RESIDENCY_SAMPLE_INTERVAL)
+namespace moodycamel { namespace details {
+	// The time-stamp counter where there is one (cheap, but in cycles), otherwise a
+	// nanosecond clock
+	static inline std::uint64_t residency_ticks()
+	{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		return __builtin_ia32_rdtsc();
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+		return __rdtsc();
+#else
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+	}
+	
+	// How many residency ticks there are in a microsecond; with the time-stamp counter,
+	// that's measured (once, taking about a millisecond) against the steady clock
+	static inline double residency_ticks_per_usec()
+	{
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))) || (defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64)))
+		static const double ticksPerUsec = []() {
+			auto start = std::chrono::steady_clock::now();
+			auto startTicks = residency_ticks();
+			std::chrono::steady_clock::time_point end;
+			do {
+				end = std::chrono::steady_clock::now();
+			} while (end - start < std::chrono::milliseconds(1));
+			auto ticks = residency_ticks() - startTicks;
+			return (double)ticks / (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() * 1000.0;
+		}();
+		return ticksPerUsec;
+#else
+		return 1000.0;
+#endif
+	}
+	
+	// Block-side enqueue timestamps of the sampled elements; nothing at all when
+	// sampling is disabled
+	template<std::size_t Count>
+	struct residency_stamps
+	{
+		inline std::uint64_t& enqueued_at(std::size_t slot) { return enqueuedAt[slot]; }
+		
+		std::uint64_t enqueuedAt[Count];
+	};
+	
+	template<>
+	struct residency_stamps<0>
+	{
+		// Never actually called
+		inline std::uint64_t& enqueued_at(std::size_t) { static std::uint64_t none = 0; return none; }
+	};
+	
+	// A lock-free log-linear histogram: values below 16 get a bucket each, and every
+	// power of 2 above that is split into 16 buckets, which keeps the relative error of
+	// the reported percentiles under about 6%
+	class log_linear_histogram
+	{
+	public:
+		log_linear_histogram()
+		{
+			reset();
+		}
+		
+		inline void record(std::uint64_t value)
+		{
+			counts[bucket_for(value)].fetch_add(1, std::memory_order_relaxed);
+		}
+		
+		std::uint64_t count() const
+		{
+			std::uint64_t total = 0;
+			for (std::size_t i = 0; i != BUCKETS; ++i) {
+				total += counts[i].load(std::memory_order_relaxed);
+			}
+			return total;
+		}
+		
+		// The (approximate) value that the given fraction of the recorded values are at
+		// or below, e.g. 0.99 for the 99th percentile; 0 if nothing's been recorded yet
+		std::uint64_t value_at(double fraction) const
+		{
+			std::uint64_t total = count();
+			if (total == 0) {
+				return 0;
+			}
+			auto rank = static_cast<std::uint64_t>(fraction * (double)total + 0.5);
+			rank = rank < 1 ? 1 : rank > total ? total : rank;
+			std::uint64_t seen = 0;
+			for (std::size_t i = 0; i != BUCKETS; ++i) {
+				seen += counts[i].load(std::memory_order_relaxed);
+				if (seen >= rank) {
+					return bucket_midpoint(i);
+				}
+			}
+			return bucket_midpoint(BUCKETS - 1);
+		}
+		
+		void reset()
+		{
+			for (std::size_t i = 0; i != BUCKETS; ++i) {
+				counts[i].store(0, std::memory_order_relaxed);
+			}
+		}
+	
+	private:
+		static const std::size_t SUB_BUCKETS = 16;
+		static const std::size_t BUCKETS = (64 - 4 + 1) * SUB_BUCKETS;
+		
+		static inline std::size_t bucket_for(std::uint64_t value)
+		{
+			if (value < SUB_BUCKETS) {
+				return static_cast<std::size_t>(value);
+			}
+			std::size_t exponent = 4;
+			while (exponent != 63 && (value >> (exponent + 1)) != 0) {
+				++exponent;
+			}
+			return (exponent - 3) * SUB_BUCKETS + static_cast<std::size_t>((value >> (exponent - 4)) & (SUB_BUCKETS - 1));
+		}
+		
+		static inline std::uint64_t bucket_midpoint(std::size_t bucket)
+		{
+			if (bucket < SUB_BUCKETS) {
+				return bucket;
+			}
+			std::size_t exponent = bucket / SUB_BUCKETS + 3;
+			std::uint64_t low = static_cast<std::uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 4);
+			return low + ((std::uint64_t)1 << (exponent - 4)) / 2;
+		}
+	
+	private:
+		std::atomic<std::uint64_t> counts[BUCKETS];
+	};
+} }
+
 #ifdef MOODYCAMEL_QUEUE_INTERNAL_DEBUG
 #include "internal/concurrentqueue_internal_debug.h"
 #endif
@@ -252,6 +442,10 @@ namespace details {
 		long long y;
 		void* z;
 	} max_align_t;
+	
+	// Packed per-element flags are stored in words of the platform's native width,
+	// so that setting several of them at once is a single atomic fetch_or
+	typedef std::conditional<sizeof(void*) >= 8, std::uint64_t, std::uint32_t>::type flag_word_t;
 }
 
 // Default traits for the ConcurrentQueue. To change some of the
@@ -285,10 +479,12 @@ struct ConcurrentQueueDefaultTraits
 	static const size_t BLOCK_SIZE = 32;
 	
 	// For explicit producers (i.e. when using a producer token), the block is
-	// checked for being empty by iterating through a list of flags, one per element.
-	// For large block sizes, this is too inefficient, and switching to an atomic
-	// counter-based approach is faster. The switch is made for block sizes strictly
-	// larger than this threshold.
+	// checked for being empty by looking at a bitmask of flags, one bit per element,
+	// packed into machine words. For large block sizes, this takes too many words,
+	// and switching to an atomic counter-based approach is faster. The switch is
+	// made for block sizes strictly larger than this threshold. Since the flags
+	// are packed, a higher threshold (e.g. 128) may be worth benchmarking for
+	// larger blocks.
 	static const size_t EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD = 32;
 	
 	// How many full blocks can be expected for a single explicit producer? This should
@@ -310,12 +506,70 @@ struct ConcurrentQueueDefaultTraits
 	// internal queue.
 	static const std::uint32_t EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE = 256;
 	
+	// Whether each explicit consumer adapts its rotation quota (see above) at runtime.
+	// A consumer that reaches its quota while its current producer still has at least
+	// that many elements queued keeps going, doubling its quota (up to 16x the one above),
+	// instead of making everyone rotate away from a producer that has work. A consumer
+	// whose current producer runs dry (or whose backlog has shrunk by the time the quota
+	// is reached) drops back to the base quota, so that it doesn't keep the others waiting
+	// for a rotation. This helps when producer rates are heavily skewed, at the cost of
+	// checking one producer's size each time a quota is reached.
+	static const bool ADAPTIVE_CONSUMER_ROTATION = false;
+	
+	// Whether bulk operations that span several blocks should issue software prefetches
+	// for the next block (its bookkeeping and the first cache lines of its first element)
+	// while the current one is being processed. This mostly pays off for large elements
+	// and/or large block sizes, where each new block would otherwise start with a string
+	// of cache misses; for small elements the hardware prefetchers generally keep up.
+	static const bool PREFETCH_NEXT_BLOCK = false;
+	
+	// Opt-in sampling of how long elements sit in the queue (their residency). When
+	// non-zero (it must be a power of 2), one in every RESIDENCY_SAMPLE_INTERVAL elements
+	// is timestamped as it's enqueued -- in its block, not in the element -- and its
+	// residency is recorded into a per-queue histogram when it's dequeued (see
+	// residency_percentile). 0 (the default) disables sampling entirely.
+	static const size_t RESIDENCY_SAMPLE_INTERVAL = 0;
+	
+	// When non-zero (it must be a power of 2), the queue also keeps a count of its elements,
+	// spread over that many cache-line-sized shards (picked by thread ID), so that
+	// size_approx can read the count in O(SIZE_COUNTER_SHARDS) instead of walking every
+	// producer. The count is only updated a block at a time, so this costs next to nothing
+	// per element, but size_approx can then be off by up to BLOCK_SIZE - 1 elements for
+	// each producer, in either direction (so it reads 0 for a queue holding fewer than a
+	// block's worth per producer). empty_approx is no less accurate than without the
+	// counters: it only takes a shortcut when they're non-zero. 0 (the default) disables
+	// the counters.
+	static const size_t SIZE_COUNTER_SHARDS = 0;
+	
 	// The maximum number of elements (inclusive) that can be enqueued to a sub-queue.
 	// Enqueue operations that would cause this limit to be surpassed will fail. Note
 	// that this limit is enforced at the block level (for performance reasons), i.e.
 	// it's rounded up to the nearest block size.
 	static const size_t MAX_SUBQUEUE_SIZE = details::const_numeric_max<size_t>::value;
 	
+	// The maximum number of times a thread that has to wait on a BlockingConcurrentQueue
+	// spins before going to sleep on a kernel semaphore. A waiting consumer spins on
+	// empty_approx, a read-only pass over the producers' counters, and only attempts a
+	// dequeue once that finds an element (the CPU is paused every 64 spins, and the rest
+	// of the timeslice given up every 4096). A spin therefore costs more with many
+	// producers; the default amounts to tens of microseconds with a handful of them.
+	// (This and the next two traits are only used by BlockingConcurrentQueue.)
+	static const int MAX_SEMA_SPINS = 10000;
+	
+	// Whether the spin budget above adapts to recent wait outcomes: it grows back towards
+	// MAX_SEMA_SPINS when spinning pays off, and shrinks when waiters end up sleeping
+	// anyway, so that oversubscribed hosts don't burn whole cores for nothing. Set to
+	// false to always spin up to MAX_SEMA_SPINS times (latency first), or set
+	// MAX_SEMA_SPINS to 0 to go straight to sleep (CPU efficiency first).
+	static const bool ADAPTIVE_SEMA_SPINNING = true;
+	
+	// How many elements a producer counts on each consumer sleeping in one of
+	// BlockingConcurrentQueue's wait_dequeue_bulk methods to take, when working out how
+	// many of them to wake for a bulk enqueue. The default of 1 wakes one consumer per
+	// element enqueued (up to the number sleeping); 0 goes by the max each consumer
+	// asked for. Anything higher cuts down on consumers woken just to find the batch
+	// already taken, at the cost of (briefly) leaving elements to fewer consumers.
+	static const size_t BULK_WAKE_BATCH_SIZE = 1;
 	
 #ifndef MCDBGQ_USE_RELACY
 	// Memory allocation can be customized if needed.
@@ -351,7 +605,7 @@ struct ProducerToken;
 struct ConsumerToken;
 
 template<typename T, typename Traits> class ConcurrentQueue;
-template<typename T, typename Traits> class BlockingConcurrentQueue;
+template<typename T, typename Traits, typename WaitStrategy> class BlockingConcurrentQueue;
 class ConcurrentQueueTests;
 
 
@@ -448,6 +702,325 @@ namespace details
 		right.store(std::move(temp), std::memory_order_relaxed);
 	}
 	
+	// A signed counter spread over Shards cache-line-sized slots picked by thread ID, so
+	// that threads updating it rarely contend; reading it sums up the slots
+	template<size_t Shards>
+	class sharded_counter
+	{
+	public:
+		sharded_counter()
+		{
+			for (size_t i = 0; i != Shards; ++i) {
+				slots[i].value.store(0, std::memory_order_relaxed);
+			}
+		}
+		
+		inline void add(std::ptrdiff_t delta)
+		{
+			slots[hash_thread_id(thread_id()) & (Shards - 1)].value.fetch_add(delta, std::memory_order_relaxed);
+		}
+		
+		std::ptrdiff_t sum() const
+		{
+			std::ptrdiff_t total = 0;
+			for (size_t i = 0; i != Shards; ++i) {
+				total += slots[i].value.load(std::memory_order_relaxed);
+			}
+			return total;
+		}
+		
+		// Not thread-safe
+		void swap(sharded_counter& other)
+		{
+			for (size_t i = 0; i != Shards; ++i) {
+				swap_relaxed(slots[i].value, other.slots[i].value);
+			}
+		}
+	
+	private:
+		struct MOODYCAMEL_ALIGNAS(64) slot
+		{
+			std::atomic<std::ptrdiff_t> value;
+			char padding[64 - sizeof(std::atomic<std::ptrdiff_t>)];
+		};
+		slot slots[Shards];
+	};
+	
+	template<>
+	class sharded_counter<0>
+	{
+	public:
+		inline void add(std::ptrdiff_t) { }
+		std::ptrdiff_t sum() const { return 0; }
+		void swap(sharded_counter&) { }
+	};
+
+#ifdef MOODYCAMEL_CONTENTION_COUNTERS
+	// Counts how often the queue's lock-free paths had to retry or back out because of
+	// other threads. The counts are spread over a few cache-line-sized shards picked by
+	// thread ID, so that counting doesn't itself become a point of contention; they're
+	// summed up only when asked for.
+	class contention_counters
+	{
+	public:
+		enum counter { freelist_add_retries, freelist_get_retries, dequeue_overcommits, consumer_rotations, implicit_hash_probes, counter_count };
+		
+		contention_counters()
+		{
+			for (size_t i = 0; i != SHARDS; ++i) {
+				for (int c = 0; c != counter_count; ++c) {
+					shards[i].counts[c].store(0, std::memory_order_relaxed);
+				}
+			}
+		}
+		
+		inline void bump(counter c)
+		{
+			shards[hash_thread_id(thread_id()) & (SHARDS - 1)].counts[c].fetch_add(1, std::memory_order_relaxed);
+		}
+		
+		// Not thread-safe
+		void swap(contention_counters& other)
+		{
+			for (size_t i = 0; i != SHARDS; ++i) {
+				for (int c = 0; c != counter_count; ++c) {
+					swap_relaxed(shards[i].counts[c], other.shards[i].counts[c]);
+				}
+			}
+		}
+		
+		std::uint64_t total(counter c) const
+		{
+			std::uint64_t sum = 0;
+			for (size_t i = 0; i != SHARDS; ++i) {
+				sum += shards[i].counts[c].load(std::memory_order_relaxed);
+			}
+			return sum;
+		}
+	
+	private:
+		static const size_t SHARDS = 16;
+		
+		struct MOODYCAMEL_ALIGNAS(64) shard
+		{
+			std::atomic<std::uint64_t> counts[counter_count];
+			char padding[64 - counter_count * sizeof(std::atomic<std::uint64_t>)];
+		};
+		shard shards[SHARDS];
+	};
+
+#define MOODYCAMEL_COUNT_CONTENTION(counters, counter) (counters).bump(::moodycamel::details::contention_counters::counter)
+#else
+#define MOODYCAMEL_COUNT_CONTENTION(counters, counter) do { } while (false)
+#endif
+
+#ifdef MOODYCAMEL_CYCLE_ACCOUNTING
+	// The time-stamp counter reads that bracket a timed step. A plain rdtsc can execute
+	// before the instructions ahead of it have finished (or after later ones have started),
+	// so the step would be timed short, or partly not at all: the start is fenced on both
+	// sides, and the end is an rdtscp (which waits for what came before it), fenced after.
+	// Elsewhere, these are just residency_ticks().
+	static inline std::uint64_t cycle_ticks_begin()
+	{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+		__builtin_ia32_lfence();
+		std::uint64_t ticks = __builtin_ia32_rdtsc();
+		__builtin_ia32_lfence();
+		return ticks;
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+		_mm_lfence();
+		std::uint64_t ticks = __rdtsc();
+		_mm_lfence();
+		return ticks;
+#else
+		return residency_ticks();
+#endif
+	}
+	
+	static inline std::uint64_t cycle_ticks_end()
+	{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+		unsigned int aux;
+		std::uint64_t ticks = __builtin_ia32_rdtscp(&aux);
+		__builtin_ia32_lfence();
+		return ticks;
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+		unsigned int aux;
+		std::uint64_t ticks = __rdtscp(&aux);
+		_mm_lfence();
+		return ticks;
+#else
+		return residency_ticks();
+#endif
+	}
+	
+	// What timing a step that does nothing at all comes to: the median of a batch of
+	// back-to-back reads, measured once. It's taken back off every step timed.
+	static inline std::uint64_t cycle_ticks_overhead()
+	{
+		static const std::uint64_t overhead = []() {
+			std::uint64_t samples[255];
+			for (int i = 0; i != 255; ++i) {
+				auto start = cycle_ticks_begin();
+				samples[i] = cycle_ticks_end() - start;
+			}
+			std::sort(samples, samples + 255);
+			return samples[127];
+		}();
+		return overhead;
+	}
+	
+	// Per-thread tallies of the time (in residency ticks) spent in each of the instrumented
+	// steps of enqueueing and dequeueing, and of how often each was timed. Every thread
+	// gets accounts of its own that only it writes to, so timing a step costs little more
+	// than the two fenced counter reads around it. All the accounts ever handed out are
+	// linked together so that they can be summed up; once a thread exits, its accounts
+	// (counts included) are passed on to the next new thread, like implicit producers.
+	struct cycle_accounts
+	{
+		enum phase { implicit_hash_lookup, block_index_lookup, free_list_pop, element_construction, tail_publish, phase_count };
+		
+		std::atomic<std::uint64_t> ticks[phase_count];
+		std::atomic<std::uint64_t> calls[phase_count];
+		std::atomic<bool> inUse;
+		cycle_accounts* next;
+		std::uint64_t overhead;		// cycle_ticks_overhead(), at hand
+		
+		inline void add(phase p, std::uint64_t elapsed)
+		{
+			elapsed = elapsed > overhead ? elapsed - overhead : 0;
+			// Only the owning thread writes, so there's no need for a locked read-modify-write
+			ticks[p].store(ticks[p].load(std::memory_order_relaxed) + elapsed, std::memory_order_relaxed);
+			calls[p].store(calls[p].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+		
+		static std::atomic<cycle_accounts*>& list_head()
+		{
+			static std::atomic<cycle_accounts*> head(nullptr);
+			return head;
+		}
+		
+		static cycle_accounts& local()
+		{
+			static thread_local holder accounts;
+			return *accounts.ptr;
+		}
+	
+	private:
+		struct holder
+		{
+			holder() : ptr(acquire()) { ptr->overhead = cycle_ticks_overhead(); }
+			~holder() { ptr->inUse.store(false, std::memory_order_release); }
+			cycle_accounts* ptr;
+		};
+		
+		static cycle_accounts* acquire()
+		{
+			for (auto ptr = list_head().load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next) {
+				bool expected = false;
+				if (!ptr->inUse.load(std::memory_order_relaxed) && ptr->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+					return ptr;
+				}
+			}
+			
+			// Never freed, since other threads may be summing them up at any time
+			auto accounts = new cycle_accounts;
+			for (int p = 0; p != phase_count; ++p) {
+				accounts->ticks[p].store(0, std::memory_order_relaxed);
+				accounts->calls[p].store(0, std::memory_order_relaxed);
+			}
+			accounts->inUse.store(true, std::memory_order_relaxed);
+			auto head = list_head().load(std::memory_order_relaxed);
+			do {
+				accounts->next = head;
+			} while (!list_head().compare_exchange_weak(head, accounts, std::memory_order_release, std::memory_order_relaxed));
+			return accounts;
+		}
+	};
+
+#define MOODYCAMEL_CYCLES_START(timer) std::uint64_t timer = ::moodycamel::details::cycle_ticks_begin()
+#define MOODYCAMEL_CYCLES_STOP(timer, phase) ::moodycamel::details::cycle_accounts::local().add(::moodycamel::details::cycle_accounts::phase, ::moodycamel::details::cycle_ticks_end() - timer)
+#else
+#define MOODYCAMEL_CYCLES_START(timer) do { } while (false)
+#define MOODYCAMEL_CYCLES_STOP(timer, phase) do { } while (false)
+#endif
+	
+	// Keeps a running count of how many blocks' worth of elements a queue holds, and calls
+	// back when it reaches the high watermark or drops to the low one. The two alternate,
+	// so each crossing is reported once however much the count jitters around a watermark.
+	// Callbacks are made one at a time: a thread that crosses a watermark while another is
+	// still reporting leaves it to that one to look at the count again afterwards, so a
+	// "low" can't overtake the "high" before it (and a callback may itself cross one).
+	class watermark_monitor
+	{
+	public:
+		typedef void (*callback_t)(void* userData, bool high, size_t approxSize);
+		
+		watermark_monitor(size_t highBlocks_, size_t lowBlocks_, size_t blockSize_, callback_t callback_, void* userData_, size_t initialBlocks)
+			: highBlocks(static_cast<std::ptrdiff_t>(highBlocks_)), lowBlocks(static_cast<std::ptrdiff_t>(lowBlocks_)), blockSize(blockSize_),
+			callback(callback_), userData(userData_), blocks(static_cast<std::ptrdiff_t>(initialBlocks)), aboveHigh(initialBlocks >= highBlocks_), reportRequests(0)
+		{
+		}
+		
+		// (The count and aboveHigh are seq_cst so that a crossing that's skipped here because
+		// the reporter hasn't flipped aboveHigh yet is seen by the reporter's next look.)
+		inline void add(size_t count)
+		{
+			auto now = blocks.fetch_add(static_cast<std::ptrdiff_t>(count), std::memory_order_seq_cst) + static_cast<std::ptrdiff_t>(count);
+			if (now >= highBlocks && !aboveHigh.load(std::memory_order_seq_cst)) {
+				report();
+			}
+		}
+		
+		inline void remove(size_t count)
+		{
+			auto now = blocks.fetch_sub(static_cast<std::ptrdiff_t>(count), std::memory_order_seq_cst) - static_cast<std::ptrdiff_t>(count);
+			if (now <= lowBlocks && aboveHigh.load(std::memory_order_seq_cst)) {
+				report();
+			}
+		}
+	
+	private:
+		void report()
+		{
+			if (reportRequests.fetch_add(1, std::memory_order_seq_cst) != 0) {
+				return;		// Whoever's reporting will look again on our behalf
+			}
+			std::ptrdiff_t handled = 1;
+			while (true) {
+				while (true) {
+					auto now = blocks.load(std::memory_order_seq_cst);
+					bool high = aboveHigh.load(std::memory_order_relaxed);		// Only written here
+					if (!high && now >= highBlocks) {
+						aboveHigh.store(true, std::memory_order_seq_cst);
+						callback(userData, true, static_cast<size_t>(now) * blockSize);
+					}
+					else if (high && now <= lowBlocks) {
+						aboveHigh.store(false, std::memory_order_seq_cst);
+						callback(userData, false, now > 0 ? static_cast<size_t>(now) * blockSize : 0);
+					}
+					else {
+						break;
+					}
+				}
+				auto left = reportRequests.fetch_sub(handled, std::memory_order_seq_cst) - handled;
+				if (left == 0) {
+					return;
+				}
+				handled = left;
+			}
+		}
+		
+		std::ptrdiff_t highBlocks;
+		std::ptrdiff_t lowBlocks;
+		size_t blockSize;
+		callback_t callback;
+		void* userData;
+		std::atomic<std::ptrdiff_t> blocks;
+		std::atomic<bool> aboveHigh;
+		std::atomic<std::ptrdiff_t> reportRequests;		// Crossings seen since the current reporter (if any) last looked, plus one
+	};
+	
 	template<typename T>
 	static inline T const& nomove(T const& x)
 	{
@@ -481,11 +1054,117 @@ namespace details
 		return *it;
 	}
 	
+	// Constructs an element during a bulk enqueue. Elements are copied out of the source
+	// iterator when NoMove is set (since we may have to revert if there's an exception),
+	// except when the iterator yields temporaries (e.g. a generator_iterator) -- those
+	// belong to nobody else, so the element is initialized from them directly.
+	template<bool NoMove, bool FromTemporary>
+	struct bulk_construct
+	{
+		template<typename T, typename It>
+		static inline void eval(T* ptr, It& it)
+		{
+			new (ptr) T(nomove_if<NoMove>::eval(*it));
+		}
+	};
+	
+	template<bool NoMove>
+	struct bulk_construct<NoMove, true>
+	{
+		template<typename T, typename It>
+		static inline void eval(T* ptr, It& it)
+		{
+			new (ptr) T(*it);
+		}
+	};
+	
+	// Adapts a generator (a callable taking no arguments whose result T can be constructed
+	// from) to the iterator interface used by the bulk enqueue methods; every dereference
+	// invokes the generator exactly once. Returning a T by value lets the element be built
+	// directly in the queue's storage (guaranteed from C++17 on, elided in practice before).
+	template<typename F>
+	struct generator_iterator
+	{
+		explicit generator_iterator(F& f) : make(&f) { }
+		
+		inline auto operator*() const -> decltype(std::declval<F&>()()) { return (*make)(); }
+		inline generator_iterator& operator++() { return *this; }
+		inline generator_iterator operator++(int) { return *this; }
+		
+		F* make;
+	};
+	
+	// Unlike iterators, generators usually construct the element themselves, so they
+	// are never assumed not to throw
+	template<typename F>
+	static inline auto deref_noexcept(generator_iterator<F>& it) -> decltype(*it)
+	{
+		return *it;
+	}
+	
+	// The value type handed to MOODYCAMEL_NOEXCEPT_CTOR for an emplacement, given as the
+	// signature T(Args...) so that it fits in a single macro argument (it only matters on
+	// compilers that can't evaluate the noexcept expression itself): a single argument
+	// behaves exactly like enqueue(U&&), anything else is treated like a copy
+	template<typename Signature> struct emplace_value_type;
+	template<typename T, typename... Args> struct emplace_value_type<T(Args...)> { typedef T const& type; };
+	template<typename T, typename U> struct emplace_value_type<T(U)> { typedef U type; };
+	
+	// Used to keep the implicit-producer emplace overloads from swallowing a producer token
+	template<typename... Args> struct is_first_producer_token : std::false_type { };
+	template<typename First, typename... Rest> struct is_first_producer_token<First, Rest...> : std::is_same<typename std::decay<First>::type, ProducerToken> { };
+
 #if defined(__clang__) || !defined(__GNUC__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)
 	template<typename T> struct is_trivially_destructible : std::is_trivially_destructible<T> { };
 #else
 	template<typename T> struct is_trivially_destructible : std::has_trivial_destructor<T> { };
 #endif
+
+#if defined(__clang__) || !defined(__GNUC__) || __GNUC__ >= 5
+	template<typename T> struct is_trivially_copyable : std::is_trivially_copyable<T> { };
+#else
+	template<typename T> struct is_trivially_copyable : std::integral_constant<bool, __has_trivial_copy(T) && __has_trivial_assign(T) && __has_trivial_destructor(T)> { };
+#endif
+	
+	// For trivially copyable types, a run of elements within a block can be copied in or out
+	// with a single memcpy instead of being constructed (or assigned and destroyed) one at a
+	// time -- provided the iterator on the other side is a plain pointer to T (short of C++20's
+	// contiguous iterators, that's the only way to know the source/target is contiguous too)
+	template<typename T, typename It>
+	struct bulk_memcpy
+	{
+		static const bool can_copy_in = false;
+		static const bool can_copy_out = false;
+		static inline void copy_in(T*, It&, std::size_t) { }
+		static inline void copy_out(It&, T const*, std::size_t) { }
+	};
+	
+	template<typename T>
+	struct bulk_memcpy<T, T*>
+	{
+		static const bool can_copy_in = is_trivially_copyable<T>::value;
+		static const bool can_copy_out = is_trivially_copyable<T>::value;
+		static inline void copy_in(T* dest, T*& it, std::size_t count) { std::memcpy(static_cast<void*>(dest), static_cast<void const*>(it), count * sizeof(T)); it += count; }
+		static inline void copy_out(T*& it, T const* src, std::size_t count) { std::memcpy(static_cast<void*>(it), static_cast<void const*>(src), count * sizeof(T)); it += count; }
+	};
+	
+	template<typename T>
+	struct bulk_memcpy<T, T const*>
+	{
+		static const bool can_copy_in = is_trivially_copyable<T>::value;
+		static const bool can_copy_out = false;
+		static inline void copy_in(T* dest, T const*& it, std::size_t count) { std::memcpy(static_cast<void*>(dest), static_cast<void const*>(it), count * sizeof(T)); it += count; }
+		static inline void copy_out(T const*&, T const*, std::size_t) { }
+	};
+	
+	template<typename T>
+	struct bulk_memcpy<T, std::move_iterator<T*>>
+	{
+		static const bool can_copy_in = is_trivially_copyable<T>::value;
+		static const bool can_copy_out = false;
+		static inline void copy_in(T* dest, std::move_iterator<T*>& it, std::size_t count) { std::memcpy(static_cast<void*>(dest), static_cast<void const*>(it.base()), count * sizeof(T)); it += static_cast<typename std::move_iterator<T*>::difference_type>(count); }
+		static inline void copy_out(std::move_iterator<T*>&, T const*, std::size_t) { }
+	};
 	
 #ifdef MOODYCAMEL_CPP11_THREAD_LOCAL_SUPPORTED
 #ifdef MCDBGQ_USE_RELACY
@@ -564,13 +1243,73 @@ namespace details
 }
 
 
+// Where enqueueing and dequeueing spend their time, step by step, as returned by
+// cycle_stats. Each phase has the total residency ticks spent in it (time-stamp
+// counter cycles where there is one, nanoseconds otherwise) and how often it was timed.
+struct CyclePhaseStats
+{
+	std::uint64_t ticks;
+	std::uint64_t calls;
+};
+
+struct CycleStats
+{
+	CyclePhaseStats implicitHashLookup;		// Finding (or adding) the enqueueing thread's implicit producer
+	CyclePhaseStats blockIndexLookup;		// Finding an element's block in a block index, or making room for a new one
+	CyclePhaseStats freeListPop;			// Trying to take a recycled block off the free list
+	CyclePhaseStats elementConstruction;	// Constructing an enqueued element in its slot
+	CyclePhaseStats tailPublish;			// Publishing enqueued elements to consumers (the tail index store)
+	double ticksPerUsec;					// For converting ticks to time
+	std::uint64_t overheadTicks;			// What timing a step costs by itself, already taken off each step's ticks
+};
+
+// Returns the ticks spent in each instrumented step of enqueueing and dequeueing, so
+// far, summed over all threads and all queues. The steps are only timed when
+// MOODYCAMEL_CYCLE_ACCOUNTING is defined (before including this header), which
+// requires thread_local support and adds two fenced time-stamp counter reads to each
+// (whose calibrated cost is subtracted again, though the fences still slow down the
+// code around them); otherwise this returns all zeros. Only the single-element enqueue
+// paths time the element construction (the bulk ones construct many at once).
+// Thread-safe.
+inline CycleStats cycle_stats()
+{
+	CycleStats result = { { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, details::residency_ticks_per_usec(), 0 };
+#ifdef MOODYCAMEL_CYCLE_ACCOUNTING
+	result.overheadTicks = details::cycle_ticks_overhead();
+	CyclePhaseStats* phases[details::cycle_accounts::phase_count] = { &result.implicitHashLookup, &result.blockIndexLookup, &result.freeListPop, &result.elementConstruction, &result.tailPublish };
+	for (auto ptr = details::cycle_accounts::list_head().load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next) {
+		for (int p = 0; p != details::cycle_accounts::phase_count; ++p) {
+			phases[p]->ticks += ptr->ticks[p].load(std::memory_order_relaxed);
+			phases[p]->calls += ptr->calls[p].load(std::memory_order_relaxed);
+		}
+	}
+#endif
+	return result;
+}
+
+// Zeroes the cycle accounts of all threads. Not thread-safe with respect to queue
+// operations (counts from steps timed meanwhile may or may not survive), so call it
+// while the queues are idle, e.g. between benchmark runs.
+inline void reset_cycle_stats()
+{
+#ifdef MOODYCAMEL_CYCLE_ACCOUNTING
+	for (auto ptr = details::cycle_accounts::list_head().load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next) {
+		for (int p = 0; p != details::cycle_accounts::phase_count; ++p) {
+			ptr->ticks[p].store(0, std::memory_order_relaxed);
+			ptr->calls[p].store(0, std::memory_order_relaxed);
+		}
+	}
+#endif
+}
+
+
 struct ProducerToken
 {
 	template<typename T, typename Traits>
 	explicit ProducerToken(ConcurrentQueue<T, Traits>& queue);
 	
-	template<typename T, typename Traits>
-	explicit ProducerToken(BlockingConcurrentQueue<T, Traits>& queue);
+	template<typename T, typename Traits, typename WaitStrategy>
+	explicit ProducerToken(BlockingConcurrentQueue<T, Traits, WaitStrategy>& queue);
 	
 	ProducerToken(ProducerToken&& other) MOODYCAMEL_NOEXCEPT
 		: producer(other.producer)
@@ -634,11 +1373,11 @@ struct ConsumerToken
 	template<typename T, typename Traits>
 	explicit ConsumerToken(ConcurrentQueue<T, Traits>& q);
 	
-	template<typename T, typename Traits>
-	explicit ConsumerToken(BlockingConcurrentQueue<T, Traits>& q);
+	template<typename T, typename Traits, typename WaitStrategy>
+	explicit ConsumerToken(BlockingConcurrentQueue<T, Traits, WaitStrategy>& q);
 	
 	ConsumerToken(ConsumerToken&& other) MOODYCAMEL_NOEXCEPT
-		: initialOffset(other.initialOffset), lastKnownGlobalOffset(other.lastKnownGlobalOffset), itemsConsumedFromCurrent(other.itemsConsumedFromCurrent), currentProducer(other.currentProducer), desiredProducer(other.desiredProducer)
+		: initialOffset(other.initialOffset), lastKnownGlobalOffset(other.lastKnownGlobalOffset), itemsConsumedFromCurrent(other.itemsConsumedFromCurrent), rotationQuota(other.rotationQuota), currentProducer(other.currentProducer), desiredProducer(other.desiredProducer)
 	{
 	}
 	
@@ -653,6 +1392,7 @@ struct ConsumerToken
 		std::swap(initialOffset, other.initialOffset);
 		std::swap(lastKnownGlobalOffset, other.lastKnownGlobalOffset);
 		std::swap(itemsConsumedFromCurrent, other.itemsConsumedFromCurrent);
+		std::swap(rotationQuota, other.rotationQuota);
 		std::swap(currentProducer, other.currentProducer);
 		std::swap(desiredProducer, other.desiredProducer);
 	}
@@ -669,6 +1409,7 @@ private: // but shared with ConcurrentQueue
 	std::uint32_t initialOffset;
 	std::uint32_t lastKnownGlobalOffset;
 	std::uint32_t itemsConsumedFromCurrent;
+	std::uint32_t rotationQuota;
 	details::ConcurrentQueueProducerTypelessBase* currentProducer;
 	details::ConcurrentQueueProducerTypelessBase* desiredProducer;
 };
@@ -695,6 +1436,10 @@ public:
 	static const size_t IMPLICIT_INITIAL_INDEX_SIZE = static_cast<size_t>(Traits::IMPLICIT_INITIAL_INDEX_SIZE);
 	static const size_t INITIAL_IMPLICIT_PRODUCER_HASH_SIZE = static_cast<size_t>(Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE);
 	static const std::uint32_t EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE = static_cast<std::uint32_t>(Traits::EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE);
+	static const bool ADAPTIVE_CONSUMER_ROTATION = static_cast<bool>(Traits::ADAPTIVE_CONSUMER_ROTATION);
+	static const bool PREFETCH_NEXT_BLOCK = static_cast<bool>(Traits::PREFETCH_NEXT_BLOCK);
+	static const size_t RESIDENCY_SAMPLE_INTERVAL = static_cast<size_t>(Traits::RESIDENCY_SAMPLE_INTERVAL);
+	static const size_t SIZE_COUNTER_SHARDS = static_cast<size_t>(Traits::SIZE_COUNTER_SHARDS);
 #ifdef _MSC_VER
 #pragma warning(push)
 #pragma warning(disable: 4307)		// + integral constant overflow (that's what the ternary expression is for!)
@@ -714,6 +1459,8 @@ public:
 	static_assert((IMPLICIT_INITIAL_INDEX_SIZE > 1) && !(IMPLICIT_INITIAL_INDEX_SIZE & (IMPLICIT_INITIAL_INDEX_SIZE - 1)), "Traits::IMPLICIT_INITIAL_INDEX_SIZE must be a power of 2 (and greater than 1)");
 	static_assert((INITIAL_IMPLICIT_PRODUCER_HASH_SIZE == 0) || !(INITIAL_IMPLICIT_PRODUCER_HASH_SIZE & (INITIAL_IMPLICIT_PRODUCER_HASH_SIZE - 1)), "Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE must be a power of 2");
 	static_assert(INITIAL_IMPLICIT_PRODUCER_HASH_SIZE == 0 || INITIAL_IMPLICIT_PRODUCER_HASH_SIZE >= 1, "Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE must be at least 1 (or 0 to disable implicit enqueueing)");
+	static_assert(!(RESIDENCY_SAMPLE_INTERVAL & (RESIDENCY_SAMPLE_INTERVAL - 1)), "Traits::RESIDENCY_SAMPLE_INTERVAL must be a power of 2 (or 0 to disable residency sampling)");
+	static_assert(!(SIZE_COUNTER_SHARDS & (SIZE_COUNTER_SHARDS - 1)), "Traits::SIZE_COUNTER_SHARDS must be a power of 2 (or 0 to disable the size counters)");
 
 public:
 	// Creates a queue with at least `capacity` element slots; note that the
@@ -729,11 +1476,23 @@ public:
 	explicit ConcurrentQueue(size_t capacity = 6 * BLOCK_SIZE)
 		: producerListTail(nullptr),
 		producerCount(0),
+		explicitProducerCount(0),
 		initialBlockPoolIndex(0),
+		dynamicBlockCount(0),
+		ownedBlockCount(0),
+		peakOwnedBlockCount(0),
+		blockIndexBytes(0),
+		residencyHistogram(RESIDENCY_SAMPLE_INTERVAL != 0 ? create<details::log_linear_histogram>() : nullptr),
+		watermarks(nullptr),
+		blockFreedCallback(nullptr),
+		blockFreedUserData(nullptr),
 		nextExplicitConsumerId(0),
 		globalExplicitConsumerOffset(0)
 	{
 		implicitProducerHashResizeInProgress.clear(std::memory_order_relaxed);
+#if defined(MOODYCAMEL_CONTENTION_COUNTERS) && !MCDBGQ_USEDEBUGFREELIST
+		freeList.contention = &contentionCounters;
+#endif
 		populate_initial_implicit_producer_hash();
 		populate_initial_block_list(capacity / BLOCK_SIZE + ((capacity & (BLOCK_SIZE - 1)) == 0 ? 0 : 1));
 		
@@ -753,11 +1512,23 @@ public:
 	ConcurrentQueue(size_t minCapacity, size_t maxExplicitProducers, size_t maxImplicitProducers)
 		: producerListTail(nullptr),
 		producerCount(0),
+		explicitProducerCount(0),
 		initialBlockPoolIndex(0),
+		dynamicBlockCount(0),
+		ownedBlockCount(0),
+		peakOwnedBlockCount(0),
+		blockIndexBytes(0),
+		residencyHistogram(RESIDENCY_SAMPLE_INTERVAL != 0 ? create<details::log_linear_histogram>() : nullptr),
+		watermarks(nullptr),
+		blockFreedCallback(nullptr),
+		blockFreedUserData(nullptr),
 		nextExplicitConsumerId(0),
 		globalExplicitConsumerOffset(0)
 	{
 		implicitProducerHashResizeInProgress.clear(std::memory_order_relaxed);
+#if defined(MOODYCAMEL_CONTENTION_COUNTERS) && !MCDBGQ_USEDEBUGFREELIST
+		freeList.contention = &contentionCounters;
+#endif
 		populate_initial_implicit_producer_hash();
 		size_t blocks = (((minCapacity + BLOCK_SIZE - 1) / BLOCK_SIZE) - 1) * (maxExplicitProducers + 1) + 2 * (maxExplicitProducers + maxImplicitProducers);
 		populate_initial_block_list(blocks);
@@ -812,6 +1583,13 @@ public:
 		
 		// Destroy initial free list
 		destroy_array(initialBlockPool, initialBlockPoolSize);
+		
+		if (residencyHistogram != nullptr) {
+			destroy(residencyHistogram);
+		}
+		if (watermarks != nullptr) {
+			destroy(watermarks);
+		}
 	}
 
 	// Disable copying and copy assignment
@@ -827,9 +1605,18 @@ public:
 	ConcurrentQueue(ConcurrentQueue&& other) MOODYCAMEL_NOEXCEPT
 		: producerListTail(other.producerListTail.load(std::memory_order_relaxed)),
 		producerCount(other.producerCount.load(std::memory_order_relaxed)),
+		explicitProducerCount(other.explicitProducerCount.load(std::memory_order_relaxed)),
 		initialBlockPoolIndex(other.initialBlockPoolIndex.load(std::memory_order_relaxed)),
 		initialBlockPool(other.initialBlockPool),
 		initialBlockPoolSize(other.initialBlockPoolSize),
+		dynamicBlockCount(other.dynamicBlockCount.load(std::memory_order_relaxed)),
+		ownedBlockCount(other.ownedBlockCount.load(std::memory_order_relaxed)),
+		peakOwnedBlockCount(other.peakOwnedBlockCount.load(std::memory_order_relaxed)),
+		blockIndexBytes(other.blockIndexBytes.load(std::memory_order_relaxed)),
+		residencyHistogram(other.residencyHistogram),
+		watermarks(other.watermarks),
+		blockFreedCallback(other.blockFreedCallback),
+		blockFreedUserData(other.blockFreedUserData),
 		freeList(std::move(other.freeList)),
 		nextExplicitConsumerId(other.nextExplicitConsumerId.load(std::memory_order_relaxed)),
 		globalExplicitConsumerOffset(other.globalExplicitConsumerOffset.load(std::memory_order_relaxed))
@@ -841,6 +1628,7 @@ public:
 		
 		other.producerListTail.store(nullptr, std::memory_order_relaxed);
 		other.producerCount.store(0, std::memory_order_relaxed);
+		other.explicitProducerCount.store(0, std::memory_order_relaxed);
 		other.nextExplicitConsumerId.store(0, std::memory_order_relaxed);
 		other.globalExplicitConsumerOffset.store(0, std::memory_order_relaxed);
 		
@@ -854,6 +1642,21 @@ public:
 		other.initialBlockPoolIndex.store(0, std::memory_order_relaxed);
 		other.initialBlockPoolSize = 0;
 		other.initialBlockPool = nullptr;
+		other.dynamicBlockCount.store(0, std::memory_order_relaxed);
+		other.ownedBlockCount.store(0, std::memory_order_relaxed);
+		other.peakOwnedBlockCount.store(0, std::memory_order_relaxed);
+		other.blockIndexBytes.store(0, std::memory_order_relaxed);
+		other.residencyHistogram = nullptr;
+		other.watermarks = nullptr;
+		other.blockFreedCallback = nullptr;
+		other.blockFreedUserData = nullptr;
+		sizeCounter.swap(other.sizeCounter);
+#ifdef MOODYCAMEL_CONTENTION_COUNTERS
+		contentionCounters.swap(other.contentionCounters);
+#if !MCDBGQ_USEDEBUGFREELIST
+		freeList.contention = &contentionCounters;
+#endif
+#endif
 		
 		reown_producers();
 	}
@@ -882,9 +1685,22 @@ private:
 		
 		details::swap_relaxed(producerListTail, other.producerListTail);
 		details::swap_relaxed(producerCount, other.producerCount);
+		details::swap_relaxed(explicitProducerCount, other.explicitProducerCount);
 		details::swap_relaxed(initialBlockPoolIndex, other.initialBlockPoolIndex);
 		std::swap(initialBlockPool, other.initialBlockPool);
 		std::swap(initialBlockPoolSize, other.initialBlockPoolSize);
+		details::swap_relaxed(dynamicBlockCount, other.dynamicBlockCount);
+		details::swap_relaxed(ownedBlockCount, other.ownedBlockCount);
+		details::swap_relaxed(peakOwnedBlockCount, other.peakOwnedBlockCount);
+		details::swap_relaxed(blockIndexBytes, other.blockIndexBytes);
+		std::swap(residencyHistogram, other.residencyHistogram);
+		std::swap(watermarks, other.watermarks);
+		std::swap(blockFreedCallback, other.blockFreedCallback);
+		std::swap(blockFreedUserData, other.blockFreedUserData);
+		sizeCounter.swap(other.sizeCounter);
+#ifdef MOODYCAMEL_CONTENTION_COUNTERS
+		contentionCounters.swap(other.contentionCounters);
+#endif
 		freeList.swap(other.freeList);
 		details::swap_relaxed(nextExplicitConsumerId, other.nextExplicitConsumerId);
 		details::swap_relaxed(globalExplicitConsumerOffset, other.globalExplicitConsumerOffset);
@@ -1025,10 +1841,105 @@ public:
 	// Note: Use std::make_move_iterator if the elements should be moved
 	// instead of copied.
 	// Thread-safe.
-	template<typename It>
-	bool try_enqueue_bulk(producer_token_t const& token, It itemFirst, size_t count)
+	template<typename It>
+	bool try_enqueue_bulk(producer_token_t const& token, It itemFirst, size_t count)
+	{
+		return inner_enqueue_bulk<CannotAlloc>(token, itemFirst, count);
+	}
+	
+	// Enqueues a single item, constructing it in place from the given arguments
+	// (so T need not be copyable or movable).
+	// Allocates memory if required. Only fails if memory allocation fails (or implicit
+	// production is disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0,
+	// or Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
+	// Thread-safe.
+	template<typename... Args>
+	inline typename std::enable_if<!details::is_first_producer_token<Args...>::value, bool>::type emplace(Args&&... args)
+	{
+		if (INITIAL_IMPLICIT_PRODUCER_HASH_SIZE == 0) return false;
+		return inner_enqueue<CanAlloc>(std::forward<Args>(args)...);
+	}
+	
+	// Enqueues a single item using an explicit producer token, constructing it in
+	// place from the given arguments.
+	// Allocates memory if required. Only fails if memory allocation fails (or
+	// Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
+	// Thread-safe.
+	template<typename... Args>
+	inline bool emplace(producer_token_t const& token, Args&&... args)
+	{
+		return inner_enqueue<CanAlloc>(token, std::forward<Args>(args)...);
+	}
+	
+	// Enqueues a single item, constructing it in place from the given arguments.
+	// Does not allocate memory (except for one-time implicit producer).
+	// Fails if not enough room to enqueue (or implicit production is
+	// disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0).
+	// Thread-safe.
+	template<typename... Args>
+	inline typename std::enable_if<!details::is_first_producer_token<Args...>::value, bool>::type try_emplace(Args&&... args)
+	{
+		if (INITIAL_IMPLICIT_PRODUCER_HASH_SIZE == 0) return false;
+		return inner_enqueue<CannotAlloc>(std::forward<Args>(args)...);
+	}
+	
+	// Enqueues a single item using an explicit producer token, constructing it in
+	// place from the given arguments.
+	// Does not allocate memory. Fails if not enough room to enqueue.
+	// Thread-safe.
+	template<typename... Args>
+	inline bool try_emplace(producer_token_t const& token, Args&&... args)
+	{
+		return inner_enqueue<CannotAlloc>(token, std::forward<Args>(args)...);
+	}
+	
+	// Enqueues count items, each one constructed from the result of calling make()
+	// (e.g. a lambda returning a T, which is then built directly in the queue's storage).
+	// make is called exactly count times, in order, unless it throws.
+	// Allocates memory if required. Only fails if memory allocation fails (or
+	// implicit production is disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE
+	// is 0, or Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
+	// Thread-safe.
+	template<typename F>
+	bool enqueue_bulk_generate(size_t count, F&& make)
+	{
+		if (INITIAL_IMPLICIT_PRODUCER_HASH_SIZE == 0) return false;
+		return inner_enqueue_bulk<CanAlloc>(details::generator_iterator<typename std::remove_reference<F>::type>(make), count);
+	}
+	
+	// Enqueues count items using an explicit producer token, each one constructed
+	// from the result of calling make().
+	// Allocates memory if required. Only fails if memory allocation fails
+	// (or Traits::MAX_SUBQUEUE_SIZE has been defined and would be surpassed).
+	// Thread-safe.
+	template<typename F>
+	bool enqueue_bulk_generate(producer_token_t const& token, size_t count, F&& make)
+	{
+		return inner_enqueue_bulk<CanAlloc>(token, details::generator_iterator<typename std::remove_reference<F>::type>(make), count);
+	}
+	
+	// Enqueues count items, each one constructed from the result of calling make().
+	// Does not allocate memory (except for one-time implicit producer).
+	// Fails if not enough room to enqueue (or implicit production is
+	// disabled because Traits::INITIAL_IMPLICIT_PRODUCER_HASH_SIZE is 0);
+	// make is not called at all in that case.
+	// Thread-safe.
+	template<typename F>
+	bool try_enqueue_bulk_generate(size_t count, F&& make)
+	{
+		if (INITIAL_IMPLICIT_PRODUCER_HASH_SIZE == 0) return false;
+		return inner_enqueue_bulk<CannotAlloc>(details::generator_iterator<typename std::remove_reference<F>::type>(make), count);
+	}
+	
+	// Enqueues count items using an explicit producer token, each one constructed
+	// from the result of calling make().
+	// Does not allocate memory. Fails if not enough room to enqueue (make is
+	// not called at all in that case).
+	// Thread-safe.
+	template<typename F>
+	bool try_enqueue_bulk_generate(producer_token_t const& token, size_t count, F&& make)
 	{
-		return inner_enqueue_bulk<CannotAlloc>(token, itemFirst, count);
+		return inner_enqueue_bulk<CannotAlloc>(token, details::generator_iterator<typename std::remove_reference<F>::type>(make), count);
 	}
 	
 	
@@ -1068,6 +1979,7 @@ public:
 				}
 			}
 		}
+		MOODYCAMEL_PROBE2(dequeue_failed, this, 1);
 		return false;
 	}
 	
@@ -1088,6 +2000,7 @@ public:
 				return true;
 			}
 		}
+		MOODYCAMEL_PROBE2(dequeue_failed, this, 1);
 		return false;
 	}
 	
@@ -1106,6 +2019,7 @@ public:
 		
 		if (token.desiredProducer == nullptr || token.lastKnownGlobalOffset != globalExplicitConsumerOffset.load(std::memory_order_relaxed)) {
 			if (!update_current_producer_after_rotation(token)) {
+				MOODYCAMEL_PROBE2(dequeue_failed, this, 1);
 				return false;
 			}
 		}
@@ -1113,11 +2027,12 @@ public:
 		// If there was at least one non-empty queue but it appears empty at the time
 		// we try to dequeue from it, we need to make sure every queue's been tried
 		if (static_cast<ProducerBase*>(token.currentProducer)->dequeue(item)) {
-			if (++token.itemsConsumedFromCurrent == EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE) {
-				globalExplicitConsumerOffset.fetch_add(1, std::memory_order_relaxed);
+			if (++token.itemsConsumedFromCurrent >= token.rotationQuota) {
+				explicit_consumer_quota_reached(token);
 			}
 			return true;
 		}
+		explicit_consumer_producer_ran_dry(token);
 		
 		auto tail = producerListTail.load(std::memory_order_acquire);
 		auto ptr = static_cast<ProducerBase*>(token.currentProducer)->next_prod();
@@ -1135,6 +2050,7 @@ public:
 				ptr = tail;
 			}
 		}
+		MOODYCAMEL_PROBE2(dequeue_failed, this, 1);
 		return false;
 	}
 	
@@ -1153,6 +2069,9 @@ public:
 				break;
 			}
 		}
+		if (count == 0) {
+			MOODYCAMEL_PROBE2(dequeue_failed, this, max);
+		}
 		return count;
 	}
 	
@@ -1166,18 +2085,20 @@ public:
 	{
 		if (token.desiredProducer == nullptr || token.lastKnownGlobalOffset != globalExplicitConsumerOffset.load(std::memory_order_relaxed)) {
 			if (!update_current_producer_after_rotation(token)) {
+				MOODYCAMEL_PROBE2(dequeue_failed, this, max);
 				return 0;
 			}
 		}
 		
 		size_t count = static_cast<ProducerBase*>(token.currentProducer)->dequeue_bulk(itemFirst, max);
 		if (count == max) {
-			if ((token.itemsConsumedFromCurrent += static_cast<std::uint32_t>(max)) >= EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE) {
-				globalExplicitConsumerOffset.fetch_add(1, std::memory_order_relaxed);
+			if ((token.itemsConsumedFromCurrent += static_cast<std::uint32_t>(max)) >= token.rotationQuota) {
+				explicit_consumer_quota_reached(token);
 			}
 			return max;
 		}
 		token.itemsConsumedFromCurrent += static_cast<std::uint32_t>(count);
+		explicit_consumer_producer_ran_dry(token);
 		max -= count;
 		
 		auto tail = producerListTail.load(std::memory_order_acquire);
@@ -1201,6 +2122,9 @@ public:
 				ptr = tail;
 			}
 		}
+		if (count == 0) {
+			MOODYCAMEL_PROBE2(dequeue_failed, this, max);
+		}
 		return count;
 	}
 	
@@ -1215,7 +2139,11 @@ public:
 	template<typename U>
 	inline bool try_dequeue_from_producer(producer_token_t const& producer, U& item)
 	{
-		return static_cast<ExplicitProducer*>(producer.producer)->dequeue(item);
+		if (static_cast<ExplicitProducer*>(producer.producer)->dequeue(item)) {
+			return true;
+		}
+		MOODYCAMEL_PROBE2(dequeue_failed, this, 1);
+		return false;
 	}
 	
 	// Attempts to dequeue several elements from a specific producer's inner queue.
@@ -1228,7 +2156,11 @@ public:
 	template<typename It>
 	inline size_t try_dequeue_bulk_from_producer(producer_token_t const& producer, It itemFirst, size_t max)
 	{
-		return static_cast<ExplicitProducer*>(producer.producer)->dequeue_bulk(itemFirst, max);
+		auto count = static_cast<ExplicitProducer*>(producer.producer)->dequeue_bulk(itemFirst, max);
+		if (count == 0) {
+			MOODYCAMEL_PROBE2(dequeue_failed, this, max);
+		}
+		return count;
 	}
 	
 	
@@ -1237,9 +2169,20 @@ public:
 	// (i.e. all enqueue and dequeue operations have completed and their memory effects are
 	// visible on the calling thread, and no further operations start while this method is
 	// being called).
+	// With Traits::SIZE_COUNTER_SHARDS set, this reads the sharded size counters instead,
+	// in O(SIZE_COUNTER_SHARDS) rather than O(producers). They count a producer's elements
+	// a block at a time: once the block is full, and until it's been fully dequeued. So
+	// the result is a multiple of BLOCK_SIZE, and off by less than BLOCK_SIZE for each
+	// producer (those with a partially filled tail block have fewer elements counted than
+	// they hold, those with a partially dequeued head block more) -- but otherwise it's
+	// no staler than the regular estimate.
 	// Thread-safe.
 	size_t size_approx() const
 	{
+		if (SIZE_COUNTER_SHARDS != 0) {
+			auto count = sizeCounter.sum();
+			return count > 0 ? static_cast<size_t>(count) : 0;
+		}
 		size_t size = 0;
 		for (auto ptr = producerListTail.load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next_prod()) {
 			size += ptr->size_approx();
@@ -1247,6 +2190,234 @@ public:
 		return size;
 	}
 	
+	// Returns true if all producer streams appeared empty at the time they were checked
+	// (with the same caveats as size_approx). Returns as soon as it finds a non-empty one.
+	// With Traits::SIZE_COUNTER_SHARDS set, a queue holding at least a full block's worth
+	// of elements is recognized as non-empty from the size counters alone, and the
+	// producers are checked one by one otherwise -- so unlike size_approx, this doesn't
+	// inherit the counters' error of up to BLOCK_SIZE - 1 elements per producer, but
+	// costs O(producers) whenever the counters read 0 (e.g. whenever the queue is empty).
+	// Thread-safe.
+	bool empty_approx() const
+	{
+		if (SIZE_COUNTER_SHARDS != 0 && sizeCounter.sum() > 0) {
+			return false;
+		}
+		for (auto ptr = producerListTail.load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next_prod()) {
+			if (ptr->size_approx() != 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	// A snapshot of the queue's memory use, as returned by stats()
+	struct Stats
+	{
+		size_t allocatedBlocks;		// In the initial block pool, or allocated since
+		size_t freeBlocks;			// Not held by any producer
+		size_t usedBlocks;			// Held by producers (explicit producers keep theirs even once emptied)
+		size_t peakUsedBlocks;		// The most blocks held by producers at once so far
+		size_t explicitProducers;
+		size_t implicitProducers;
+		size_t blockIndexBytes;		// Allocated for the producers' block indices
+	};
+	
+	// Returns a snapshot of the queue's memory use and (block-level) occupancy. Unlike
+	// size_approx, this only reads a handful of counters that are maintained as blocks
+	// change hands, so it's cheap enough to be called periodically, e.g. by a metrics
+	// exporter. The counters are read independently of each other, so while the queue
+	// is in use, the snapshot is only approximately consistent.
+	// Thread-safe.
+	Stats stats() const
+	{
+		Stats result;
+		result.allocatedBlocks = initialBlockPoolSize + dynamicBlockCount.load(std::memory_order_relaxed);
+		result.usedBlocks = ownedBlockCount.load(std::memory_order_relaxed);
+		if (result.usedBlocks > result.allocatedBlocks) {
+			result.usedBlocks = result.allocatedBlocks;
+		}
+		result.freeBlocks = result.allocatedBlocks - result.usedBlocks;
+		result.peakUsedBlocks = peakOwnedBlockCount.load(std::memory_order_relaxed);
+		auto producers = producerCount.load(std::memory_order_relaxed);
+		auto explicitProducers = explicitProducerCount.load(std::memory_order_relaxed);
+		result.explicitProducers = explicitProducers;
+		result.implicitProducers = producers > explicitProducers ? producers - explicitProducers : 0;
+		result.blockIndexBytes = blockIndexBytes.load(std::memory_order_relaxed);
+		return result;
+	}
+	
+	// Returns how long (in microseconds, approximately) the given percentile (e.g. 99.9)
+	// of the sampled elements sat in the queue between being enqueued and dequeued, or
+	// 0 if nothing's been sampled (see Traits::RESIDENCY_SAMPLE_INTERVAL).
+	// Thread-safe.
+	double residency_percentile(double percentile) const
+	{
+		if (residencyHistogram == nullptr) {
+			return 0;
+		}
+		return (double)residencyHistogram->value_at(percentile / 100.0) / details::residency_ticks_per_usec();
+	}
+	
+	// Returns the number of residencies sampled so far (or since the last reset).
+	// Thread-safe.
+	std::uint64_t residency_samples() const
+	{
+		return residencyHistogram == nullptr ? 0 : residencyHistogram->count();
+	}
+	
+	// Forgets the residencies sampled so far, e.g. to export one interval at a time
+	// (samples recorded concurrently may or may not survive).
+	// Thread-safe.
+	void reset_residency_samples()
+	{
+		if (residencyHistogram != nullptr) {
+			residencyHistogram->reset();
+		}
+	}
+	
+	struct ContentionStats
+	{
+		std::uint64_t freeListAddRetries;	// Failed CASes putting a block back on the free list
+		std::uint64_t freeListGetRetries;	// Failed attempts at taking a block off the free list
+		std::uint64_t dequeueOvercommits;	// Dequeues from a producer that looked non-empty but wasn't
+		std::uint64_t consumerRotations;	// Times a consumer token had to find a new producer after a rotation
+		std::uint64_t implicitHashProbes;	// Extra slots probed looking up or adding implicit producers
+	};
+	
+	// Returns how often the queue's lock-free paths have had to retry or back out
+	// because of other threads so far. The counters are only maintained when
+	// MOODYCAMEL_CONTENTION_COUNTERS is defined (before including this header);
+	// otherwise they cost nothing, and this returns all zeros.
+	// Thread-safe.
+	ContentionStats contention_stats() const
+	{
+		ContentionStats result = { 0, 0, 0, 0, 0 };
+#ifdef MOODYCAMEL_CONTENTION_COUNTERS
+		result.freeListAddRetries = contentionCounters.total(details::contention_counters::freelist_add_retries);
+		result.freeListGetRetries = contentionCounters.total(details::contention_counters::freelist_get_retries);
+		result.dequeueOvercommits = contentionCounters.total(details::contention_counters::dequeue_overcommits);
+		result.consumerRotations = contentionCounters.total(details::contention_counters::consumer_rotations);
+		result.implicitHashProbes = contentionCounters.total(details::contention_counters::implicit_hash_probes);
+#endif
+		return result;
+	}
+	
+	typedef details::watermark_monitor::callback_t watermark_callback_t;
+	
+	// Has callback(userData, high, approxSize) called as soon as the queue fills up to the
+	// high watermark (high is true), and then as soon as it drains down to the low one
+	// (high is false), and so on, alternately -- e.g. to have consumer threads added and
+	// removed. Both watermarks are in elements, but the queue keeps track of its size only
+	// in whole blocks (counting the blocks elements are in, including partially dequeued
+	// ones and tail blocks that aren't full yet), so they're effectively rounded to a
+	// multiple of BLOCK_SIZE (high upwards, low downwards), as is approxSize. The callback
+	// is made from within whichever enqueue or dequeue crossed the watermark (or from one
+	// that's still making the previous callback), so it had better be quick; callbacks are
+	// never made concurrently, and always alternate. Passing a null callback removes the
+	// watermarks.
+	// Returns false if memory for the bookkeeping couldn't be allocated.
+	// Not thread-safe: no other operations may be in progress.
+	bool set_watermarks(size_t high, size_t low, watermark_callback_t callback, void* userData = nullptr)
+	{
+		assert(callback == nullptr || low < high);
+		if (watermarks != nullptr) {
+			destroy(watermarks);
+			watermarks = nullptr;
+		}
+		if (callback == nullptr) {
+			return true;
+		}
+		size_t blocks = 0;
+		for (auto ptr = producerListTail.load(std::memory_order_relaxed); ptr != nullptr; ptr = ptr->next_prod()) {
+			blocks += ptr->blocks_spanned();
+		}
+		watermarks = create<details::watermark_monitor>((high + BLOCK_SIZE - 1) / BLOCK_SIZE, low / BLOCK_SIZE, static_cast<size_t>(BLOCK_SIZE), callback, userData, blocks);
+		return watermarks != nullptr;
+	}
+	
+	struct ProducerInfo
+	{
+		bool isExplicit;				// Created for a ProducerToken (otherwise implicitly, by enqueueing from a thread)
+		bool isActive;					// False once its token is gone or its thread has exited (it can then be reused)
+		details::thread_id_t threadId;	// For implicit producers, their thread (as per details::thread_id())
+		size_t size;					// Approximate number of elements
+		size_t blocks;					// Blocks held
+		std::uint64_t lastActivity;		// When it last started on a block, enqueueing or dequeueing (0 if never)
+		double idleUsecs;				// How long ago that was, in microseconds (-1 if never)
+	};
+	
+	// Calls f(ProducerInfo const&) with a snapshot of each of the queue's producers (each
+	// a sub-queue of elements enqueued with the same token, or from the same thread), and
+	// returns how many there were; e.g. to find the one stream a backlog is stuck in.
+	// Nothing gets locked, so this can run alongside the queue's other operations, but
+	// each snapshot is only approximately consistent, and producers added meanwhile may
+	// or may not be visited. lastActivity is in the same (platform-specific) ticks as
+	// residency sampling, and comparable between producers.
+	// Thread-safe.
+	template<typename F>
+	size_t for_each_producer(F&& f) const
+	{
+		auto now = details::residency_ticks();
+		size_t count = 0;
+		for (auto ptr = producerListTail.load(std::memory_order_acquire); ptr != nullptr; ptr = ptr->next_prod()) {
+			ProducerInfo info;
+			info.isExplicit = ptr->isExplicit;
+			info.isActive = !ptr->inactive.load(std::memory_order_relaxed);
+			info.threadId = ptr->isExplicit ? details::invalid_thread_id : static_cast<ImplicitProducer*>(ptr)->ownerThread.load(std::memory_order_relaxed);
+			info.size = ptr->size_approx();
+			info.blocks = ptr->blocks_held();
+			info.lastActivity = ptr->lastActivity.load(std::memory_order_relaxed);
+			info.idleUsecs = info.lastActivity == 0 ? -1 : (double)(now > info.lastActivity ? now - info.lastActivity : 0) / details::residency_ticks_per_usec();
+			f(static_cast<ProducerInfo const&>(info));
+			++count;
+		}
+		return count;
+	}
+	
+	// Calls f(T const&) on up to max of the oldest elements enqueued with the given
+	// token, oldest first, without dequeueing them, and returns how many it was called
+	// on; e.g. to log how long the oldest element of a stuck stream has been waiting.
+	// Nothing is claimed, so this is only safe for a single consumer (the elements
+	// must not be dequeued while f looks at them), though the producer can keep
+	// enqueueing concurrently.
+	template<typename F>
+	size_t peek_oldest(producer_token_t const& producer, size_t max, F&& f) const
+	{
+		return static_cast<ExplicitProducer const*>(producer.producer)->peek(max, std::forward<F>(f));
+	}
+	
+	// Returns the oldest element enqueued with the given token, without dequeueing it,
+	// or nullptr if there isn't one. With the same caveat as peek_oldest: the element
+	// stays valid only until the (single) consumer dequeues it.
+	T const* front(producer_token_t const& producer) const
+	{
+		T const* result = nullptr;
+		peek_oldest(producer, 1, [&](T const& element) { result = &element; });
+		return result;
+	}
+	
+	// Copies up to max elements to the output iterator without dequeueing them, going
+	// through the producers one by one (each one's elements oldest first), and returns
+	// how many it copied. Meant for monitoring and debugging, not for getting at the
+	// elements. Only for trivially copyable element types (enforced at compile time).
+	// Nothing is claimed, so this must not run concurrently with dequeues: an element
+	// that's dequeued (and its slot reused) while it's being copied would be read as
+	// it's overwritten, which is a data race even for trivially copyable types. Safe
+	// to call concurrently with enqueues, though (elements enqueued meanwhile may or
+	// may not be included).
+	template<typename OutputIt>
+	size_t snapshot(OutputIt out, size_t max) const
+	{
+		static_assert(details::is_trivially_copyable<T>::value, "snapshot requires a trivially copyable element type");
+		
+		size_t count = 0;
+		for (auto ptr = producerListTail.load(std::memory_order_acquire); ptr != nullptr && count != max; ptr = ptr->next_prod()) {
+			count += ptr->peek(max - count, [&](T const& element) { *out = element; ++out; });
+		}
+		return count;
+	}
+	
 	
 	// Returns true if the underlying atomic variables used by
 	// the queue are lock-free (they should be on most platforms).
@@ -1271,6 +2442,7 @@ private:
 	struct ImplicitProducer;
 	friend struct ImplicitProducer;
 	friend class ConcurrentQueueTests;
+	template<typename U, typename UTraits, typename WaitStrategy> friend class BlockingConcurrentQueue;
 		
 	enum AllocationMode { CanAlloc, CannotAlloc };
 	
@@ -1279,34 +2451,42 @@ private:
 	// Queue methods
 	///////////////////////////////
 	
-	template<AllocationMode canAlloc, typename U>
-	inline bool inner_enqueue(producer_token_t const& token, U&& element)
+	template<AllocationMode canAlloc, typename... Args>
+	inline bool inner_enqueue(producer_token_t const& token, Args&&... args)
 	{
-		return static_cast<ExplicitProducer*>(token.producer)->ConcurrentQueue::ExplicitProducer::template enqueue<canAlloc>(std::forward<U>(element));
+		return static_cast<ExplicitProducer*>(token.producer)->ConcurrentQueue::ExplicitProducer::template enqueue<canAlloc>(std::forward<Args>(args)...);
 	}
 	
-	template<AllocationMode canAlloc, typename U>
-	inline bool inner_enqueue(U&& element)
+	template<AllocationMode canAlloc, typename... Args>
+	inline bool inner_enqueue(Args&&... args)
 	{
+		MOODYCAMEL_CYCLES_START(lookupStart);
 		auto producer = get_or_add_implicit_producer();
-		return producer == nullptr ? false : producer->ConcurrentQueue::ImplicitProducer::template enqueue<canAlloc>(std::forward<U>(element));
+		MOODYCAMEL_CYCLES_STOP(lookupStart, implicit_hash_lookup);
+		return producer == nullptr ? false : producer->ConcurrentQueue::ImplicitProducer::template enqueue<canAlloc>(std::forward<Args>(args)...);
 	}
 	
 	template<AllocationMode canAlloc, typename It>
 	inline bool inner_enqueue_bulk(producer_token_t const& token, It itemFirst, size_t count)
 	{
-		return static_cast<ExplicitProducer*>(token.producer)->ConcurrentQueue::ExplicitProducer::template enqueue_bulk<canAlloc>(itemFirst, count);
+		// Cast by reference, since the token is valid anyway; a pointer cast's null check leaves GCC (12)
+		// looking at a path through a null producer, and warning about it with -Wstringop-overflow
+		return static_cast<ExplicitProducer&>(*token.producer).ConcurrentQueue::ExplicitProducer::template enqueue_bulk<canAlloc>(itemFirst, count);
 	}
 	
 	template<AllocationMode canAlloc, typename It>
 	inline bool inner_enqueue_bulk(It itemFirst, size_t count)
 	{
+		MOODYCAMEL_CYCLES_START(lookupStart);
 		auto producer = get_or_add_implicit_producer();
+		MOODYCAMEL_CYCLES_STOP(lookupStart, implicit_hash_lookup);
 		return producer == nullptr ? false : producer->ConcurrentQueue::ImplicitProducer::template enqueue_bulk<canAlloc>(itemFirst, count);
 	}
 	
 	inline bool update_current_producer_after_rotation(consumer_token_t& token)
 	{
+		MOODYCAMEL_COUNT_CONTENTION(contentionCounters, consumer_rotations);
+		
 		// Ah, there's been a rotation, figure out where we should be!
 		auto tail = producerListTail.load(std::memory_order_acquire);
 		if (token.desiredProducer == nullptr && tail == nullptr) {
@@ -1345,6 +2525,30 @@ private:
 		return true;
 	}
 	
+	inline void explicit_consumer_quota_reached(consumer_token_t& token)
+	{
+		if (ADAPTIVE_CONSUMER_ROTATION) {
+			// Rotating away from a producer that still has a deep backlog would just send everyone
+			// looking for it again; extend this consumer's quota instead (up to a bound, so that
+			// the other producers still get their turn)
+			auto backlog = static_cast<ProducerBase*>(token.currentProducer)->size_approx();
+			if (backlog >= token.rotationQuota && token.rotationQuota / 16 < EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE) {
+				token.rotationQuota *= 2;
+				return;
+			}
+			token.rotationQuota = EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE;
+		}
+		globalExplicitConsumerOffset.fetch_add(1, std::memory_order_relaxed);
+	}
+	
+	inline void explicit_consumer_producer_ran_dry(consumer_token_t& token)
+	{
+		if (ADAPTIVE_CONSUMER_ROTATION) {
+			// Whatever backlog justified an extended quota is gone
+			token.rotationQuota = EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE;
+		}
+	}
+	
 	
 	///////////////////////////
 	// Free list
@@ -1396,6 +2600,7 @@ private:
 				auto prevHead = head;
 				auto refs = head->freeListRefs.load(std::memory_order_relaxed);
 				if ((refs & REFS_MASK) == 0 || !head->freeListRefs.compare_exchange_strong(refs, refs + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+					MOODYCAMEL_COUNT_CONTENTION(*contention, freelist_get_retries);
 					head = freeListHead.load(std::memory_order_acquire);
 					continue;
 				}
@@ -1416,6 +2621,7 @@ private:
 				// OK, the head must have changed on us, but we still need to decrease the refcount we increased.
 				// Note that we don't need to release any memory effects, but we do need to ensure that the reference
 				// count decrement happens-after the CAS on the head.
+				MOODYCAMEL_COUNT_CONTENTION(*contention, freelist_get_retries);
 				refs = prevHead->freeListRefs.fetch_sub(1, std::memory_order_acq_rel);
 				if (refs == SHOULD_BE_ON_FREELIST + 1) {
 					add_knowing_refcount_is_zero(prevHead);
@@ -1444,6 +2650,8 @@ private:
 				node->freeListNext.store(head, std::memory_order_relaxed);
 				node->freeListRefs.store(1, std::memory_order_release);
 				if (!freeListHead.compare_exchange_strong(head, node, std::memory_order_release, std::memory_order_relaxed)) {
+					MOODYCAMEL_COUNT_CONTENTION(*contention, freelist_add_retries);
+					
 					// Hmm, the add failed, but we can only try again when the refcount goes back to zero
 					if (node->freeListRefs.fetch_add(SHOULD_BE_ON_FREELIST - 1, std::memory_order_release) == 1) {
 						continue;
@@ -1456,6 +2664,14 @@ private:
 	private:
 		// Implemented like a stack, but where node order doesn't matter (nodes are inserted out of order under contention)
 		std::atomic<N*> freeListHead;
+
+#ifdef MOODYCAMEL_CONTENTION_COUNTERS
+	public:
+		// Set by the owning queue (and kept pointing at its own counters, rather than
+		// following the list around when it's moved or swapped)
+		details::contention_counters* contention = nullptr;
+	private:
+#endif
 	
 	static const std::uint32_t REFS_MASK = 0x7FFFFFFF;
 	static const std::uint32_t SHOULD_BE_ON_FREELIST = 0x80000000;
@@ -1472,7 +2688,7 @@ private:
 	
 	enum InnerQueueContext { implicit_context = 0, explicit_context = 1 };
 	
-	struct Block
+	struct Block : public details::residency_stamps<RESIDENCY_SAMPLE_INTERVAL == 0 ? 0 : RESIDENCY_SAMPLE_INTERVAL < BLOCK_SIZE ? BLOCK_SIZE / RESIDENCY_SAMPLE_INTERVAL : 1>
 	{
 		Block()
 			: next(nullptr), elementsCompletelyDequeued(0), freeListRefs(0), freeListNext(nullptr), shouldBeOnFreeList(false), dynamicallyAllocated(true)
@@ -1487,8 +2703,8 @@ private:
 		{
 			if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD) {
 				// Check flags
-				for (size_t i = 0; i < BLOCK_SIZE; ++i) {
-					if (!emptyFlags[i].load(std::memory_order_relaxed)) {
+				for (size_t i = 0; i != EMPTY_FLAG_WORDS; ++i) {
+					if (emptyFlags[i].load(std::memory_order_relaxed) != EMPTY_FLAG_WORD_FULL) {
 						return false;
 					}
 				}
@@ -1514,8 +2730,10 @@ private:
 		{
 			if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD) {
 				// Set flag
-				assert(!emptyFlags[BLOCK_SIZE - 1 - static_cast<size_t>(i & static_cast<index_t>(BLOCK_SIZE - 1))].load(std::memory_order_relaxed));
-				emptyFlags[BLOCK_SIZE - 1 - static_cast<size_t>(i & static_cast<index_t>(BLOCK_SIZE - 1))].store(true, std::memory_order_release);
+				auto bit = static_cast<size_t>(i & static_cast<index_t>(BLOCK_SIZE - 1));
+				auto mask = static_cast<details::flag_word_t>(1) << (bit % EMPTY_FLAG_WORD_BITS);
+				assert((emptyFlags[bit / EMPTY_FLAG_WORD_BITS].load(std::memory_order_relaxed) & mask) == 0);
+				emptyFlags[bit / EMPTY_FLAG_WORD_BITS].fetch_or(mask, std::memory_order_release);
 				return false;
 			}
 			else {
@@ -1532,12 +2750,17 @@ private:
 		inline bool set_many_empty(index_t i, size_t count)
 		{
 			if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD) {
-				// Set flags
+				// Set flags, one word at a time
 				std::atomic_thread_fence(std::memory_order_release);
-				i = BLOCK_SIZE - 1 - static_cast<size_t>(i & static_cast<index_t>(BLOCK_SIZE - 1)) - count + 1;
-				for (size_t j = 0; j != count; ++j) {
-					assert(!emptyFlags[i + j].load(std::memory_order_relaxed));
-					emptyFlags[i + j].store(true, std::memory_order_relaxed);
+				auto bit = static_cast<size_t>(i & static_cast<index_t>(BLOCK_SIZE - 1));
+				while (count != 0) {
+					auto offset = bit % EMPTY_FLAG_WORD_BITS;
+					auto n = count < EMPTY_FLAG_WORD_BITS - offset ? count : EMPTY_FLAG_WORD_BITS - offset;
+					auto mask = (n == EMPTY_FLAG_WORD_BITS ? ~static_cast<details::flag_word_t>(0) : (static_cast<details::flag_word_t>(1) << n) - 1) << offset;
+					assert((emptyFlags[bit / EMPTY_FLAG_WORD_BITS].load(std::memory_order_relaxed) & mask) == 0);
+					emptyFlags[bit / EMPTY_FLAG_WORD_BITS].fetch_or(mask, std::memory_order_relaxed);
+					bit += n;
+					count -= n;
 				}
 				return false;
 			}
@@ -1549,13 +2772,50 @@ private:
 			}
 		}
 		
+		// Like set_many_empty in explicit context, but also tells whether that left the whole
+		// block empty (if several callers finish it off at once, at least one of them gets
+		// true). Costs a little more, since the flags' previous values have to be looked at.
+		inline bool set_many_empty_checked(index_t i, size_t count)
+		{
+			if (BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD) {
+				std::atomic_thread_fence(std::memory_order_release);
+				auto bit = static_cast<size_t>(i & static_cast<index_t>(BLOCK_SIZE - 1));
+				bool filledWord = false;
+				while (count != 0) {
+					auto offset = bit % EMPTY_FLAG_WORD_BITS;
+					auto n = count < EMPTY_FLAG_WORD_BITS - offset ? count : EMPTY_FLAG_WORD_BITS - offset;
+					auto mask = (n == EMPTY_FLAG_WORD_BITS ? ~static_cast<details::flag_word_t>(0) : (static_cast<details::flag_word_t>(1) << n) - 1) << offset;
+					auto prev = emptyFlags[bit / EMPTY_FLAG_WORD_BITS].fetch_or(mask, std::memory_order_relaxed);
+					assert((prev & mask) == 0);
+					filledWord |= (prev | mask) == EMPTY_FLAG_WORD_FULL;
+					bit += n;
+					count -= n;
+				}
+				if (!filledWord || EMPTY_FLAG_WORDS == 1) {
+					return filledWord;
+				}
+				// Whoever fills another word at the same time goes through the same fence, so
+				// at least one of us sees the other's word full
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				for (size_t w = 0; w != EMPTY_FLAG_WORDS; ++w) {
+					if (emptyFlags[w].load(std::memory_order_relaxed) != EMPTY_FLAG_WORD_FULL) {
+						return false;
+					}
+				}
+				return true;
+			}
+			else {
+				return set_many_empty<explicit_context>(i, count);
+			}
+		}
+		
 		template<InnerQueueContext context>
 		inline void set_all_empty()
 		{
 			if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD) {
 				// Set all flags
-				for (size_t i = 0; i != BLOCK_SIZE; ++i) {
-					emptyFlags[i].store(true, std::memory_order_relaxed);
+				for (size_t i = 0; i != EMPTY_FLAG_WORDS; ++i) {
+					emptyFlags[i].store(EMPTY_FLAG_WORD_FULL, std::memory_order_relaxed);
 				}
 			}
 			else {
@@ -1569,8 +2829,8 @@ private:
 		{
 			if (context == explicit_context && BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD) {
 				// Reset flags
-				for (size_t i = 0; i != BLOCK_SIZE; ++i) {
-					emptyFlags[i].store(false, std::memory_order_relaxed);
+				for (size_t i = 0; i != EMPTY_FLAG_WORDS; ++i) {
+					emptyFlags[i].store(0, std::memory_order_relaxed);
 				}
 			}
 			else {
@@ -1582,7 +2842,29 @@ private:
 		inline T* operator[](index_t idx) MOODYCAMEL_NOEXCEPT { return static_cast<T*>(static_cast<void*>(elements)) + static_cast<size_t>(idx & static_cast<index_t>(BLOCK_SIZE - 1)); }
 		inline T const* operator[](index_t idx) const MOODYCAMEL_NOEXCEPT { return static_cast<T const*>(static_cast<void const*>(elements)) + static_cast<size_t>(idx & static_cast<index_t>(BLOCK_SIZE - 1)); }
 		
+		// Prefetch hints for a bulk operation that's about to move on to this block (see
+		// Traits::PREFETCH_NEXT_BLOCK). Only the first few cache lines of the element at idx
+		// are requested; the hardware prefetchers take over once the sequential walk starts.
+		inline void prefetch_for_enqueue(index_t idx) const
+		{
+			prefetch_element(idx, true);
+		}
+		
+		inline void prefetch_for_dequeue(index_t idx) const
+		{
+			// The emptiness bookkeeping is written once the elements have been consumed
+			details::prefetch_for_write(&elementsCompletelyDequeued);
+			details::prefetch_for_write(&emptyFlags[0]);
+			prefetch_element(idx, false);
+		}
+	
 	private:
+		// One bit per element (bit i is set once element i has been dequeued), or a single unused word
+		// if the block is large enough to use the elementsCompletelyDequeued counter instead
+		static const size_t EMPTY_FLAG_WORD_BITS = sizeof(details::flag_word_t) * CHAR_BIT;
+		static const size_t EMPTY_FLAG_WORDS = BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD ? (BLOCK_SIZE + EMPTY_FLAG_WORD_BITS - 1) / EMPTY_FLAG_WORD_BITS : 1;
+		static const details::flag_word_t EMPTY_FLAG_WORD_FULL = ~static_cast<details::flag_word_t>(0) >> (EMPTY_FLAG_WORD_BITS - (BLOCK_SIZE < EMPTY_FLAG_WORD_BITS ? BLOCK_SIZE : EMPTY_FLAG_WORD_BITS));
+		
 		// IMPORTANT: This must be the first member in Block, so that if T depends on the alignment of
 		// addresses returned by malloc, that alignment will be preserved. Apparently clang actually
 		// generates code that uses this assumption for AVX instructions in some cases. Ideally, we
@@ -1597,10 +2879,26 @@ private:
 			char elements[sizeof(T) * BLOCK_SIZE];
 			details::max_align_t dummy;
 		};
+		
+		inline void prefetch_element(index_t idx, bool forWrite) const
+		{
+			const size_t cacheLineSize = 64;
+			const size_t maxLines = 4;
+			auto ptr = static_cast<char const*>(static_cast<void const*>((*this)[idx]));
+			for (size_t offset = 0; offset < sizeof(T) && offset != maxLines * cacheLineSize; offset += cacheLineSize) {
+				if (forWrite) {
+					details::prefetch_for_write(ptr + offset);
+				}
+				else {
+					details::prefetch_for_read(ptr + offset);
+				}
+			}
+		}
+	
 	public:
 		Block* next;
 		std::atomic<size_t> elementsCompletelyDequeued;
-		std::atomic<bool> emptyFlags[BLOCK_SIZE <= EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD ? BLOCK_SIZE : 1];
+		std::atomic<details::flag_word_t> emptyFlags[EMPTY_FLAG_WORDS];
 	public:
 		std::atomic<std::uint32_t> freeListRefs;
 		std::atomic<Block*> freeListNext;
@@ -1632,6 +2930,7 @@ private:
 			dequeueOptimisticCount(0),
 			dequeueOvercommit(0),
 			tailBlock(nullptr),
+			lastActivity(0),
 			isExplicit(isExplicit_),
 			parent(parent_)
 		{
@@ -1671,6 +2970,112 @@ private:
 		}
 		
 		inline index_t getTail() const { return tailIndex.load(std::memory_order_relaxed); }
+		
+		// Calls f(T const&) on up to max elements, from the oldest on, and returns how many.
+		// Reads the tail and head and looks the blocks up the way a dequeue would, but claims
+		// nothing (see peek_oldest and snapshot); stops early if a block index entry no
+		// longer matches, which can only happen if elements are being dequeued meanwhile.
+		template<typename F>
+		size_t peek(size_t max, F&& f) const
+		{
+			auto tail = tailIndex.load(std::memory_order_acquire);
+			auto index = headIndex.load(std::memory_order_acquire);
+			size_t count = 0;
+			Block const* block = nullptr;
+			for (; count != max && details::circular_less_than(index, tail); ++index, ++count) {
+				if (block == nullptr || (index & static_cast<index_t>(BLOCK_SIZE - 1)) == 0) {
+					if (isExplicit) {
+						block = static_cast<ExplicitProducer const*>(this)->peek_block(index);
+					}
+					else {
+						block = static_cast<ImplicitProducer const*>(this)->peek_block(index);
+					}
+					if (block == nullptr) {
+						break;
+					}
+				}
+				f(*(*block)[index]);
+			}
+			return count;
+		}
+		
+		inline size_t blocks_held() const
+		{
+			if (isExplicit) {
+				return static_cast<ExplicitProducer const*>(this)->blockCount.load(std::memory_order_relaxed);
+			}
+			// Implicit producers hand their blocks back as they're emptied
+			return blocks_spanned();
+		}
+		
+		// How many blocks the elements span, counting each block from when its first element
+		// is enqueued until its last one is dequeued (so including a tail block that's not full)
+		inline size_t blocks_spanned() const
+		{
+			auto tail = tailIndex.load(std::memory_order_relaxed);
+			auto head = headIndex.load(std::memory_order_relaxed);
+			if (!details::circular_less_than(head, tail)) {
+				head = tail;
+			}
+			auto started = static_cast<index_t>(static_cast<index_t>(tail + static_cast<index_t>(BLOCK_SIZE - 1)) & ~static_cast<index_t>(BLOCK_SIZE - 1));
+			auto finished = static_cast<index_t>(head & ~static_cast<index_t>(BLOCK_SIZE - 1));
+			return static_cast<size_t>(static_cast<index_t>(started - finished) / BLOCK_SIZE);
+		}
+		
+		// Called for each run [first, end) of indices enqueued into (before publishing them).
+		// Stamps lastActivity and counts towards the watermarks when the run starts a block,
+		// so that this happens only about once per block's worth of elements.
+		inline void note_enqueued(index_t first, index_t end)
+		{
+			auto started = static_cast<index_t>((static_cast<index_t>(end - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1)) - (static_cast<index_t>(first - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1)));
+			if (started != 0) {
+				lastActivity.store(details::residency_ticks(), std::memory_order_relaxed);
+				if (parent->watermarks != nullptr) {
+					parent->watermarks->add(static_cast<size_t>(started / BLOCK_SIZE));
+				}
+			}
+			if (SIZE_COUNTER_SHARDS != 0) {
+				// The size counters take in a block's elements once it's full
+				auto filled = static_cast<index_t>((end & ~static_cast<index_t>(BLOCK_SIZE - 1)) - (first & ~static_cast<index_t>(BLOCK_SIZE - 1)));
+				if (filled != 0) {
+					parent->sizeCounter.add(static_cast<std::ptrdiff_t>(filled));
+				}
+			}
+		}
+		
+		// Undoes note_enqueued for [first, end), made up of runs that were noted but whose
+		// elements were never published after all (an element constructor threw)
+		inline void unnote_enqueued(index_t first, index_t end)
+		{
+			auto started = static_cast<index_t>((static_cast<index_t>(end - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1)) - (static_cast<index_t>(first - 1) & ~static_cast<index_t>(BLOCK_SIZE - 1)));
+			if (started != 0 && parent->watermarks != nullptr) {
+				parent->watermarks->remove(static_cast<size_t>(started / BLOCK_SIZE));
+			}
+			if (SIZE_COUNTER_SHARDS != 0) {
+				auto filled = static_cast<index_t>((end & ~static_cast<index_t>(BLOCK_SIZE - 1)) - (first & ~static_cast<index_t>(BLOCK_SIZE - 1)));
+				if (filled != 0) {
+					parent->sizeCounter.add(-static_cast<std::ptrdiff_t>(filled));
+				}
+			}
+		}
+		
+		// Called for each run [first, end) of indices dequeued from. Stamps lastActivity when
+		// the run starts on a block, and counts towards the watermarks and size counters
+		// when it finishes one.
+		inline void note_dequeued(index_t first, index_t end)
+		{
+			if ((static_cast<index_t>(static_cast<index_t>(first - 1) ^ static_cast<index_t>(end - 1)) & ~static_cast<index_t>(BLOCK_SIZE - 1)) != 0) {
+				lastActivity.store(details::residency_ticks(), std::memory_order_relaxed);
+			}
+			auto finished = static_cast<index_t>((end & ~static_cast<index_t>(BLOCK_SIZE - 1)) - (first & ~static_cast<index_t>(BLOCK_SIZE - 1)));
+			if (finished != 0) {
+				if (parent->watermarks != nullptr) {
+					parent->watermarks->remove(static_cast<size_t>(finished / BLOCK_SIZE));
+				}
+				parent->sizeCounter.add(-static_cast<std::ptrdiff_t>(finished));
+			}
+		}
+	
 	protected:
 		std::atomic<index_t> tailIndex;		// Where to enqueue to next
 		std::atomic<index_t> headIndex;		// Where to dequeue from next
@@ -1681,6 +3086,7 @@ private:
 		Block* tailBlock;
 		
 	public:
+		std::atomic<std::uint64_t> lastActivity;		// When the producer last started on a block, in residency ticks (0 if never)
 		bool isExplicit;
 		ConcurrentQueue* parent;
 		
@@ -1699,6 +3105,7 @@ private:
 	{
 		explicit ExplicitProducer(ConcurrentQueue* parent) :
 			ProducerBase(parent, true),
+			blockCount(0),
 			blockIndex(nullptr),
 			pr_blockIndexSlotsUsed(0),
 			pr_blockIndexSize(EXPLICIT_INITIAL_INDEX_SIZE >> 1),
@@ -1779,8 +3186,8 @@ private:
 			}
 		}
 		
-		template<AllocationMode allocMode, typename U>
-		inline bool enqueue(U&& element)
+		template<AllocationMode allocMode, typename... Args>
+		inline bool enqueue(Args&&... args)
 		{
 			index_t currentTailIndex = this->tailIndex.load(std::memory_order_relaxed);
 			index_t newTailIndex = 1 + currentTailIndex;
@@ -1828,6 +3235,7 @@ private:
 					if (newBlock == nullptr) {
 						return false;
 					}
+					blockCount.fetch_add(1, std::memory_order_relaxed);
 #if MCDBGQ_TRACKMEM
 					newBlock->owner = this;
 #endif
@@ -1843,11 +3251,11 @@ private:
 					++pr_blockIndexSlotsUsed;
 				}
 				
-				if (!MOODYCAMEL_NOEXCEPT_CTOR(T, U, new (nullptr) T(std::forward<U>(element)))) {
+				if (!MOODYCAMEL_NOEXCEPT_CTOR(T, typename details::emplace_value_type<T(Args...)>::type, new (nullptr) T(std::forward<Args>(args)...))) {
 					// The constructor may throw. We want the element not to appear in the queue in
 					// that case (without corrupting the queue):
 					MOODYCAMEL_TRY {
-						new ((*this->tailBlock)[currentTailIndex]) T(std::forward<U>(element));
+						new ((*this->tailBlock)[currentTailIndex]) T(std::forward<Args>(args)...);
 					}
 					MOODYCAMEL_CATCH (...) {
 						// Revert change to the current block, but leave the new block available
@@ -1863,25 +3271,54 @@ private:
 				}
 				
 				// Add block to block index
+				MOODYCAMEL_CYCLES_START(indexStart);
 				auto& entry = blockIndex.load(std::memory_order_relaxed)->entries[pr_blockIndexFront];
 				entry.base = currentTailIndex;
 				entry.block = this->tailBlock;
 				blockIndex.load(std::memory_order_relaxed)->front.store(pr_blockIndexFront, std::memory_order_release);
 				pr_blockIndexFront = (pr_blockIndexFront + 1) & (pr_blockIndexSize - 1);
+				MOODYCAMEL_CYCLES_STOP(indexStart, block_index_lookup);
 				
-				if (!MOODYCAMEL_NOEXCEPT_CTOR(T, U, new (nullptr) T(std::forward<U>(element)))) {
+				if (!MOODYCAMEL_NOEXCEPT_CTOR(T, typename details::emplace_value_type<T(Args...)>::type, new (nullptr) T(std::forward<Args>(args)...))) {
+					this->parent->stamp_residency(this->tailBlock, currentTailIndex);
+					this->note_enqueued(currentTailIndex, currentTailIndex + 1);
+					MOODYCAMEL_CYCLES_START(publishStart);
 					this->tailIndex.store(newTailIndex, std::memory_order_release);
+					MOODYCAMEL_CYCLES_STOP(publishStart, tail_publish);
 					return true;
 				}
 			}
 			
 			// Enqueue
-			new ((*this->tailBlock)[currentTailIndex]) T(std::forward<U>(element));
+			MOODYCAMEL_CYCLES_START(constructStart);
+			new ((*this->tailBlock)[currentTailIndex]) T(std::forward<Args>(args)...);
+			MOODYCAMEL_CYCLES_STOP(constructStart, element_construction);
 			
+			this->parent->stamp_residency(this->tailBlock, currentTailIndex);
+			this->note_enqueued(currentTailIndex, currentTailIndex + 1);
+			MOODYCAMEL_CYCLES_START(publishStart);
 			this->tailIndex.store(newTailIndex, std::memory_order_release);
+			MOODYCAMEL_CYCLES_STOP(publishStart, tail_publish);
 			return true;
 		}
 		
+		// Marks elements [i, i + count) of block as dequeued; if a BlockingConcurrentQueue
+		// is listening for room being made, also tells it when that empties the block out
+		inline void set_dequeued(Block* block, index_t i, size_t count)
+		{
+			if (this->parent->blockFreedCallback == nullptr) {
+				if (count == 1) {
+					block->ConcurrentQueue::Block::template set_empty<explicit_context>(i);
+				}
+				else {
+					block->ConcurrentQueue::Block::template set_many_empty<explicit_context>(i, count);
+				}
+			}
+			else if (block->ConcurrentQueue::Block::set_many_empty_checked(i, count)) {
+				this->parent->note_block_freed();
+			}
+		}
+		
 		template<typename U>
 		bool dequeue(U& element)
 		{
@@ -1936,6 +3373,7 @@ private:
 					
 					// Determine which block the element is in
 					
+					MOODYCAMEL_CYCLES_START(lookupStart);
 					auto localBlockIndex = blockIndex.load(std::memory_order_acquire);
 					auto localBlockIndexHead = localBlockIndex->front.load(std::memory_order_acquire);
 					
@@ -1946,35 +3384,40 @@ private:
 					auto blockBaseIndex = index & ~static_cast<index_t>(BLOCK_SIZE - 1);
 					auto offset = static_cast<size_t>(static_cast<typename std::make_signed<index_t>::type>(blockBaseIndex - headBase) / BLOCK_SIZE);
 					auto block = localBlockIndex->entries[(localBlockIndexHead + offset) & (localBlockIndex->size - 1)].block;
+					MOODYCAMEL_CYCLES_STOP(lookupStart, block_index_lookup);
 					
 					// Dequeue
+					this->parent->record_residency(block, index, index + 1);
+					this->note_dequeued(index, index + 1);
 					auto& el = *((*block)[index]);
 					if (!MOODYCAMEL_NOEXCEPT_ASSIGN(T, T&&, element = std::move(el))) {
 						// Make sure the element is still fully dequeued and destroyed even if the assignment
 						// throws
 						struct Guard {
+							ExplicitProducer* producer;
 							Block* block;
 							index_t index;
 							
 							~Guard()
 							{
 								(*block)[index]->~T();
-								block->ConcurrentQueue::Block::template set_empty<explicit_context>(index);
+								producer->set_dequeued(block, index, 1);
 							}
-						} guard = { block, index };
+						} guard = { this, block, index };
 						
 						element = std::move(el);
 					}
 					else {
 						element = std::move(el);
 						el.~T();
-						block->ConcurrentQueue::Block::template set_empty<explicit_context>(index);
+						set_dequeued(block, index, 1);
 					}
 					
 					return true;
 				}
 				else {
 					// Wasn't anything to dequeue after all; make the effective dequeue count eventually consistent
+					MOODYCAMEL_COUNT_CONTENTION(this->parent->contentionCounters, dequeue_overcommits);
 					this->dequeueOvercommit.fetch_add(1, std::memory_order_release);		// Release so that the fetch_add on dequeueOptimisticCount is guaranteed to happen before this write
 				}
 			}
@@ -2007,10 +3450,12 @@ private:
 					this->tailBlock = this->tailBlock->next;
 					firstAllocatedBlock = firstAllocatedBlock == nullptr ? this->tailBlock : firstAllocatedBlock;
 					
+					MOODYCAMEL_CYCLES_START(indexStart);
 					auto& entry = blockIndex.load(std::memory_order_relaxed)->entries[pr_blockIndexFront];
 					entry.base = currentTailIndex;
 					entry.block = this->tailBlock;
 					pr_blockIndexFront = (pr_blockIndexFront + 1) & (pr_blockIndexSize - 1);
+					MOODYCAMEL_CYCLES_STOP(indexStart, block_index_lookup);
 				}
 				
 				// Now allocate as many blocks as necessary from the block pool
@@ -2022,6 +3467,7 @@ private:
 					assert(!details::circular_less_than<index_t>(currentTailIndex, head));
 					bool full = !details::circular_less_than<index_t>(head, currentTailIndex + BLOCK_SIZE) || (MAX_SUBQUEUE_SIZE != details::const_numeric_max<size_t>::value && (MAX_SUBQUEUE_SIZE == 0 || MAX_SUBQUEUE_SIZE - BLOCK_SIZE < currentTailIndex - head));
 					if (pr_blockIndexRaw == nullptr || pr_blockIndexSlotsUsed == pr_blockIndexSize || full) {
+						MOODYCAMEL_CYCLES_START(growStart);
 						if (allocMode == CannotAlloc || full || !new_block_index(originalBlockIndexSlotsUsed)) {
 							// Failed to allocate, undo changes (but keep injected blocks)
 							pr_blockIndexFront = originalBlockIndexFront;
@@ -2030,6 +3476,8 @@ private:
 							return false;
 						}
 						
+						MOODYCAMEL_CYCLES_STOP(growStart, block_index_lookup);
+						
 						// pr_blockIndexFront is updated inside new_block_index, so we need to
 						// update our fallback value too (since we keep the new index even if we
 						// later fail)
@@ -2044,6 +3492,7 @@ private:
 						this->tailBlock = startBlock == nullptr ? firstAllocatedBlock : startBlock;
 						return false;
 					}
+					blockCount.fetch_add(1, std::memory_order_relaxed);
 					
 #if MCDBGQ_TRACKMEM
 					newBlock->owner = this;
@@ -2061,10 +3510,12 @@ private:
 					
 					++pr_blockIndexSlotsUsed;
 					
+					MOODYCAMEL_CYCLES_START(indexStart);
 					auto& entry = blockIndex.load(std::memory_order_relaxed)->entries[pr_blockIndexFront];
 					entry.base = currentTailIndex;
 					entry.block = this->tailBlock;
 					pr_blockIndexFront = (pr_blockIndexFront + 1) & (pr_blockIndexSize - 1);
+					MOODYCAMEL_CYCLES_STOP(indexStart, block_index_lookup);
 				}
 				
 				// Excellent, all allocations succeeded. Reset each block's emptiness before we fill them up, and
@@ -2097,7 +3548,16 @@ private:
 				if (details::circular_less_than<index_t>(newTailIndex, stopIndex)) {
 					stopIndex = newTailIndex;
 				}
-				if (MOODYCAMEL_NOEXCEPT_CTOR(T, decltype(*itemFirst), new (nullptr) T(details::deref_noexcept(itemFirst)))) {
+				if (PREFETCH_NEXT_BLOCK && this->tailBlock != endBlock) {
+					this->tailBlock->next->prefetch_for_enqueue(stopIndex);
+				}
+				this->parent->stamp_residency(this->tailBlock, currentTailIndex, stopIndex);
+				this->note_enqueued(currentTailIndex, stopIndex);
+				if (details::bulk_memcpy<T, It>::can_copy_in) {
+					details::bulk_memcpy<T, It>::copy_in((*this->tailBlock)[currentTailIndex], itemFirst, static_cast<size_t>(stopIndex - currentTailIndex));
+					currentTailIndex = stopIndex;
+				}
+				else if (MOODYCAMEL_NOEXCEPT_CTOR(T, decltype(*itemFirst), new (nullptr) T(details::deref_noexcept(itemFirst)))) {
 					while (currentTailIndex != stopIndex) {
 						new ((*this->tailBlock)[currentTailIndex++]) T(*itemFirst++);
 					}
@@ -2112,7 +3572,7 @@ private:
 							// may only define a (noexcept) move constructor, and so calls to the
 							// cctor will not compile, even if they are in an if branch that will never
 							// be executed
-							new ((*this->tailBlock)[currentTailIndex]) T(details::nomove_if<(bool)!MOODYCAMEL_NOEXCEPT_CTOR(T, decltype(*itemFirst), new (nullptr) T(details::deref_noexcept(itemFirst)))>::eval(*itemFirst));
+							details::bulk_construct<(bool)!MOODYCAMEL_NOEXCEPT_CTOR(T, decltype(*itemFirst), new (nullptr) T(details::deref_noexcept(itemFirst))), !std::is_reference<decltype(*itemFirst)>::value>::eval((*this->tailBlock)[currentTailIndex], itemFirst);
 							++currentTailIndex;
 							++itemFirst;
 						}
@@ -2123,6 +3583,7 @@ private:
 						// any allocated blocks in our linked list for later, though).
 						auto constructedStopIndex = currentTailIndex;
 						auto lastBlockEnqueued = this->tailBlock;
+						this->unnote_enqueued(startTailIndex, stopIndex);
 						
 						pr_blockIndexFront = originalBlockIndexFront;
 						pr_blockIndexSlotsUsed = originalBlockIndexSlotsUsed;
@@ -2160,10 +3621,14 @@ private:
 			}
 			
 			if (!MOODYCAMEL_NOEXCEPT_CTOR(T, decltype(*itemFirst), new (nullptr) T(details::deref_noexcept(itemFirst))) && firstAllocatedBlock != nullptr) {
+				MOODYCAMEL_CYCLES_START(indexStart);
 				blockIndex.load(std::memory_order_relaxed)->front.store((pr_blockIndexFront - 1) & (pr_blockIndexSize - 1), std::memory_order_release);
+				MOODYCAMEL_CYCLES_STOP(indexStart, block_index_lookup);
 			}
 			
+			MOODYCAMEL_CYCLES_START(publishStart);
 			this->tailIndex.store(newTailIndex, std::memory_order_release);
+			MOODYCAMEL_CYCLES_STOP(publishStart, tail_publish);
 			return true;
 		}
 		
@@ -2184,6 +3649,7 @@ private:
 				if (details::circular_less_than<size_t>(0, actualCount)) {
 					actualCount = desiredCount < actualCount ? desiredCount : actualCount;
 					if (actualCount < desiredCount) {
+						MOODYCAMEL_COUNT_CONTENTION(this->parent->contentionCounters, dequeue_overcommits);
 						this->dequeueOvercommit.fetch_add(desiredCount - actualCount, std::memory_order_release);
 					}
 					
@@ -2192,6 +3658,7 @@ private:
 					auto firstIndex = this->headIndex.fetch_add(actualCount, std::memory_order_acq_rel);
 					
 					// Determine which block the first element is in
+					MOODYCAMEL_CYCLES_START(lookupStart);
 					auto localBlockIndex = blockIndex.load(std::memory_order_acquire);
 					auto localBlockIndexHead = localBlockIndex->front.load(std::memory_order_acquire);
 					
@@ -2199,6 +3666,7 @@ private:
 					auto firstBlockBaseIndex = firstIndex & ~static_cast<index_t>(BLOCK_SIZE - 1);
 					auto offset = static_cast<size_t>(static_cast<typename std::make_signed<index_t>::type>(firstBlockBaseIndex - headBase) / BLOCK_SIZE);
 					auto indexIndex = (localBlockIndexHead + offset) & (localBlockIndex->size - 1);
+					MOODYCAMEL_CYCLES_STOP(lookupStart, block_index_lookup);
 					
 					// Iterate the blocks and dequeue
 					auto index = firstIndex;
@@ -2207,7 +3675,16 @@ private:
 						auto endIndex = (index & ~static_cast<index_t>(BLOCK_SIZE - 1)) + static_cast<index_t>(BLOCK_SIZE);
 						endIndex = details::circular_less_than<index_t>(firstIndex + static_cast<index_t>(actualCount), endIndex) ? firstIndex + static_cast<index_t>(actualCount) : endIndex;
 						auto block = localBlockIndex->entries[indexIndex].block;
-						if (MOODYCAMEL_NOEXCEPT_ASSIGN(T, T&&, details::deref_noexcept(itemFirst) = std::move((*(*block)[index])))) {
+						if (PREFETCH_NEXT_BLOCK && endIndex != firstIndex + static_cast<index_t>(actualCount)) {
+							localBlockIndex->entries[(indexIndex + 1) & (localBlockIndex->size - 1)].block->prefetch_for_dequeue(endIndex);
+						}
+						this->parent->record_residency(block, index, endIndex);
+						this->note_dequeued(index, endIndex);
+						if (details::bulk_memcpy<T, It>::can_copy_out) {
+							details::bulk_memcpy<T, It>::copy_out(itemFirst, (*block)[index], static_cast<size_t>(endIndex - index));
+							index = endIndex;
+						}
+						else if (MOODYCAMEL_NOEXCEPT_ASSIGN(T, T&&, details::deref_noexcept(itemFirst) = std::move((*(*block)[index])))) {
 							while (index != endIndex) {
 								auto& el = *((*block)[index]);
 								*itemFirst++ = std::move(el);
@@ -2234,7 +3711,7 @@ private:
 									while (index != endIndex) {
 										(*block)[index++]->~T();
 									}
-									block->ConcurrentQueue::Block::template set_many_empty<explicit_context>(firstIndexInBlock, static_cast<size_t>(endIndex - firstIndexInBlock));
+									set_dequeued(block, firstIndexInBlock, static_cast<size_t>(endIndex - firstIndexInBlock));
 									indexIndex = (indexIndex + 1) & (localBlockIndex->size - 1);
 									
 									firstIndexInBlock = index;
@@ -2245,7 +3722,7 @@ private:
 								MOODYCAMEL_RETHROW;
 							}
 						}
-						block->ConcurrentQueue::Block::template set_many_empty<explicit_context>(firstIndexInBlock, static_cast<size_t>(endIndex - firstIndexInBlock));
+						set_dequeued(block, firstIndexInBlock, static_cast<size_t>(endIndex - firstIndexInBlock));
 						indexIndex = (indexIndex + 1) & (localBlockIndex->size - 1);
 					} while (index != firstIndex + actualCount);
 					
@@ -2253,6 +3730,7 @@ private:
 				}
 				else {
 					// Wasn't anything to dequeue after all; make the effective dequeue count eventually consistent
+					MOODYCAMEL_COUNT_CONTENTION(this->parent->contentionCounters, dequeue_overcommits);
 					this->dequeueOvercommit.fetch_add(desiredCount, std::memory_order_release);
 				}
 			}
@@ -2282,11 +3760,13 @@ private:
 			
 			// Create the new block
 			pr_blockIndexSize <<= 1;
-			auto newRawPtr = static_cast<char*>((Traits::malloc)(sizeof(BlockIndexHeader) + std::alignment_of<BlockIndexEntry>::value - 1 + sizeof(BlockIndexEntry) * pr_blockIndexSize));
+			auto newRawSize = sizeof(BlockIndexHeader) + std::alignment_of<BlockIndexEntry>::value - 1 + sizeof(BlockIndexEntry) * pr_blockIndexSize;
+			auto newRawPtr = static_cast<char*>((Traits::malloc)(newRawSize));
 			if (newRawPtr == nullptr) {
 				pr_blockIndexSize >>= 1;		// Reset to allow graceful retry
 				return false;
 			}
+			this->parent->blockIndexBytes.fetch_add(newRawSize, std::memory_order_relaxed);
 			
 			auto newBlockIndexEntries = reinterpret_cast<BlockIndexEntry*>(details::align_for<BlockIndexEntry>(newRawPtr + sizeof(BlockIndexHeader)));
 			
@@ -2312,9 +3792,26 @@ private:
 			pr_blockIndexRaw = newRawPtr;
 			blockIndex.store(header, std::memory_order_release);
 			
+			MOODYCAMEL_PROBE4(block_index_grow, this->parent, this, pr_blockIndexSize, newRawSize);
 			return true;
 		}
 		
+	public:
+		std::atomic<size_t> blockCount;		// Blocks in the circular list (explicit producers never give any back)
+		
+		// Looks up the block an enqueued element is in, like dequeue does, or returns nullptr
+		// if the entry found isn't for that index (after concurrent dequeues)
+		inline Block const* peek_block(index_t index) const
+		{
+			auto localBlockIndex = blockIndex.load(std::memory_order_acquire);
+			auto localBlockIndexHead = localBlockIndex->front.load(std::memory_order_acquire);
+			auto headBase = localBlockIndex->entries[localBlockIndexHead].base;
+			auto blockBaseIndex = index & ~static_cast<index_t>(BLOCK_SIZE - 1);
+			auto offset = static_cast<size_t>(static_cast<typename std::make_signed<index_t>::type>(blockBaseIndex - headBase) / BLOCK_SIZE);
+			auto& entry = localBlockIndex->entries[(localBlockIndexHead + offset) & (localBlockIndex->size - 1)];
+			return entry.base == blockBaseIndex ? entry.block : nullptr;
+		}
+	
 	private:
 		std::atomic<BlockIndexHeader*> blockIndex;
 		
@@ -2345,6 +3842,7 @@ private:
 	{			
 		ImplicitProducer(ConcurrentQueue* parent) :
 			ProducerBase(parent, false),
+			ownerThread(details::invalid_thread_id),
 			nextBlockIndexCapacity(IMPLICIT_INITIAL_INDEX_SIZE),
 			blockIndex(nullptr)
 		{
@@ -2406,8 +3904,8 @@ private:
 			}
 		}
 		
-		template<AllocationMode allocMode, typename U>
-		inline bool enqueue(U&& element)
+		template<AllocationMode allocMode, typename... Args>
+		inline bool enqueue(Args&&... args)
 		{
 			index_t currentTailIndex = this->tailIndex.load(std::memory_order_relaxed);
 			index_t newTailIndex = 1 + currentTailIndex;
@@ -2439,10 +3937,10 @@ private:
 #endif
 				newBlock->ConcurrentQueue::Block::template reset_empty<implicit_context>();
 				
-				if (!MOODYCAMEL_NOEXCEPT_CTOR(T, U, new (nullptr) T(std::forward<U>(element)))) {
+				if (!MOODYCAMEL_NOEXCEPT_CTOR(T, typename details::emplace_value_type<T(Args...)>::type, new (nullptr) T(std::forward<Args>(args)...))) {
 					// May throw, try to insert now before we publish the fact that we have this new block
 					MOODYCAMEL_TRY {
-						new ((*newBlock)[currentTailIndex]) T(std::forward<U>(element));
+						new ((*newBlock)[currentTailIndex]) T(std::forward<Args>(args)...);
 					}
 					MOODYCAMEL_CATCH (...) {
 						rewind_block_index_tail();
@@ -2457,16 +3955,26 @@ private:
 				
 				this->tailBlock = newBlock;
 				
-				if (!MOODYCAMEL_NOEXCEPT_CTOR(T, U, new (nullptr) T(std::forward<U>(element)))) {
+				if (!MOODYCAMEL_NOEXCEPT_CTOR(T, typename details::emplace_value_type<T(Args...)>::type, new (nullptr) T(std::forward<Args>(args)...))) {
+					this->parent->stamp_residency(this->tailBlock, currentTailIndex);
+					this->note_enqueued(currentTailIndex, currentTailIndex + 1);
+					MOODYCAMEL_CYCLES_START(publishStart);
 					this->tailIndex.store(newTailIndex, std::memory_order_release);
+					MOODYCAMEL_CYCLES_STOP(publishStart, tail_publish);
 					return true;
 				}
 			}
 			
 			// Enqueue
-			new ((*this->tailBlock)[currentTailIndex]) T(std::forward<U>(element));
+			MOODYCAMEL_CYCLES_START(constructStart);
+			new ((*this->tailBlock)[currentTailIndex]) T(std::forward<Args>(args)...);
+			MOODYCAMEL_CYCLES_STOP(constructStart, element_construction);
 			
+			this->parent->stamp_residency(this->tailBlock, currentTailIndex);
+			this->note_enqueued(currentTailIndex, currentTailIndex + 1);
+			MOODYCAMEL_CYCLES_START(publishStart);
 			this->tailIndex.store(newTailIndex, std::memory_order_release);
+			MOODYCAMEL_CYCLES_STOP(publishStart, tail_publish);
 			return true;
 		}
 		
@@ -2489,6 +3997,8 @@ private:
 					
 					// Dequeue
 					auto block = entry->value.load(std::memory_order_relaxed);
+					this->parent->record_residency(block, index, index + 1);
+					this->note_dequeued(index, index + 1);
 					auto& el = *((*block)[index]);
 					
 					if (!MOODYCAMEL_NOEXCEPT_ASSIGN(T, T&&, element = std::move(el))) {
@@ -2509,6 +4019,7 @@ private:
 								if (block->ConcurrentQueue::Block::template set_empty<implicit_context>(index)) {
 									entry->value.store(nullptr, std::memory_order_relaxed);
 									parent->add_block_to_free_list(block);
+									parent->note_block_freed();
 								}
 							}
 						} guard = { block, index, entry, this->parent };
@@ -2528,12 +4039,14 @@ private:
 								entry->value.store(nullptr, std::memory_order_relaxed);
 							}
 							this->parent->add_block_to_free_list(block);		// releases the above store
+							this->parent->note_block_freed();
 						}
 					}
 					
 					return true;
 				}
 				else {
+					MOODYCAMEL_COUNT_CONTENTION(this->parent->contentionCounters, dequeue_overcommits);
 					this->dequeueOvercommit.fetch_add(1, std::memory_order_release);
 				}
 			}
@@ -2630,7 +4143,16 @@ private:
 				if (details::circular_less_than<index_t>(newTailIndex, stopIndex)) {
 					stopIndex = newTailIndex;
 				}
-				if (MOODYCAMEL_NOEXCEPT_CTOR(T, decltype(*itemFirst), new (nullptr) T(details::deref_noexcept(itemFirst)))) {
+				if (PREFETCH_NEXT_BLOCK && this->tailBlock != endBlock) {
+					this->tailBlock->next->prefetch_for_enqueue(stopIndex);
+				}
+				this->parent->stamp_residency(this->tailBlock, currentTailIndex, stopIndex);
+				this->note_enqueued(currentTailIndex, stopIndex);
+				if (details::bulk_memcpy<T, It>::can_copy_in) {
+					details::bulk_memcpy<T, It>::copy_in((*this->tailBlock)[currentTailIndex], itemFirst, static_cast<size_t>(stopIndex - currentTailIndex));
+					currentTailIndex = stopIndex;
+				}
+				else if (MOODYCAMEL_NOEXCEPT_CTOR(T, decltype(*itemFirst), new (nullptr) T(details::deref_noexcept(itemFirst)))) {
 					while (currentTailIndex != stopIndex) {
 						new ((*this->tailBlock)[currentTailIndex++]) T(*itemFirst++);
 					}
@@ -2638,7 +4160,7 @@ private:
 				else {
 					MOODYCAMEL_TRY {
 						while (currentTailIndex != stopIndex) {
-							new ((*this->tailBlock)[currentTailIndex]) T(details::nomove_if<(bool)!MOODYCAMEL_NOEXCEPT_CTOR(T, decltype(*itemFirst), new (nullptr) T(details::deref_noexcept(itemFirst)))>::eval(*itemFirst));
+							details::bulk_construct<(bool)!MOODYCAMEL_NOEXCEPT_CTOR(T, decltype(*itemFirst), new (nullptr) T(details::deref_noexcept(itemFirst))), !std::is_reference<decltype(*itemFirst)>::value>::eval((*this->tailBlock)[currentTailIndex], itemFirst);
 							++currentTailIndex;
 							++itemFirst;
 						}
@@ -2646,6 +4168,7 @@ private:
 					MOODYCAMEL_CATCH (...) {
 						auto constructedStopIndex = currentTailIndex;
 						auto lastBlockEnqueued = this->tailBlock;
+						this->unnote_enqueued(startTailIndex, stopIndex);
 						
 						if (!details::is_trivially_destructible<T>::value) {
 							auto block = startBlock;
@@ -2687,7 +4210,9 @@ private:
 				}
 				this->tailBlock = this->tailBlock->next;
 			}
+			MOODYCAMEL_CYCLES_START(publishStart);
 			this->tailIndex.store(newTailIndex, std::memory_order_release);
+			MOODYCAMEL_CYCLES_STOP(publishStart, tail_publish);
 			return true;
 		}
 		
@@ -2708,6 +4233,7 @@ private:
 				if (details::circular_less_than<size_t>(0, actualCount)) {
 					actualCount = desiredCount < actualCount ? desiredCount : actualCount;
 					if (actualCount < desiredCount) {
+						MOODYCAMEL_COUNT_CONTENTION(this->parent->contentionCounters, dequeue_overcommits);
 						this->dequeueOvercommit.fetch_add(desiredCount - actualCount, std::memory_order_release);
 					}
 					
@@ -2726,7 +4252,16 @@ private:
 						
 						auto entry = localBlockIndex->index[indexIndex];
 						auto block = entry->value.load(std::memory_order_relaxed);
-						if (MOODYCAMEL_NOEXCEPT_ASSIGN(T, T&&, details::deref_noexcept(itemFirst) = std::move((*(*block)[index])))) {
+						if (PREFETCH_NEXT_BLOCK && endIndex != firstIndex + static_cast<index_t>(actualCount)) {
+							localBlockIndex->index[(indexIndex + 1) & (localBlockIndex->capacity - 1)]->value.load(std::memory_order_relaxed)->prefetch_for_dequeue(endIndex);
+						}
+						this->parent->record_residency(block, index, endIndex);
+						this->note_dequeued(index, endIndex);
+						if (details::bulk_memcpy<T, It>::can_copy_out) {
+							details::bulk_memcpy<T, It>::copy_out(itemFirst, (*block)[index], static_cast<size_t>(endIndex - index));
+							index = endIndex;
+						}
+						else if (MOODYCAMEL_NOEXCEPT_ASSIGN(T, T&&, details::deref_noexcept(itemFirst) = std::move((*(*block)[index])))) {
 							while (index != endIndex) {
 								auto& el = *((*block)[index]);
 								*itemFirst++ = std::move(el);
@@ -2758,6 +4293,7 @@ private:
 #endif
 										entry->value.store(nullptr, std::memory_order_relaxed);
 										this->parent->add_block_to_free_list(block);
+										this->parent->note_block_freed();
 									}
 									indexIndex = (indexIndex + 1) & (localBlockIndex->capacity - 1);
 									
@@ -2779,6 +4315,7 @@ private:
 								entry->value.store(nullptr, std::memory_order_relaxed);
 							}
 							this->parent->add_block_to_free_list(block);		// releases the above store
+							this->parent->note_block_freed();
 						}
 						indexIndex = (indexIndex + 1) & (localBlockIndex->capacity - 1);
 					} while (index != firstIndex + actualCount);
@@ -2786,6 +4323,7 @@ private:
 					return actualCount;
 				}
 				else {
+					MOODYCAMEL_COUNT_CONTENTION(this->parent->contentionCounters, dequeue_overcommits);
 					this->dequeueOvercommit.fetch_add(desiredCount, std::memory_order_release);
 				}
 			}
@@ -2815,6 +4353,7 @@ private:
 		template<AllocationMode allocMode>
 		inline bool insert_block_index_entry(BlockIndexEntry*& idxEntry, index_t blockStartIndex)
 		{
+			MOODYCAMEL_CYCLES_START(lookupStart);
 			auto localBlockIndex = blockIndex.load(std::memory_order_relaxed);		// We're the only writer thread, relaxed is OK
 			if (localBlockIndex == nullptr) {
 				return false;  // this can happen if new_block_index failed in the constructor
@@ -2826,6 +4365,7 @@ private:
 				
 				idxEntry->key.store(blockStartIndex, std::memory_order_relaxed);
 				localBlockIndex->tail.store(newTail, std::memory_order_release);
+				MOODYCAMEL_CYCLES_STOP(lookupStart, block_index_lookup);
 				return true;
 			}
 			
@@ -2839,6 +4379,7 @@ private:
 			assert(idxEntry->key.load(std::memory_order_relaxed) == INVALID_BLOCK_BASE);
 			idxEntry->key.store(blockStartIndex, std::memory_order_relaxed);
 			localBlockIndex->tail.store(newTail, std::memory_order_release);
+			MOODYCAMEL_CYCLES_STOP(lookupStart, block_index_lookup);
 			return true;
 		}
 		
@@ -2860,6 +4401,7 @@ private:
 #if MCDBGQ_NOLOCKFREE_IMPLICITPRODBLOCKINDEX
 			debug::DebugLock lock(mutex);
 #endif
+			MOODYCAMEL_CYCLES_START(lookupStart);
 			index &= ~static_cast<index_t>(BLOCK_SIZE - 1);
 			localBlockIndex = blockIndex.load(std::memory_order_acquire);
 			auto tail = localBlockIndex->tail.load(std::memory_order_acquire);
@@ -2870,6 +4412,7 @@ private:
 			auto offset = static_cast<size_t>(static_cast<typename std::make_signed<index_t>::type>(index - tailBase) / BLOCK_SIZE);
 			size_t idx = (tail + offset) & (localBlockIndex->capacity - 1);
 			assert(localBlockIndex->index[idx]->key.load(std::memory_order_relaxed) == index && localBlockIndex->index[idx]->value.load(std::memory_order_relaxed) != nullptr);
+			MOODYCAMEL_CYCLES_STOP(lookupStart, block_index_lookup);
 			return idx;
 		}
 		
@@ -2878,13 +4421,14 @@ private:
 			auto prev = blockIndex.load(std::memory_order_relaxed);
 			size_t prevCapacity = prev == nullptr ? 0 : prev->capacity;
 			auto entryCount = prev == nullptr ? nextBlockIndexCapacity : prevCapacity;
-			auto raw = static_cast<char*>((Traits::malloc)(
-				sizeof(BlockIndexHeader) +
+			auto rawSize = sizeof(BlockIndexHeader) +
 				std::alignment_of<BlockIndexEntry>::value - 1 + sizeof(BlockIndexEntry) * entryCount +
-				std::alignment_of<BlockIndexEntry*>::value - 1 + sizeof(BlockIndexEntry*) * nextBlockIndexCapacity));
+				std::alignment_of<BlockIndexEntry*>::value - 1 + sizeof(BlockIndexEntry*) * nextBlockIndexCapacity;
+			auto raw = static_cast<char*>((Traits::malloc)(rawSize));
 			if (raw == nullptr) {
 				return false;
 			}
+			this->parent->blockIndexBytes.fetch_add(rawSize, std::memory_order_relaxed);
 			
 			auto header = new (raw) BlockIndexHeader;
 			auto entries = reinterpret_cast<BlockIndexEntry*>(details::align_for<BlockIndexEntry>(raw + sizeof(BlockIndexHeader)));
@@ -2911,12 +4455,36 @@ private:
 			header->tail.store((prevCapacity - 1) & (nextBlockIndexCapacity - 1), std::memory_order_relaxed);
 			
 			blockIndex.store(header, std::memory_order_release);
+			MOODYCAMEL_PROBE4(block_index_grow, this->parent, this, nextBlockIndexCapacity, rawSize);
 			
 			nextBlockIndexCapacity <<= 1;
 			
 			return true;
 		}
 		
+	public:
+		std::atomic<details::thread_id_t> ownerThread;		// Set while the producer belongs to a thread
+		
+		// Looks up the block an enqueued element is in, like get_block_index_entry_for_index
+		// but without asserting that it's still there; returns nullptr if it isn't (after
+		// concurrent dequeues)
+		inline Block const* peek_block(index_t index) const
+		{
+#if MCDBGQ_NOLOCKFREE_IMPLICITPRODBLOCKINDEX
+			debug::DebugLock lock(mutex);
+#endif
+			index &= ~static_cast<index_t>(BLOCK_SIZE - 1);
+			auto localBlockIndex = blockIndex.load(std::memory_order_acquire);
+			auto tail = localBlockIndex->tail.load(std::memory_order_acquire);
+			auto tailBase = localBlockIndex->index[tail]->key.load(std::memory_order_relaxed);
+			if (tailBase == INVALID_BLOCK_BASE) {
+				return nullptr;
+			}
+			auto offset = static_cast<size_t>(static_cast<typename std::make_signed<index_t>::type>(index - tailBase) / BLOCK_SIZE);
+			auto entry = localBlockIndex->index[(tail + offset) & (localBlockIndex->capacity - 1)];
+			return entry->key.load(std::memory_order_relaxed) == index ? entry->value.load(std::memory_order_acquire) : nullptr;
+		}
+	
 	private:
 		size_t nextBlockIndexCapacity;
 		std::atomic<BlockIndexHeader*> blockIndex;
@@ -2942,6 +4510,53 @@ private:
 	};
 	
 	
+	//////////////////////////////////
+	// Residency sampling
+	//////////////////////////////////
+	
+	inline void stamp_residency(Block* block, index_t index)
+	{
+		if (RESIDENCY_SAMPLE_INTERVAL != 0 && (index & static_cast<index_t>(RESIDENCY_SAMPLE_INTERVAL - 1)) == 0) {
+			stamp_slot(block, index) = details::residency_ticks();
+		}
+	}
+	
+	// Stamps the sampled elements in [first, end), which must all be in the given block
+	inline void stamp_residency(Block* block, index_t first, index_t end)
+	{
+		if (RESIDENCY_SAMPLE_INTERVAL != 0) {
+			index_t index = (first + static_cast<index_t>(RESIDENCY_SAMPLE_INTERVAL - 1)) & ~static_cast<index_t>(RESIDENCY_SAMPLE_INTERVAL - 1);
+			if (details::circular_less_than<index_t>(index, end)) {
+				auto now = details::residency_ticks();
+				for (; details::circular_less_than<index_t>(index, end); index += static_cast<index_t>(RESIDENCY_SAMPLE_INTERVAL)) {
+					stamp_slot(block, index) = now;
+				}
+			}
+		}
+	}
+	
+	// Records the residencies of the sampled elements in [first, end), which must all
+	// be in the given block (and not dequeued yet)
+	inline void record_residency(Block* block, index_t first, index_t end)
+	{
+		if (RESIDENCY_SAMPLE_INTERVAL != 0 && residencyHistogram != nullptr) {
+			index_t index = (first + static_cast<index_t>(RESIDENCY_SAMPLE_INTERVAL - 1)) & ~static_cast<index_t>(RESIDENCY_SAMPLE_INTERVAL - 1);
+			if (details::circular_less_than<index_t>(index, end)) {
+				auto now = details::residency_ticks();
+				for (; details::circular_less_than<index_t>(index, end); index += static_cast<index_t>(RESIDENCY_SAMPLE_INTERVAL)) {
+					auto enqueuedAt = stamp_slot(block, index);
+					residencyHistogram->record(now > enqueuedAt ? now - enqueuedAt : 0);
+				}
+			}
+		}
+	}
+	
+	static inline std::uint64_t& stamp_slot(Block* block, index_t index)
+	{
+		return block->enqueued_at(static_cast<size_t>(index & static_cast<index_t>(BLOCK_SIZE - 1)) / (RESIDENCY_SAMPLE_INTERVAL == 0 ? 1 : RESIDENCY_SAMPLE_INTERVAL));
+	}
+	
+	
 	//////////////////////////////////
 	// Block pool manipulation
 	//////////////////////////////////
@@ -2979,9 +4594,19 @@ private:
 #if MCDBGQ_TRACKMEM
 		block->owner = nullptr;
 #endif
+		ownedBlockCount.fetch_sub(1, std::memory_order_relaxed);
 		freeList.add(block);
 	}
 	
+	// Called whenever dequeueing empties out a block, i.e. whenever there may be room
+	// again for an enqueue that failed for lack of it
+	inline void note_block_freed()
+	{
+		if (blockFreedCallback != nullptr) {
+			blockFreedCallback(blockFreedUserData);
+		}
+	}
+	
 	inline void add_blocks_to_free_list(Block* block)
 	{
 		while (block != nullptr) {
@@ -2993,7 +4618,10 @@ private:
 	
 	inline Block* try_get_block_from_free_list()
 	{
-		return freeList.try_get();
+		MOODYCAMEL_CYCLES_START(popStart);
+		auto block = freeList.try_get();
+		MOODYCAMEL_CYCLES_STOP(popStart, free_list_pop);
+		return block;
 	}
 	
 	// Gets a free block from one of the memory pools, or allocates a new one (if applicable)
@@ -3001,20 +4629,25 @@ private:
 	Block* requisition_block()
 	{
 		auto block = try_get_block_from_initial_pool();
-		if (block != nullptr) {
-			return block;
+		if (block == nullptr) {
+			block = try_get_block_from_free_list();
 		}
-		
-		block = try_get_block_from_free_list();
-		if (block != nullptr) {
-			return block;
+		if (block == nullptr && canAlloc == CanAlloc) {
+			block = create<Block>();
+			if (block != nullptr) {
+				dynamicBlockCount.fetch_add(1, std::memory_order_relaxed);
+				MOODYCAMEL_PROBE2(block_alloc, this, initialBlockPoolSize + dynamicBlockCount.load(std::memory_order_relaxed));
+			}
 		}
-		
-		if (canAlloc == CanAlloc) {
-			return create<Block>();
+		if (block != nullptr) {
+			auto owned = ownedBlockCount.fetch_add(1, std::memory_order_relaxed) + 1;
+			auto peak = peakOwnedBlockCount.load(std::memory_order_relaxed);
+			while (owned > peak && !peakOwnedBlockCount.compare_exchange_weak(peak, owned, std::memory_order_relaxed, std::memory_order_relaxed)) {
+				continue;
+			}
+			MOODYCAMEL_PROBE2(block_requisition, this, owned);
 		}
-		
-		return nullptr;
+		return block;
 	}
 	
 
@@ -3163,6 +4796,9 @@ private:
 		}
 		
 		producerCount.fetch_add(1, std::memory_order_relaxed);
+		if (producer->isExplicit) {
+			explicitProducerCount.fetch_add(1, std::memory_order_relaxed);
+		}
 		
 		// Add it to the lock-free list
 		auto prevTail = producerListTail.load(std::memory_order_relaxed);
@@ -3350,6 +4986,7 @@ private:
 				if (probedKey == details::invalid_thread_id) {
 					break;		// Not in this hash table
 				}
+				MOODYCAMEL_COUNT_CONTENTION(contentionCounters, implicit_hash_probes);
 				++index;
 			}
 		}
@@ -3406,6 +5043,8 @@ private:
 				if (recycled) {
 					implicitProducerHashCount.fetch_sub(1, std::memory_order_relaxed);
 				}
+				producer->ownerThread.store(id, std::memory_order_relaxed);
+				MOODYCAMEL_PROBE4(implicit_producer_create, this, producer, recycled ? 1 : 0, producerCount.load(std::memory_order_relaxed));
 				
 #ifdef MOODYCAMEL_CPP11_THREAD_LOCAL_SUPPORTED
 				producer->threadExitListener.callback = &ConcurrentQueue::implicit_producer_thread_exited_callback;
@@ -3429,6 +5068,7 @@ private:
 						mainHash->entries[index].value = producer;
 						break;
 					}
+					MOODYCAMEL_COUNT_CONTENTION(contentionCounters, implicit_hash_probes);
 					++index;
 				}
 				return producer;
@@ -3473,6 +5113,7 @@ private:
 		}
 		
 		// Mark the queue as being recyclable
+		producer->ownerThread.store(details::invalid_thread_id, std::memory_order_relaxed);
 		producer->inactive.store(true, std::memory_order_release);
 	}
 	
@@ -3522,11 +5163,11 @@ private:
 		return p != nullptr ? new (p) U : nullptr;
 	}
 	
-	template<typename U, typename A1>
-	static inline U* create(A1&& a1)
+	template<typename U, typename A1, typename... Args>
+	static inline U* create(A1&& a1, Args&&... args)
 	{
 		auto p = (Traits::malloc)(sizeof(U));
-		return p != nullptr ? new (p) U(std::forward<A1>(a1)) : nullptr;
+		return p != nullptr ? new (p) U(std::forward<A1>(a1), std::forward<Args>(args)...) : nullptr;
 	}
 	
 	template<typename U>
@@ -3541,11 +5182,37 @@ private:
 private:
 	std::atomic<ProducerBase*> producerListTail;
 	std::atomic<std::uint32_t> producerCount;
+	std::atomic<std::uint32_t> explicitProducerCount;
 	
 	std::atomic<size_t> initialBlockPoolIndex;
 	Block* initialBlockPool;
 	size_t initialBlockPoolSize;
 	
+	// Maintained for stats(): blocks allocated beyond the initial pool, blocks currently
+	// (and at most ever) held by producers, and bytes of producer block indices
+	std::atomic<size_t> dynamicBlockCount;
+	std::atomic<size_t> ownedBlockCount;
+	std::atomic<size_t> peakOwnedBlockCount;
+	std::atomic<size_t> blockIndexBytes;
+	
+	// Where sampled residencies are recorded (if RESIDENCY_SAMPLE_INTERVAL isn't 0)
+	details::log_linear_histogram* residencyHistogram;
+
+	// Set up by set_watermarks, if at all
+	details::watermark_monitor* watermarks;
+	
+	// Set up by BlockingConcurrentQueue, for its producers waiting for room (see note_block_freed)
+	void (*blockFreedCallback)(void*);
+	void* blockFreedUserData;
+	
+	// Whole blocks' worth of elements (see SIZE_COUNTER_SHARDS)
+	details::sharded_counter<SIZE_COUNTER_SHARDS> sizeCounter;
+
+#ifdef MOODYCAMEL_CONTENTION_COUNTERS
+	// Where retries in the contended paths are counted (see contention_stats)
+	details::contention_counters contentionCounters;
+#endif
+
 #if !MCDBGQ_USEDEBUGFREELIST
 	FreeList<Block> freeList;
 #else
@@ -3581,8 +5248,8 @@ ProducerToken::ProducerToken(ConcurrentQueue<T, Traits>& queue)
 	}
 }
 
-template<typename T, typename Traits>
-ProducerToken::ProducerToken(BlockingConcurrentQueue<T, Traits>& queue)
+template<typename T, typename Traits, typename WaitStrategy>
+ProducerToken::ProducerToken(BlockingConcurrentQueue<T, Traits, WaitStrategy>& queue)
 	: producer(reinterpret_cast<ConcurrentQueue<T, Traits>*>(&queue)->recycle_or_create_producer(true))
 {
 	if (producer != nullptr) {
@@ -3592,15 +5259,15 @@ ProducerToken::ProducerToken(BlockingConcurrentQueue<T, Traits>& queue)
 
 template<typename T, typename Traits>
 ConsumerToken::ConsumerToken(ConcurrentQueue<T, Traits>& queue)
-	: itemsConsumedFromCurrent(0), currentProducer(nullptr), desiredProducer(nullptr)
+	: itemsConsumedFromCurrent(0), rotationQuota(ConcurrentQueue<T, Traits>::EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE), currentProducer(nullptr), desiredProducer(nullptr)
 {
 	initialOffset = queue.nextExplicitConsumerId.fetch_add(1, std::memory_order_release);
 	lastKnownGlobalOffset = -1;
 }
 
-template<typename T, typename Traits>
-ConsumerToken::ConsumerToken(BlockingConcurrentQueue<T, Traits>& queue)
-	: itemsConsumedFromCurrent(0), currentProducer(nullptr), desiredProducer(nullptr)
+template<typename T, typename Traits, typename WaitStrategy>
+ConsumerToken::ConsumerToken(BlockingConcurrentQueue<T, Traits, WaitStrategy>& queue)
+	: itemsConsumedFromCurrent(0), rotationQuota(ConcurrentQueue<T, Traits>::EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE), currentProducer(nullptr), desiredProducer(nullptr)
 {
 	initialOffset = reinterpret_cast<ConcurrentQueue<T, Traits>*>(&queue)->nextExplicitConsumerId.fetch_add(1, std::memory_order_release);
 	lastKnownGlobalOffset = -1;
@@ -11,6 +11,8 @@
 #include <cstdlib>
 #include <cstring>
 #include <string>
+#include <functional>
+#include <algorithm>
 #include <cstddef>
 #include <string>
 
@@ -27,6 +29,10 @@
 #include "../../concurrentqueue.h"
 #include "../../blockingconcurrentqueue.h"
 
+#ifdef MOODYCAMEL_HAS_EVENTFD
+#include <sys/resource.h>
+#endif
+
 namespace {
 	struct tracking_allocator
 	{
@@ -85,6 +91,12 @@ struct MallocTrackingTraits : public ConcurrentQueueDefaultTraits
 	static inline void free(void* ptr) { tracking_allocator::free(ptr); }
 };
 
+struct ShardedSizeTraits : public MallocTrackingTraits
+{
+	static const size_t BLOCK_SIZE = 8;
+	static const size_t SIZE_COUNTER_SHARDS = 4;
+};
+
 template<std::size_t BlockSize = ConcurrentQueueDefaultTraits::BLOCK_SIZE, std::size_t InitialIndexSize = ConcurrentQueueDefaultTraits::EXPLICIT_INITIAL_INDEX_SIZE>
 struct TestTraits : public MallocTrackingTraits
 {
@@ -105,6 +117,13 @@ struct TestTraits : public MallocTrackingTraits
 	static inline void free(void* obj) { ++_free_count(); return tracking_allocator::free(obj); }
 };
 
+// Keeps the empty flags (rather than the counter) for blocks of up to 128 elements
+template<std::size_t BlockSize>
+struct EmptyFlagTraits : public TestTraits<BlockSize>
+{
+	static const std::size_t EXPLICIT_BLOCK_EMPTY_COUNTER_THRESHOLD = 128;
+};
+
 struct SmallIndexTraits : public MallocTrackingTraits
 {
 	typedef uint16_t size_t;
@@ -252,6 +271,70 @@ public:
 	bool throwOnSecondCctor;
 };
 
+// Can only be constructed in place (but can be assigned to, so that it can be dequeued)
+struct Emplaceable {
+	Emplaceable() : id(-1), assigned(false) { }
+	Emplaceable(int a, int b) : id(a + b), assigned(false) { }
+	Emplaceable(Emplaceable const&) MOODYCAMEL_DELETE_FUNCTION;
+	Emplaceable(Emplaceable&&) MOODYCAMEL_DELETE_FUNCTION;
+	void operator=(Emplaceable&& o) { id = o.id; assigned = true; }
+	int id;
+	bool assigned;
+};
+
+#ifdef MOODYCAMEL_HAS_COROUTINES
+// Just enough of a coroutine type to test async_dequeue with: runs eagerly,
+// and is destroyed when it finishes
+struct DetachedTask {
+	struct promise_type {
+		DetachedTask get_return_object() { return DetachedTask(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() { }
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+// Runs jobs on a couple of worker threads
+struct PoolExecutor {
+	struct Pool {
+		BlockingConcurrentQueue<std::function<void()>> jobs;
+		SimpleThread workers[2];
+		
+		Pool()
+		{
+			for (int i = 0; i != 2; ++i) {
+				workers[i] = SimpleThread([this]() {
+					std::function<void()> job;
+					while (true) {
+						jobs.wait_dequeue(job);
+						if (!job) {
+							return;
+						}
+						job();
+					}
+				});
+			}
+		}
+		
+		~Pool()
+		{
+			for (int i = 0; i != 2; ++i) {
+				jobs.enqueue(std::function<void()>());
+			}
+			for (int i = 0; i != 2; ++i) {
+				workers[i].join();
+			}
+		}
+	};
+	
+	Pool* pool;
+	
+	template<typename F>
+	void operator()(F&& f) const { pool->jobs.enqueue(std::function<void()>(std::forward<F>(f))); }
+};
+#endif
+
 
 class ConcurrentQueueTests : public TestClass<ConcurrentQueueTests>
 {
@@ -270,15 +353,27 @@ public:
 		REGISTER_TEST(block_alloc);
 		REGISTER_TEST(token_move);
 		REGISTER_TEST(multi_producers);
+		REGISTER_TEST(adaptive_rotation);
 		REGISTER_TEST(producer_reuse);
 		REGISTER_TEST(block_reuse);
+		REGISTER_TEST(explicit_empty_flags);
 		REGISTER_TEST(block_recycling);
 		REGISTER_TEST(leftovers_destroyed);
 		REGISTER_TEST(block_index_resized);
+		REGISTER_TEST(queue_stats);
+		REGISTER_TEST(residency_sampling);
+		REGISTER_TEST(contention_counters);
+		REGISTER_TEST(producer_introspection);
+		REGISTER_TEST(watermarks);
+		REGISTER_TEST(sharded_size_counters);
+		REGISTER_TEST(peek_and_snapshot);
+		REGISTER_TEST(cycle_accounting);
 		REGISTER_TEST(try_dequeue);
 		REGISTER_TEST(try_dequeue_threaded);
 		REGISTER_TEST(try_dequeue_bulk);
 		REGISTER_TEST(try_dequeue_bulk_threaded);
+		REGISTER_TEST(trivially_copyable_bulk);
+		REGISTER_TEST(prefetch_next_block);
 		REGISTER_TEST(implicit_producer_hash);
 		REGISTER_TEST(index_wrapping);
 		REGISTER_TEST(subqueue_size_limit);
@@ -289,6 +384,19 @@ public:
 		REGISTER_TEST(full_api<SmallIndexTraits>);
 		REGISTER_TEST(blocking_wrappers);
 		REGISTER_TEST(timed_blocking_wrappers);
+		REGISTER_TEST(kernel_semaphore);
+		REGISTER_TEST(sema_spinning);
+		REGISTER_TEST(mixed_consumers);
+		REGISTER_TEST(spin_on_pending);
+		REGISTER_TEST(wait_strategies);
+		REGISTER_TEST(signal_coalescing);
+		REGISTER_TEST(bulk_wake_batch);
+		REGISTER_TEST(blocking_bulk_min);
+		REGISTER_TEST(blocking_enqueue);
+		REGISTER_TEST(wait_dequeue_any);
+		REGISTER_TEST(eventfd_drain);
+		REGISTER_TEST(async_dequeue);
+		REGISTER_TEST(emplace);
 		
 		// Core algos
 		REGISTER_TEST(core_add_only_list);
@@ -1125,6 +1233,111 @@ public:
 		return true;
 	}
 	
+	struct AdaptiveRotationTraits : public MallocTrackingTraits
+	{
+		static const std::uint32_t EXPLICIT_CONSUMER_CONSUMPTION_QUOTA_BEFORE_ROTATE = 16;
+		static const bool ADAPTIVE_CONSUMER_ROTATION = true;
+	};
+	
+	bool adaptive_rotation()
+	{
+		typedef ConcurrentQueue<int, AdaptiveRotationTraits> Queue;
+		int item;
+		
+		// A deep backlog extends the quota instead of rotating, up to 16x
+		{
+			Queue q;
+			ProducerToken p(q);
+			for (int i = 0; i != 10000; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(p, i));
+			}
+			ConsumerToken t(q);
+			for (int i = 0; i != 16 * 3; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(t, item));
+				ASSERT_OR_FAIL(item == i);
+			}
+			ASSERT_OR_FAIL(t.rotationQuota == 64);
+			ASSERT_OR_FAIL(q.globalExplicitConsumerOffset.load() == 0);
+			for (int i = 16 * 3; i != 16 * 16 - 1; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(t, item));
+				ASSERT_OR_FAIL(item == i);
+			}
+			ASSERT_OR_FAIL(t.rotationQuota == 256);
+			ASSERT_OR_FAIL(q.globalExplicitConsumerOffset.load() == 0);
+			
+			// Once the bound is reached, the rotation happens anyway
+			ASSERT_OR_FAIL(q.try_dequeue(t, item));
+			ASSERT_OR_FAIL(q.globalExplicitConsumerOffset.load() == 1);
+		}
+		
+		// A producer running dry resets the quota
+		{
+			Queue q;
+			ProducerToken p(q);
+			ConsumerToken t(q);
+			for (int i = 0; i != 100; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(p, i));
+			}
+			for (int i = 0; i != 40; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(t, item));
+			}
+			ASSERT_OR_FAIL(t.rotationQuota == 64);
+			std::vector<int> items(100);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(t, items.begin(), 100) == 60);
+			ASSERT_OR_FAIL(t.rotationQuota == 16);
+			ASSERT_OR_FAIL(q.globalExplicitConsumerOffset.load() == 0);
+		}
+		
+		// Nothing gets lost or duplicated with skewed producers and several consumers
+		{
+			Queue q;
+			const int producers = 4;
+			const int perProducer[producers] = { 20000, 2000, 200, 20 };
+			std::vector<SimpleThread> threads;
+			std::vector<std::vector<bool>> seen(producers);
+			std::atomic<int> remaining(20000 + 2000 + 200 + 20);
+			for (int i = 0; i != producers; ++i) {
+				seen[i].resize(perProducer[i]);
+				threads.push_back(SimpleThread([&](int id) {
+					ProducerToken p(q);
+					for (int j = 0; j != perProducer[id]; ++j) {
+						q.enqueue(p, id << 24 | j);
+					}
+				}, i));
+			}
+			std::vector<std::vector<int>> dequeued(3);
+			for (int i = 0; i != 3; ++i) {
+				threads.push_back(SimpleThread([&](int id) {
+					ConsumerToken t(q);
+					int value;
+					while (remaining.load(std::memory_order_relaxed) > 0) {
+						if (q.try_dequeue(t, value)) {
+							dequeued[id].push_back(value);
+							remaining.fetch_sub(1, std::memory_order_relaxed);
+						}
+					}
+				}, i));
+			}
+			for (auto& thread : threads) {
+				thread.join();
+			}
+			for (auto& values : dequeued) {
+				for (int value : values) {
+					int producer = value >> 24, index = value & 0xFFFFFF;
+					ASSERT_OR_FAIL(!seen[producer][index]);
+					seen[producer][index] = true;
+				}
+			}
+			for (int i = 0; i != producers; ++i) {
+				for (int j = 0; j != perProducer[i]; ++j) {
+					ASSERT_OR_FAIL(seen[i][j]);
+				}
+			}
+		}
+		
+		return true;
+	}
+	
 	bool producer_reuse()
 	{
 		typedef TestTraits<16> Traits;
@@ -1424,6 +1637,50 @@ public:
 		return true;
 	}
 	
+	template<std::size_t BlockSize>
+	bool explicit_empty_flags_for_block_size()
+	{
+		// Two preallocated blocks; try_enqueue only succeeds if drained blocks are seen as empty
+		const int blockSize = (int)BlockSize;
+		ConcurrentQueue<int, EmptyFlagTraits<BlockSize>> q(BlockSize * 2);
+		ProducerToken t(q);
+		std::vector<int> items(BlockSize * 2);
+		for (int round = 0; round != 3; ++round) {
+			for (int i = 0; i != blockSize * 2; ++i) {
+				ASSERT_OR_FAIL(q.try_enqueue(t, i));
+			}
+			ASSERT_OR_FAIL(!q.try_enqueue(t, -1));
+			
+			// Bulk dequeues in odd-sized chunks straddle flag word boundaries
+			int dequeued = 0;
+			while (dequeued != blockSize) {
+				int chunk = std::min(7, blockSize - dequeued);
+				ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(t, items.begin(), (std::size_t)chunk) == (std::size_t)chunk);
+				for (int i = 0; i != chunk; ++i) {
+					ASSERT_OR_FAIL(items[(std::size_t)i] == dequeued + i);
+				}
+				dequeued += chunk;
+			}
+			for (int i = 0; i != blockSize; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue_from_producer(t, items[0]));
+				ASSERT_OR_FAIL(items[0] == blockSize + i);
+			}
+			ASSERT_OR_FAIL(!q.try_dequeue_from_producer(t, items[0]));
+		}
+		return true;
+	}
+	
+	bool explicit_empty_flags()
+	{
+		// One partial flag word, exactly one word, several words, and the counter fallback
+		ASSERT_OR_FAIL(explicit_empty_flags_for_block_size<2>());
+		ASSERT_OR_FAIL(explicit_empty_flags_for_block_size<16>());
+		ASSERT_OR_FAIL(explicit_empty_flags_for_block_size<64>());
+		ASSERT_OR_FAIL(explicit_empty_flags_for_block_size<128>());
+		ASSERT_OR_FAIL(explicit_empty_flags_for_block_size<256>());
+		return true;
+	}
+	
 	bool block_recycling()
 	{
 		typedef TestTraits<4> SmallBlocks;
@@ -1660,1134 +1917,1639 @@ public:
 		return true;
 	}
 	
-	bool try_dequeue()
+	bool queue_stats()
 	{
-		ConcurrentQueue<int, MallocTrackingTraits> q;
+		typedef TestTraits<4> Traits;
+		ConcurrentQueue<int, Traits> q(8);
+		auto stats = q.stats();
+		ASSERT_OR_FAIL(stats.allocatedBlocks == 2);
+		ASSERT_OR_FAIL(stats.freeBlocks == 2);
+		ASSERT_OR_FAIL(stats.usedBlocks == 0);
+		ASSERT_OR_FAIL(stats.peakUsedBlocks == 0);
+		ASSERT_OR_FAIL(stats.explicitProducers == 0);
+		ASSERT_OR_FAIL(stats.implicitProducers == 0);
+		ASSERT_OR_FAIL(stats.blockIndexBytes == 0);
+		
+		// Implicit producers hand their blocks back as they're emptied
+		for (int i = 0; i != 12; ++i) {
+			ASSERT_OR_FAIL(q.enqueue(i));
+		}
+		stats = q.stats();
+		ASSERT_OR_FAIL(stats.allocatedBlocks == 3);
+		ASSERT_OR_FAIL(stats.freeBlocks == 0);
+		ASSERT_OR_FAIL(stats.usedBlocks == 3);
+		ASSERT_OR_FAIL(stats.peakUsedBlocks == 3);
+		ASSERT_OR_FAIL(stats.implicitProducers == 1);
+		ASSERT_OR_FAIL(stats.blockIndexBytes > 0);
+		size_t implicitIndexBytes = stats.blockIndexBytes;
 		int item;
+		for (int i = 0; i != 12; ++i) {
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+		}
+		stats = q.stats();
+		ASSERT_OR_FAIL(stats.allocatedBlocks == 3);
+		ASSERT_OR_FAIL(stats.freeBlocks == 3);
+		ASSERT_OR_FAIL(stats.usedBlocks == 0);
+		ASSERT_OR_FAIL(stats.peakUsedBlocks == 3);
 		
-		// Producer token
+		// Explicit producers keep theirs
 		{
-			for (int i = 0; i != 50; ++i) {
-				ProducerToken t(q);
-				for (int j = 0; j != 100; ++j) {
-					ASSERT_OR_FAIL(q.enqueue(t, i * 100 + j));
-				}
+			ProducerToken tok(q);
+			for (int i = 0; i != 8; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(tok, i));
 			}
-			
-			
-			for (int i = 0; i != 50; ++i) {
-				for (int j = 0; j != 100; ++j) {
-					ASSERT_OR_FAIL(q.try_dequeue(item));
-					ASSERT_OR_FAIL(item == i * 100 + j);
-				}
+			for (int i = 0; i != 8; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item));
 			}
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
 		}
+		stats = q.stats();
+		ASSERT_OR_FAIL(stats.allocatedBlocks == 3);
+		ASSERT_OR_FAIL(stats.usedBlocks == 2);
+		ASSERT_OR_FAIL(stats.freeBlocks == 1);
+		ASSERT_OR_FAIL(stats.peakUsedBlocks == 3);
+		ASSERT_OR_FAIL(stats.explicitProducers == 1);
+		ASSERT_OR_FAIL(stats.implicitProducers == 1);
+		ASSERT_OR_FAIL(stats.blockIndexBytes > implicitIndexBytes);
+		
+		// Moved along with the rest of the queue
+		ConcurrentQueue<int, Traits> moved(std::move(q));
+		ASSERT_OR_FAIL(moved.stats().usedBlocks == 2);
+		ASSERT_OR_FAIL(moved.stats().explicitProducers == 1);
+		ASSERT_OR_FAIL(q.stats().allocatedBlocks == 0);
+		ASSERT_OR_FAIL(q.stats().explicitProducers == 0);
+		
+		BlockingConcurrentQueue<int, Traits> bq(8);
+		ASSERT_OR_FAIL(bq.enqueue(1));
+		ASSERT_OR_FAIL(bq.stats().usedBlocks == 1);
+		ASSERT_OR_FAIL(bq.stats().implicitProducers == 1);
+		return true;
+	}
+	
+	template<std::size_t Interval>
+	struct ResidencyTraits : public MallocTrackingTraits
+	{
+		static const size_t BLOCK_SIZE = 8;
+		static const size_t RESIDENCY_SAMPLE_INTERVAL = Interval;
+	};
+	
+	bool residency_sampling()
+	{
+		int item, items[64];
 		
-		// Mixed producer types
+		// Off by default
 		{
-			for (int i = 0; i != 25; ++i) {
-				for (int j = 0; j != 100; ++j) {
-					ASSERT_OR_FAIL(q.enqueue(i * 100 + j));
-				}
-			}
-			for (int i = 25; i != 50; ++i) {
-				ProducerToken t(q);
-				for (int j = 0; j != 100; ++j) {
-					ASSERT_OR_FAIL(q.enqueue(t, i * 100 + j));
-				}
-			}
-			bool success[5000];
-			std::memset(success, 0, sizeof(success));
-			for (int i = 0; i != 50; ++i) {
-				for (int j = 0; j != 100; ++j) {
-					ASSERT_OR_FAIL(q.try_dequeue(item));
-					success[item] = true;
-				}
-			}
-			for (int i = 0; i != 5000; ++i) {
-				ASSERT_OR_FAIL(success[i]);
-			}
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			ConcurrentQueue<int, MallocTrackingTraits> q;
+			ASSERT_OR_FAIL(q.enqueue(1));
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(q.residency_samples() == 0);
+			ASSERT_OR_FAIL(q.residency_percentile(50) == 0);
 		}
 		
-		// Mixed producer types with consumer token
+		// One in four elements gets sampled, however it's enqueued and dequeued
 		{
-			for (int i = 0; i != 25; ++i) {
-				for (int j = 0; j != 100; ++j) {
-					ASSERT_OR_FAIL(q.enqueue(i * 100 + j));
-				}
-			}
-			for (int i = 25; i != 50; ++i) {
-				ProducerToken t(q);
-				for (int j = 0; j != 100; ++j) {
-					ASSERT_OR_FAIL(q.enqueue(t, i * 100 + j));
-				}
-			}
-			bool success[5000];
-			std::memset(success, 0, sizeof(success));
-			for (int i = 0; i != 50; ++i) {
-				ConsumerToken t(q);
-				for (int j = 0; j != 100; ++j) {
-					ASSERT_OR_FAIL(q.try_dequeue(t, item));
-					success[item] = true;
-				}
+			ConcurrentQueue<int, ResidencyTraits<4>> q;
+			for (int i = 0; i != 100; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(i));
 			}
-			for (int i = 0; i != 5000; ++i) {
-				ASSERT_OR_FAIL(success[i]);
+			for (int i = 0; i != 100; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item));
 			}
-			ConsumerToken t(q);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-			ASSERT_OR_FAIL(!q.try_dequeue(t, item));
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-			ASSERT_OR_FAIL(!q.try_dequeue(t, item));
+			ASSERT_OR_FAIL(q.residency_samples() == 25);
+			
+			ProducerToken tok(q);
+			ConsumerToken consTok(q);
+			ASSERT_OR_FAIL(q.enqueue_bulk(tok, items, 64));
+			ASSERT_OR_FAIL(q.enqueue(tok, 1));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(consTok, items, 64) == 64);
+			ASSERT_OR_FAIL(q.try_dequeue(consTok, item));
+			ASSERT_OR_FAIL(q.residency_samples() == 25 + 17);
+			
+			q.reset_residency_samples();
+			ASSERT_OR_FAIL(q.residency_samples() == 0);
+		}
+		
+		// Sampling intervals can be longer than a block
+		{
+			ConcurrentQueue<int, ResidencyTraits<32>> q;
+			ASSERT_OR_FAIL(q.enqueue_bulk(items, 64));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 64) == 64);
+			ASSERT_OR_FAIL(q.residency_samples() == 2);
 		}
 		
+		// Percentiles reflect how long the elements actually sat there
+		{
+			BlockingConcurrentQueue<int, ResidencyTraits<1>> q;
+			for (int i = 0; i != 99; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(i));
+				ASSERT_OR_FAIL(q.try_dequeue(item));
+			}
+			ASSERT_OR_FAIL(q.enqueue(99));
+			moodycamel::sleep(20);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(q.residency_samples() == 100);
+			ASSERT_OR_FAIL(q.residency_percentile(50) < 5000);
+			ASSERT_OR_FAIL(q.residency_percentile(100) > 15000);
+			ASSERT_OR_FAIL(q.residency_percentile(100) < 1000000);
+		}
 		return true;
 	}
 	
-	bool try_dequeue_threaded()
+	bool contention_counters()
 	{
 		int item;
-		ConcurrentQueue<int, MallocTrackingTraits> q;
+
+#ifdef MOODYCAMEL_CONTENTION_COUNTERS
+		// A consumer token has to go find a producer before its first dequeue
+		{
+			ConcurrentQueue<int, MallocTrackingTraits> q;
+			ConsumerToken tok(q);
+			ASSERT_OR_FAIL(q.enqueue(1));
+			ASSERT_OR_FAIL(q.try_dequeue(tok, item));
+			ASSERT_OR_FAIL(q.contention_stats().consumerRotations == 1);
+			ASSERT_OR_FAIL(q.contention_stats().dequeueOvercommits == 0);
+			
+			// The counts go along with the queue's state
+			ConcurrentQueue<int, MallocTrackingTraits> other(std::move(q));
+			ASSERT_OR_FAIL(other.contention_stats().consumerRotations == 1);
+			ASSERT_OR_FAIL(q.contention_stats().consumerRotations == 0);
+			ASSERT_OR_FAIL(q.enqueue(2));
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 2);
+		}
 		
-		// Threaded consumption with tokens
+		// Counting doesn't get in the way when things are actually contended
 		{
-			SimpleThread threads[20];
-			for (int i = 0; i != 10; ++i) {
-				threads[i] = SimpleThread([&](int i) {
-					ProducerToken t(q);
-					for (int j = 0; j != 100; ++j) {
-						q.enqueue(t, i * 10 + j);
+			BlockingConcurrentQueue<int, MallocTrackingTraits> q;
+			std::vector<SimpleThread> threads;
+			std::atomic<int> remaining(4 * 10000);
+			for (int i = 0; i != 4; ++i) {
+				threads.push_back(SimpleThread([&]() {
+					for (int j = 0; j != 10000; ++j) {
+						q.enqueue(j);
 					}
-				}, i);
-			}
-
-			std::atomic<int> dequeueCount(0);
-			for (int i = 10; i != 20; ++i) {
-				threads[i] = SimpleThread([&]() {
-					int item;
+				}));
+				threads.push_back(SimpleThread([&]() {
 					ConsumerToken t(q);
-					while (dequeueCount.load(std::memory_order_relaxed) != 1000) {
-						if (q.try_dequeue(t, item)) {
-							dequeueCount.fetch_add(1, std::memory_order_relaxed);
+					int value;
+					while (remaining.load(std::memory_order_relaxed) > 0) {
+						if (q.try_dequeue(t, value)) {
+							remaining.fetch_sub(1, std::memory_order_relaxed);
 						}
 					}
-				});
+				}));
 			}
-			
-			for (int i = 0; i != 20; ++i) {
-				threads[i].join();
+			for (auto& thread : threads) {
+				thread.join();
 			}
-			
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			ASSERT_OR_FAIL(q.contention_stats().consumerRotations >= 4);
 		}
+#else
+		// Compiled out, there's nothing to report
+		ConcurrentQueue<int, MallocTrackingTraits> q;
+		ConsumerToken tok(q);
+		ASSERT_OR_FAIL(q.enqueue(1));
+		ASSERT_OR_FAIL(q.try_dequeue(tok, item));
+		ASSERT_OR_FAIL(q.contention_stats().consumerRotations == 0);
+#endif
+		return true;
+	}
+	
+	bool producer_introspection()
+	{
+		typedef ConcurrentQueue<int, TestTraits<8>> Queue;
+		int item;
 		
-		// Threaded consumption
-		{
-			SimpleThread threads[20];
-			for (int i = 0; i != 10; ++i) {
-				threads[i] = SimpleThread([&](int i) {
-					for (int j = 0; j != 100; ++j) {
-						q.enqueue(i * 10 + j);
-					}
-				}, i);
-			}
+		Queue q;
+		std::vector<Queue::ProducerInfo> infos;
+		auto snapshot = [&]() {
+			infos.clear();
+			return q.for_each_producer([&](Queue::ProducerInfo const& info) { infos.push_back(info); });
+		};
+		ASSERT_OR_FAIL(snapshot() == 0);
+		
+		ProducerToken tok(q);
+		for (int i = 0; i != 20; ++i) {
+			ASSERT_OR_FAIL(q.enqueue(tok, i));
+		}
+		ASSERT_OR_FAIL(snapshot() == 1);
+		ASSERT_OR_FAIL(infos[0].isExplicit && infos[0].isActive);
+		ASSERT_OR_FAIL(infos[0].threadId == details::invalid_thread_id);
+		ASSERT_OR_FAIL(infos[0].size == 20);
+		ASSERT_OR_FAIL(infos[0].blocks == 3);
+		ASSERT_OR_FAIL(infos[0].lastActivity != 0 && infos[0].idleUsecs >= 0);
+		
+		// Explicit producers hold on to their blocks once they're emptied
+		for (int i = 0; i != 20; ++i) {
+			ASSERT_OR_FAIL(q.try_dequeue_from_producer(tok, item) && item == i);
+		}
+		ASSERT_OR_FAIL(snapshot() == 1);
+		ASSERT_OR_FAIL(infos[0].size == 0 && infos[0].blocks == 3);
+		
+		// A stream that's gone quiet stands out
+		moodycamel::sleep(20);
+		for (int i = 0; i != 10; ++i) {
+			ASSERT_OR_FAIL(q.enqueue(i));
+		}
+		ASSERT_OR_FAIL(snapshot() == 2);
+		auto& implicitInfo = infos[0].isExplicit ? infos[1] : infos[0];
+		auto& explicitInfo = infos[0].isExplicit ? infos[0] : infos[1];
+		ASSERT_OR_FAIL(!implicitInfo.isExplicit && implicitInfo.isActive);
+		ASSERT_OR_FAIL(implicitInfo.threadId == details::thread_id());
+		ASSERT_OR_FAIL(implicitInfo.size == 10 && implicitInfo.blocks == 2);
+		ASSERT_OR_FAIL(explicitInfo.idleUsecs > 15000);
+		ASSERT_OR_FAIL(implicitInfo.idleUsecs < explicitInfo.idleUsecs);
+		
+		// Implicit producers give blocks back as they go
+		for (int i = 0; i != 9; ++i) {
+			ASSERT_OR_FAIL(q.try_dequeue_non_interleaved(item));
+		}
+		ASSERT_OR_FAIL(snapshot() == 2);
+		auto& drained = infos[0].isExplicit ? infos[1] : infos[0];
+		ASSERT_OR_FAIL(drained.size == 1 && drained.blocks == 1);
 
-			std::atomic<int> dequeueCount(0);
-			for (int i = 10; i != 20; ++i) {
-				threads[i] = SimpleThread([&]() {
-					int item;
-					while (dequeueCount.load(std::memory_order_relaxed) != 1000) {
-						if (q.try_dequeue(item)) {
-							dequeueCount.fetch_add(1, std::memory_order_relaxed);
-						}
-					}
-				});
-			}
-			
-			for (int i = 0; i != 20; ++i) {
-				threads[i].join();
+#ifdef MOODYCAMEL_CPP11_THREAD_LOCAL_SUPPORTED
+		SimpleThread t([&]() { q.enqueue(1); });
+		t.join();
+		ASSERT_OR_FAIL(snapshot() == 3);
+		size_t finished = 0;
+		for (auto& info : infos) {
+			if (!info.isExplicit && !info.isActive) {
+				ASSERT_OR_FAIL(info.threadId == details::invalid_thread_id && info.size == 1);
+				++finished;
 			}
-			
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
 		}
-		
+		ASSERT_OR_FAIL(finished == 1);
+#endif
 		return true;
 	}
 	
-	bool try_dequeue_bulk()
+	static void record_watermark(void* userData, bool high, size_t approxSize)
 	{
-		typedef TestTraits<4> Traits;
-		int items[5];
+		static_cast<std::vector<std::pair<bool, size_t>>*>(userData)->push_back(std::make_pair(high, approxSize));
+	}
+	
+	struct WatermarkLog
+	{
+		std::atomic<int> inCallback;
+		std::atomic<bool> overlapped;
+		std::vector<bool> highs;		// Only touched by one callback at a time
+	};
+	
+	static void log_watermark(void* userData, bool high, size_t)
+	{
+		auto log = static_cast<WatermarkLog*>(userData);
+		if (log->inCallback.fetch_add(1) != 0) {
+			log->overlapped = true;
+		}
+		log->highs.push_back(high);
+		log->inCallback.fetch_sub(1);
+	}
+	
+	bool watermarks()
+	{
+		typedef ConcurrentQueue<int, TestTraits<8>> Queue;
+		int item, items[40];
+		std::vector<std::pair<bool, size_t>> events;
 		
-		// Explicit producer
+		// Crossings are reported once each, at block granularity
 		{
-			Traits::reset();
-			ConcurrentQueue<int, Traits> q;
-			ProducerToken tok(q);
-			
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 0);
-			
-			q.enqueue(tok, 17);
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 1);
-			ASSERT_OR_FAIL(items[0] == 17);
-			
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
-			
-			for (int i = 0; i != 4; ++i) {
-				q.enqueue(tok, i + 1);
+			Queue q;
+			ASSERT_OR_FAIL(q.set_watermarks(30, 10, &record_watermark, &events));
+			for (int i = 0; i != 40; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(i));
+				ASSERT_OR_FAIL(events.size() == (i < 24 ? 0u : 1u));
 			}
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 4);
-			for (int i = 0; i != 4; ++i) {
-				ASSERT_OR_FAIL(items[i] == i + 1);
+			ASSERT_OR_FAIL(events[0] == std::make_pair(true, (size_t)32));
+			for (int i = 0; i != 40; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+				ASSERT_OR_FAIL(events.size() == (i < 31 ? 1u : 2u));
 			}
+			ASSERT_OR_FAIL(events[1] == std::make_pair(false, (size_t)8));
 			
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
-			
-			for (int i = 0; i != 5; ++i) {
-				q.enqueue(tok, i + 1);
+			// Jittering around the high watermark doesn't repeat it
+			ProducerToken tok(q);
+			for (int round = 0; round != 3; ++round) {
+				ASSERT_OR_FAIL(q.enqueue_bulk(tok, items, 40));
+				ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(tok, items, 8) == 8);
+			}
+			ASSERT_OR_FAIL(events.size() == 3 && events[2].first);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(tok, items, 40) == 40);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(tok, items, 40) == 40);
+			ASSERT_OR_FAIL(events.size() == 3);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(tok, items, 40) == 16);
+			ASSERT_OR_FAIL(events.size() == 4 && !events[3].first);
+		}
+		
+		// Elements already in the queue count too
+		{
+			events.clear();
+			BlockingConcurrentQueue<int, TestTraits<8>> q;
+			ASSERT_OR_FAIL(q.enqueue_bulk(items, 40));
+			ASSERT_OR_FAIL(q.set_watermarks(64, 16, &record_watermark, &events));
+			ASSERT_OR_FAIL(q.wait_dequeue_bulk(items, 40) == 40);
+			ASSERT_OR_FAIL(events.empty());
+			ASSERT_OR_FAIL(q.set_watermarks(32, 16, &record_watermark, &events));
+			ASSERT_OR_FAIL(q.enqueue_bulk(items, 40));
+			ASSERT_OR_FAIL(events.size() == 1 && events[0].first);
+			ASSERT_OR_FAIL(q.set_watermarks(0, 0, nullptr));
+			ASSERT_OR_FAIL(q.wait_dequeue_bulk(items, 40) == 40);
+			ASSERT_OR_FAIL(events.size() == 1);
+		}
+		
+		// A bulk enqueue that throws takes back the blocks it counted
+		for (int implicit = 0; implicit != 2; ++implicit) {
+			events.clear();
+			ConcurrentQueue<ThrowingMovable, TestTraits<8>> q;
+			ProducerToken tok(q);
+			ASSERT_OR_FAIL(q.set_watermarks(30, 10, &record_watermark, &events));
+			std::vector<ThrowingMovable> elements;
+			for (int i = 0; i != 40; ++i) {
+				elements.push_back(ThrowingMovable(i));
 			}
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
-			for (int i = 0; i != 5; ++i) {
-				ASSERT_OR_FAIL(items[i] == i + 1);
+			elements[35].throwOnCctor = true;
+			bool threw = false;
+			try {
+				if (implicit) {
+					q.enqueue_bulk(std::make_move_iterator(elements.begin()), 40);
+				}
+				else {
+					q.enqueue_bulk(tok, std::make_move_iterator(elements.begin()), 40);
+				}
 			}
-			
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
-			
-			for (int i = 0; i != 6; ++i) {
-				q.enqueue(tok, i + 1);
+			catch (ThrowingMovable*) {
+				threw = true;
 			}
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
-			for (int i = 0; i != 5; ++i) {
-				ASSERT_OR_FAIL(items[i] == i + 1);
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(events.size() == 2 && events[1] == std::make_pair(false, (size_t)0));
+			for (int i = 0; i != 24; ++i) {
+				ASSERT_OR_FAIL(implicit ? q.enqueue(ThrowingMovable(i)) : q.enqueue(tok, ThrowingMovable(i)));
 			}
-			ASSERT_OR_FAIL(q.try_dequeue(items[0]));
-			ASSERT_OR_FAIL(items[0] == 6);
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
-			
-			for (int i = 0; i != 10; ++i) {
-				q.enqueue(tok, i + 1);
+			ASSERT_OR_FAIL(events.size() == 2);
+			for (int i = 0; i != 8; ++i) {
+				ASSERT_OR_FAIL(implicit ? q.enqueue(ThrowingMovable(i)) : q.enqueue(tok, ThrowingMovable(i)));
 			}
-			for (int k = 0; k != 2; ++k) {
-				ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
-				for (int i = 0; i != 5; ++i) {
-					ASSERT_OR_FAIL(items[i] == k * 5 + i + 1);
-				}
+			ASSERT_OR_FAIL(events.size() == 3 && events[2] == std::make_pair(true, (size_t)32));
+		}
+		
+		// Crossings from several threads at once are still reported one at a time, in order
+		{
+			ConcurrentQueue<int, TestTraits<8>> q;
+			WatermarkLog log;
+			log.inCallback = 0;
+			log.overlapped = false;
+			ASSERT_OR_FAIL(q.set_watermarks(16, 8, &log_watermark, &log));
+			SimpleThread threads[4];
+			for (int t = 0; t != 4; ++t) {
+				threads[t] = SimpleThread([&]() {
+					ProducerToken tok(q);
+					int local[16];
+					for (int i = 0; i != 2000; ++i) {
+						q.enqueue_bulk(tok, local, 16);
+						q.try_dequeue_bulk_from_producer(tok, local, 16);
+					}
+				});
 			}
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
+			for (int t = 0; t != 4; ++t) {
+				threads[t].join();
+			}
+			ASSERT_OR_FAIL(!log.overlapped.load());
+			for (size_t i = 0; i != log.highs.size(); ++i) {
+				ASSERT_OR_FAIL(log.highs[i] == (i % 2 == 0));
+			}
+			ASSERT_OR_FAIL(log.highs.size() % 2 == 0);
+		}
+		return true;
+	}
+	
+	bool sharded_size_counters()
+	{
+		int item, items[20];
+		
+		// The regular walk over the producers
+		{
+			ConcurrentQueue<int, TestTraits<8>> q;
+			ASSERT_OR_FAIL(q.empty_approx());
+			ASSERT_OR_FAIL(q.enqueue(1));
+			ASSERT_OR_FAIL(!q.empty_approx() && q.size_approx() == 1);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(q.empty_approx());
 		}
 		
-		// Implicit producer
+		// Counted a block at a time, in shards that each have a cache line to themselves
 		{
-			Traits::reset();
-			ConcurrentQueue<int, Traits> q;
-			
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 0);
-			
-			q.enqueue(17);
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 1);
-			ASSERT_OR_FAIL(items[0] == 17);
+			ConcurrentQueue<int, ShardedSizeTraits> q;
+			ASSERT_OR_FAIL((std::alignment_of<ConcurrentQueue<int, ShardedSizeTraits>>::value == 64));
+			ASSERT_OR_FAIL(reinterpret_cast<std::uintptr_t>(&q) % 64 == 0);
+			ASSERT_OR_FAIL(q.empty_approx() && q.size_approx() == 0);
+			for (int i = 0; i != 20; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(i));
+			}
+			ASSERT_OR_FAIL(q.size_approx() == 16 && !q.empty_approx());
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 10) == 10);
+			ASSERT_OR_FAIL(q.size_approx() == 8);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 10) == 10);
+			ASSERT_OR_FAIL(q.size_approx() == 0 && q.empty_approx());
 			
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
+			// Less than a block's worth is still noticed by empty_approx
+			ASSERT_OR_FAIL(q.enqueue(1));
+			ASSERT_OR_FAIL(q.size_approx() == 0 && !q.empty_approx());
+			ASSERT_OR_FAIL(q.try_dequeue(item) && q.empty_approx());
 			
+			ConcurrentQueue<int, ShardedSizeTraits> other;
+			ProducerToken tok(other);
+			ASSERT_OR_FAIL(other.enqueue_bulk(tok, items, 20));
+			q.swap(other);
+			ASSERT_OR_FAIL(q.size_approx() == 16 && other.size_approx() == 0);
+		}
+		
+		// Enqueued and dequeued by different threads (so into different shards)
+		{
+			ConcurrentQueue<int, ShardedSizeTraits> q;
+			std::vector<SimpleThread> threads;
 			for (int i = 0; i != 4; ++i) {
-				q.enqueue(i + 1);
+				threads.push_back(SimpleThread([&]() {
+					for (int j = 0; j != 1000; ++j) {
+						q.enqueue(j);
+					}
+				}));
 			}
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 4);
-			for (int i = 0; i != 4; ++i) {
-				ASSERT_OR_FAIL(items[i] == i + 1);
+			for (auto& thread : threads) {
+				thread.join();
 			}
+			ASSERT_OR_FAIL(q.size_approx() == 4000);
 			
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
-			
-			for (int i = 0; i != 5; ++i) {
-				q.enqueue(i + 1);
+			threads.clear();
+			std::atomic<int> remaining(4000);
+			for (int i = 0; i != 4; ++i) {
+				threads.push_back(SimpleThread([&]() {
+					int value;
+					while (remaining.load(std::memory_order_relaxed) > 0) {
+						if (q.try_dequeue(value)) {
+							remaining.fetch_sub(1, std::memory_order_relaxed);
+						}
+					}
+				}));
 			}
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
-			for (int i = 0; i != 5; ++i) {
-				ASSERT_OR_FAIL(items[i] == i + 1);
+			for (auto& thread : threads) {
+				thread.join();
 			}
+			ASSERT_OR_FAIL(q.size_approx() == 0 && q.empty_approx());
+		}
+		return true;
+	}
+	
+	bool peek_and_snapshot()
+	{
+		int item, items[40];
+		
+		// Peeking at an explicit producer's elements, across blocks
+		{
+			ConcurrentQueue<int, TestTraits<4>> q;
+			ProducerToken tok(q);
+			ASSERT_OR_FAIL(q.front(tok) == nullptr);
+			ASSERT_OR_FAIL(q.peek_oldest(tok, 10, [](int const&) { }) == 0);
 			
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
-			
-			for (int i = 0; i != 6; ++i) {
-				q.enqueue(i + 1);
+			for (int i = 0; i != 10; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(tok, i));
 			}
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
+			ASSERT_OR_FAIL(q.front(tok) != nullptr && *q.front(tok) == 0);
+			
+			int expected = 0;
+			bool inOrder = true;
+			ASSERT_OR_FAIL(q.peek_oldest(tok, 6, [&](int const& element) { inOrder &= element == expected++; }) == 6);
+			ASSERT_OR_FAIL(inOrder && expected == 6);
+			
+			// Nothing was dequeued
+			ASSERT_OR_FAIL(q.size_approx() == 10);
 			for (int i = 0; i != 5; ++i) {
-				ASSERT_OR_FAIL(items[i] == i + 1);
+				ASSERT_OR_FAIL(q.try_dequeue_from_producer(tok, item) && item == i);
 			}
-			ASSERT_OR_FAIL(q.try_dequeue(items[0]));
-			ASSERT_OR_FAIL(items[0] == 6);
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
+			ASSERT_OR_FAIL(*q.front(tok) == 5);
+			expected = 5;
+			ASSERT_OR_FAIL(q.peek_oldest(tok, 100, [&](int const& element) { inOrder &= element == expected++; }) == 5);
+			ASSERT_OR_FAIL(inOrder && expected == 10);
 			
+			// After the producer's wrapped around its blocks
+			for (int i = 10; i != 30; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(tok, i));
+				ASSERT_OR_FAIL(q.try_dequeue_from_producer(tok, item) && item == i - 5);
+			}
+			ASSERT_OR_FAIL(*q.front(tok) == 25);
+			while (q.try_dequeue_from_producer(tok, item)) {
+				continue;
+			}
+			ASSERT_OR_FAIL(q.front(tok) == nullptr);
+		}
+		
+		// Snapshots of explicit and implicit producers
+		{
+			ConcurrentQueue<int, TestTraits<4>> q;
+			ProducerToken tok(q);
 			for (int i = 0; i != 10; ++i) {
-				q.enqueue(i + 1);
+				ASSERT_OR_FAIL(q.enqueue(tok, i));
 			}
-			for (int k = 0; k != 2; ++k) {
-				ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
-				for (int i = 0; i != 5; ++i) {
-					ASSERT_OR_FAIL(items[i] == k * 5 + i + 1);
+			SimpleThread t([&]() {
+				for (int i = 100; i != 110; ++i) {
+					q.enqueue(i);
 				}
+			});
+			t.join();
+			ASSERT_OR_FAIL(q.try_dequeue_from_producer(tok, item) && item == 0);
+			
+			ASSERT_OR_FAIL(q.snapshot(items, 40) == 19);
+			std::sort(items, items + 19);
+			for (int i = 0; i != 9; ++i) {
+				ASSERT_OR_FAIL(items[i] == i + 1 && items[i + 9] == i + 100);
 			}
-			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
+			ASSERT_OR_FAIL(items[18] == 109);
+			ASSERT_OR_FAIL(q.snapshot(items, 5) == 5);
+			ASSERT_OR_FAIL(q.size_approx() == 19);
+		}
+		
+		// While other threads enqueue (but nobody dequeues)
+		{
+			ConcurrentQueue<int, TestTraits<4>> q;
+			std::atomic<bool> done(false);
+			std::vector<SimpleThread> threads;
+			for (int i = 0; i != 2; ++i) {
+				threads.push_back(SimpleThread([&]() {
+					for (int j = 0; j != 10000; ++j) {
+						q.enqueue(j);
+					}
+				}));
+			}
+			threads.push_back(SimpleThread([&]() {
+				int copies[16];
+				while (!done.load(std::memory_order_relaxed)) {
+					size_t count = q.snapshot(copies, 16);
+					if (count > 16) {
+						std::abort();
+					}
+					for (size_t i = 0; i != count; ++i) {
+						if (copies[i] < 0 || copies[i] >= 10000) {
+							std::abort();
+						}
+					}
+				}
+			}));
+			for (int i = 0; i != 2; ++i) {
+				threads[i].join();
+			}
+			done.store(true, std::memory_order_relaxed);
+			threads[2].join();
+			ASSERT_OR_FAIL(q.snapshot(items, 40) == 40);
 		}
 		
+		// Forwarded by the blocking queue
+		{
+			BlockingConcurrentQueue<int> q;
+			BlockingConcurrentQueue<int>::producer_token_t tok(q);
+			ASSERT_OR_FAIL(q.enqueue(tok, 7));
+			ASSERT_OR_FAIL(q.front(tok) != nullptr && *q.front(tok) == 7);
+			ASSERT_OR_FAIL(q.peek_oldest(tok, 1, [](int const&) { }) == 1);
+			ASSERT_OR_FAIL(q.snapshot(items, 40) == 1 && items[0] == 7);
+			ASSERT_OR_FAIL(q.wait_dequeue_timed(item, 0) && item == 7);
+		}
 		return true;
 	}
 	
-	bool try_dequeue_bulk_threaded()
+	bool cycle_accounting()
 	{
-		typedef TestTraits<2> Traits;
-		int dummy;
+		int item;
 		
-		// Explicit producer
+		reset_cycle_stats();
 		{
-			Traits::reset();
-			ConcurrentQueue<int, Traits> q;
-			SimpleThread threads[2];
-			bool success[2] = { true, true };
-			for (int i = 0; i != 2; ++i) {
-				if (i == 0) {
-					threads[i] = SimpleThread([&](int i) {
-						// Producer
-						ProducerToken tok(q);
-						for (int i = 0; i != 32*1024; ++i) {
-							q.enqueue(tok, i);
-						}
-					}, i);
-				}
-				else {
-					threads[i] = SimpleThread([&](int i) {
-						// Consumer
-						int items[5];
-						int prevItem = -1;
-						for (int i = 0; i != 32*1024;) {
-							auto dequeued = q.try_dequeue_bulk(items, 5);
-							if (dequeued > 0) {
-								if (dequeued > 5) {
-									success[i] = false;
-									break;
-								}
-								for (std::size_t j = 0; j != dequeued; ++j) {
-									if (items[j] != prevItem + 1) {
-										success[i] = false;
-									}
-									prevItem = items[j];
-								}
-								i += (int)dequeued;
-							}
-						}
-					}, i);
-				}
+			ConcurrentQueue<int, TestTraits<4>> q(0);
+			ProducerToken tok(q);
+			for (int i = 0; i != 10; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(i));
+				ASSERT_OR_FAIL(q.enqueue(tok, i));
 			}
-			for (int i = 0; i != 2; ++i) {
-				threads[i].join();
+			for (int i = 0; i != 20; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item));
 			}
 			
-			ASSERT_OR_FAIL(success[0]);
-			ASSERT_OR_FAIL(success[1]);
-			ASSERT_OR_FAIL(!q.try_dequeue(dummy));
+			// Steps timed on other threads count too
+			SimpleThread t([&]() {
+				for (int i = 0; i != 10; ++i) {
+					q.enqueue(i);
+				}
+			});
+			t.join();
 		}
 		
-		// Implicit producer
+		auto stats = cycle_stats();
+		ASSERT_OR_FAIL(stats.ticksPerUsec > 0);
+#ifdef MOODYCAMEL_CYCLE_ACCOUNTING
+		ASSERT_OR_FAIL(stats.implicitHashLookup.calls == 20);
+		ASSERT_OR_FAIL(stats.elementConstruction.calls == 30);
+		ASSERT_OR_FAIL(stats.tailPublish.calls == 30);
+		ASSERT_OR_FAIL(stats.blockIndexLookup.calls >= 10);
+		ASSERT_OR_FAIL(stats.freeListPop.calls > 0);
+		
+		reset_cycle_stats();
+		stats = cycle_stats();
+		ASSERT_OR_FAIL(stats.implicitHashLookup.calls == 0 && stats.implicitHashLookup.ticks == 0);
+		ASSERT_OR_FAIL(stats.tailPublish.calls == 0 && stats.freeListPop.calls == 0);
+		
+		// The bulk paths time their tail stores and block index work too
 		{
-			Traits::reset();
-			ConcurrentQueue<int, Traits> q;
-			SimpleThread threads[2];
-			bool success[2] = { true, true };
-			for (int i = 0; i != 2; ++i) {
-				if (i == 0) {
-					threads[i] = SimpleThread([&](int i) {
-						// Producer
-						for (int i = 0; i != 32*1024; ++i) {
-							q.enqueue(i);
-						}
-					}, i);
+			ConcurrentQueue<int, TestTraits<4>> q(0);
+			ProducerToken tok(q);
+			int items[10] = { 0 };
+			ASSERT_OR_FAIL(q.enqueue_bulk(items, 10));
+			ASSERT_OR_FAIL(q.enqueue_bulk(tok, items, 10));
+			stats = cycle_stats();
+			ASSERT_OR_FAIL(stats.tailPublish.calls == 2);
+			ASSERT_OR_FAIL(stats.blockIndexLookup.calls >= 6);
+			auto lookups = stats.blockIndexLookup.calls;
+			ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(tok, items, 10) == 10);
+			ASSERT_OR_FAIL(cycle_stats().blockIndexLookup.calls == lookups + 1);
+		}
+#else
+		ASSERT_OR_FAIL(stats.implicitHashLookup.calls == 0 && stats.blockIndexLookup.calls == 0 && stats.freeListPop.calls == 0);
+		ASSERT_OR_FAIL(stats.elementConstruction.calls == 0 && stats.tailPublish.calls == 0);
+#endif
+		return true;
+	}
+	
+	bool try_dequeue()
+	{
+		ConcurrentQueue<int, MallocTrackingTraits> q;
+		int item;
+		
+		// Producer token
+		{
+			for (int i = 0; i != 50; ++i) {
+				ProducerToken t(q);
+				for (int j = 0; j != 100; ++j) {
+					ASSERT_OR_FAIL(q.enqueue(t, i * 100 + j));
 				}
-				else {
-					threads[i] = SimpleThread([&](int i) {
-						// Consumer
-						int items[5];
-						int prevItem = -1;
-						for (int i = 0; i != 32*1024;) {
-							auto dequeued = q.try_dequeue_bulk(items, 5);
-							if (dequeued > 0) {
-								if (dequeued > 5) {
-									success[i] = false;
-									break;
-								}
-								for (std::size_t j = 0; j != dequeued; ++j) {
-									if (items[j] != prevItem + 1) {
-										success[i] = false;
-									}
-									prevItem = items[j];
-								}
-								i += (int)dequeued;
-							}
-						}
-					}, i);
+			}
+			
+			
+			for (int i = 0; i != 50; ++i) {
+				for (int j = 0; j != 100; ++j) {
+					ASSERT_OR_FAIL(q.try_dequeue(item));
+					ASSERT_OR_FAIL(item == i * 100 + j);
 				}
 			}
-			for (int i = 0; i != 2; ++i) {
-				threads[i].join();
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// Mixed producer types
+		{
+			for (int i = 0; i != 25; ++i) {
+				for (int j = 0; j != 100; ++j) {
+					ASSERT_OR_FAIL(q.enqueue(i * 100 + j));
+				}
 			}
-			
-			ASSERT_OR_FAIL(success[0]);
-			ASSERT_OR_FAIL(success[1]);
-			ASSERT_OR_FAIL(!q.try_dequeue(dummy));
+			for (int i = 25; i != 50; ++i) {
+				ProducerToken t(q);
+				for (int j = 0; j != 100; ++j) {
+					ASSERT_OR_FAIL(q.enqueue(t, i * 100 + j));
+				}
+			}
+			bool success[5000];
+			std::memset(success, 0, sizeof(success));
+			for (int i = 0; i != 50; ++i) {
+				for (int j = 0; j != 100; ++j) {
+					ASSERT_OR_FAIL(q.try_dequeue(item));
+					success[item] = true;
+				}
+			}
+			for (int i = 0; i != 5000; ++i) {
+				ASSERT_OR_FAIL(success[i]);
+			}
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
 		}
 		
-		// Multithreaded consumption
+		// Mixed producer types with consumer token
+		{
+			for (int i = 0; i != 25; ++i) {
+				for (int j = 0; j != 100; ++j) {
+					ASSERT_OR_FAIL(q.enqueue(i * 100 + j));
+				}
+			}
+			for (int i = 25; i != 50; ++i) {
+				ProducerToken t(q);
+				for (int j = 0; j != 100; ++j) {
+					ASSERT_OR_FAIL(q.enqueue(t, i * 100 + j));
+				}
+			}
+			bool success[5000];
+			std::memset(success, 0, sizeof(success));
+			for (int i = 0; i != 50; ++i) {
+				ConsumerToken t(q);
+				for (int j = 0; j != 100; ++j) {
+					ASSERT_OR_FAIL(q.try_dequeue(t, item));
+					success[item] = true;
+				}
+			}
+			for (int i = 0; i != 5000; ++i) {
+				ASSERT_OR_FAIL(success[i]);
+			}
+			ConsumerToken t(q);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			ASSERT_OR_FAIL(!q.try_dequeue(t, item));
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			ASSERT_OR_FAIL(!q.try_dequeue(t, item));
+		}
+		
+		return true;
+	}
+	
+	bool try_dequeue_threaded()
+	{
+		int item;
+		ConcurrentQueue<int, MallocTrackingTraits> q;
+		
+		// Threaded consumption with tokens
 		{
-			Traits::reset();
-			ConcurrentQueue<int, Traits> q;
-			
-			bool success[20];
 			SimpleThread threads[20];
 			for (int i = 0; i != 10; ++i) {
-				success[i] = true;
 				threads[i] = SimpleThread([&](int i) {
 					ProducerToken t(q);
-					if ((i & 1) == 1) {
-						for (int j = 0; j != 100; ++j) {
-							q.enqueue(t, i * 128 + j);
-						}
-					}
-					else {
-						for (int j = 0; j != 100; ++j) {
-							q.enqueue(i * 128 + j);
-						}
+					for (int j = 0; j != 100; ++j) {
+						q.enqueue(t, i * 10 + j);
 					}
 				}, i);
 			}
-			
-			std::atomic<size_t> dequeueCount(0);
+
+			std::atomic<int> dequeueCount(0);
 			for (int i = 10; i != 20; ++i) {
-				success[i] = true;
-				threads[i] = SimpleThread([&](int i) {
-					int prevItems[10];
-					for (int j = 0; j != 10; ++j) {
-						prevItems[j] = -1;
-					}
-					int items[15];
+				threads[i] = SimpleThread([&]() {
+					int item;
 					ConsumerToken t(q);
-					
 					while (dequeueCount.load(std::memory_order_relaxed) != 1000) {
-						size_t count;
-						if ((i & 1) == 1) {
-							count = q.try_dequeue_bulk(items, 15);
-						}
-						else {
-							count = q.try_dequeue_bulk(t, items, 15);
-						}
-						
-						if (count > 15) {
-							success[i] = false;
-						}
-						for (size_t k = 0; k != count; ++k) {
-							if (prevItems[items[k] / 128] >= (items[k] & 127)) {
-								success[i] = false;
-							}
-							prevItems[items[k] / 128] = items[k] & 127;
+						if (q.try_dequeue(t, item)) {
+							dequeueCount.fetch_add(1, std::memory_order_relaxed);
 						}
-						dequeueCount.fetch_add(count, std::memory_order_relaxed);
 					}
-				}, i);
+				});
 			}
 			
 			for (int i = 0; i != 20; ++i) {
 				threads[i].join();
 			}
 			
-			int item;
 			ASSERT_OR_FAIL(!q.try_dequeue(item));
-			for (int i = 0; i != 20; ++i) {
-				ASSERT_OR_FAIL(success[i]);
-			}
 		}
 		
-		return true;
-	}
-	
-	bool implicit_producer_hash()
-	{
-		for (int j = 0; j != 5; ++j) {
-			ConcurrentQueue<int, MallocTrackingTraits> q;
-			std::vector<SimpleThread> threads;
-			for (int i = 0; i != 20; ++i) {
-				threads.push_back(SimpleThread([&]() {
-					q.enqueue(7);
-				}));
+		// Threaded consumption
+		{
+			SimpleThread threads[20];
+			for (int i = 0; i != 10; ++i) {
+				threads[i] = SimpleThread([&](int i) {
+					for (int j = 0; j != 100; ++j) {
+						q.enqueue(i * 10 + j);
+					}
+				}, i);
 			}
-			
-			for (auto it = threads.begin(); it != threads.end(); ++it) {
-				it->join();
+
+			std::atomic<int> dequeueCount(0);
+			for (int i = 10; i != 20; ++i) {
+				threads[i] = SimpleThread([&]() {
+					int item;
+					while (dequeueCount.load(std::memory_order_relaxed) != 1000) {
+						if (q.try_dequeue(item)) {
+							dequeueCount.fetch_add(1, std::memory_order_relaxed);
+						}
+					}
+				});
 			}
 			
-			int item;
-			ConsumerToken t(q);
-			for (auto i = 0; i != 20; ++i) {
-				if ((j & 1) == 0) {
-					ASSERT_OR_FAIL(q.try_dequeue(item));
-				}
-				else {
-					ASSERT_OR_FAIL(q.try_dequeue(t, item));
-				}
-				ASSERT_OR_FAIL(item == 7);
+			for (int i = 0; i != 20; ++i) {
+				threads[i].join();
 			}
+			
 			ASSERT_OR_FAIL(!q.try_dequeue(item));
 		}
 		
 		return true;
 	}
 	
-	bool index_wrapping()
+	bool try_dequeue_bulk()
 	{
+		typedef TestTraits<4> Traits;
+		int items[5];
+		
+		// Explicit producer
 		{
-			// Implicit
-			ConcurrentQueue<int, SmallIndexTraits> q(16);
-			int item;
+			Traits::reset();
+			ConcurrentQueue<int, Traits> q;
+			ProducerToken tok(q);
 			
-			for (int i = 0; i != (1 << 18); ++i) {
-				if ((i & 16) == 0) {
-					ASSERT_OR_FAIL(q.try_enqueue(i));
-				}
-				else {
-					ASSERT_OR_FAIL(q.try_dequeue(item));
-					ASSERT_OR_FAIL(item == (i - 16));
-				}
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 0);
+			
+			q.enqueue(tok, 17);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 1);
+			ASSERT_OR_FAIL(items[0] == 17);
+			
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
+			
+			for (int i = 0; i != 4; ++i) {
+				q.enqueue(tok, i + 1);
+			}
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 4);
+			for (int i = 0; i != 4; ++i) {
+				ASSERT_OR_FAIL(items[i] == i + 1);
 			}
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		
-		{
-			// Explicit
-			ConcurrentQueue<int, SmallIndexTraits> q(16);
-			ProducerToken tok(q);
-			int item;
 			
-			for (int i = 0; i != (1 << 18); ++i) {
-				if ((i & 16) == 0) {
-					ASSERT_OR_FAIL(q.try_enqueue(tok, i));
-				}
-				else {
-					ASSERT_OR_FAIL(q.try_dequeue_from_producer(tok, item));
-					ASSERT_OR_FAIL(item == (i - 16));
-				}
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
+			
+			for (int i = 0; i != 5; ++i) {
+				q.enqueue(tok, i + 1);
+			}
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
+			for (int i = 0; i != 5; ++i) {
+				ASSERT_OR_FAIL(items[i] == i + 1);
 			}
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		
-		{
-			// Implicit extra small
-			ConcurrentQueue<int, ExtraSmallIndexTraits> q(1);
-			int item;
 			
-			for (int i = 0; i != 4097; ++i) {
-				q.enqueue(i);
-				ASSERT_OR_FAIL(q.try_dequeue(item));
-				ASSERT_OR_FAIL(item == i);
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
+			
+			for (int i = 0; i != 6; ++i) {
+				q.enqueue(tok, i + 1);
 			}
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		
-		{
-			// Explicit extra small
-			ConcurrentQueue<int, ExtraSmallIndexTraits> q(1);
-			ProducerToken tok(q);
-			int item;
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
+			for (int i = 0; i != 5; ++i) {
+				ASSERT_OR_FAIL(items[i] == i + 1);
+			}
+			ASSERT_OR_FAIL(q.try_dequeue(items[0]));
+			ASSERT_OR_FAIL(items[0] == 6);
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
 			
-			for (int i = 0; i != 4097; ++i) {
-				q.enqueue(tok, i);
-				ASSERT_OR_FAIL(q.try_dequeue(item));
-				ASSERT_OR_FAIL(item == i);
+			for (int i = 0; i != 10; ++i) {
+				q.enqueue(tok, i + 1);
 			}
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			for (int k = 0; k != 2; ++k) {
+				ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
+				for (int i = 0; i != 5; ++i) {
+					ASSERT_OR_FAIL(items[i] == k * 5 + i + 1);
+				}
+			}
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
 		}
 		
-		return true;
-	}
-	
-	struct SizeLimitTraits : public MallocTrackingTraits
-	{
-		static const size_t BLOCK_SIZE = 2;
-		static const size_t MAX_SUBQUEUE_SIZE = 5;		// Will round up to 6 because of block size
-	};
-	
-	bool subqueue_size_limit()
-	{
+		// Implicit producer
 		{
-			// Explicit
-			ConcurrentQueue<int, SizeLimitTraits> q;
-			ProducerToken t(q);
-			int item;
+			Traits::reset();
+			ConcurrentQueue<int, Traits> q;
 			
-			ASSERT_OR_FAIL(q.enqueue(t, 1));
-			ASSERT_OR_FAIL(q.enqueue(t, 2));
-			ASSERT_OR_FAIL(q.enqueue(t, 3));
-			ASSERT_OR_FAIL(q.enqueue(t, 4));
-			ASSERT_OR_FAIL(q.enqueue(t, 5));
-			ASSERT_OR_FAIL(q.enqueue(t, 6));
-			ASSERT_OR_FAIL(!q.enqueue(t, 7));
-			ASSERT_OR_FAIL(!q.enqueue(t, 8));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 0);
 			
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 1);
-			ASSERT_OR_FAIL(!q.enqueue(t, 7));		// Can't reuse block until it's completely empty
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 2);
-			ASSERT_OR_FAIL(q.enqueue(t, 7));
-			ASSERT_OR_FAIL(q.enqueue(t, 8));
-			ASSERT_OR_FAIL(!q.enqueue(t, 9));
+			q.enqueue(17);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 1);
+			ASSERT_OR_FAIL(items[0] == 17);
 			
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 3);
-			ASSERT_OR_FAIL(!q.enqueue(t, 9));
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 4);
-			ASSERT_OR_FAIL(q.enqueue(t, 9));
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
 			
-			for (int i = 5; i <= 9; ++i) {
-				ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+			for (int i = 0; i != 4; ++i) {
+				q.enqueue(i + 1);
 			}
-			ASSERT_OR_FAIL(q.enqueue(t, 10));
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 10);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-			for (int i = 0; i != 6; ++i) {
-				ASSERT_OR_FAIL(q.try_enqueue(t, i));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 4);
+			for (int i = 0; i != 4; ++i) {
+				ASSERT_OR_FAIL(items[i] == i + 1);
 			}
-			ASSERT_OR_FAIL(!q.try_enqueue(t, 7));
-			ASSERT_OR_FAIL(!q.enqueue(t, 7));
-			
-			// Bulk
-			int items[6];
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 6) == 6);
-			ASSERT_OR_FAIL(!q.try_enqueue_bulk(t, items, 7));
-			ASSERT_OR_FAIL(!q.enqueue_bulk(t, items, 7));
-			ASSERT_OR_FAIL(q.enqueue_bulk(t, items, 6));
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 6) == 6);
-			ASSERT_OR_FAIL(q.enqueue_bulk(t, items, 3));
-			ASSERT_OR_FAIL(!q.enqueue_bulk(t, items, 4));
-			ASSERT_OR_FAIL(q.enqueue_bulk(t, items, 3));
-			ASSERT_OR_FAIL(!q.enqueue_bulk(t, items, 1));
-			ASSERT_OR_FAIL(!q.enqueue(t, 100));
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 1) == 1);
-			ASSERT_OR_FAIL(!q.enqueue(t, 100));
-		}
-		
-		{
-			// Implicit
-			ConcurrentQueue<int, SizeLimitTraits> q;
-			int item;
 			
-			ASSERT_OR_FAIL(q.enqueue(1));
-			ASSERT_OR_FAIL(q.enqueue(2));
-			ASSERT_OR_FAIL(q.enqueue(3));
-			ASSERT_OR_FAIL(q.enqueue(4));
-			ASSERT_OR_FAIL(q.enqueue(5));
-			ASSERT_OR_FAIL(q.enqueue(6));
-			ASSERT_OR_FAIL(!q.enqueue(7));
-			ASSERT_OR_FAIL(!q.enqueue(8));
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
 			
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 1);
-			ASSERT_OR_FAIL(!q.enqueue(7));		// Can't reuse block until it's completely empty
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 2);
-			ASSERT_OR_FAIL(q.enqueue(7));
-			ASSERT_OR_FAIL(q.enqueue(8));
-			ASSERT_OR_FAIL(!q.enqueue(9));
+			for (int i = 0; i != 5; ++i) {
+				q.enqueue(i + 1);
+			}
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
+			for (int i = 0; i != 5; ++i) {
+				ASSERT_OR_FAIL(items[i] == i + 1);
+			}
 			
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 3);
-			ASSERT_OR_FAIL(!q.enqueue(9));
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 4);
-			ASSERT_OR_FAIL(q.enqueue(9));
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
 			
-			for (int i = 5; i <= 9; ++i) {
-				ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
-			}
-			ASSERT_OR_FAIL(q.enqueue(10));
-			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 10);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
 			for (int i = 0; i != 6; ++i) {
-				ASSERT_OR_FAIL(q.try_enqueue(i));
+				q.enqueue(i + 1);
 			}
-			ASSERT_OR_FAIL(!q.try_enqueue(7));
-			ASSERT_OR_FAIL(!q.enqueue(7));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
+			for (int i = 0; i != 5; ++i) {
+				ASSERT_OR_FAIL(items[i] == i + 1);
+			}
+			ASSERT_OR_FAIL(q.try_dequeue(items[0]));
+			ASSERT_OR_FAIL(items[0] == 6);
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
 			
-			// Bulk
-			int items[6];
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 6) == 6);
-			ASSERT_OR_FAIL(!q.try_enqueue_bulk(items, 7));
-			ASSERT_OR_FAIL(!q.enqueue_bulk(items, 7));
-			ASSERT_OR_FAIL(q.enqueue_bulk(items, 6));
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 6) == 6);
-			ASSERT_OR_FAIL(q.enqueue_bulk(items, 3));
-			ASSERT_OR_FAIL(!q.enqueue_bulk(items, 4));
-			ASSERT_OR_FAIL(q.enqueue_bulk(items, 3));
-			ASSERT_OR_FAIL(!q.enqueue_bulk(items, 1));
-			ASSERT_OR_FAIL(!q.enqueue(100));
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 1) == 1);
-			ASSERT_OR_FAIL(!q.enqueue(100));
+			for (int i = 0; i != 10; ++i) {
+				q.enqueue(i + 1);
+			}
+			for (int k = 0; k != 2; ++k) {
+				ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 5) == 5);
+				for (int i = 0; i != 5; ++i) {
+					ASSERT_OR_FAIL(items[i] == k * 5 + i + 1);
+				}
+			}
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
 		}
 		
 		return true;
 	}
 	
-	bool exceptions()
+	bool try_dequeue_bulk_threaded()
 	{
-		typedef TestTraits<4, 2> Traits;
+		typedef TestTraits<2> Traits;
+		int dummy;
 		
+		// Explicit producer
 		{
-			// Explicit, basic
-			// enqueue
-			ConcurrentQueue<ThrowingMovable, Traits> q;
-			ProducerToken tok(q);
-			
-			ThrowingMovable::reset();
-			
-			bool threw = false;
-			try {
-				q.enqueue(tok, ThrowingMovable(1, true));
-			}
-			catch (ThrowingMovable* m) {
-				threw = true;
-				ASSERT_OR_FAIL(m->id == 1);
-				ASSERT_OR_FAIL(m->moved);
-			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 0);
-			
-			ASSERT_OR_FAIL(q.enqueue(tok, ThrowingMovable(2)));
-			ThrowingMovable result(-1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 2);
-			ASSERT_OR_FAIL(result.moved);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 3);
-			
-			// dequeue
-			ThrowingMovable::reset();
-			q.enqueue(tok, ThrowingMovable(10));
-			q.enqueue(tok, ThrowingMovable(11, false, true));
-			q.enqueue(tok, ThrowingMovable(12));
-			ASSERT_OR_FAIL(q.size_approx() == 3);
-			
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 10);
-			threw = false;
-			try {
-				q.try_dequeue(result);
+			Traits::reset();
+			ConcurrentQueue<int, Traits> q;
+			SimpleThread threads[2];
+			bool success[2] = { true, true };
+			for (int i = 0; i != 2; ++i) {
+				if (i == 0) {
+					threads[i] = SimpleThread([&](int i) {
+						// Producer
+						ProducerToken tok(q);
+						for (int i = 0; i != 32*1024; ++i) {
+							q.enqueue(tok, i);
+						}
+					}, i);
+				}
+				else {
+					threads[i] = SimpleThread([&](int i) {
+						// Consumer
+						int items[5];
+						int prevItem = -1;
+						for (int i = 0; i != 32*1024;) {
+							auto dequeued = q.try_dequeue_bulk(items, 5);
+							if (dequeued > 0) {
+								if (dequeued > 5) {
+									success[i] = false;
+									break;
+								}
+								for (std::size_t j = 0; j != dequeued; ++j) {
+									if (items[j] != prevItem + 1) {
+										success[i] = false;
+									}
+									prevItem = items[j];
+								}
+								i += (int)dequeued;
+							}
+						}
+					}, i);
+				}
 			}
-			catch (ThrowingMovable* m) {
-				ASSERT_OR_FAIL(m->id == 11);
-				threw = true;
+			for (int i = 0; i != 2; ++i) {
+				threads[i].join();
 			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 12);
-			ASSERT_OR_FAIL(result.moved);
 			
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			q.enqueue(tok, ThrowingMovable(13));
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 13);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 8);
+			ASSERT_OR_FAIL(success[0]);
+			ASSERT_OR_FAIL(success[1]);
+			ASSERT_OR_FAIL(!q.try_dequeue(dummy));
 		}
 		
+		// Implicit producer
 		{
-			// Explicit, on and off block boundaries
-			// enqueue
-			ConcurrentQueue<ThrowingMovable, Traits> q;
-			ProducerToken tok(q);
-			
-			ThrowingMovable::reset();
-			
-			for (int i = 0; i != 3; ++i) {
-				q.enqueue(tok, ThrowingMovable(i));
-			}
-			bool threw = false;
-			try {
-				q.enqueue(tok, ThrowingMovable(3, true));
-			}
-			catch (ThrowingMovable* m) {
-				threw = true;
-				ASSERT_OR_FAIL(m->id == 3);
-			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 3);
-			
-			q.enqueue(tok, ThrowingMovable(4));
-			threw = false;
-			try {
-				q.enqueue(tok, ThrowingMovable(5, true));
-			}
-			catch (ThrowingMovable* m) {
-				threw = true;
-				ASSERT_OR_FAIL(m->id == 5);
-				ASSERT_OR_FAIL(m->moved);
-			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 4);
-			q.enqueue(tok, ThrowingMovable(6));
-			
-			ThrowingMovable result(-1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 0);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 2);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 4);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 6);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 12);
-			
-			// dequeue
-			ThrowingMovable::reset();
-			q.enqueue(tok, ThrowingMovable(10, false, true));
-			q.enqueue(tok, ThrowingMovable(11));
-			q.enqueue(tok, ThrowingMovable(12));
-			q.enqueue(tok, ThrowingMovable(13, false, true));
-			q.enqueue(tok, ThrowingMovable(14, false, true));
-			q.enqueue(tok, ThrowingMovable(15, false, true));
-			q.enqueue(tok, ThrowingMovable(16));
-			ASSERT_OR_FAIL(q.size_approx() == 7);
-			
-			for (int i = 10; i != 17; ++i) {
-				if (i == 10 || (i >= 13 && i <= 15)) {
-					threw = false;
-					try {
-						q.try_dequeue(result);
-					}
-					catch (ThrowingMovable* m) {
-						ASSERT_OR_FAIL(m->id == i);
-						ASSERT_OR_FAIL(m->moved);
-						threw = true;
-					}
-					ASSERT_OR_FAIL(threw);
+			Traits::reset();
+			ConcurrentQueue<int, Traits> q;
+			SimpleThread threads[2];
+			bool success[2] = { true, true };
+			for (int i = 0; i != 2; ++i) {
+				if (i == 0) {
+					threads[i] = SimpleThread([&](int i) {
+						// Producer
+						for (int i = 0; i != 32*1024; ++i) {
+							q.enqueue(i);
+						}
+					}, i);
 				}
 				else {
-					ASSERT_OR_FAIL(q.try_dequeue(result));
-					ASSERT_OR_FAIL(result.id == i);
-					ASSERT_OR_FAIL(result.moved);
+					threads[i] = SimpleThread([&](int i) {
+						// Consumer
+						int items[5];
+						int prevItem = -1;
+						for (int i = 0; i != 32*1024;) {
+							auto dequeued = q.try_dequeue_bulk(items, 5);
+							if (dequeued > 0) {
+								if (dequeued > 5) {
+									success[i] = false;
+									break;
+								}
+								for (std::size_t j = 0; j != dequeued; ++j) {
+									if (items[j] != prevItem + 1) {
+										success[i] = false;
+									}
+									prevItem = items[j];
+								}
+								i += (int)dequeued;
+							}
+						}
+					}, i);
 				}
-				ASSERT_OR_FAIL(q.size_approx() == (std::uint32_t)(16 - i));
+			}
+			for (int i = 0; i != 2; ++i) {
+				threads[i].join();
 			}
 			
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			q.enqueue(tok, ThrowingMovable(20));
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 20);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 16);
+			ASSERT_OR_FAIL(success[0]);
+			ASSERT_OR_FAIL(success[1]);
+			ASSERT_OR_FAIL(!q.try_dequeue(dummy));
 		}
 		
+		// Multithreaded consumption
 		{
-			// Explicit bulk
-			// enqueue
-			ConcurrentQueue<ThrowingMovable, Traits> q;
-			ProducerToken tok(q);
-			
-			ThrowingMovable::reset();
-			std::vector<ThrowingMovable> items;
-			items.reserve(5);
-			items.push_back(ThrowingMovable(1));
-			items.push_back(ThrowingMovable(2));
-			items.push_back(ThrowingMovable(3));
-			items.push_back(ThrowingMovable(4));
-			items.push_back(ThrowingMovable(5));
-			items.back().throwOnCctor = true;
-			
-			bool threw = false;
-			try {
-				q.enqueue_bulk(tok, std::make_move_iterator(items.begin()), 5);
-			}
-			catch (ThrowingMovable* m) {
-				threw = true;
-				ASSERT_OR_FAIL(m->id == 5);
-				ASSERT_OR_FAIL(m->copied);
-			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 0);
-			q.enqueue(tok, ThrowingMovable(6));
+			Traits::reset();
+			ConcurrentQueue<int, Traits> q;
 			
-			threw = false;
-			try {
-				q.enqueue_bulk(tok, std::make_move_iterator(items.begin()), 5);
-			}
-			catch (ThrowingMovable* m) {
-				threw = true;
-				ASSERT_OR_FAIL(m->id == 5);
+			bool success[20];
+			SimpleThread threads[20];
+			for (int i = 0; i != 10; ++i) {
+				success[i] = true;
+				threads[i] = SimpleThread([&](int i) {
+					ProducerToken t(q);
+					if ((i & 1) == 1) {
+						for (int j = 0; j != 100; ++j) {
+							q.enqueue(t, i * 128 + j);
+						}
+					}
+					else {
+						for (int j = 0; j != 100; ++j) {
+							q.enqueue(i * 128 + j);
+						}
+					}
+				}, i);
 			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 1);
 			
-			ThrowingMovable result(-1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 6);
-			ASSERT_OR_FAIL(result.moved);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 15);
-			
-			// dequeue
-			ThrowingMovable::reset();
-			q.enqueue(tok, ThrowingMovable(10));
-			q.enqueue(tok, ThrowingMovable(11));
-			q.enqueue(tok, ThrowingMovable(12));
-			q.enqueue(tok, ThrowingMovable(13));
-			q.enqueue(tok, ThrowingMovable(14, false, true, true));		// std::back_inserter turns an assignment into a ctor call
-			q.enqueue(tok, ThrowingMovable(15));
-			ASSERT_OR_FAIL(q.size_approx() == 6);
-			
-			std::vector<ThrowingMovable> results;
-			results.reserve(5);
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(std::back_inserter(results), 2));
-			ASSERT_OR_FAIL(results.size() == 2);
-			ASSERT_OR_FAIL(results[0].id == 10);
-			ASSERT_OR_FAIL(results[1].id == 11);
-			ASSERT_OR_FAIL(results[0].moved);
-			ASSERT_OR_FAIL(results[1].moved);
-			ASSERT_OR_FAIL(q.size_approx() == 4);
-			threw = false;
-			try {
-				q.try_dequeue_bulk(std::back_inserter(results), 4);
-			}
-			catch (ThrowingMovable*) {
-				// Note: Can't inspect thrown value since it points to an object whose construction was attempted on the vector and
-				// no longer exists
-				threw = true;
+			std::atomic<size_t> dequeueCount(0);
+			for (int i = 10; i != 20; ++i) {
+				success[i] = true;
+				threads[i] = SimpleThread([&](int i) {
+					int prevItems[10];
+					for (int j = 0; j != 10; ++j) {
+						prevItems[j] = -1;
+					}
+					int items[15];
+					ConsumerToken t(q);
+					
+					while (dequeueCount.load(std::memory_order_relaxed) != 1000) {
+						size_t count;
+						if ((i & 1) == 1) {
+							count = q.try_dequeue_bulk(items, 15);
+						}
+						else {
+							count = q.try_dequeue_bulk(t, items, 15);
+						}
+						
+						if (count > 15) {
+							success[i] = false;
+						}
+						for (size_t k = 0; k != count; ++k) {
+							if (prevItems[items[k] / 128] >= (items[k] & 127)) {
+								success[i] = false;
+							}
+							prevItems[items[k] / 128] = items[k] & 127;
+						}
+						dequeueCount.fetch_add(count, std::memory_order_relaxed);
+					}
+				}, i);
 			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 0);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(std::back_inserter(results), 1) == 0);
 			
-			ASSERT_OR_FAIL(results.size() == 4);
-			ASSERT_OR_FAIL(results[2].id == 12);
-			ASSERT_OR_FAIL(results[3].id == 13);
+			for (int i = 0; i != 20; ++i) {
+				threads[i].join();
+			}
 			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 12);
+			int item;
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			for (int i = 0; i != 20; ++i) {
+				ASSERT_OR_FAIL(success[i]);
+			}
 		}
 		
+		return true;
+	}
+	
+	struct Tick
+	{
+		std::uint64_t timestamp;
+		std::uint32_t symbol;
+		float price;
+	};
+	
+	bool trivially_copyable_bulk()
+	{
+		// Runs of trivially copyable elements are memcpy'd in and out of blocks when
+		// the other side is a pointer; make sure that's right across block boundaries
+		typedef TestTraits<8> Traits;
 		
-		{
-			// Implicit, basic
-			// enqueue
-			ConcurrentQueue<ThrowingMovable, Traits> q;
-			
-			ThrowingMovable::reset();
-			
-			bool threw = false;
-			try {
-				q.enqueue(ThrowingMovable(1, true));
+		Tick ticks[50];
+		for (int i = 0; i != 50; ++i) {
+			ticks[i].timestamp = (std::uint64_t)i * 1000;
+			ticks[i].symbol = (std::uint32_t)i;
+			ticks[i].price = (float)i / 2;
+		}
+		
+		for (int explicitProducer = 0; explicitProducer != 2; ++explicitProducer) {
+			ConcurrentQueue<Tick, Traits> q;
+			ProducerToken tok(q);
+			Tick const* constTicks = ticks;
+			if (explicitProducer) {
+				ASSERT_OR_FAIL(q.enqueue_bulk(tok, ticks, 3));
+				ASSERT_OR_FAIL(q.enqueue_bulk(tok, constTicks + 3, 20));
+				ASSERT_OR_FAIL(q.enqueue_bulk(tok, std::make_move_iterator(ticks + 23), 27));
 			}
-			catch (ThrowingMovable* m) {
-				threw = true;
-				ASSERT_OR_FAIL(m->id == 1);
-				ASSERT_OR_FAIL(m->moved);
+			else {
+				ASSERT_OR_FAIL(q.enqueue_bulk(ticks, 3));
+				ASSERT_OR_FAIL(q.enqueue_bulk(constTicks + 3, 20));
+				ASSERT_OR_FAIL(q.enqueue_bulk(std::make_move_iterator(ticks + 23), 27));
 			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 0);
-			
-			ASSERT_OR_FAIL(q.enqueue(ThrowingMovable(2)));
-			ThrowingMovable result(-1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 2);
-			ASSERT_OR_FAIL(result.moved);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 3);
-			
-			// dequeue
-			ThrowingMovable::reset();
-			q.enqueue(ThrowingMovable(10));
-			q.enqueue(ThrowingMovable(11, false, true));
-			q.enqueue(ThrowingMovable(12));
-			ASSERT_OR_FAIL(q.size_approx() == 3);
+			ASSERT_OR_FAIL(q.size_approx() == 50);
 			
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 10);
-			threw = false;
-			try {
-				q.try_dequeue(result);
+			Tick results[50];
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(results, 5) == 5);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(results + 5, 30) == 30);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(results + 35, 30) == 15);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(results, 1) == 0);
+			for (int i = 0; i != 50; ++i) {
+				ASSERT_OR_FAIL(results[i].timestamp == ticks[i].timestamp);
+				ASSERT_OR_FAIL(results[i].symbol == ticks[i].symbol);
+				ASSERT_OR_FAIL(results[i].price == ticks[i].price);
 			}
-			catch (ThrowingMovable* m) {
-				ASSERT_OR_FAIL(m->id == 11);
-				threw = true;
+		}
+		
+		return true;
+	}
+	
+	struct PrefetchTraits : public TestTraits<4>
+	{
+		static const bool PREFETCH_NEXT_BLOCK = true;
+	};
+	
+	bool prefetch_next_block()
+	{
+		// Bulk operations spanning several blocks prefetch the block after the current one;
+		// make sure that never touches a block that isn't there, with and without memcpy
+		for (int explicitProducer = 0; explicitProducer != 2; ++explicitProducer) {
+			ConcurrentQueue<int, PrefetchTraits> q;
+			ProducerToken tok(q);
+			std::vector<int> source(37);
+			for (int i = 0; i != 37; ++i) {
+				source[i] = i;
+			}
+			for (int round = 0; round != 3; ++round) {
+				if (explicitProducer) {
+					ASSERT_OR_FAIL(q.enqueue_bulk(tok, source.begin(), 37));
+					ASSERT_OR_FAIL(q.enqueue_bulk(tok, source.data(), 37));
+				}
+				else {
+					ASSERT_OR_FAIL(q.enqueue_bulk(source.begin(), 37));
+					ASSERT_OR_FAIL(q.enqueue_bulk(source.data(), 37));
+				}
+				
+				int results[74];
+				std::vector<int> moreResults(74);
+				ASSERT_OR_FAIL(q.try_dequeue_bulk(results, 30) == 30);
+				ASSERT_OR_FAIL(q.try_dequeue_bulk(moreResults.begin(), 74) == 44);
+				ASSERT_OR_FAIL(q.try_dequeue_bulk(results, 1) == 0);
+				for (int i = 0; i != 74; ++i) {
+					ASSERT_OR_FAIL((i < 30 ? results[i] : moreResults[i - 30]) == i % 37);
+				}
+			}
+		}
+		
+		return true;
+	}
+	
+	bool implicit_producer_hash()
+	{
+		for (int j = 0; j != 5; ++j) {
+			ConcurrentQueue<int, MallocTrackingTraits> q;
+			std::vector<SimpleThread> threads;
+			for (int i = 0; i != 20; ++i) {
+				threads.push_back(SimpleThread([&]() {
+					q.enqueue(7);
+				}));
 			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 12);
-			ASSERT_OR_FAIL(result.moved);
 			
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			q.enqueue(ThrowingMovable(13));
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 13);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			for (auto it = threads.begin(); it != threads.end(); ++it) {
+				it->join();
+			}
 			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 8);
+			int item;
+			ConsumerToken t(q);
+			for (auto i = 0; i != 20; ++i) {
+				if ((j & 1) == 0) {
+					ASSERT_OR_FAIL(q.try_dequeue(item));
+				}
+				else {
+					ASSERT_OR_FAIL(q.try_dequeue(t, item));
+				}
+				ASSERT_OR_FAIL(item == 7);
+			}
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
 		}
 		
+		return true;
+	}
+	
+	bool index_wrapping()
+	{
 		{
-			// Implicit, on and off block boundaries
-			// enqueue
-			ConcurrentQueue<ThrowingMovable, Traits> q;
-			
-			ThrowingMovable::reset();
+			// Implicit
+			ConcurrentQueue<int, SmallIndexTraits> q(16);
+			int item;
 			
-			for (int i = 0; i != 3; ++i) {
-				q.enqueue(ThrowingMovable(i));
-			}
-			bool threw = false;
-			try {
-				q.enqueue(ThrowingMovable(3, true));
-			}
-			catch (ThrowingMovable* m) {
-				threw = true;
-				ASSERT_OR_FAIL(m->id == 3);
+			for (int i = 0; i != (1 << 18); ++i) {
+				if ((i & 16) == 0) {
+					ASSERT_OR_FAIL(q.try_enqueue(i));
+				}
+				else {
+					ASSERT_OR_FAIL(q.try_dequeue(item));
+					ASSERT_OR_FAIL(item == (i - 16));
+				}
 			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 3);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		{
+			// Explicit
+			ConcurrentQueue<int, SmallIndexTraits> q(16);
+			ProducerToken tok(q);
+			int item;
 			
-			q.enqueue(ThrowingMovable(4));
-			threw = false;
-			try {
-				q.enqueue(ThrowingMovable(5, true));
-			}
-			catch (ThrowingMovable* m) {
-				threw = true;
-				ASSERT_OR_FAIL(m->id == 5);
-				ASSERT_OR_FAIL(m->moved);
+			for (int i = 0; i != (1 << 18); ++i) {
+				if ((i & 16) == 0) {
+					ASSERT_OR_FAIL(q.try_enqueue(tok, i));
+				}
+				else {
+					ASSERT_OR_FAIL(q.try_dequeue_from_producer(tok, item));
+					ASSERT_OR_FAIL(item == (i - 16));
+				}
 			}
-			ASSERT_OR_FAIL(threw);
-			ASSERT_OR_FAIL(q.size_approx() == 4);
-			q.enqueue(ThrowingMovable(6));
-			
-			ThrowingMovable result(-1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 0);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 2);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 4);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 6);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		{
+			// Implicit extra small
+			ConcurrentQueue<int, ExtraSmallIndexTraits> q(1);
+			int item;
 			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 12);
+			for (int i = 0; i != 4097; ++i) {
+				q.enqueue(i);
+				ASSERT_OR_FAIL(q.try_dequeue(item));
+				ASSERT_OR_FAIL(item == i);
+			}
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		{
+			// Explicit extra small
+			ConcurrentQueue<int, ExtraSmallIndexTraits> q(1);
+			ProducerToken tok(q);
+			int item;
 			
-			// dequeue
-			ThrowingMovable::reset();
-			q.enqueue(ThrowingMovable(10, false, true));
-			q.enqueue(ThrowingMovable(11));
-			q.enqueue(ThrowingMovable(12));
-			q.enqueue(ThrowingMovable(13, false, true));
-			q.enqueue(ThrowingMovable(14, false, true));
-			q.enqueue(ThrowingMovable(15, false, true));
-			q.enqueue(ThrowingMovable(16));
-			ASSERT_OR_FAIL(q.size_approx() == 7);
+			for (int i = 0; i != 4097; ++i) {
+				q.enqueue(tok, i);
+				ASSERT_OR_FAIL(q.try_dequeue(item));
+				ASSERT_OR_FAIL(item == i);
+			}
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		return true;
+	}
+	
+	struct SizeLimitTraits : public MallocTrackingTraits
+	{
+		static const size_t BLOCK_SIZE = 2;
+		static const size_t MAX_SUBQUEUE_SIZE = 5;		// Will round up to 6 because of block size
+	};
+	
+	bool subqueue_size_limit()
+	{
+		{
+			// Explicit
+			ConcurrentQueue<int, SizeLimitTraits> q;
+			ProducerToken t(q);
+			int item;
 			
-			for (int i = 10; i != 17; ++i) {
-				if (i == 10 || (i >= 13 && i <= 15)) {
-					threw = false;
-					try {
-						q.try_dequeue(result);
-					}
-					catch (ThrowingMovable* m) {
-						ASSERT_OR_FAIL(m->id == i);
-						ASSERT_OR_FAIL(m->moved);
-						threw = true;
-					}
-					ASSERT_OR_FAIL(threw);
-				}
-				else {
-					ASSERT_OR_FAIL(q.try_dequeue(result));
-					ASSERT_OR_FAIL(result.id == i);
-					ASSERT_OR_FAIL(result.moved);
-				}
-				ASSERT_OR_FAIL(q.size_approx() == (std::uint32_t)(16 - i));
+			ASSERT_OR_FAIL(q.enqueue(t, 1));
+			ASSERT_OR_FAIL(q.enqueue(t, 2));
+			ASSERT_OR_FAIL(q.enqueue(t, 3));
+			ASSERT_OR_FAIL(q.enqueue(t, 4));
+			ASSERT_OR_FAIL(q.enqueue(t, 5));
+			ASSERT_OR_FAIL(q.enqueue(t, 6));
+			ASSERT_OR_FAIL(!q.enqueue(t, 7));
+			ASSERT_OR_FAIL(!q.enqueue(t, 8));
+			
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 1);
+			ASSERT_OR_FAIL(!q.enqueue(t, 7));		// Can't reuse block until it's completely empty
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 2);
+			ASSERT_OR_FAIL(q.enqueue(t, 7));
+			ASSERT_OR_FAIL(q.enqueue(t, 8));
+			ASSERT_OR_FAIL(!q.enqueue(t, 9));
+			
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 3);
+			ASSERT_OR_FAIL(!q.enqueue(t, 9));
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 4);
+			ASSERT_OR_FAIL(q.enqueue(t, 9));
+			
+			for (int i = 5; i <= 9; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+			}
+			ASSERT_OR_FAIL(q.enqueue(t, 10));
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 10);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			for (int i = 0; i != 6; ++i) {
+				ASSERT_OR_FAIL(q.try_enqueue(t, i));
 			}
+			ASSERT_OR_FAIL(!q.try_enqueue(t, 7));
+			ASSERT_OR_FAIL(!q.enqueue(t, 7));
 			
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
-			q.enqueue(ThrowingMovable(20));
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 20);
-			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			// Bulk
+			int items[6];
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 6) == 6);
+			ASSERT_OR_FAIL(!q.try_enqueue_bulk(t, items, 7));
+			ASSERT_OR_FAIL(!q.enqueue_bulk(t, items, 7));
+			ASSERT_OR_FAIL(q.enqueue_bulk(t, items, 6));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 6) == 6);
+			ASSERT_OR_FAIL(q.enqueue_bulk(t, items, 3));
+			ASSERT_OR_FAIL(!q.enqueue_bulk(t, items, 4));
+			ASSERT_OR_FAIL(q.enqueue_bulk(t, items, 3));
+			ASSERT_OR_FAIL(!q.enqueue_bulk(t, items, 1));
+			ASSERT_OR_FAIL(!q.enqueue(t, 100));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 1) == 1);
+			ASSERT_OR_FAIL(!q.enqueue(t, 100));
+		}
+		
+		{
+			// Implicit
+			ConcurrentQueue<int, SizeLimitTraits> q;
+			int item;
 			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 16);
+			ASSERT_OR_FAIL(q.enqueue(1));
+			ASSERT_OR_FAIL(q.enqueue(2));
+			ASSERT_OR_FAIL(q.enqueue(3));
+			ASSERT_OR_FAIL(q.enqueue(4));
+			ASSERT_OR_FAIL(q.enqueue(5));
+			ASSERT_OR_FAIL(q.enqueue(6));
+			ASSERT_OR_FAIL(!q.enqueue(7));
+			ASSERT_OR_FAIL(!q.enqueue(8));
+			
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 1);
+			ASSERT_OR_FAIL(!q.enqueue(7));		// Can't reuse block until it's completely empty
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 2);
+			ASSERT_OR_FAIL(q.enqueue(7));
+			ASSERT_OR_FAIL(q.enqueue(8));
+			ASSERT_OR_FAIL(!q.enqueue(9));
+			
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 3);
+			ASSERT_OR_FAIL(!q.enqueue(9));
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 4);
+			ASSERT_OR_FAIL(q.enqueue(9));
+			
+			for (int i = 5; i <= 9; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+			}
+			ASSERT_OR_FAIL(q.enqueue(10));
+			ASSERT_OR_FAIL(q.try_dequeue(item) && item == 10);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			for (int i = 0; i != 6; ++i) {
+				ASSERT_OR_FAIL(q.try_enqueue(i));
+			}
+			ASSERT_OR_FAIL(!q.try_enqueue(7));
+			ASSERT_OR_FAIL(!q.enqueue(7));
+			
+			// Bulk
+			int items[6];
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 6) == 6);
+			ASSERT_OR_FAIL(!q.try_enqueue_bulk(items, 7));
+			ASSERT_OR_FAIL(!q.enqueue_bulk(items, 7));
+			ASSERT_OR_FAIL(q.enqueue_bulk(items, 6));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 6) == 6);
+			ASSERT_OR_FAIL(q.enqueue_bulk(items, 3));
+			ASSERT_OR_FAIL(!q.enqueue_bulk(items, 4));
+			ASSERT_OR_FAIL(q.enqueue_bulk(items, 3));
+			ASSERT_OR_FAIL(!q.enqueue_bulk(items, 1));
+			ASSERT_OR_FAIL(!q.enqueue(100));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(items, 1) == 1);
+			ASSERT_OR_FAIL(!q.enqueue(100));
 		}
 		
+		return true;
+	}
+	
+	bool exceptions()
+	{
+		typedef TestTraits<4, 2> Traits;
+		
 		{
-			// Impplicit bulk
+			// Explicit, basic
 			// enqueue
 			ConcurrentQueue<ThrowingMovable, Traits> q;
+			ProducerToken tok(q);
 			
 			ThrowingMovable::reset();
-			std::vector<ThrowingMovable> items;
-			items.reserve(5);
-			items.push_back(ThrowingMovable(1));
-			items.push_back(ThrowingMovable(2));
-			items.push_back(ThrowingMovable(3));
-			items.push_back(ThrowingMovable(4));
-			items.push_back(ThrowingMovable(5));
-			items.back().throwOnCctor = true;
 			
 			bool threw = false;
 			try {
-				q.enqueue_bulk(std::make_move_iterator(items.begin()), 5);
+				q.enqueue(tok, ThrowingMovable(1, true));
 			}
 			catch (ThrowingMovable* m) {
 				threw = true;
-				ASSERT_OR_FAIL(m->id == 5);
-				ASSERT_OR_FAIL(m->copied);
+				ASSERT_OR_FAIL(m->id == 1);
+				ASSERT_OR_FAIL(m->moved);
 			}
 			ASSERT_OR_FAIL(threw);
 			ASSERT_OR_FAIL(q.size_approx() == 0);
-			q.enqueue(ThrowingMovable(6));
 			
+			ASSERT_OR_FAIL(q.enqueue(tok, ThrowingMovable(2)));
+			ThrowingMovable result(-1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 2);
+			ASSERT_OR_FAIL(result.moved);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 3);
+			
+			// dequeue
+			ThrowingMovable::reset();
+			q.enqueue(tok, ThrowingMovable(10));
+			q.enqueue(tok, ThrowingMovable(11, false, true));
+			q.enqueue(tok, ThrowingMovable(12));
+			ASSERT_OR_FAIL(q.size_approx() == 3);
+			
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 10);
 			threw = false;
 			try {
-				q.enqueue_bulk(std::make_move_iterator(items.begin()), 5);
+				q.try_dequeue(result);
 			}
 			catch (ThrowingMovable* m) {
+				ASSERT_OR_FAIL(m->id == 11);
 				threw = true;
-				ASSERT_OR_FAIL(m->id == 5);
 			}
 			ASSERT_OR_FAIL(threw);
 			ASSERT_OR_FAIL(q.size_approx() == 1);
 			
-			ThrowingMovable result(-1);
 			ASSERT_OR_FAIL(q.try_dequeue(result));
-			ASSERT_OR_FAIL(result.id == 6);
+			ASSERT_OR_FAIL(result.id == 12);
 			ASSERT_OR_FAIL(result.moved);
+			
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			q.enqueue(tok, ThrowingMovable(13));
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 13);
 			ASSERT_OR_FAIL(!q.try_dequeue(result));
 			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 15);
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 8);
+		}
+		
+		{
+			// Explicit, on and off block boundaries
+			// enqueue
+			ConcurrentQueue<ThrowingMovable, Traits> q;
+			ProducerToken tok(q);
 			
-			// dequeue
 			ThrowingMovable::reset();
-			q.enqueue(ThrowingMovable(10));
-			q.enqueue(ThrowingMovable(11));
-			q.enqueue(ThrowingMovable(12));
-			q.enqueue(ThrowingMovable(13));
-			q.enqueue(ThrowingMovable(14, false, true, true));		// std::back_inserter turns an assignment into a ctor call
-			q.enqueue(ThrowingMovable(15));
+			
+			for (int i = 0; i != 3; ++i) {
+				q.enqueue(tok, ThrowingMovable(i));
+			}
+			bool threw = false;
+			try {
+				q.enqueue(tok, ThrowingMovable(3, true));
+			}
+			catch (ThrowingMovable* m) {
+				threw = true;
+				ASSERT_OR_FAIL(m->id == 3);
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 3);
+			
+			q.enqueue(tok, ThrowingMovable(4));
+			threw = false;
+			try {
+				q.enqueue(tok, ThrowingMovable(5, true));
+			}
+			catch (ThrowingMovable* m) {
+				threw = true;
+				ASSERT_OR_FAIL(m->id == 5);
+				ASSERT_OR_FAIL(m->moved);
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 4);
+			q.enqueue(tok, ThrowingMovable(6));
+			
+			ThrowingMovable result(-1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 0);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 2);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 4);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 6);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 12);
+			
+			// dequeue
+			ThrowingMovable::reset();
+			q.enqueue(tok, ThrowingMovable(10, false, true));
+			q.enqueue(tok, ThrowingMovable(11));
+			q.enqueue(tok, ThrowingMovable(12));
+			q.enqueue(tok, ThrowingMovable(13, false, true));
+			q.enqueue(tok, ThrowingMovable(14, false, true));
+			q.enqueue(tok, ThrowingMovable(15, false, true));
+			q.enqueue(tok, ThrowingMovable(16));
+			ASSERT_OR_FAIL(q.size_approx() == 7);
+			
+			for (int i = 10; i != 17; ++i) {
+				if (i == 10 || (i >= 13 && i <= 15)) {
+					threw = false;
+					try {
+						q.try_dequeue(result);
+					}
+					catch (ThrowingMovable* m) {
+						ASSERT_OR_FAIL(m->id == i);
+						ASSERT_OR_FAIL(m->moved);
+						threw = true;
+					}
+					ASSERT_OR_FAIL(threw);
+				}
+				else {
+					ASSERT_OR_FAIL(q.try_dequeue(result));
+					ASSERT_OR_FAIL(result.id == i);
+					ASSERT_OR_FAIL(result.moved);
+				}
+				ASSERT_OR_FAIL(q.size_approx() == (std::uint32_t)(16 - i));
+			}
+			
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			q.enqueue(tok, ThrowingMovable(20));
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 20);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 16);
+		}
+		
+		{
+			// Explicit bulk
+			// enqueue
+			ConcurrentQueue<ThrowingMovable, Traits> q;
+			ProducerToken tok(q);
+			
+			ThrowingMovable::reset();
+			std::vector<ThrowingMovable> items;
+			items.reserve(5);
+			items.push_back(ThrowingMovable(1));
+			items.push_back(ThrowingMovable(2));
+			items.push_back(ThrowingMovable(3));
+			items.push_back(ThrowingMovable(4));
+			items.push_back(ThrowingMovable(5));
+			items.back().throwOnCctor = true;
+			
+			bool threw = false;
+			try {
+				q.enqueue_bulk(tok, std::make_move_iterator(items.begin()), 5);
+			}
+			catch (ThrowingMovable* m) {
+				threw = true;
+				ASSERT_OR_FAIL(m->id == 5);
+				ASSERT_OR_FAIL(m->copied);
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			q.enqueue(tok, ThrowingMovable(6));
+			
+			threw = false;
+			try {
+				q.enqueue_bulk(tok, std::make_move_iterator(items.begin()), 5);
+			}
+			catch (ThrowingMovable* m) {
+				threw = true;
+				ASSERT_OR_FAIL(m->id == 5);
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			
+			ThrowingMovable result(-1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 6);
+			ASSERT_OR_FAIL(result.moved);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 15);
+			
+			// dequeue
+			ThrowingMovable::reset();
+			q.enqueue(tok, ThrowingMovable(10));
+			q.enqueue(tok, ThrowingMovable(11));
+			q.enqueue(tok, ThrowingMovable(12));
+			q.enqueue(tok, ThrowingMovable(13));
+			q.enqueue(tok, ThrowingMovable(14, false, true, true));		// std::back_inserter turns an assignment into a ctor call
+			q.enqueue(tok, ThrowingMovable(15));
 			ASSERT_OR_FAIL(q.size_approx() == 6);
 			
 			std::vector<ThrowingMovable> results;
@@ -2804,6 +3566,8 @@ public:
 				q.try_dequeue_bulk(std::back_inserter(results), 4);
 			}
 			catch (ThrowingMovable*) {
+				// Note: Can't inspect thrown value since it points to an object whose construction was attempted on the vector and
+				// no longer exists
 				threw = true;
 			}
 			ASSERT_OR_FAIL(threw);
@@ -2818,1451 +3582,2851 @@ public:
 			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 12);
 		}
 		
+		
 		{
-			// Threaded
+			// Implicit, basic
+			// enqueue
 			ConcurrentQueue<ThrowingMovable, Traits> q;
+			
 			ThrowingMovable::reset();
 			
-			std::vector<SimpleThread> threads(6);
-			for (std::size_t tid = 0; tid != threads.size(); ++tid) {
-				threads[tid] = SimpleThread([&](std::size_t tid) {
-					std::vector<ThrowingMovable> inVec;
-					inVec.push_back(ThrowingMovable(1));
-					inVec.push_back(ThrowingMovable(2));
-					inVec.push_back(ThrowingMovable(3));
-					
-					std::vector<ThrowingMovable> outVec;
-					outVec.push_back(ThrowingMovable(-1));
-					outVec.push_back(ThrowingMovable(-1));
-					outVec.push_back(ThrowingMovable(-1));
-					
-					ProducerToken tok(q);
-					ThrowingMovable result(-1);
-					
-					for (std::size_t i = 0; i != 8192; ++i) {
-						auto magic = (tid + 1) * i + tid * 17 + i;
-						auto op = magic & 7;
-						auto ctorThrow = (magic & 0x10) != 0;
-						auto assignThrow = (magic & 0x20) != 0;
-						auto throwOnNextCctor = (magic & 0x40) != 0;
-						try {
-							switch (op) {
-							case 0:
-								q.enqueue(tok, ThrowingMovable((int)i, ctorThrow, assignThrow, throwOnNextCctor));
-								break;
-							case 1:
-								inVec[i & 3].throwOnCctor = ctorThrow;
-								inVec[i & 3].throwOnAssignment = assignThrow;
-								inVec[i & 3].throwOnSecondCctor = throwOnNextCctor;
-								q.enqueue_bulk(tok, inVec.begin(), 3);
-								break;
-							case 2:
-								q.enqueue(ThrowingMovable((int)i, ctorThrow, assignThrow, throwOnNextCctor));
-								break;
-							case 3:
-								inVec[i & 3].throwOnCctor = ctorThrow;
-								inVec[i & 3].throwOnAssignment = assignThrow;
-								inVec[i & 3].throwOnSecondCctor = throwOnNextCctor;
-								q.enqueue_bulk(inVec.begin(), 3);
-								break;
-							case 4:
-							case 5:
-								q.try_dequeue(result);
-								break;
-							case 6:
-							case 7:
-								q.try_dequeue_bulk(outVec.data(), 3);
-								break;
+			bool threw = false;
+			try {
+				q.enqueue(ThrowingMovable(1, true));
+			}
+			catch (ThrowingMovable* m) {
+				threw = true;
+				ASSERT_OR_FAIL(m->id == 1);
+				ASSERT_OR_FAIL(m->moved);
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			
+			ASSERT_OR_FAIL(q.enqueue(ThrowingMovable(2)));
+			ThrowingMovable result(-1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 2);
+			ASSERT_OR_FAIL(result.moved);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 3);
+			
+			// dequeue
+			ThrowingMovable::reset();
+			q.enqueue(ThrowingMovable(10));
+			q.enqueue(ThrowingMovable(11, false, true));
+			q.enqueue(ThrowingMovable(12));
+			ASSERT_OR_FAIL(q.size_approx() == 3);
+			
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 10);
+			threw = false;
+			try {
+				q.try_dequeue(result);
+			}
+			catch (ThrowingMovable* m) {
+				ASSERT_OR_FAIL(m->id == 11);
+				threw = true;
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 12);
+			ASSERT_OR_FAIL(result.moved);
+			
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			q.enqueue(ThrowingMovable(13));
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 13);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 8);
+		}
+		
+		{
+			// Implicit, on and off block boundaries
+			// enqueue
+			ConcurrentQueue<ThrowingMovable, Traits> q;
+			
+			ThrowingMovable::reset();
+			
+			for (int i = 0; i != 3; ++i) {
+				q.enqueue(ThrowingMovable(i));
+			}
+			bool threw = false;
+			try {
+				q.enqueue(ThrowingMovable(3, true));
+			}
+			catch (ThrowingMovable* m) {
+				threw = true;
+				ASSERT_OR_FAIL(m->id == 3);
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 3);
+			
+			q.enqueue(ThrowingMovable(4));
+			threw = false;
+			try {
+				q.enqueue(ThrowingMovable(5, true));
+			}
+			catch (ThrowingMovable* m) {
+				threw = true;
+				ASSERT_OR_FAIL(m->id == 5);
+				ASSERT_OR_FAIL(m->moved);
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 4);
+			q.enqueue(ThrowingMovable(6));
+			
+			ThrowingMovable result(-1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 0);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 2);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 4);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 6);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 12);
+			
+			// dequeue
+			ThrowingMovable::reset();
+			q.enqueue(ThrowingMovable(10, false, true));
+			q.enqueue(ThrowingMovable(11));
+			q.enqueue(ThrowingMovable(12));
+			q.enqueue(ThrowingMovable(13, false, true));
+			q.enqueue(ThrowingMovable(14, false, true));
+			q.enqueue(ThrowingMovable(15, false, true));
+			q.enqueue(ThrowingMovable(16));
+			ASSERT_OR_FAIL(q.size_approx() == 7);
+			
+			for (int i = 10; i != 17; ++i) {
+				if (i == 10 || (i >= 13 && i <= 15)) {
+					threw = false;
+					try {
+						q.try_dequeue(result);
+					}
+					catch (ThrowingMovable* m) {
+						ASSERT_OR_FAIL(m->id == i);
+						ASSERT_OR_FAIL(m->moved);
+						threw = true;
+					}
+					ASSERT_OR_FAIL(threw);
+				}
+				else {
+					ASSERT_OR_FAIL(q.try_dequeue(result));
+					ASSERT_OR_FAIL(result.id == i);
+					ASSERT_OR_FAIL(result.moved);
+				}
+				ASSERT_OR_FAIL(q.size_approx() == (std::uint32_t)(16 - i));
+			}
+			
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			q.enqueue(ThrowingMovable(20));
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 20);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 16);
+		}
+		
+		{
+			// Impplicit bulk
+			// enqueue
+			ConcurrentQueue<ThrowingMovable, Traits> q;
+			
+			ThrowingMovable::reset();
+			std::vector<ThrowingMovable> items;
+			items.reserve(5);
+			items.push_back(ThrowingMovable(1));
+			items.push_back(ThrowingMovable(2));
+			items.push_back(ThrowingMovable(3));
+			items.push_back(ThrowingMovable(4));
+			items.push_back(ThrowingMovable(5));
+			items.back().throwOnCctor = true;
+			
+			bool threw = false;
+			try {
+				q.enqueue_bulk(std::make_move_iterator(items.begin()), 5);
+			}
+			catch (ThrowingMovable* m) {
+				threw = true;
+				ASSERT_OR_FAIL(m->id == 5);
+				ASSERT_OR_FAIL(m->copied);
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			q.enqueue(ThrowingMovable(6));
+			
+			threw = false;
+			try {
+				q.enqueue_bulk(std::make_move_iterator(items.begin()), 5);
+			}
+			catch (ThrowingMovable* m) {
+				threw = true;
+				ASSERT_OR_FAIL(m->id == 5);
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			
+			ThrowingMovable result(-1);
+			ASSERT_OR_FAIL(q.try_dequeue(result));
+			ASSERT_OR_FAIL(result.id == 6);
+			ASSERT_OR_FAIL(result.moved);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 15);
+			
+			// dequeue
+			ThrowingMovable::reset();
+			q.enqueue(ThrowingMovable(10));
+			q.enqueue(ThrowingMovable(11));
+			q.enqueue(ThrowingMovable(12));
+			q.enqueue(ThrowingMovable(13));
+			q.enqueue(ThrowingMovable(14, false, true, true));		// std::back_inserter turns an assignment into a ctor call
+			q.enqueue(ThrowingMovable(15));
+			ASSERT_OR_FAIL(q.size_approx() == 6);
+			
+			std::vector<ThrowingMovable> results;
+			results.reserve(5);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(std::back_inserter(results), 2));
+			ASSERT_OR_FAIL(results.size() == 2);
+			ASSERT_OR_FAIL(results[0].id == 10);
+			ASSERT_OR_FAIL(results[1].id == 11);
+			ASSERT_OR_FAIL(results[0].moved);
+			ASSERT_OR_FAIL(results[1].moved);
+			ASSERT_OR_FAIL(q.size_approx() == 4);
+			threw = false;
+			try {
+				q.try_dequeue_bulk(std::back_inserter(results), 4);
+			}
+			catch (ThrowingMovable*) {
+				threw = true;
+			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(std::back_inserter(results), 1) == 0);
+			
+			ASSERT_OR_FAIL(results.size() == 4);
+			ASSERT_OR_FAIL(results[2].id == 12);
+			ASSERT_OR_FAIL(results[3].id == 13);
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() == 12);
+		}
+		
+		{
+			// Threaded
+			ConcurrentQueue<ThrowingMovable, Traits> q;
+			ThrowingMovable::reset();
+			
+			std::vector<SimpleThread> threads(6);
+			for (std::size_t tid = 0; tid != threads.size(); ++tid) {
+				threads[tid] = SimpleThread([&](std::size_t tid) {
+					std::vector<ThrowingMovable> inVec;
+					inVec.push_back(ThrowingMovable(1));
+					inVec.push_back(ThrowingMovable(2));
+					inVec.push_back(ThrowingMovable(3));
+					
+					std::vector<ThrowingMovable> outVec;
+					outVec.push_back(ThrowingMovable(-1));
+					outVec.push_back(ThrowingMovable(-1));
+					outVec.push_back(ThrowingMovable(-1));
+					
+					ProducerToken tok(q);
+					ThrowingMovable result(-1);
+					
+					for (std::size_t i = 0; i != 8192; ++i) {
+						auto magic = (tid + 1) * i + tid * 17 + i;
+						auto op = magic & 7;
+						auto ctorThrow = (magic & 0x10) != 0;
+						auto assignThrow = (magic & 0x20) != 0;
+						auto throwOnNextCctor = (magic & 0x40) != 0;
+						try {
+							switch (op) {
+							case 0:
+								q.enqueue(tok, ThrowingMovable((int)i, ctorThrow, assignThrow, throwOnNextCctor));
+								break;
+							case 1:
+								inVec[i & 3].throwOnCctor = ctorThrow;
+								inVec[i & 3].throwOnAssignment = assignThrow;
+								inVec[i & 3].throwOnSecondCctor = throwOnNextCctor;
+								q.enqueue_bulk(tok, inVec.begin(), 3);
+								break;
+							case 2:
+								q.enqueue(ThrowingMovable((int)i, ctorThrow, assignThrow, throwOnNextCctor));
+								break;
+							case 3:
+								inVec[i & 3].throwOnCctor = ctorThrow;
+								inVec[i & 3].throwOnAssignment = assignThrow;
+								inVec[i & 3].throwOnSecondCctor = throwOnNextCctor;
+								q.enqueue_bulk(inVec.begin(), 3);
+								break;
+							case 4:
+							case 5:
+								q.try_dequeue(result);
+								break;
+							case 6:
+							case 7:
+								q.try_dequeue_bulk(outVec.data(), 3);
+								break;
+							}
+						}
+						catch (ThrowingMovable*) {
+						}
+					}
+				}, tid);
+			}
+			for (std::size_t i = 0; i != threads.size(); ++i) {
+				threads[i].join();
+			}
+			
+			ThrowingMovable result(-1);
+			while (true) {
+				try {
+					if (!q.try_dequeue(result)) {
+						break;
+					}
+				}
+				catch (ThrowingMovable*) {
+				}
+			}
+			
+			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() + 1 == ThrowingMovable::ctorCount());
+		}
+		
+		return true;
+	}
+	
+	bool test_threaded()
+	{
+		typedef TestTraits<4> Traits;
+		Traits::reset();
+		
+		bool inOrder = true;
+		
+		{
+			// Single producer, single consumer
+			ConcurrentQueue<int, Traits> q;
+			ProducerToken t(q);
+			SimpleThread a([&]() {
+				for (int i = 0; i != 123456; ++i) {
+					q.enqueue(t, i);
+				}
+			});
+			SimpleThread b([&]() {
+				int item;
+				int prevItem = -1;
+				while (true) {
+					if (q.try_dequeue_from_producer(t, item)) {
+						if (item == 123455) {
+							break;
+						}
+						inOrder = item == prevItem + 1 && inOrder;
+						prevItem = item;
+					}
+				}
+			});
+			
+			a.join();
+			b.join();
+		}
+		ASSERT_OR_FAIL(inOrder);
+		
+		{
+			// Single producer, multi consumer
+			ConcurrentQueue<int, Traits> q;
+			ProducerToken t(q);
+			SimpleThread a([&]() {
+				for (int i = 0; i != 123456; ++i) {
+					q.enqueue(t, i);
+				}
+			});
+			SimpleThread b([&]() {
+				int item, prevItem = -1;
+				for (int i = 0; i != 123456; ++i) {
+					if (q.try_dequeue_from_producer(t, item)) {
+						inOrder = item > prevItem && inOrder;
+						prevItem = item;
+					}
+				}
+			});
+			SimpleThread c([&]() {
+				int item;
+				for (int i = 0; i != 123456; ++i) q.try_dequeue_from_producer(t, item);
+			});
+			SimpleThread d([&]() {
+				int item;
+				for (int i = 0; i != 123456; ++i) q.try_dequeue_from_producer(t, item);
+			});
+			
+			a.join();
+			b.join();
+			c.join();
+			d.join();
+		}
+		ASSERT_OR_FAIL(inOrder);
+		
+		ASSERT_OR_FAIL(Traits::malloc_count() == Traits::free_count());
+		
+		return true;
+	}
+	
+	bool test_threaded_bulk()
+	{
+		typedef TestTraits<2> Traits;
+		
+		// Enqueue bulk (implicit)
+		Traits::reset();
+		{
+			ConcurrentQueue<int, Traits> q;
+			SimpleThread threads[2];
+			bool success[2];
+			
+			int stuff[] = { 1, 2, 3, 4, 5 };
+			for (int i = 0; i != 2; ++i) {
+				success[i] = true;
+				
+				if (i == 0) {
+					// Enqueue bulk
+					threads[i] = SimpleThread([&](int j) {
+						for (int k = 0; k != 2048; ++k) {
+							success[j] = q.enqueue_bulk(stuff, 5) && success[j];
+						}
+					}, i);
+				}
+				else {
+					// Dequeue
+					threads[i] = SimpleThread([&](int j) {
+						int item;
+						int prevItem = 0;
+						for (int k = 0; k != 2048 * 5;) {
+							if (q.try_dequeue(item)) {
+								if (item != prevItem + 1) {
+									success[j] = false;
+								}
+								prevItem = item;
+								if (item == 5) {
+									prevItem = 0;
+								}
+								++k;
+							}
+						}
+					}, i);
+				}
+			}
+			for (int i = 0; i != 2; ++i) {
+				threads[i].join();
+			}
+			
+			ASSERT_OR_FAIL(success[0]);
+			ASSERT_OR_FAIL(success[1]);
+		}
+		
+		// Enqueue bulk (while somebody is dequeueing (with tokens))
+		Traits::reset();
+		{
+			ConcurrentQueue<int, Traits> q;
+			SimpleThread threads[2];
+			bool success[2];
+			
+			int stuff[] = { 1, 2, 3, 4, 5 };
+			for (int i = 0; i != 2; ++i) {
+				success[i] = true;
+				
+				if (i == 0) {
+					// Enqueue bulk
+					threads[i] = SimpleThread([&](int j) {
+						ProducerToken tok(q);
+						for (int k = 0; k != 2048; ++k) {
+							success[j] = q.enqueue_bulk(tok, stuff, 5) && success[j];
+						}
+					}, i);
+				}
+				else {
+					// Dequeue
+					threads[i] = SimpleThread([&](int j) {
+						ConsumerToken tok(q);
+						int item;
+						int prevItem = 0;
+						for (int k = 0; k != 2048 * 5;) {
+							if (q.try_dequeue(tok, item)) {
+								if (item != prevItem + 1) {
+									success[j] = false;
+								}
+								prevItem = item;
+								if (item == 5) {
+									prevItem = 0;
+								}
+								++k;
+							}
+						}
+					}, i);
+				}
+			}
+			for (int i = 0; i != 2; ++i) {
+				threads[i].join();
+			}
+			
+			ASSERT_OR_FAIL(success[0]);
+			ASSERT_OR_FAIL(success[1]);
+		}
+		
+		return true;
+	}
+	
+	template<typename Traits>
+	bool full_api()
+	{
+		// A simple test that exercises the full public API (just to make sure every function is implemented
+		// and works on at least the most basic level)
+		
+		// enqueue(T const&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			Copyable original(12345);
+			ASSERT_OR_FAIL(q.enqueue(original));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// enqueue(T&&)
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			Moveable original(12345);
+			ASSERT_OR_FAIL(q.enqueue(std::move(original)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// enqueue(Token, T const&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ProducerToken t(q);
+			Copyable original(12345);
+			ASSERT_OR_FAIL(q.enqueue(t, original));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// enqueue(Token, T&&)
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ProducerToken t(q);
+			ASSERT_OR_FAIL(q.enqueue(t, Moveable(12345)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ProducerToken t(q);
+			Moveable original(12345);
+			ASSERT_OR_FAIL(q.enqueue(t, std::move(original)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ProducerToken t(q);
+			ASSERT_OR_FAIL(q.enqueue(t, Copyable(12345)));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_enqueue(T const&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			Copyable original(12345);
+			ASSERT_OR_FAIL(q.try_enqueue(original));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_enqueue(T&&)
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ASSERT_OR_FAIL(q.try_enqueue(Moveable(12345)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			Moveable original(12345);
+			ASSERT_OR_FAIL(q.try_enqueue(std::move(original)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ASSERT_OR_FAIL(q.try_enqueue(Copyable(12345)));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_enqueue(Token, T const&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ProducerToken t(q);
+			Copyable original(12345);
+			ASSERT_OR_FAIL(q.try_enqueue(t, original));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_enqueue(Token, T&&)
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ProducerToken t(q);
+			ASSERT_OR_FAIL(q.try_enqueue(t, Moveable(12345)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ProducerToken t(q);
+			Moveable original(12345);
+			ASSERT_OR_FAIL(q.try_enqueue(t, std::move(original)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ProducerToken t(q);
+			ASSERT_OR_FAIL(q.try_enqueue(t, Copyable(12345)));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// enqueue_bulk(It itemFirst, size_t count)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			Copyable original(12345);
+			ASSERT_OR_FAIL(q.enqueue_bulk(&original, 1));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			Moveable original(12345);
+			ASSERT_OR_FAIL(q.enqueue_bulk(std::make_move_iterator(&original), 1));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// enqueue_bulk(Token, It itemFirst, size_t count)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ProducerToken t(q);
+			Copyable original(12345);
+			ASSERT_OR_FAIL(q.enqueue_bulk(t, &original, 1));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ProducerToken t(q);
+			Moveable original(12345);
+			ASSERT_OR_FAIL(q.enqueue_bulk(t, std::make_move_iterator(&original), 1));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_enqueue_bulk(It itemFirst, size_t count)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			Copyable original(12345);
+			ASSERT_OR_FAIL(q.try_enqueue_bulk(&original, 1));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			Moveable original(12345);
+			ASSERT_OR_FAIL(q.try_enqueue_bulk(std::make_move_iterator(&original), 1));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_enqueue_bulk(Token, It itemFirst, size_t count)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ProducerToken t(q);
+			Copyable original(12345);
+			ASSERT_OR_FAIL(q.try_enqueue_bulk(t, &original, 1));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ProducerToken t(q);
+			Moveable original(12345);
+			ASSERT_OR_FAIL(q.try_enqueue_bulk(t, std::make_move_iterator(&original), 1));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_dequeue(T&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_dequeue(Token, T&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
+			Copyable item(0);
+			ConsumerToken t(q);
+			ASSERT_OR_FAIL(q.try_dequeue(t, item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(t, item));
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
+			Moveable item(0);
+			ConsumerToken t(q);
+			ASSERT_OR_FAIL(q.try_dequeue(t, item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue(t, item));
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_dequeue_from_producer(Token, T&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ProducerToken t(q);
+			ASSERT_OR_FAIL(q.enqueue(t, Copyable(12345)));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue_from_producer(t, item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue_from_producer(t, item));
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ProducerToken t(q);
+			ASSERT_OR_FAIL(q.enqueue(t, Moveable(12345)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue_from_producer(t, item));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue_from_producer(t, item));
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// try_dequeue_bulk(T&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(&item, 1) == 1);
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue_bulk(&item, 1));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(&item, 1) == 1);
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue_bulk(&item, 1));
+		}
+		
+		// try_dequeue_bulk(Token, T&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
+			Copyable item(0);
+			ConsumerToken t(q);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(t, &item, 1));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue_bulk(t, &item, 1));
+			ASSERT_OR_FAIL(!q.try_dequeue_bulk(&item, 1));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
+			Moveable item(0);
+			ConsumerToken t(q);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk(t, &item, 1));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue_bulk(t, &item, 1));
+			ASSERT_OR_FAIL(!q.try_dequeue_bulk(&item, 1));
+		}
+		
+		// try_dequeue_bulk_from_producer(Token, T&)
+		{
+			ConcurrentQueue<Copyable, Traits> q;
+			ProducerToken t(q);
+			ASSERT_OR_FAIL(q.enqueue(t, Copyable(12345)));
+			Copyable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(t, &item, 1));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue_bulk_from_producer(t, &item, 1));
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		{
+			ConcurrentQueue<Moveable, Traits> q;
+			ProducerToken t(q);
+			ASSERT_OR_FAIL(q.enqueue(t, Moveable(12345)));
+			Moveable item(0);
+			ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(t, &item, 1));
+			ASSERT_OR_FAIL(item.id == 12345);
+			ASSERT_OR_FAIL(item.moved);
+			ASSERT_OR_FAIL(!item.copied);
+			ASSERT_OR_FAIL(!q.try_dequeue_bulk_from_producer(t, &item, 1));
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// size_approx()
+		{
+			ConcurrentQueue<Foo, Traits> q;
+			for (int i = 0; i != 1234; ++i) {
+				q.enqueue(Foo());
+			}
+			ASSERT_OR_FAIL(q.size_approx() == 1234);
+		}
+		
+		// is_lock_free()
+		{
+			bool lockFree = ConcurrentQueue<Foo, Traits>::is_lock_free();
+#if defined(__amd64__) || defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__) || defined(_M_PPC) || defined(__powerpc__)
+			ASSERT_OR_FAIL(lockFree);
+#endif
+		}
+		
+		// moving
+		{
+			ConcurrentQueue<int, MallocTrackingTraits> q(4);
+			ProducerToken t(q);
+			for (int i = 0; i != 1233; ++i) {
+				q.enqueue(i);
+			}
+			for (int i = 1234; i != 5678; ++i) {
+				q.enqueue(t, i);
+			}
+			ASSERT_OR_FAIL(q.size_approx() == 5677);
+			
+			ConcurrentQueue<int, MallocTrackingTraits> q2(std::move(q));
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			ASSERT_OR_FAIL(q2.size_approx() == 5677);
+			
+			q2.enqueue(t, 5678);
+			q2.enqueue(1233);
+			ASSERT_OR_FAIL(q2.size_approx() == 5679);
+			
+			for (int i = 1234; i != 0; --i) {
+				q.enqueue(i);
+			}
+			ASSERT_OR_FAIL(q.size_approx() == 1234);
+			
+			int item;
+			for (int i = 0; i <= 5678; ++i) {
+				ASSERT_OR_FAIL(q2.try_dequeue_non_interleaved(item));
+				ASSERT_OR_FAIL(item == i);
+			}
+			ASSERT_OR_FAIL(!q2.try_dequeue_non_interleaved(item));
+			ASSERT_OR_FAIL(q2.size_approx() == 0);
+			
+			for (int i = 1234; i != 0; --i) {
+				ASSERT_OR_FAIL(q.try_dequeue_non_interleaved(item));
+				ASSERT_OR_FAIL(item == i);
+			}
+			ASSERT_OR_FAIL(!q.try_dequeue_non_interleaved(item));
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+		}
+		
+		// swapping
+		{
+			ConcurrentQueue<int, MallocTrackingTraits> q1, q2, q3;
+			ProducerToken t1(q1), t2(q2), t3(q3);
+			
+			for (int i = 1234; i != 5678; ++i) {
+				q1.enqueue(t1, i);
+			}
+			for (int i = 21234; i != 25678; ++i) {
+				q2.enqueue(t2, i);
+			}
+			for (int i = 31234; i != 35678; ++i) {
+				q3.enqueue(t3, i);
+			}
+			
+			for (int i = 0; i != 1234; ++i) {
+				q1.enqueue(i);
+			}
+			for (int i = 20000; i != 21234; ++i) {
+				q2.enqueue(i);
+			}
+			for (int i = 30000; i != 31234; ++i) {
+				q3.enqueue(i);
+			}
+			
+			{
+				ConcurrentQueue<int, MallocTrackingTraits> temp;
+				temp = std::move(q1);
+				q1 = std::move(q2);
+				q2 = std::move(temp);
+			}
+			// q1 in q2, q2 in q1
+			
+			swap(q2, q3);	// q1 in q3, q3 in q2
+			q1.swap(q2);	// q2 in q2, q3 in q1
+			q1.swap(q2);	// q3 in q2, q2 in q1
+			q1.swap(q2);	// q2 in q2, q3 in q1
+			q2.swap(q3);	// q1 in q2, q2 in q3
+			
+			// So now q1 is in q2, q2 is in q3, and q3 is in q1
+			int item;
+			for (int i = 30000; i != 35678; ++i) {
+				ASSERT_OR_FAIL(q1.try_dequeue_non_interleaved(item));
+				ASSERT_OR_FAIL(item == i);
+			}
+			ASSERT_OR_FAIL(!q1.try_dequeue_non_interleaved(item));
+			ASSERT_OR_FAIL(q1.size_approx() == 0);
+			
+			for (int i = 0; i != 5678; ++i) {
+				ASSERT_OR_FAIL(q2.try_dequeue_non_interleaved(item));
+				ASSERT_OR_FAIL(item == i);
+			}
+			ASSERT_OR_FAIL(!q2.try_dequeue_non_interleaved(item));
+			ASSERT_OR_FAIL(q2.size_approx() == 0);
+			
+			for (int i = 20000; i != 25678; ++i) {
+				ASSERT_OR_FAIL(q3.try_dequeue_non_interleaved(item));
+				ASSERT_OR_FAIL(item == i);
+			}
+			ASSERT_OR_FAIL(!q3.try_dequeue_non_interleaved(item));
+			ASSERT_OR_FAIL(q3.size_approx() == 0);
+		}
+		
+		return true;
+	}
+	
+	
+	bool blocking_wrappers()
+	{
+		typedef BlockingConcurrentQueue<int, MallocTrackingTraits> Q;
+		ASSERT_OR_FAIL((Q::is_lock_free() == ConcurrentQueue<int, MallocTrackingTraits>::is_lock_free()));
+		
+		// Moving
+		{
+			Q a, b, c;
+			a = std::move(b);
+			b = std::move(c);
+			a = std::move(a);
+			c = std::move(b);
+			b = Q(std::move(b));
+			using std::swap;
+			swap(a, b);
+			a.swap(c);
+			c.swap(c);
+		}
+		
+		// Implicit
+		{
+			Q q;
+			ASSERT_OR_FAIL(q.enqueue(1));
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			int item;
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item == 1);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			
+			ASSERT_OR_FAIL(q.enqueue(2));
+			ASSERT_OR_FAIL(q.enqueue(3));
+			ASSERT_OR_FAIL(q.size_approx() == 2);
+			q.wait_dequeue(item);
+			ASSERT_OR_FAIL(item == 2);
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			q.wait_dequeue(item);
+			ASSERT_OR_FAIL(item == 3);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+		}
+		
+		// Implicit threaded
+		{
+			Q q;
+			const int THREADS = 8;
+			SimpleThread threads[THREADS];
+			bool success[THREADS];
+			
+			for (int i = 0; i != THREADS; ++i) {
+				success[i] = true;
+				
+				if (i % 2 == 0) {
+					// Enqueue
+					if (i % 4 == 0) {
+						threads[i] = SimpleThread([&](int j) {
+							int stuff[5];
+							for (int k = 0; k != 2048; ++k) {
+								for (int x = 0; x != 5; ++x) {
+									stuff[x] = (j << 16) | (k * 5 + x);
+								}
+								success[j] = q.enqueue_bulk(stuff, 5) && success[j];
+							}
+						}, i);
+					}
+					else {
+						threads[i] = SimpleThread([&](int j) {
+							for (int k = 0; k != 4096; ++k) {
+								success[j] = q.enqueue((j << 16) | k) && success[j];
+							}
+						}, i);
+					}
+				}
+				else {
+					// Dequeue
+					threads[i] = SimpleThread([&](int j) {
+						int item;
+						std::vector<int> prevItems(THREADS, -1);
+						if (j % 4 == 1) {
+							for (int k = 0; k != 2048 * 5; ++k) {
+								if (q.try_dequeue(item)) {
+									int thread = item >> 16;
+									item &= 0xffff;
+									if (item <= prevItems[thread]) {
+										success[j] = false;
+									}
+									prevItems[thread] = item;
+								}
+							}
+						}
+						else {
+							int items[6];
+							for (int k = 0; k < 4096;  ++k) {
+								if (std::size_t dequeued = q.try_dequeue_bulk(items, 6)) {
+									for (std::size_t x = 0; x != dequeued; ++x) {
+										item = items[x];
+										int thread = item >> 16;
+										item &= 0xffff;
+										if (item <= prevItems[thread]) {
+											success[j] = false;
+										}
+										prevItems[thread] = item;
+									}
+								}
+							}
+						}
+					}, i);
+				}
+			}
+			for (int i = 0; i != THREADS; ++i) {
+				threads[i].join();
+			}
+			
+			for (int i = 0; i != THREADS; ++i) {
+				ASSERT_OR_FAIL(success[i]);
+			}
+		}
+		
+		// Implicit threaded, blocking
+		{
+			Q q;
+			const int THREADS = 8;
+			SimpleThread threads[THREADS];
+			bool success[THREADS];
+			
+			for (int i = 0; i != THREADS; ++i) {
+				success[i] = true;
+				
+				if (i % 2 == 0) {
+					// Enqueue
+					if (i % 4 == 0) {
+						threads[i] = SimpleThread([&](int j) {
+							int stuff[5];
+							for (int k = 0; k != 2048; ++k) {
+								for (int x = 0; x != 5; ++x) {
+									stuff[x] = (j << 16) | (k * 5 + x);
+								}
+								success[j] = q.enqueue_bulk(stuff, 5) && success[j];
+							}
+						}, i);
+					}
+					else {
+						threads[i] = SimpleThread([&](int j) {
+							for (int k = 0; k != 4096; ++k) {
+								success[j] = q.enqueue((j << 16) | k) && success[j];
+							}
+						}, i);
+					}
+				}
+				else {
+					// Dequeue
+					threads[i] = SimpleThread([&](int j) {
+						int item;
+						std::vector<int> prevItems(THREADS, -1);
+						if (j % 4 == 1) {
+							for (int k = 0; k != 2048 * 5; ++k) {
+								q.wait_dequeue(item);
+								int thread = item >> 16;
+								item &= 0xffff;
+								if (item <= prevItems[thread]) {
+									success[j] = false;
+								}
+								prevItems[thread] = item;
+							}
+						}
+						else {
+							int items[6];
+							int k;
+							for (k = 0; k < 4090; ) {
+								if (std::size_t dequeued = q.wait_dequeue_bulk(items, 6)) {
+									for (std::size_t x = 0; x != dequeued; ++x) {
+										item = items[x];
+										int thread = item >> 16;
+										item &= 0xffff;
+										if (item <= prevItems[thread]) {
+											success[j] = false;
+										}
+										prevItems[thread] = item;
+									}
+									k += (int)dequeued;
+								}
+								else {
+									success[j] = false;
+								}
+							}
+							for (; k != 4096; ++k) {
+								q.wait_dequeue(item);
+								int thread = item >> 16;
+								item &= 0xffff;
+								if (item <= prevItems[thread]) {
+									success[j] = false;
+								}
+								prevItems[thread] = item;
+							}
+						}
+					}, i);
+				}
+			}
+			for (int i = 0; i != THREADS; ++i) {
+				threads[i].join();
+			}
+			
+			for (int i = 0; i != THREADS; ++i) {
+				ASSERT_OR_FAIL(success[i]);
+			}
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+		}
+		
+		// Explicit
+		{
+			Q q;
+			ProducerToken pt(q);
+			ASSERT_OR_FAIL(q.enqueue(pt, 1));
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			int item;
+			ConsumerToken ct(q);
+			ASSERT_OR_FAIL(q.try_dequeue(ct, item));
+			ASSERT_OR_FAIL(item == 1);
+			ASSERT_OR_FAIL(!q.try_dequeue(ct, item));
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			
+			ASSERT_OR_FAIL(q.enqueue(pt, 2));
+			ASSERT_OR_FAIL(q.enqueue(pt, 3));
+			ASSERT_OR_FAIL(q.size_approx() == 2);
+			q.wait_dequeue(ct, item);
+			ASSERT_OR_FAIL(item == 2);
+			ASSERT_OR_FAIL(q.size_approx() == 1);
+			q.wait_dequeue(ct, item);
+			ASSERT_OR_FAIL(item == 3);
+			ASSERT_OR_FAIL(!q.try_dequeue(ct, item));
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+		}
+		
+		// Explicit threaded
+		{
+			Q q;
+			const int THREADS = 8;
+			SimpleThread threads[THREADS];
+			bool success[THREADS];
+			
+			for (int i = 0; i != THREADS; ++i) {
+				success[i] = true;
+				
+				if (i % 2 == 0) {
+					// Enqueue
+					if (i % 4 == 0) {
+						threads[i] = SimpleThread([&](int j) {
+							ProducerToken t(q);
+							int stuff[5];
+							for (int k = 0; k != 2048; ++k) {
+								for (int x = 0; x != 5; ++x) {
+									stuff[x] = (j << 16) | (k * 5 + x);
+								}
+								success[j] = q.enqueue_bulk(t, stuff, 5) && success[j];
+							}
+						}, i);
+					}
+					else {
+						threads[i] = SimpleThread([&](int j) {
+							ProducerToken t(q);
+							for (int k = 0; k != 4096; ++k) {
+								success[j] = q.enqueue(t, (j << 16) | k) && success[j];
+							}
+						}, i);
+					}
+				}
+				else {
+					// Dequeue
+					threads[i] = SimpleThread([&](int j) {
+						ConsumerToken t(q);
+						int item;
+						std::vector<int> prevItems(THREADS, -1);
+						if (j % 4 == 1) {
+							for (int k = 0; k != 2048 * 5; ++k) {
+								if (q.try_dequeue(t, item)) {
+									int thread = item >> 16;
+									item &= 0xffff;
+									if (item <= prevItems[thread]) {
+										success[j] = false;
+									}
+									prevItems[thread] = item;
+								}
+							}
+						}
+						else {
+							int items[6];
+							for (int k = 0; k < 4096;  ++k) {
+								if (std::size_t dequeued = q.try_dequeue_bulk(t, items, 6)) {
+									for (std::size_t x = 0; x != dequeued; ++x) {
+										item = items[x];
+										int thread = item >> 16;
+										item &= 0xffff;
+										if (item <= prevItems[thread]) {
+											success[j] = false;
+										}
+										prevItems[thread] = item;
+									}
+								}
 							}
 						}
-						catch (ThrowingMovable*) {
-						}
-					}
-				}, tid);
+					}, i);
+				}
 			}
-			for (std::size_t i = 0; i != threads.size(); ++i) {
+			for (int i = 0; i != THREADS; ++i) {
 				threads[i].join();
 			}
 			
-			ThrowingMovable result(-1);
-			while (true) {
-				try {
-					if (!q.try_dequeue(result)) {
-						break;
-					}
-				}
-				catch (ThrowingMovable*) {
-				}
+			for (int i = 0; i != THREADS; ++i) {
+				ASSERT_OR_FAIL(success[i]);
 			}
-			
-			ASSERT_OR_FAIL(ThrowingMovable::destroyCount() + 1 == ThrowingMovable::ctorCount());
 		}
 		
-		return true;
-	}
-	
-	bool test_threaded()
-	{
-		typedef TestTraits<4> Traits;
-		Traits::reset();
-		
-		bool inOrder = true;
-		
+		// Explicit threaded, blocking
 		{
-			// Single producer, single consumer
-			ConcurrentQueue<int, Traits> q;
-			ProducerToken t(q);
-			SimpleThread a([&]() {
-				for (int i = 0; i != 123456; ++i) {
-					q.enqueue(t, i);
-				}
-			});
-			SimpleThread b([&]() {
-				int item;
-				int prevItem = -1;
-				while (true) {
-					if (q.try_dequeue_from_producer(t, item)) {
-						if (item == 123455) {
-							break;
-						}
-						inOrder = item == prevItem + 1 && inOrder;
-						prevItem = item;
-					}
-				}
-			});
+			Q q;
+			const int THREADS = 8;
+			SimpleThread threads[THREADS];
+			bool success[THREADS];
 			
-			a.join();
-			b.join();
-		}
-		ASSERT_OR_FAIL(inOrder);
-		
-		{
-			// Single producer, multi consumer
-			ConcurrentQueue<int, Traits> q;
-			ProducerToken t(q);
-			SimpleThread a([&]() {
-				for (int i = 0; i != 123456; ++i) {
-					q.enqueue(t, i);
-				}
-			});
-			SimpleThread b([&]() {
-				int item, prevItem = -1;
-				for (int i = 0; i != 123456; ++i) {
-					if (q.try_dequeue_from_producer(t, item)) {
-						inOrder = item > prevItem && inOrder;
-						prevItem = item;
+			for (int i = 0; i != THREADS; ++i) {
+				success[i] = true;
+				
+				if (i % 2 == 0) {
+					// Enqueue
+					if (i % 4 == 0) {
+						threads[i] = SimpleThread([&](int j) {
+							ProducerToken t(q);
+							int stuff[5];
+							for (int k = 0; k != 2048; ++k) {
+								for (int x = 0; x != 5; ++x) {
+									stuff[x] = (j << 16) | (k * 5 + x);
+								}
+								success[j] = q.enqueue_bulk(t, stuff, 5) && success[j];
+							}
+						}, i);
+					}
+					else {
+						threads[i] = SimpleThread([&](int j) {
+							ProducerToken t(q);
+							for (int k = 0; k != 4096; ++k) {
+								success[j] = q.enqueue(t, (j << 16) | k) && success[j];
+							}
+						}, i);
 					}
 				}
-			});
-			SimpleThread c([&]() {
-				int item;
-				for (int i = 0; i != 123456; ++i) q.try_dequeue_from_producer(t, item);
-			});
-			SimpleThread d([&]() {
-				int item;
-				for (int i = 0; i != 123456; ++i) q.try_dequeue_from_producer(t, item);
-			});
+				else {
+					// Dequeue
+					threads[i] = SimpleThread([&](int j) {
+						ConsumerToken t(q);
+						int item;
+						std::vector<int> prevItems(THREADS, -1);
+						if (j % 4 == 1) {
+							for (int k = 0; k != 2048 * 5; ++k) {
+								q.wait_dequeue(t, item);
+								int thread = item >> 16;
+								item &= 0xffff;
+								if (item <= prevItems[thread]) {
+									success[j] = false;
+								}
+								prevItems[thread] = item;
+							}
+						}
+						else {
+							int items[6];
+							int k;
+							for (k = 0; k < 4090; ) {
+								if (std::size_t dequeued = q.wait_dequeue_bulk(t, items, 6)) {
+									for (std::size_t x = 0; x != dequeued; ++x) {
+										item = items[x];
+										int thread = item >> 16;
+										item &= 0xffff;
+										if (item <= prevItems[thread]) {
+											success[j] = false;
+										}
+										prevItems[thread] = item;
+									}
+									k += (int)dequeued;
+								}
+								else {
+									success[j] = false;
+								}
+							}
+							for (; k != 4096; ++k) {
+								q.wait_dequeue(t, item);
+								int thread = item >> 16;
+								item &= 0xffff;
+								if (item <= prevItems[thread]) {
+									success[j] = false;
+								}
+								prevItems[thread] = item;
+							}
+						}
+					}, i);
+				}
+			}
+			for (int i = 0; i != THREADS; ++i) {
+				threads[i].join();
+			}
 			
-			a.join();
-			b.join();
-			c.join();
-			d.join();
+			for (int i = 0; i != THREADS; ++i) {
+				ASSERT_OR_FAIL(success[i]);
+			}
+			ASSERT_OR_FAIL(q.size_approx() == 0);
 		}
-		ASSERT_OR_FAIL(inOrder);
-		
-		ASSERT_OR_FAIL(Traits::malloc_count() == Traits::free_count());
 		
 		return true;
 	}
 	
-	bool test_threaded_bulk()
+	bool timed_blocking_wrappers()
 	{
-		typedef TestTraits<2> Traits;
+		typedef BlockingConcurrentQueue<int, MallocTrackingTraits> Q;
 		
-		// Enqueue bulk (implicit)
-		Traits::reset();
+		// Implicit
 		{
-			ConcurrentQueue<int, Traits> q;
-			SimpleThread threads[2];
-			bool success[2];
+			Q q;
+			int item;
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 0));
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 1));
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 100));
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, std::chrono::milliseconds(1)));
+			q.enqueue(123);
+			ASSERT_OR_FAIL(q.wait_dequeue_timed(item, 0));
+			ASSERT_OR_FAIL(item == 123);
+		}
+		
+		// Implicit, threaded
+		{
+			Q q;
+			const int THREADS = 8;
+			SimpleThread threads[THREADS];
+			bool success[THREADS];
 			
-			int stuff[] = { 1, 2, 3, 4, 5 };
-			for (int i = 0; i != 2; ++i) {
+			for (int i = 0; i != THREADS; ++i) {
 				success[i] = true;
 				
-				if (i == 0) {
-					// Enqueue bulk
-					threads[i] = SimpleThread([&](int j) {
-						for (int k = 0; k != 2048; ++k) {
-							success[j] = q.enqueue_bulk(stuff, 5) && success[j];
-						}
-					}, i);
+				if (i % 2 == 0) {
+					// Enqueue
+					if (i % 4 == 0) {
+						threads[i] = SimpleThread([&](int j) {
+							int stuff[5];
+							for (int k = 0; k != 2048; ++k) {
+								for (int x = 0; x != 5; ++x) {
+									stuff[x] = (j << 16) | (k * 5 + x);
+								}
+								success[j] = q.enqueue_bulk(stuff, 5) && success[j];
+							}
+						}, i);
+					}
+					else {
+						threads[i] = SimpleThread([&](int j) {
+							for (int k = 0; k != 4096; ++k) {
+								success[j] = q.enqueue((j << 16) | k) && success[j];
+							}
+						}, i);
+					}
 				}
 				else {
 					// Dequeue
 					threads[i] = SimpleThread([&](int j) {
 						int item;
-						int prevItem = 0;
-						for (int k = 0; k != 2048 * 5;) {
-							if (q.try_dequeue(item)) {
-								if (item != prevItem + 1) {
+						std::vector<int> prevItems(THREADS, -1);
+						if (j % 4 == 1) {
+							for (int k = 0; k != 2048 * 5; ++k) {
+								if (!q.wait_dequeue_timed(item, 1000)) {
+									--k;
+									continue;
+								}
+								int thread = item >> 16;
+								item &= 0xffff;
+								if (item <= prevItems[thread]) {
+									success[j] = false;
+								}
+								prevItems[thread] = item;
+							}
+						}
+						else {
+							int items[6];
+							int k;
+							for (k = 0; k < 4090; ) {
+								if (std::size_t dequeued = q.wait_dequeue_bulk_timed(items, 6, 1000)) {
+									for (std::size_t x = 0; x != dequeued; ++x) {
+										item = items[x];
+										int thread = item >> 16;
+										item &= 0xffff;
+										if (item <= prevItems[thread]) {
+											success[j] = false;
+										}
+										prevItems[thread] = item;
+									}
+									k += (int)dequeued;
+								}
+							}
+							for (; k != 4096; ++k) {
+								if (!q.wait_dequeue_timed(item, std::chrono::hours(1))) {
 									success[j] = false;
 								}
-								prevItem = item;
-								if (item == 5) {
-									prevItem = 0;
+								int thread = item >> 16;
+								item &= 0xffff;
+								if (item <= prevItems[thread]) {
+									success[j] = false;
 								}
-								++k;
+								prevItems[thread] = item;
 							}
 						}
 					}, i);
 				}
 			}
-			for (int i = 0; i != 2; ++i) {
+			for (int i = 0; i != THREADS; ++i) {
 				threads[i].join();
 			}
 			
-			ASSERT_OR_FAIL(success[0]);
-			ASSERT_OR_FAIL(success[1]);
+			for (int i = 0; i != THREADS; ++i) {
+				ASSERT_OR_FAIL(success[i]);
+			}
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			
+			int item;
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 0));
 		}
 		
-		// Enqueue bulk (while somebody is dequeueing (with tokens))
-		Traits::reset();
+		// Explicit
 		{
-			ConcurrentQueue<int, Traits> q;
-			SimpleThread threads[2];
-			bool success[2];
+			Q q;
+			ProducerToken ptok(q);
+			ConsumerToken ctok(q);
+			int item;
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(ctok, item, 0));
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(ctok, item, 1));
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(ctok, item, 100));
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(ctok, item, std::chrono::milliseconds(1)));
+			q.enqueue(ptok, 123);
+			ASSERT_OR_FAIL(q.wait_dequeue_timed(ctok, item, 0));
+			ASSERT_OR_FAIL(item == 123);
+		}
+		
+		// Explicit, threaded
+		{
+			Q q;
+			const int THREADS = 8;
+			SimpleThread threads[THREADS];
+			bool success[THREADS];
 			
-			int stuff[] = { 1, 2, 3, 4, 5 };
-			for (int i = 0; i != 2; ++i) {
+			for (int i = 0; i != THREADS; ++i) {
 				success[i] = true;
 				
-				if (i == 0) {
-					// Enqueue bulk
-					threads[i] = SimpleThread([&](int j) {
-						ProducerToken tok(q);
-						for (int k = 0; k != 2048; ++k) {
-							success[j] = q.enqueue_bulk(tok, stuff, 5) && success[j];
-						}
-					}, i);
+				if (i % 2 == 0) {
+					// Enqueue
+					if (i % 4 == 0) {
+						threads[i] = SimpleThread([&](int j) {
+							ProducerToken tok(q);
+							int stuff[5];
+							for (int k = 0; k != 2048; ++k) {
+								for (int x = 0; x != 5; ++x) {
+									stuff[x] = (j << 16) | (k * 5 + x);
+								}
+								success[j] = q.enqueue_bulk(tok, stuff, 5) && success[j];
+							}
+						}, i);
+					}
+					else {
+						threads[i] = SimpleThread([&](int j) {
+							ProducerToken tok(q);
+							for (int k = 0; k != 4096; ++k) {
+								success[j] = q.enqueue(tok, (j << 16) | k) && success[j];
+							}
+						}, i);
+					}
 				}
 				else {
 					// Dequeue
 					threads[i] = SimpleThread([&](int j) {
-						ConsumerToken tok(q);
 						int item;
-						int prevItem = 0;
-						for (int k = 0; k != 2048 * 5;) {
-							if (q.try_dequeue(tok, item)) {
-								if (item != prevItem + 1) {
+						std::vector<int> prevItems(THREADS, -1);
+						ConsumerToken tok(q);
+						if (j % 4 == 1) {
+							for (int k = 0; k != 2048 * 5; ++k) {
+								if (!q.wait_dequeue_timed(tok, item, 1000)) {
+									--k;
+									continue;
+								}
+								int thread = item >> 16;
+								item &= 0xffff;
+								if (item <= prevItems[thread]) {
 									success[j] = false;
 								}
-								prevItem = item;
-								if (item == 5) {
-									prevItem = 0;
+								prevItems[thread] = item;
+							}
+						}
+						else {
+							int items[6];
+							int k;
+							for (k = 0; k < 4090; ) {
+								if (std::size_t dequeued = q.wait_dequeue_bulk_timed(tok, items, 6, 1000)) {
+									for (std::size_t x = 0; x != dequeued; ++x) {
+										item = items[x];
+										int thread = item >> 16;
+										item &= 0xffff;
+										if (item <= prevItems[thread]) {
+											success[j] = false;
+										}
+										prevItems[thread] = item;
+									}
+									k += (int)dequeued;
 								}
-								++k;
+							}
+							for (; k != 4096; ++k) {
+								if (!q.wait_dequeue_timed(tok, item, std::chrono::hours(1))) {
+									success[j] = false;
+								}
+								int thread = item >> 16;
+								item &= 0xffff;
+								if (item <= prevItems[thread]) {
+									success[j] = false;
+								}
+								prevItems[thread] = item;
 							}
 						}
 					}, i);
 				}
 			}
-			for (int i = 0; i != 2; ++i) {
+			for (int i = 0; i != THREADS; ++i) {
 				threads[i].join();
 			}
 			
-			ASSERT_OR_FAIL(success[0]);
-			ASSERT_OR_FAIL(success[1]);
-		}
-		
-		return true;
-	}
-	
-	template<typename Traits>
-	bool full_api()
-	{
-		// A simple test that exercises the full public API (just to make sure every function is implemented
-		// and works on at least the most basic level)
-		
-		// enqueue(T const&)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			Copyable original(12345);
-			ASSERT_OR_FAIL(q.enqueue(original));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		
-		// enqueue(T&&)
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			Moveable original(12345);
-			ASSERT_OR_FAIL(q.enqueue(std::move(original)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		
-		// enqueue(Token, T const&)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ProducerToken t(q);
-			Copyable original(12345);
-			ASSERT_OR_FAIL(q.enqueue(t, original));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		
-		// enqueue(Token, T&&)
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ProducerToken t(q);
-			ASSERT_OR_FAIL(q.enqueue(t, Moveable(12345)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ProducerToken t(q);
-			Moveable original(12345);
-			ASSERT_OR_FAIL(q.enqueue(t, std::move(original)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ProducerToken t(q);
-			ASSERT_OR_FAIL(q.enqueue(t, Copyable(12345)));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			for (int i = 0; i != THREADS; ++i) {
+				ASSERT_OR_FAIL(success[i]);
+			}
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			
+			int item;
+			ConsumerToken tok(q);
+			ASSERT_OR_FAIL(!q.wait_dequeue_timed(tok, item, 0));
 		}
 		
-		// try_enqueue(T const&)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			Copyable original(12345);
-			ASSERT_OR_FAIL(q.try_enqueue(original));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
+		return true;
+	}
+	
+	bool kernel_semaphore()
+	{
+		// The semaphore blocking queues sleep on (futex-based on Linux)
+		typedef details::mpmc_sema::Semaphore Sema;
 		
-		// try_enqueue(T&&)
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ASSERT_OR_FAIL(q.try_enqueue(Moveable(12345)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			Moveable original(12345);
-			ASSERT_OR_FAIL(q.try_enqueue(std::move(original)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-		}
 		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ASSERT_OR_FAIL(q.try_enqueue(Copyable(12345)));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			Sema s;
+			ASSERT_OR_FAIL(!s.try_wait());
+			auto start = std::chrono::steady_clock::now();
+			ASSERT_OR_FAIL(!s.timed_wait(2000));
+			ASSERT_OR_FAIL(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(2));
+			s.signal(3);
+			ASSERT_OR_FAIL(s.try_wait());
+			ASSERT_OR_FAIL(s.timed_wait(0));
+			ASSERT_OR_FAIL(s.timed_wait(1000000));
+			ASSERT_OR_FAIL(!s.try_wait());
 		}
 		
-		// try_enqueue(Token, T const&)
 		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ProducerToken t(q);
-			Copyable original(12345);
-			ASSERT_OR_FAIL(q.try_enqueue(t, original));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			Sema s(1);
+			const int THREADS = 6;
+			SimpleThread threads[THREADS];
+			std::atomic<int> woken(0);
+			for (int i = 0; i != THREADS; ++i) {
+				threads[i] = SimpleThread([&](int j) {
+					if (j % 2 == 0) {
+						s.wait();
+					}
+					else {
+						while (!s.timed_wait(100)) {
+							continue;
+						}
+					}
+					woken.fetch_add(1, std::memory_order_relaxed);
+				}, i);
+			}
+			s.signal(2);
+			for (int i = 3; i != THREADS; ++i) {
+				s.signal();
+			}
+			for (int i = 0; i != THREADS; ++i) {
+				threads[i].join();
+			}
+			ASSERT_OR_FAIL(woken.load() == THREADS);
+			ASSERT_OR_FAIL(!s.try_wait());
 		}
 		
-		// try_enqueue(Token, T&&)
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ProducerToken t(q);
-			ASSERT_OR_FAIL(q.try_enqueue(t, Moveable(12345)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		return true;
+	}
+	
+	struct NoSpinTraits : public MallocTrackingTraits
+	{
+		static const int MAX_SEMA_SPINS = 0;
+	};
+	
+	struct FixedSpinTraits : public MallocTrackingTraits
+	{
+		static const int MAX_SEMA_SPINS = 100;
+		static const bool ADAPTIVE_SEMA_SPINNING = false;
+	};
+	
+	template<typename Traits, typename WaitStrategy = KernelWaitStrategy>
+	bool blocking_consumers()
+	{
+		BlockingConcurrentQueue<int, Traits, WaitStrategy> q;
+		int item = 0;
+		ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 1000));
+		
+		std::atomic<int> sum(0);
+		SimpleThread consumers[2];
+		for (int i = 0; i != 2; ++i) {
+			consumers[i] = SimpleThread([&]() {
+				int value, items[8];
+				for (int j = 0; j != 100; ++j) {
+					q.wait_dequeue(value);
+					sum.fetch_add(value, std::memory_order_relaxed);
+				}
+				for (int got = 0; got != 100; ) {
+					auto count = q.wait_dequeue_bulk(items, (size_t)std::min(8, 100 - got));
+					for (size_t k = 0; k != count; ++k) {
+						sum.fetch_add(items[k], std::memory_order_relaxed);
+					}
+					got += (int)count;
+				}
+			});
 		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ProducerToken t(q);
-			Moveable original(12345);
-			ASSERT_OR_FAIL(q.try_enqueue(t, std::move(original)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		for (int i = 0; i != 400; ++i) {
+			q.enqueue(1);
+			if (i % 50 == 0) {
+				moodycamel::sleep(1);
+			}
 		}
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ProducerToken t(q);
-			ASSERT_OR_FAIL(q.try_enqueue(t, Copyable(12345)));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		for (int i = 0; i != 2; ++i) {
+			consumers[i].join();
 		}
-		
-		// enqueue_bulk(It itemFirst, size_t count)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			Copyable original(12345);
-			ASSERT_OR_FAIL(q.enqueue_bulk(&original, 1));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		ASSERT_OR_FAIL(sum.load() == 400);
+		ASSERT_OR_FAIL(!q.try_dequeue(item));
+		return true;
+	}
+	
+	bool sema_spinning()
+	{
+		// Waiting works the same whether waiters go straight to sleep, always spin
+		// a fixed number of times first, or adapt their spinning (the default)
+		ASSERT_OR_FAIL(blocking_consumers<NoSpinTraits>());
+		ASSERT_OR_FAIL(blocking_consumers<FixedSpinTraits>());
+		ASSERT_OR_FAIL(blocking_consumers<MallocTrackingTraits>());
+		return true;
+	}
+	
+	bool mixed_consumers()
+	{
+		// A try_dequeue can fail spuriously while another consumer backs out of its claim on
+		// the last element; consumers that only try_dequeue make that happen a lot, and no
+		// waiter may end up sleeping through an element it was woken for
+		for (int round = 0; round != 5; ++round) {
+			BlockingConcurrentQueue<int, NoSpinTraits> q;
+			std::atomic<int> received(0);
+			std::atomic<bool> producing(true);
+			SimpleThread producers[2], tryers[3], waiters[3];
+			for (int i = 0; i != 2; ++i) {
+				producers[i] = SimpleThread([&]() {
+					for (int j = 0; j != 2000; ++j) {
+						q.enqueue(1);
+						if (j % 64 == 0) {
+							std::this_thread::yield();
+						}
+					}
+				});
+			}
+			for (int i = 0; i != 3; ++i) {
+				tryers[i] = SimpleThread([&]() {
+					int item;
+					while (producing.load(std::memory_order_relaxed)) {
+						if (q.try_dequeue(item)) {
+							received.fetch_add(item, std::memory_order_relaxed);
+						}
+					}
+				});
+				waiters[i] = SimpleThread([&]() {
+					int item;
+					while (true) {
+						q.wait_dequeue(item);
+						if (item < 0) {
+							break;
+						}
+						received.fetch_add(item, std::memory_order_relaxed);
+					}
+				});
+			}
+			for (int i = 0; i != 2; ++i) {
+				producers[i].join();
+			}
+			producing.store(false, std::memory_order_relaxed);
+			for (int i = 0; i != 3; ++i) {
+				tryers[i].join();
+			}
+			// Whatever the tryers left is up to the waiters
+			auto start = getSystemTime();
+			while (received.load(std::memory_order_relaxed) != 4000 && getTimeDelta(start) < 5000) {
+				moodycamel::sleep(1);
+			}
+			bool allReceived = received.load() == 4000;
+			for (int i = 0; i != 3; ++i) {
+				q.enqueue(-1);
+			}
+			for (int i = 0; i != 3; ++i) {
+				waiters[i].join();
+			}
+			ASSERT_OR_FAIL(allReceived);
+			ASSERT_OR_FAIL(q.size_approx() == 0);
 		}
+		return true;
+	}
+	
+	bool spin_on_pending()
+	{
+		// Waiters spin on the cheap pending() check, and only attempt to consume once it
+		// says there's something there
+		details::mpmc_sema::BasicEventCount<KernelWaitStrategy> eventCount(10000, false);
+		int tries = 0;
+		ASSERT_OR_FAIL(!eventCount.waitWithRecheck([&]() { ++tries; return false; }, []() { return false; }, 1000));
+		ASSERT_OR_FAIL(tries <= 3);
+		
+		int checks = 0;
+		tries = 0;
+		ASSERT_OR_FAIL(eventCount.waitWithRecheck([&]() { return ++tries == 2; }, [&]() { return ++checks >= 100; }));
+		ASSERT_OR_FAIL(tries == 2 && checks >= 100);
+		
+		// wait() has nothing cheaper to spin on
+		tries = 0;
+		ASSERT_OR_FAIL(eventCount.wait([&]() { return ++tries == 100; }));
+		ASSERT_OR_FAIL(tries == 100);
+		return true;
+	}
+	
+	// A user-provided wait strategy, e.g. what a fiber scheduler would plug in
+	struct CountingWaitStrategy
+	{
+		static std::atomic<int>& waits() { static std::atomic<int> n(0); return n; }
+		static std::atomic<int>& signals() { static std::atomic<int> n(0); return n; }
+		static std::atomic<int>& released() { static std::atomic<int> n(0); return n; }
+		
+		CountingWaitStrategy() : count(0) { }
+		
+		void wait() { waits().fetch_add(1); std::unique_lock<std::mutex> lock(mutex); cond.wait(lock, [this]() { return count > 0; }); --count; }
+		bool try_wait() { std::unique_lock<std::mutex> lock(mutex); if (count == 0) return false; --count; return true; }
+		bool timed_wait(std::uint64_t usecs)
 		{
-			ConcurrentQueue<Moveable, Traits> q;
-			Moveable original(12345);
-			ASSERT_OR_FAIL(q.enqueue_bulk(std::make_move_iterator(&original), 1));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			waits().fetch_add(1);
+			std::unique_lock<std::mutex> lock(mutex);
+			if (!cond.wait_for(lock, std::chrono::microseconds(usecs), [this]() { return count > 0; })) return false;
+			--count;
+			return true;
 		}
+		void signal(int n) { signals().fetch_add(1); released().fetch_add(n); { std::unique_lock<std::mutex> lock(mutex); count += n; } cond.notify_all(); }
 		
-		// enqueue_bulk(Token, It itemFirst, size_t count)
+		std::mutex mutex;
+		std::condition_variable cond;
+		int count;
+	};
+	
+	bool wait_strategies()
+	{
+		ASSERT_OR_FAIL((blocking_consumers<NoSpinTraits, BusySpinWaitStrategy>()));
+		ASSERT_OR_FAIL((blocking_consumers<NoSpinTraits, SpinYieldWaitStrategy>()));
+		ASSERT_OR_FAIL((blocking_consumers<NoSpinTraits, CondVarWaitStrategy<>>()));
+		ASSERT_OR_FAIL((blocking_consumers<MallocTrackingTraits, CondVarWaitStrategy<>>()));
+#ifdef MOODYCAMEL_USE_FUTEX
+		ASSERT_OR_FAIL((blocking_consumers<NoSpinTraits, FutexWaitStrategy>()));
+#endif
+		CountingWaitStrategy::waits() = 0;
+		ASSERT_OR_FAIL((blocking_consumers<NoSpinTraits, CountingWaitStrategy>()));
+		ASSERT_OR_FAIL(CountingWaitStrategy::waits() > 0);
+		
+		// Tokens work with any strategy
+		BlockingConcurrentQueue<int, MallocTrackingTraits, SpinYieldWaitStrategy> q;
+		ProducerToken prodTok(q);
+		ConsumerToken consTok(q);
+		int item;
+		ASSERT_OR_FAIL(q.enqueue(prodTok, 7));
+		ASSERT_OR_FAIL(q.wait_dequeue_timed(consTok, item, 1000));
+		ASSERT_OR_FAIL(item == 7);
+		ASSERT_OR_FAIL(!q.wait_dequeue_timed(consTok, item, 1000));
+		return true;
+	}
+	
+	bool signal_coalescing()
+	{
+		BlockingConcurrentQueue<int, NoSpinTraits, CountingWaitStrategy> q;
+		int item, items[4] = { 1, 1, 1, 1 };
+		
+		// Nobody is waiting, so nobody gets signalled
+		CountingWaitStrategy::waits() = 0;
+		CountingWaitStrategy::signals() = 0;
 		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ProducerToken t(q);
-			Copyable original(12345);
-			ASSERT_OR_FAIL(q.enqueue_bulk(t, &original, 1));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			ProducerToken tok(q);
+			for (int i = 0; i != 100; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(1));
+				ASSERT_OR_FAIL(q.enqueue(tok, 1));
+				ASSERT_OR_FAIL(q.enqueue_bulk(items, 4));
+				ASSERT_OR_FAIL(q.enqueue_bulk(tok, items, 4));
+			}
 		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ProducerToken t(q);
-			Moveable original(12345);
-			ASSERT_OR_FAIL(q.enqueue_bulk(t, std::make_move_iterator(&original), 1));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		ASSERT_OR_FAIL(q.size_approx() == 1000);
+		for (int i = 0; i != 1000; ++i) {
+			ASSERT_OR_FAIL(q.wait_dequeue_timed(item, 0));
 		}
-		
-		// try_enqueue_bulk(It itemFirst, size_t count)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			Copyable original(12345);
-			ASSERT_OR_FAIL(q.try_enqueue_bulk(&original, 1));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		ASSERT_OR_FAIL(!q.try_dequeue(item));
+		ASSERT_OR_FAIL(CountingWaitStrategy::signals() == 0);
+		ASSERT_OR_FAIL(CountingWaitStrategy::waits() == 0);
+		
+		// A bulk enqueue wakes all the waiters it has elements for at once
+		std::atomic<int> sum(0);
+		SimpleThread consumers[2];
+		for (int i = 0; i != 2; ++i) {
+			consumers[i] = SimpleThread([&]() {
+				int value;
+				q.wait_dequeue(value);
+				sum.fetch_add(value, std::memory_order_relaxed);
+			});
 		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			Moveable original(12345);
-			ASSERT_OR_FAIL(q.try_enqueue_bulk(std::make_move_iterator(&original), 1));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		while (CountingWaitStrategy::waits() != 2) {
+			moodycamel::sleep(1);
+		}
+		ASSERT_OR_FAIL(q.enqueue_bulk(items, 2));
+		for (int i = 0; i != 2; ++i) {
+			consumers[i].join();
+		}
+		ASSERT_OR_FAIL(sum.load() == 2);
+		ASSERT_OR_FAIL(CountingWaitStrategy::signals() == 1);
+		ASSERT_OR_FAIL(!q.try_dequeue(item));
+		return true;
+	}
+	
+	struct BatchWakeTraits : public NoSpinTraits
+	{
+		static const size_t BULK_WAKE_BATCH_SIZE = 0;
+	};
+	
+	struct ShardedBatchWakeTraits : public BatchWakeTraits
+	{
+		static const size_t BLOCK_SIZE = 8;
+		static const size_t SIZE_COUNTER_SHARDS = 4;
+	};
+	
+	// However few the consumers woken by bulk enqueues end up taking, nothing is left behind
+	template<typename Traits>
+	static bool bulk_wake_leftovers()
+	{
+		BlockingConcurrentQueue<int, Traits> q;
+		std::vector<int> items(250, 1);
+		std::atomic<int> received(0);
+		SimpleThread consumers[8];
+		for (int i = 0; i != 8; ++i) {
+			consumers[i] = SimpleThread([&](int id) {
+				int values[64];
+				while (received.load(std::memory_order_relaxed) < 10000) {
+					// Half of the consumers take one element at a time
+					size_t count = q.wait_dequeue_bulk(values, id % 2 == 0 ? 64 : 1);
+					received.fetch_add((int)count, std::memory_order_relaxed);
+				}
+			}, i);
 		}
-		
-		// try_enqueue_bulk(Token, It itemFirst, size_t count)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ProducerToken t(q);
-			Copyable original(12345);
-			ASSERT_OR_FAIL(q.try_enqueue_bulk(t, &original, 1));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		for (int i = 0; i != 100; ++i) {
+			ASSERT_OR_FAIL(q.enqueue_bulk(items.begin(), 100));
 		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ProducerToken t(q);
-			Moveable original(12345);
-			ASSERT_OR_FAIL(q.try_enqueue_bulk(t, std::make_move_iterator(&original), 1));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		auto start = getSystemTime();
+		while (received.load(std::memory_order_relaxed) != 10000 && getTimeDelta(start) < 10000) {
+			moodycamel::sleep(1);
 		}
+		ASSERT_OR_FAIL(received.load() == 10000);
+		ASSERT_OR_FAIL(q.size_approx() == 0);
 		
-		// try_dequeue(T&)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		// Enough for everyone, so that they all get to stop
+		ASSERT_OR_FAIL(q.enqueue_bulk(items.begin(), 250));
+		ASSERT_OR_FAIL(q.enqueue_bulk(items.begin(), 250));
+		for (int i = 0; i != 8; ++i) {
+			consumers[i].join();
 		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		return true;
+	}
+	
+	bool bulk_wake_batch()
+	{
+		// With the batch size going by what the consumers ask for, a bulk enqueue only
+		// wakes as many of them as it takes to cover it
+		BlockingConcurrentQueue<int, BatchWakeTraits, CountingWaitStrategy> q;
+		std::vector<int> items(250, 1);
+		std::atomic<int> sum(0), done(0);
+		CountingWaitStrategy::waits() = 0;
+		CountingWaitStrategy::released() = 0;
+		SimpleThread consumers[8];
+		for (int i = 0; i != 8; ++i) {
+			consumers[i] = SimpleThread([&]() {
+				int values[100];
+				size_t count = q.wait_dequeue_bulk(values, 100);
+				for (size_t j = 0; j != count; ++j) {
+					sum.fetch_add(values[j], std::memory_order_relaxed);
+				}
+				done.fetch_add(1, std::memory_order_release);
+			});
 		}
-		
-		// try_dequeue(Token, T&)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
-			Copyable item(0);
-			ConsumerToken t(q);
-			ASSERT_OR_FAIL(q.try_dequeue(t, item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(t, item));
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		while (CountingWaitStrategy::waits() != 8) {
+			moodycamel::sleep(1);
 		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
-			Moveable item(0);
-			ConsumerToken t(q);
-			ASSERT_OR_FAIL(q.try_dequeue(t, item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue(t, item));
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		ASSERT_OR_FAIL(q.enqueue_bulk(items.begin(), 250));
+		while (done.load(std::memory_order_acquire) != 3) {
+			moodycamel::sleep(1);
 		}
+		ASSERT_OR_FAIL(sum.load() == 250);
+		ASSERT_OR_FAIL(CountingWaitStrategy::released() == 3);
 		
-		// try_dequeue_from_producer(Token, T&)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ProducerToken t(q);
-			ASSERT_OR_FAIL(q.enqueue(t, Copyable(12345)));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue_from_producer(t, item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue_from_producer(t, item));
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		// Singles wake the rest one by one
+		for (int i = 0; i != 5; ++i) {
+			ASSERT_OR_FAIL(q.enqueue(1));
 		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ProducerToken t(q);
-			ASSERT_OR_FAIL(q.enqueue(t, Moveable(12345)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue_from_producer(t, item));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue_from_producer(t, item));
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		for (int i = 0; i != 8; ++i) {
+			consumers[i].join();
 		}
+		ASSERT_OR_FAIL(sum.load() == 255);
+		ASSERT_OR_FAIL(CountingWaitStrategy::released() == 8);
 		
-		// try_dequeue_bulk(T&)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(&item, 1) == 1);
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue_bulk(&item, 1));
+		ASSERT_OR_FAIL(bulk_wake_leftovers<BatchWakeTraits>());
+		// Also with sharded size counters, which don't see partly filled blocks
+		ASSERT_OR_FAIL(bulk_wake_leftovers<ShardedBatchWakeTraits>());
+		return true;
+	}
+	
+	bool blocking_bulk_min()
+	{
+		BlockingConcurrentQueue<int, MallocTrackingTraits> q;
+		int items[32];
+		
+		// Not enough elements: lingers, then returns what it got
+		for (int i = 0; i != 3; ++i) {
+			ASSERT_OR_FAIL(q.enqueue(i));
 		}
-		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(&item, 1) == 1);
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue_bulk(&item, 1));
+		auto start = getSystemTime();
+		ASSERT_OR_FAIL(q.wait_dequeue_bulk_min(items, 5, 10, 10000) == 3);
+		ASSERT_OR_FAIL(getTimeDelta(start) >= 9);
+		for (int i = 0; i != 3; ++i) {
+			ASSERT_OR_FAIL(items[i] == i);
 		}
+		ASSERT_OR_FAIL(q.wait_dequeue_bulk_min(items, 1, 10, std::chrono::milliseconds(1)) == 0);
 		
-		// try_dequeue_bulk(Token, T&)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Copyable(12345)));
-			Copyable item(0);
-			ConsumerToken t(q);
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(t, &item, 1));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue_bulk(t, &item, 1));
-			ASSERT_OR_FAIL(!q.try_dequeue_bulk(&item, 1));
+		// Enough elements: returns right away, with no more than the maximum
+		for (int i = 0; i != 20; ++i) {
+			ASSERT_OR_FAIL(q.enqueue(i));
 		}
+		ASSERT_OR_FAIL(q.wait_dequeue_bulk_min(items, 5, 10, -1) == 10);
 		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ASSERT_OR_FAIL(q.enqueue(Moveable(12345)));
-			Moveable item(0);
-			ConsumerToken t(q);
-			ASSERT_OR_FAIL(q.try_dequeue_bulk(t, &item, 1));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue_bulk(t, &item, 1));
-			ASSERT_OR_FAIL(!q.try_dequeue_bulk(&item, 1));
+			ConsumerToken tok(q);
+			ASSERT_OR_FAIL(q.wait_dequeue_bulk_min(tok, items + 10, 10, 32, 0) == 10);
+			ASSERT_OR_FAIL(q.wait_dequeue_bulk_min(tok, items, 0, 32, -1) == 0);
+		}
+		for (int i = 0; i != 20; ++i) {
+			ASSERT_OR_FAIL(items[i] == i);
 		}
 		
-		// try_dequeue_bulk_from_producer(Token, T&)
-		{
-			ConcurrentQueue<Copyable, Traits> q;
-			ProducerToken t(q);
-			ASSERT_OR_FAIL(q.enqueue(t, Copyable(12345)));
-			Copyable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(t, &item, 1));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue_bulk_from_producer(t, &item, 1));
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		// Elements trickling in: waits until there's a big enough batch
+		bool batchesBigEnough = true;
+		SimpleThread consumer([&]() {
+			int batch[32];
+			for (int got = 0; got != 100; ) {
+				size_t count = q.wait_dequeue_bulk_min(batch, (size_t)std::min(16, 100 - got), 32, -1);
+				if (count < (size_t)std::min(16, 100 - got)) {
+					batchesBigEnough = false;
+				}
+				got += (int)count;
+			}
+		});
+		for (int i = 0; i != 100; ++i) {
+			ASSERT_OR_FAIL(q.enqueue(i));
+			if (i % 10 == 0) {
+				moodycamel::sleep(1);
+			}
 		}
+		consumer.join();
+		ASSERT_OR_FAIL(batchesBigEnough);
+		ASSERT_OR_FAIL(q.size_approx() == 0);
+		return true;
+	}
+	
+	struct SmallBlockNoSpinTraits : public TestTraits<4>
+	{
+		static const int MAX_SEMA_SPINS = 0;
+	};
+	
+	bool blocking_enqueue()
+	{
+		typedef BlockingConcurrentQueue<int, TestTraits<4>> Q;
+		
+		// Explicit
 		{
-			ConcurrentQueue<Moveable, Traits> q;
-			ProducerToken t(q);
-			ASSERT_OR_FAIL(q.enqueue(t, Moveable(12345)));
-			Moveable item(0);
-			ASSERT_OR_FAIL(q.try_dequeue_bulk_from_producer(t, &item, 1));
-			ASSERT_OR_FAIL(item.id == 12345);
-			ASSERT_OR_FAIL(item.moved);
-			ASSERT_OR_FAIL(!item.copied);
-			ASSERT_OR_FAIL(!q.try_dequeue_bulk_from_producer(t, &item, 1));
+			Q q(8);
+			ProducerToken tok(q);
+			int full = 0;
+			while (q.try_enqueue(tok, full)) {
+				++full;
+			}
+			ASSERT_OR_FAIL(full >= 8);
+			int more[2] = { full, full + 1 };
+			ASSERT_OR_FAIL(!q.wait_enqueue_timed(tok, full, 0));
+			ASSERT_OR_FAIL(!q.wait_enqueue_timed(tok, full, 1000));
+			ASSERT_OR_FAIL(!q.wait_enqueue_timed(tok, full, std::chrono::milliseconds(1)));
+			ASSERT_OR_FAIL(!q.wait_enqueue_bulk_timed(tok, more, 2, 1000));
+			ASSERT_OR_FAIL(q.size_approx() == (size_t)full);
+			
+			// The producer has to wait for the (slow) consumer to make room
+			SimpleThread producer([&]() {
+				for (int i = full; i != 1000; ++i) {
+					int copy = i;
+					if (i % 3 == 0) {
+						q.wait_enqueue(tok, i);
+					}
+					else if (i % 3 == 1) {
+						q.wait_enqueue(tok, std::move(copy));
+					}
+					else {
+						q.wait_enqueue_timed(tok, i, -1);
+					}
+				}
+			});
+			bool inOrder = true;
+			int item;
+			for (int i = 0; i != 1000; ++i) {
+				q.wait_dequeue(item);
+				inOrder = inOrder && item == i;
+				if (i % 100 == 0) {
+					moodycamel::sleep(1);
+				}
+			}
+			producer.join();
+			ASSERT_OR_FAIL(inOrder);
 			ASSERT_OR_FAIL(!q.try_dequeue(item));
 		}
 		
-		// size_approx()
+		// Implicit, bulk
 		{
-			ConcurrentQueue<Foo, Traits> q;
-			for (int i = 0; i != 1234; ++i) {
-				q.enqueue(Foo());
+			Q q(8);
+			int full = 0;
+			while (q.try_enqueue(full)) {
+				++full;
 			}
-			ASSERT_OR_FAIL(q.size_approx() == 1234);
+			int items[4] = { 1, 1, 1, 1 };
+			ASSERT_OR_FAIL(!q.wait_enqueue_bulk_timed(items, 4, std::chrono::milliseconds(1)));
+			
+			SimpleThread producer([&]() {
+				for (int i = 0; i != 100; ++i) {
+					q.wait_enqueue_bulk(items, 4);
+				}
+				q.wait_enqueue(-1);
+			});
+			int sum = 0, batch[3];
+			bool done = false;
+			while (!done) {
+				size_t count = q.wait_dequeue_bulk(batch, 3);
+				for (size_t i = 0; i != count; ++i) {
+					done = done || batch[i] == -1;
+					sum += batch[i] == -1 ? 0 : 1;
+				}
+			}
+			producer.join();
+			while (q.try_dequeue(batch[0])) {
+				++sum;
+			}
+			ASSERT_OR_FAIL(sum == full + 400);
 		}
 		
-		// is_lock_free()
+		// Several producers competing for the blocks the consumer frees up
 		{
-			bool lockFree = ConcurrentQueue<Foo, Traits>::is_lock_free();
-#if defined(__amd64__) || defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__) || defined(_M_PPC) || defined(__powerpc__)
-			ASSERT_OR_FAIL(lockFree);
-#endif
+			Q q(8);
+			SimpleThread producers[4];
+			for (int i = 0; i != 4; ++i) {
+				producers[i] = SimpleThread([&]() {
+					for (int j = 0; j != 200; ++j) {
+						q.wait_enqueue(1);
+					}
+				});
+			}
+			int sum = 0, item;
+			for (int i = 0; i != 800; ++i) {
+				q.wait_dequeue(item);
+				sum += item;
+			}
+			for (int i = 0; i != 4; ++i) {
+				producers[i].join();
+			}
+			ASSERT_OR_FAIL(sum == 800);
 		}
 		
-		// moving
+		// A waiting producer only hears about room once a whole block has been freed up
 		{
-			ConcurrentQueue<int, MallocTrackingTraits> q(4);
-			ProducerToken t(q);
-			for (int i = 0; i != 1233; ++i) {
-				q.enqueue(i);
-			}
-			for (int i = 1234; i != 5678; ++i) {
-				q.enqueue(t, i);
-			}
-			ASSERT_OR_FAIL(q.size_approx() == 5677);
-			
-			ConcurrentQueue<int, MallocTrackingTraits> q2(std::move(q));
-			ASSERT_OR_FAIL(q.size_approx() == 0);
-			ASSERT_OR_FAIL(q2.size_approx() == 5677);
-			
-			q2.enqueue(t, 5678);
-			q2.enqueue(1233);
-			ASSERT_OR_FAIL(q2.size_approx() == 5679);
-			
-			for (int i = 1234; i != 0; --i) {
-				q.enqueue(i);
+			BlockingConcurrentQueue<int, SmallBlockNoSpinTraits, CountingWaitStrategy> q(8);
+			ProducerToken tok(q);
+			int full = 0;
+			while (q.try_enqueue(tok, full)) {
+				++full;
+			}
+			CountingWaitStrategy::waits() = 0;
+			CountingWaitStrategy::signals() = 0;
+			SimpleThread producer([&]() {
+				q.wait_enqueue(tok, full);
+			});
+			while (CountingWaitStrategy::waits() == 0) {
+				moodycamel::sleep(1);
 			}
-			ASSERT_OR_FAIL(q.size_approx() == 1234);
-			
 			int item;
-			for (int i = 0; i <= 5678; ++i) {
-				ASSERT_OR_FAIL(q2.try_dequeue_non_interleaved(item));
-				ASSERT_OR_FAIL(item == i);
-			}
-			ASSERT_OR_FAIL(!q2.try_dequeue_non_interleaved(item));
-			ASSERT_OR_FAIL(q2.size_approx() == 0);
-			
-			for (int i = 1234; i != 0; --i) {
-				ASSERT_OR_FAIL(q.try_dequeue_non_interleaved(item));
-				ASSERT_OR_FAIL(item == i);
+			for (int i = 0; i != 3; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item));
+				moodycamel::sleep(1);
 			}
-			ASSERT_OR_FAIL(!q.try_dequeue_non_interleaved(item));
-			ASSERT_OR_FAIL(q.size_approx() == 0);
+			ASSERT_OR_FAIL(CountingWaitStrategy::signals() == 0);
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			producer.join();
+			ASSERT_OR_FAIL(CountingWaitStrategy::signals() == 1);
+			ASSERT_OR_FAIL(q.size_approx() == (size_t)full - 3);
 		}
 		
-		// swapping
-		{
-			ConcurrentQueue<int, MallocTrackingTraits> q1, q2, q3;
-			ProducerToken t1(q1), t2(q2), t3(q3);
-			
-			for (int i = 1234; i != 5678; ++i) {
-				q1.enqueue(t1, i);
-			}
-			for (int i = 21234; i != 25678; ++i) {
-				q2.enqueue(t2, i);
+		// Likewise when the block's empty flags take several words
+		{
+			BlockingConcurrentQueue<int, EmptyFlagTraits<128>, CountingWaitStrategy> q(256);
+			ProducerToken tok(q);
+			int full = 0;
+			while (q.try_enqueue(tok, full)) {
+				++full;
+			}
+			CountingWaitStrategy::waits() = 0;
+			CountingWaitStrategy::signals() = 0;
+			SimpleThread producer([&]() {
+				q.wait_enqueue(tok, full);
+			});
+			while (CountingWaitStrategy::waits() == 0) {
+				moodycamel::sleep(1);
 			}
-			for (int i = 31234; i != 35678; ++i) {
-				q3.enqueue(t3, i);
+			int items[50];
+			for (size_t taken = 0; taken != 128; ) {
+				taken += q.try_dequeue_bulk(items, std::min((size_t)50, 128 - taken));
 			}
-			
-			for (int i = 0; i != 1234; ++i) {
-				q1.enqueue(i);
+			producer.join();
+			ASSERT_OR_FAIL(CountingWaitStrategy::signals() == 1);
+			ASSERT_OR_FAIL(q.size_approx() == (size_t)full - 127);
+		}
+		return true;
+	}
+	
+	bool wait_dequeue_any()
+	{
+		typedef BlockingConcurrentQueue<int, MallocTrackingTraits> Q;
+		BlockingQueueNotifier<> notifier;
+		Q high(32, notifier), normal(32, notifier), control(32, notifier);
+		int item;
+		
+		ASSERT_OR_FAIL(notifier.wait_dequeue_any_timed(item, 0, high, normal, control) == -1);
+		ASSERT_OR_FAIL(notifier.wait_dequeue_any_timed(item, 1000, high, normal, control) == -1);
+		ASSERT_OR_FAIL(notifier.wait_dequeue_any_timed(item, std::chrono::milliseconds(1), high, normal, control) == -1);
+		
+		// Earlier queues take priority
+		ASSERT_OR_FAIL(control.enqueue(3));
+		ASSERT_OR_FAIL(normal.enqueue(2));
+		ASSERT_OR_FAIL(high.enqueue(1));
+		ASSERT_OR_FAIL(notifier.wait_dequeue_any(item, high, normal, control) == 0 && item == 1);
+		ASSERT_OR_FAIL(notifier.wait_dequeue_any(item, high, normal, control) == 1 && item == 2);
+		ASSERT_OR_FAIL(notifier.wait_dequeue_any_timed(item, -1, high, normal, control) == 2 && item == 3);
+		
+		// Whichever queue gets an item wakes the waiters, including those waiting on
+		// other queues that share the notifier
+		std::atomic<int> sum(0);
+		int counts[2] = { 0, 0 };
+		SimpleThread dispatcher([&]() {
+			int value;
+			for (int i = 0; i != 200; ++i) {
+				int index = notifier.wait_dequeue_any(value, high, control);
+				++counts[index];
+				sum.fetch_add(value, std::memory_order_relaxed);
+			}
+		});
+		SimpleThread normalOnly([&]() {
+			int value;
+			for (int i = 0; i != 200; ++i) {
+				normal.wait_dequeue(value);
+				sum.fetch_add(value, std::memory_order_relaxed);
+			}
+		});
+		for (int i = 0; i != 100; ++i) {
+			high.enqueue(1);
+			control.enqueue(1);
+			normal.enqueue(1);
+			normal.enqueue(1);
+			if (i % 25 == 0) {
+				moodycamel::sleep(1);
+			}
+		}
+		dispatcher.join();
+		normalOnly.join();
+		ASSERT_OR_FAIL(sum.load() == 400);
+		ASSERT_OR_FAIL(counts[0] == 100 && counts[1] == 100);
+		ASSERT_OR_FAIL(notifier.wait_dequeue_any_timed(item, 0, high, normal, control) == -1);
+		
+		// Pre-sized for a number of producers, with the spin settings of custom traits
+		BlockingQueueNotifier<> quietNotifier(NoSpinTraits::MAX_SEMA_SPINS, NoSpinTraits::ADAPTIVE_SEMA_SPINNING);
+		BlockingConcurrentQueue<int, NoSpinTraits> first(64, 1, 1, quietNotifier), second(64, 1, 1, quietNotifier);
+		SimpleThread waiter([&]() {
+			int value;
+			quietNotifier.wait_dequeue_any(value, first, second);
+			sum.fetch_add(value, std::memory_order_relaxed);
+		});
+		moodycamel::sleep(1);
+		ASSERT_OR_FAIL(second.enqueue(5));
+		waiter.join();
+		ASSERT_OR_FAIL(sum.load() == 405);
+		
+		// An enqueue only wakes as many of the waiters as it has elements for
+		{
+			BlockingQueueNotifier<CountingWaitStrategy> counted(0, false);
+			BlockingConcurrentQueue<int, NoSpinTraits, CountingWaitStrategy> a(32, counted), b(32, counted);
+			CountingWaitStrategy::waits() = 0;
+			CountingWaitStrategy::released() = 0;
+			std::atomic<int> received(0);
+			SimpleThread waiters[4];
+			for (int i = 0; i != 4; ++i) {
+				waiters[i] = SimpleThread([&]() {
+					int value;
+					counted.wait_dequeue_any(value, a, b);
+					received.fetch_add(value, std::memory_order_relaxed);
+				});
 			}
-			for (int i = 20000; i != 21234; ++i) {
-				q2.enqueue(i);
+			while (CountingWaitStrategy::waits() != 4) {
+				moodycamel::sleep(1);
 			}
-			for (int i = 30000; i != 31234; ++i) {
-				q3.enqueue(i);
+			ASSERT_OR_FAIL(b.enqueue(1));
+			while (received.load() != 1) {
+				moodycamel::sleep(1);
 			}
-			
-			{
-				ConcurrentQueue<int, MallocTrackingTraits> temp;
-				temp = std::move(q1);
-				q1 = std::move(q2);
-				q2 = std::move(temp);
+			moodycamel::sleep(10);
+			ASSERT_OR_FAIL(CountingWaitStrategy::released() == 1);
+			for (int i = 0; i != 3; ++i) {
+				ASSERT_OR_FAIL(a.enqueue(1));
 			}
-			// q1 in q2, q2 in q1
-			
-			swap(q2, q3);	// q1 in q3, q3 in q2
-			q1.swap(q2);	// q2 in q2, q3 in q1
-			q1.swap(q2);	// q3 in q2, q2 in q1
-			q1.swap(q2);	// q2 in q2, q3 in q1
-			q2.swap(q3);	// q1 in q2, q2 in q3
-			
-			// So now q1 is in q2, q2 is in q3, and q3 is in q1
-			int item;
-			for (int i = 30000; i != 35678; ++i) {
-				ASSERT_OR_FAIL(q1.try_dequeue_non_interleaved(item));
-				ASSERT_OR_FAIL(item == i);
+			for (int i = 0; i != 4; ++i) {
+				waiters[i].join();
+			}
+			ASSERT_OR_FAIL(received.load() == 4);
+		}
+		
+		// The wake goes to a waiter that's waiting on the queue the element went into (well
+		// before its timeout), not to whichever waiter is first in line
+		for (int round = 0; round != 20; ++round) {
+			BlockingQueueNotifier<CountingWaitStrategy> counted(0, false);
+			BlockingConcurrentQueue<int, NoSpinTraits, CountingWaitStrategy> a(32, counted), b(32, counted);
+			CountingWaitStrategy::waits() = 0;
+			std::atomic<int> fromA(0), fromB(0);
+			SimpleThread aWaiter([&]() {
+				int value;
+				if (a.wait_dequeue_timed(value, 2000000)) {
+					fromA.fetch_add(value, std::memory_order_relaxed);
+				}
+			});
+			SimpleThread bWaiters[2];
+			for (int i = 0; i != 2; ++i) {
+				bWaiters[i] = SimpleThread([&]() {
+					int value;
+					if (b.wait_dequeue_timed(value, 2000000)) {
+						fromB.fetch_add(value, std::memory_order_relaxed);
+					}
+				});
 			}
-			ASSERT_OR_FAIL(!q1.try_dequeue_non_interleaved(item));
-			ASSERT_OR_FAIL(q1.size_approx() == 0);
-			
-			for (int i = 0; i != 5678; ++i) {
-				ASSERT_OR_FAIL(q2.try_dequeue_non_interleaved(item));
-				ASSERT_OR_FAIL(item == i);
+			while (CountingWaitStrategy::waits() < 3) {
+				moodycamel::sleep(1);
 			}
-			ASSERT_OR_FAIL(!q2.try_dequeue_non_interleaved(item));
-			ASSERT_OR_FAIL(q2.size_approx() == 0);
-			
-			for (int i = 20000; i != 25678; ++i) {
-				ASSERT_OR_FAIL(q3.try_dequeue_non_interleaved(item));
-				ASSERT_OR_FAIL(item == i);
+			auto start = getSystemTime();
+			ASSERT_OR_FAIL(a.enqueue(1));
+			aWaiter.join();
+			ASSERT_OR_FAIL(fromA.load() == 1);
+			ASSERT_OR_FAIL(getTimeDelta(start) < 1000);
+			ASSERT_OR_FAIL(b.enqueue(1) && b.enqueue(1));
+			for (int i = 0; i != 2; ++i) {
+				bWaiters[i].join();
 			}
-			ASSERT_OR_FAIL(!q3.try_dequeue_non_interleaved(item));
-			ASSERT_OR_FAIL(q3.size_approx() == 0);
+			ASSERT_OR_FAIL(fromB.load() == 2);
 		}
-		
 		return true;
 	}
 	
-	
-	bool blocking_wrappers()
+	bool eventfd_drain()
 	{
-		typedef BlockingConcurrentQueue<int, MallocTrackingTraits> Q;
-		ASSERT_OR_FAIL((Q::is_lock_free() == ConcurrentQueue<int, MallocTrackingTraits>::is_lock_free()));
-		
-		// Moving
-		{
-			Q a, b, c;
-			a = std::move(b);
-			b = std::move(c);
-			a = std::move(a);
-			c = std::move(b);
-			b = Q(std::move(b));
-			using std::swap;
-			swap(a, b);
-			a.swap(c);
-			c.swap(c);
-		}
-		
-		// Implicit
-		{
-			Q q;
-			ASSERT_OR_FAIL(q.enqueue(1));
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			int item;
-			ASSERT_OR_FAIL(q.try_dequeue(item));
-			ASSERT_OR_FAIL(item == 1);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-			ASSERT_OR_FAIL(q.size_approx() == 0);
-			
-			ASSERT_OR_FAIL(q.enqueue(2));
-			ASSERT_OR_FAIL(q.enqueue(3));
-			ASSERT_OR_FAIL(q.size_approx() == 2);
-			q.wait_dequeue(item);
-			ASSERT_OR_FAIL(item == 2);
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			q.wait_dequeue(item);
-			ASSERT_OR_FAIL(item == 3);
-			ASSERT_OR_FAIL(!q.try_dequeue(item));
-			ASSERT_OR_FAIL(q.size_approx() == 0);
-		}
+#ifdef MOODYCAMEL_HAS_EVENTFD
+		typedef BlockingConcurrentQueue<int, MallocTrackingTraits, EventFdWaitStrategy> Q;
+		auto readable = [](int fd, int timeout_msecs) {
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			return poll(&pfd, 1, timeout_msecs) == 1;
+		};
 		
-		// Implicit threaded
 		{
 			Q q;
-			const int THREADS = 8;
-			SimpleThread threads[THREADS];
-			bool success[THREADS];
+			int fd = q.notification_fd();
+			int items[10];
+			ASSERT_OR_FAIL(fd >= 0);
+			ASSERT_OR_FAIL(q.drain(items, 10) == 0);
+			ASSERT_OR_FAIL(!readable(fd, 0));
 			
-			for (int i = 0; i != THREADS; ++i) {
-				success[i] = true;
-				
-				if (i % 2 == 0) {
-					// Enqueue
-					if (i % 4 == 0) {
-						threads[i] = SimpleThread([&](int j) {
-							int stuff[5];
-							for (int k = 0; k != 2048; ++k) {
-								for (int x = 0; x != 5; ++x) {
-									stuff[x] = (j << 16) | (k * 5 + x);
-								}
-								success[j] = q.enqueue_bulk(stuff, 5) && success[j];
-							}
-						}, i);
-					}
-					else {
-						threads[i] = SimpleThread([&](int j) {
-							for (int k = 0; k != 4096; ++k) {
-								success[j] = q.enqueue((j << 16) | k) && success[j];
-							}
-						}, i);
-					}
-				}
-				else {
-					// Dequeue
-					threads[i] = SimpleThread([&](int j) {
-						int item;
-						std::vector<int> prevItems(THREADS, -1);
-						if (j % 4 == 1) {
-							for (int k = 0; k != 2048 * 5; ++k) {
-								if (q.try_dequeue(item)) {
-									int thread = item >> 16;
-									item &= 0xffff;
-									if (item <= prevItems[thread]) {
-										success[j] = false;
-									}
-									prevItems[thread] = item;
-								}
-							}
-						}
-						else {
-							int items[6];
-							for (int k = 0; k < 4096;  ++k) {
-								if (std::size_t dequeued = q.try_dequeue_bulk(items, 6)) {
-									for (std::size_t x = 0; x != dequeued; ++x) {
-										item = items[x];
-										int thread = item >> 16;
-										item &= 0xffff;
-										if (item <= prevItems[thread]) {
-											success[j] = false;
-										}
-										prevItems[thread] = item;
-									}
-								}
-							}
-						}
-					}, i);
-				}
+			// One signal for the whole batch
+			for (int i = 0; i != 5; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(i));
+				ASSERT_OR_FAIL(readable(fd, 0));
 			}
-			for (int i = 0; i != THREADS; ++i) {
-				threads[i].join();
+			ASSERT_OR_FAIL(q.drain(items, 10) == 5);
+			ASSERT_OR_FAIL(!readable(fd, 0));
+			for (int i = 0; i != 5; ++i) {
+				ASSERT_OR_FAIL(items[i] == i);
 			}
 			
-			for (int i = 0; i != THREADS; ++i) {
-				ASSERT_OR_FAIL(success[i]);
+			// A full batch leaves the queue unarmed
+			for (int i = 0; i != 20; ++i) {
+				ASSERT_OR_FAIL(q.enqueue(i));
 			}
+			ASSERT_OR_FAIL(readable(fd, 0));
+			ASSERT_OR_FAIL(q.drain(items, 10) == 10);
+			ASSERT_OR_FAIL(!readable(fd, 0));
+			ASSERT_OR_FAIL(q.drain(items, 10) == 10);
+			ASSERT_OR_FAIL(q.enqueue(0));
+			ASSERT_OR_FAIL(!readable(fd, 0));
+			ASSERT_OR_FAIL(q.drain(items, 10) == 1);
+			ASSERT_OR_FAIL(q.enqueue(0));
+			ASSERT_OR_FAIL(readable(fd, 0));
+			ASSERT_OR_FAIL(q.drain(items, 10) == 1);
 		}
 		
-		// Implicit threaded, blocking
+		// An event loop
 		{
 			Q q;
-			const int THREADS = 8;
-			SimpleThread threads[THREADS];
-			bool success[THREADS];
-			
-			for (int i = 0; i != THREADS; ++i) {
-				success[i] = true;
-				
-				if (i % 2 == 0) {
-					// Enqueue
-					if (i % 4 == 0) {
-						threads[i] = SimpleThread([&](int j) {
-							int stuff[5];
-							for (int k = 0; k != 2048; ++k) {
-								for (int x = 0; x != 5; ++x) {
-									stuff[x] = (j << 16) | (k * 5 + x);
-								}
-								success[j] = q.enqueue_bulk(stuff, 5) && success[j];
-							}
-						}, i);
-					}
-					else {
-						threads[i] = SimpleThread([&](int j) {
-							for (int k = 0; k != 4096; ++k) {
-								success[j] = q.enqueue((j << 16) | k) && success[j];
-							}
-						}, i);
+			SimpleThread producer([&]() {
+				for (int i = 0; i != 1000; ++i) {
+					q.enqueue(1);
+					if (i % 100 == 0) {
+						moodycamel::sleep(1);
 					}
 				}
-				else {
-					// Dequeue
-					threads[i] = SimpleThread([&](int j) {
-						int item;
-						std::vector<int> prevItems(THREADS, -1);
-						if (j % 4 == 1) {
-							for (int k = 0; k != 2048 * 5; ++k) {
-								q.wait_dequeue(item);
-								int thread = item >> 16;
-								item &= 0xffff;
-								if (item <= prevItems[thread]) {
-									success[j] = false;
-								}
-								prevItems[thread] = item;
-							}
-						}
-						else {
-							int items[6];
-							int k;
-							for (k = 0; k < 4090; ) {
-								if (std::size_t dequeued = q.wait_dequeue_bulk(items, 6)) {
-									for (std::size_t x = 0; x != dequeued; ++x) {
-										item = items[x];
-										int thread = item >> 16;
-										item &= 0xffff;
-										if (item <= prevItems[thread]) {
-											success[j] = false;
-										}
-										prevItems[thread] = item;
-									}
-									k += (int)dequeued;
-								}
-								else {
-									success[j] = false;
-								}
-							}
-							for (; k != 4096; ++k) {
-								q.wait_dequeue(item);
-								int thread = item >> 16;
-								item &= 0xffff;
-								if (item <= prevItems[thread]) {
-									success[j] = false;
-								}
-								prevItems[thread] = item;
-							}
-						}
-					}, i);
+			});
+			int sum = 0, items[16];
+			while (sum != 1000) {
+				size_t count = q.drain(items, 16);
+				for (size_t i = 0; i != count; ++i) {
+					sum += items[i];
+				}
+				if (count != 16 && sum != 1000) {
+					readable(q.notification_fd(), -1);
 				}
 			}
-			for (int i = 0; i != THREADS; ++i) {
-				threads[i].join();
+			producer.join();
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
+		}
+		
+		// Several producers (so dequeues can fail spuriously), and a loop that gives up
+		// if it's left waiting with elements in the queue
+		{
+			Q q;
+			SimpleThread producers[4];
+			for (int t = 0; t != 4; ++t) {
+				producers[t] = SimpleThread([&]() {
+					for (int i = 0; i != 5000; ++i) {
+						q.enqueue(1);
+					}
+				});
 			}
-			
-			for (int i = 0; i != THREADS; ++i) {
-				ASSERT_OR_FAIL(success[i]);
+			int sum = 0, items[16];
+			bool stuck = false;
+			while (sum != 20000 && !stuck) {
+				size_t count = q.drain(items, 16);
+				for (size_t i = 0; i != count; ++i) {
+					sum += items[i];
+				}
+				if (count != 16 && sum != 20000) {
+					stuck = !readable(q.notification_fd(), 5000);
+				}
 			}
-			ASSERT_OR_FAIL(q.size_approx() == 0);
+			for (int t = 0; t != 4; ++t) {
+				producers[t].join();
+			}
+			ASSERT_OR_FAIL(!stuck);
+			ASSERT_OR_FAIL(!q.try_dequeue(items[0]));
 		}
 		
-		// Explicit
+		// Running out of file descriptors is reported, rather than leaving a queue behind
+		// that can never wake anyone up (and without leaking what was already allocated)
+		{
+			struct rlimit limit;
+			ASSERT_OR_FAIL(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+			struct rlimit lowered = limit;
+			lowered.rlim_cur = 0;
+			ASSERT_OR_FAIL(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+			std::size_t usage = tracking_allocator::current_usage();
+			bool threw = false;
+			try {
+				Q q;
+			}
+			catch (std::system_error const& e) {
+				threw = e.code().value() == EMFILE;
+			}
+			setrlimit(RLIMIT_NOFILE, &limit);
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(tracking_allocator::current_usage() == usage);
+		}
+		
+		// The eventfd also works as a regular wait strategy
+		ASSERT_OR_FAIL((blocking_consumers<NoSpinTraits, EventFdWaitStrategy>()));
+#endif
+		return true;
+	}
+	
+#ifdef MOODYCAMEL_HAS_COROUTINES
+	template<typename Q, typename Executor = InlineExecutor>
+	static DetachedTask async_consumer(Q& q, int count, std::atomic<int>& sum, std::atomic<int>& done, Executor executor = Executor())
+	{
+		int item;
+		for (int i = 0; i != count; ++i) {
+			co_await q.async_dequeue(item, executor);
+			sum.fetch_add(item, std::memory_order_relaxed);
+		}
+		done.fetch_add(1, std::memory_order_release);
+	}
+	
+	template<typename Q, typename Executor>
+	static DetachedTask async_bulk_consumer(Q& q, int count, std::atomic<int>& sum, std::atomic<int>& done, Executor executor)
+	{
+		ConsumerToken tok(q);
+		int items[8];
+		for (int got = 0; got != count; ) {
+			size_t n = co_await q.async_dequeue_bulk(tok, items, (size_t)std::min(8, count - got), executor);
+			for (size_t i = 0; i != n; ++i) {
+				sum.fetch_add(items[i], std::memory_order_relaxed);
+			}
+			got += (int)n;
+		}
+		done.fetch_add(1, std::memory_order_release);
+	}
+#endif
+	
+#ifdef MOODYCAMEL_HAS_COROUTINES
+	template<typename Q>
+	static bool async_dequeue_from()
+	{
+		// Elements that are already there don't suspend anything
 		{
 			Q q;
-			ProducerToken pt(q);
-			ASSERT_OR_FAIL(q.enqueue(pt, 1));
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			int item;
-			ConsumerToken ct(q);
-			ASSERT_OR_FAIL(q.try_dequeue(ct, item));
-			ASSERT_OR_FAIL(item == 1);
-			ASSERT_OR_FAIL(!q.try_dequeue(ct, item));
-			ASSERT_OR_FAIL(q.size_approx() == 0);
-			
-			ASSERT_OR_FAIL(q.enqueue(pt, 2));
-			ASSERT_OR_FAIL(q.enqueue(pt, 3));
-			ASSERT_OR_FAIL(q.size_approx() == 2);
-			q.wait_dequeue(ct, item);
-			ASSERT_OR_FAIL(item == 2);
-			ASSERT_OR_FAIL(q.size_approx() == 1);
-			q.wait_dequeue(ct, item);
-			ASSERT_OR_FAIL(item == 3);
-			ASSERT_OR_FAIL(!q.try_dequeue(ct, item));
+			std::atomic<int> sum(0), done(0);
+			for (int i = 0; i != 10; ++i) {
+				q.enqueue(1);
+			}
+			async_consumer(q, 10, sum, done);
+			ASSERT_OR_FAIL(done.load() == 1 && sum.load() == 10);
+		}
+		
+		// Suspended coroutines are resumed by whoever enqueues, one per element
+		{
+			Q q;
+			std::atomic<int> sum(0), done(0);
+			for (int i = 0; i != 100; ++i) {
+				async_consumer(q, 10, sum, done);
+			}
+			ASSERT_OR_FAIL(done.load() == 0);
+			for (int i = 0; i != 500; ++i) {
+				q.enqueue(1);
+			}
+			ASSERT_OR_FAIL(sum.load() == 500);
+			int items[500];
+			for (int i = 0; i != 500; ++i) {
+				items[i] = 1;
+			}
+			q.enqueue_bulk(items, 500);
+			ASSERT_OR_FAIL(done.load() == 100 && sum.load() == 1000);
 			ASSERT_OR_FAIL(q.size_approx() == 0);
 		}
 		
-		// Explicit threaded
+		// Many coroutines on a couple of threads, fed from another thread
 		{
 			Q q;
-			const int THREADS = 8;
-			SimpleThread threads[THREADS];
-			bool success[THREADS];
-			
-			for (int i = 0; i != THREADS; ++i) {
-				success[i] = true;
-				
-				if (i % 2 == 0) {
-					// Enqueue
-					if (i % 4 == 0) {
-						threads[i] = SimpleThread([&](int j) {
-							ProducerToken t(q);
-							int stuff[5];
-							for (int k = 0; k != 2048; ++k) {
-								for (int x = 0; x != 5; ++x) {
-									stuff[x] = (j << 16) | (k * 5 + x);
-								}
-								success[j] = q.enqueue_bulk(t, stuff, 5) && success[j];
-							}
-						}, i);
-					}
-					else {
-						threads[i] = SimpleThread([&](int j) {
-							ProducerToken t(q);
-							for (int k = 0; k != 4096; ++k) {
-								success[j] = q.enqueue(t, (j << 16) | k) && success[j];
-							}
-						}, i);
+			std::atomic<int> sum(0), done(0);
+			{
+				PoolExecutor::Pool pool;
+				PoolExecutor executor = { &pool };
+				for (int i = 0; i != 50; ++i) {
+					async_consumer(q, 20, sum, done, executor);
+					async_bulk_consumer(q, 20, sum, done, executor);
+				}
+				SimpleThread producer([&]() {
+					for (int i = 0; i != 2000; ++i) {
+						q.enqueue(1);
+						if (i % 200 == 0) {
+							moodycamel::sleep(1);
+						}
 					}
+				});
+				producer.join();
+				while (done.load(std::memory_order_acquire) != 100) {
+					moodycamel::sleep(1);
 				}
-				else {
-					// Dequeue
-					threads[i] = SimpleThread([&](int j) {
-						ConsumerToken t(q);
-						int item;
-						std::vector<int> prevItems(THREADS, -1);
-						if (j % 4 == 1) {
-							for (int k = 0; k != 2048 * 5; ++k) {
-								if (q.try_dequeue(t, item)) {
-									int thread = item >> 16;
-									item &= 0xffff;
-									if (item <= prevItems[thread]) {
-										success[j] = false;
-									}
-									prevItems[thread] = item;
-								}
-							}
+			}
+			ASSERT_OR_FAIL(sum.load() == 2000);
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+		}
+		
+		// Coroutines resumed inline on the producers' threads, racing threads that steal
+		// the elements they were woken for (so they keep going back to waiting)
+		{
+			Q q;
+			std::atomic<int> sum(0), done(0), produced(0), stolen(0);
+			for (int i = 0; i != 100; ++i) {
+				async_consumer(q, 10, sum, done);
+			}
+			SimpleThread threads[4];
+			for (int t = 0; t != 4; ++t) {
+				threads[t] = SimpleThread([&, t]() {
+					int item;
+					while (done.load(std::memory_order_acquire) != 100) {
+						if (t < 2) {
+							q.enqueue(1);
+							produced.fetch_add(1, std::memory_order_relaxed);
 						}
-						else {
-							int items[6];
-							for (int k = 0; k < 4096;  ++k) {
-								if (std::size_t dequeued = q.try_dequeue_bulk(t, items, 6)) {
-									for (std::size_t x = 0; x != dequeued; ++x) {
-										item = items[x];
-										int thread = item >> 16;
-										item &= 0xffff;
-										if (item <= prevItems[thread]) {
-											success[j] = false;
-										}
-										prevItems[thread] = item;
-									}
-								}
-							}
+						else if (q.try_dequeue(item)) {
+							stolen.fetch_add(item, std::memory_order_relaxed);
 						}
-					}, i);
-				}
+					}
+				});
 			}
-			for (int i = 0; i != THREADS; ++i) {
-				threads[i].join();
+			for (int t = 0; t != 4; ++t) {
+				threads[t].join();
 			}
-			
-			for (int i = 0; i != THREADS; ++i) {
-				ASSERT_OR_FAIL(success[i]);
+			int item, left = 0;
+			while (q.try_dequeue(item)) {
+				left += item;
 			}
+			ASSERT_OR_FAIL(sum.load() == 1000);
+			ASSERT_OR_FAIL(sum.load() + stolen.load() + left == produced.load());
 		}
+		return true;
+	}
+
+#endif
+	bool async_dequeue()
+	{
+#ifdef MOODYCAMEL_HAS_COROUTINES
+		ASSERT_OR_FAIL((async_dequeue_from<BlockingConcurrentQueue<int, MallocTrackingTraits>>()));
+		// Also with sharded size counters, which don't see partly filled blocks
+		ASSERT_OR_FAIL((async_dequeue_from<BlockingConcurrentQueue<int, ShardedSizeTraits>>()));
+#endif
+		return true;
+	}
+	
+	bool emplace()
+	{
+		typedef TestTraits<4> Traits;
 		
-		// Explicit threaded, blocking
+		// Explicit
 		{
-			Q q;
-			const int THREADS = 8;
-			SimpleThread threads[THREADS];
-			bool success[THREADS];
+			ConcurrentQueue<Emplaceable, Traits> q;
+			ProducerToken tok(q);
+			for (int i = 0; i != 10; ++i) {
+				ASSERT_OR_FAIL(q.emplace(tok, i, 100));
+			}
+			ASSERT_OR_FAIL(q.emplace(tok));
+			ASSERT_OR_FAIL(q.size_approx() == 11);
 			
-			for (int i = 0; i != THREADS; ++i) {
-				success[i] = true;
-				
-				if (i % 2 == 0) {
-					// Enqueue
-					if (i % 4 == 0) {
-						threads[i] = SimpleThread([&](int j) {
-							ProducerToken t(q);
-							int stuff[5];
-							for (int k = 0; k != 2048; ++k) {
-								for (int x = 0; x != 5; ++x) {
-									stuff[x] = (j << 16) | (k * 5 + x);
-								}
-								success[j] = q.enqueue_bulk(t, stuff, 5) && success[j];
-							}
-						}, i);
-					}
-					else {
-						threads[i] = SimpleThread([&](int j) {
-							ProducerToken t(q);
-							for (int k = 0; k != 4096; ++k) {
-								success[j] = q.enqueue(t, (j << 16) | k) && success[j];
-							}
-						}, i);
-					}
-				}
-				else {
-					// Dequeue
-					threads[i] = SimpleThread([&](int j) {
-						ConsumerToken t(q);
-						int item;
-						std::vector<int> prevItems(THREADS, -1);
-						if (j % 4 == 1) {
-							for (int k = 0; k != 2048 * 5; ++k) {
-								q.wait_dequeue(t, item);
-								int thread = item >> 16;
-								item &= 0xffff;
-								if (item <= prevItems[thread]) {
-									success[j] = false;
-								}
-								prevItems[thread] = item;
-							}
-						}
-						else {
-							int items[6];
-							int k;
-							for (k = 0; k < 4090; ) {
-								if (std::size_t dequeued = q.wait_dequeue_bulk(t, items, 6)) {
-									for (std::size_t x = 0; x != dequeued; ++x) {
-										item = items[x];
-										int thread = item >> 16;
-										item &= 0xffff;
-										if (item <= prevItems[thread]) {
-											success[j] = false;
-										}
-										prevItems[thread] = item;
-									}
-									k += (int)dequeued;
-								}
-								else {
-									success[j] = false;
-								}
-							}
-							for (; k != 4096; ++k) {
-								q.wait_dequeue(t, item);
-								int thread = item >> 16;
-								item &= 0xffff;
-								if (item <= prevItems[thread]) {
-									success[j] = false;
-								}
-								prevItems[thread] = item;
-							}
-						}
-					}, i);
-				}
+			Emplaceable item;
+			for (int i = 0; i != 10; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item));
+				ASSERT_OR_FAIL(item.id == i + 100);
+				ASSERT_OR_FAIL(item.assigned);
 			}
-			for (int i = 0; i != THREADS; ++i) {
-				threads[i].join();
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == -1);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+		}
+		
+		// Implicit
+		{
+			ConcurrentQueue<Emplaceable, Traits> q;
+			for (int i = 0; i != 10; ++i) {
+				ASSERT_OR_FAIL(q.emplace(i, 100));
 			}
 			
-			for (int i = 0; i != THREADS; ++i) {
-				ASSERT_OR_FAIL(success[i]);
+			Emplaceable item;
+			for (int i = 0; i != 10; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item));
+				ASSERT_OR_FAIL(item.id == i + 100);
 			}
-			ASSERT_OR_FAIL(q.size_approx() == 0);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
 		}
 		
-		return true;
-	}
-	
-	bool timed_blocking_wrappers()
-	{
-		typedef BlockingConcurrentQueue<int, MallocTrackingTraits> Q;
-		
-		// Implicit
+		// try_emplace doesn't allocate
 		{
-			Q q;
-			int item;
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 0));
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 1));
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 100));
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, std::chrono::milliseconds(1)));
-			q.enqueue(123);
-			ASSERT_OR_FAIL(q.wait_dequeue_timed(item, 0));
-			ASSERT_OR_FAIL(item == 123);
+			ConcurrentQueue<Emplaceable, Traits> q(4);
+			ProducerToken tok(q);
+			for (int i = 0; i != 4; ++i) {
+				ASSERT_OR_FAIL(q.try_emplace(tok, i, 0));
+			}
+			ASSERT_OR_FAIL(!q.try_emplace(tok, 4, 0));
+			
+			Emplaceable item;
+			ASSERT_OR_FAIL(q.try_dequeue(item));
+			ASSERT_OR_FAIL(item.id == 0);
+			ASSERT_OR_FAIL(q.size_approx() == 3);
 		}
 		
-		// Implicit, threaded
+		// Bulk generation
 		{
-			Q q;
-			const int THREADS = 8;
-			SimpleThread threads[THREADS];
-			bool success[THREADS];
+			ConcurrentQueue<int, Traits> q;
+			ProducerToken tok(q);
+			int next = 0;
+			ASSERT_OR_FAIL(q.enqueue_bulk_generate(tok, 10, [&]() { return next++; }));
+			ASSERT_OR_FAIL(next == 10);
+			ASSERT_OR_FAIL(q.enqueue_bulk_generate(7, [&]() { return next++; }));
+			ASSERT_OR_FAIL(next == 17);
 			
-			for (int i = 0; i != THREADS; ++i) {
-				success[i] = true;
-				
-				if (i % 2 == 0) {
-					// Enqueue
-					if (i % 4 == 0) {
-						threads[i] = SimpleThread([&](int j) {
-							int stuff[5];
-							for (int k = 0; k != 2048; ++k) {
-								for (int x = 0; x != 5; ++x) {
-									stuff[x] = (j << 16) | (k * 5 + x);
-								}
-								success[j] = q.enqueue_bulk(stuff, 5) && success[j];
-							}
-						}, i);
-					}
-					else {
-						threads[i] = SimpleThread([&](int j) {
-							for (int k = 0; k != 4096; ++k) {
-								success[j] = q.enqueue((j << 16) | k) && success[j];
-							}
-						}, i);
-					}
-				}
-				else {
-					// Dequeue
-					threads[i] = SimpleThread([&](int j) {
-						int item;
-						std::vector<int> prevItems(THREADS, -1);
-						if (j % 4 == 1) {
-							for (int k = 0; k != 2048 * 5; ++k) {
-								if (!q.wait_dequeue_timed(item, 1000)) {
-									--k;
-									continue;
-								}
-								int thread = item >> 16;
-								item &= 0xffff;
-								if (item <= prevItems[thread]) {
-									success[j] = false;
-								}
-								prevItems[thread] = item;
-							}
-						}
-						else {
-							int items[6];
-							int k;
-							for (k = 0; k < 4090; ) {
-								if (std::size_t dequeued = q.wait_dequeue_bulk_timed(items, 6, 1000)) {
-									for (std::size_t x = 0; x != dequeued; ++x) {
-										item = items[x];
-										int thread = item >> 16;
-										item &= 0xffff;
-										if (item <= prevItems[thread]) {
-											success[j] = false;
-										}
-										prevItems[thread] = item;
-									}
-									k += (int)dequeued;
-								}
-							}
-							for (; k != 4096; ++k) {
-								if (!q.wait_dequeue_timed(item, std::chrono::hours(1))) {
-									success[j] = false;
-								}
-								int thread = item >> 16;
-								item &= 0xffff;
-								if (item <= prevItems[thread]) {
-									success[j] = false;
-								}
-								prevItems[thread] = item;
-							}
-						}
-					}, i);
-				}
-			}
-			for (int i = 0; i != THREADS; ++i) {
-				threads[i].join();
+			int item;
+			for (int i = 0; i != 10; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue_from_producer(tok, item));
+				ASSERT_OR_FAIL(item == i);
 			}
-			
-			for (int i = 0; i != THREADS; ++i) {
-				ASSERT_OR_FAIL(success[i]);
+			for (int i = 10; i != 17; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(item));
+				ASSERT_OR_FAIL(item == i);
 			}
-			ASSERT_OR_FAIL(q.size_approx() == 0);
-			
-			int item;
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 0));
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
 		}
-		
-		// Explicit
 		{
-			Q q;
-			ProducerToken ptok(q);
-			ConsumerToken ctok(q);
-			int item;
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(ctok, item, 0));
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(ctok, item, 1));
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(ctok, item, 100));
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(ctok, item, std::chrono::milliseconds(1)));
-			q.enqueue(ptok, 123);
-			ASSERT_OR_FAIL(q.wait_dequeue_timed(ctok, item, 0));
-			ASSERT_OR_FAIL(item == 123);
+			ConcurrentQueue<int, Traits> q(8);
+			ProducerToken tok(q);
+			int calls = 0;
+			ASSERT_OR_FAIL(!q.try_enqueue_bulk_generate(tok, 9, [&]() { return calls++; }));
+			ASSERT_OR_FAIL(calls == 0);
+			ASSERT_OR_FAIL(q.try_enqueue_bulk_generate(tok, 8, [&]() { return calls++; }));
+			ASSERT_OR_FAIL(calls == 8);
+			ASSERT_OR_FAIL(q.size_approx() == 8);
 		}
 		
-		// Explicit, threaded
+		// A generator that throws reverts the whole operation
 		{
-			Q q;
-			const int THREADS = 8;
-			SimpleThread threads[THREADS];
-			bool success[THREADS];
+			ConcurrentQueue<ThrowingMovable, Traits> q;
+			ProducerToken tok(q);
+			ThrowingMovable::reset();
 			
-			for (int i = 0; i != THREADS; ++i) {
-				success[i] = true;
-				
-				if (i % 2 == 0) {
-					// Enqueue
-					if (i % 4 == 0) {
-						threads[i] = SimpleThread([&](int j) {
-							ProducerToken tok(q);
-							int stuff[5];
-							for (int k = 0; k != 2048; ++k) {
-								for (int x = 0; x != 5; ++x) {
-									stuff[x] = (j << 16) | (k * 5 + x);
-								}
-								success[j] = q.enqueue_bulk(tok, stuff, 5) && success[j];
-							}
-						}, i);
-					}
-					else {
-						threads[i] = SimpleThread([&](int j) {
-							ProducerToken tok(q);
-							for (int k = 0; k != 4096; ++k) {
-								success[j] = q.enqueue(tok, (j << 16) | k) && success[j];
-							}
-						}, i);
+			int made = 0;
+			bool threw = false;
+			try {
+				q.enqueue_bulk_generate(tok, 6, [&]() -> ThrowingMovable {
+					if (made == 5) {
+						throw made;
 					}
-				}
-				else {
-					// Dequeue
-					threads[i] = SimpleThread([&](int j) {
-						int item;
-						std::vector<int> prevItems(THREADS, -1);
-						ConsumerToken tok(q);
-						if (j % 4 == 1) {
-							for (int k = 0; k != 2048 * 5; ++k) {
-								if (!q.wait_dequeue_timed(tok, item, 1000)) {
-									--k;
-									continue;
-								}
-								int thread = item >> 16;
-								item &= 0xffff;
-								if (item <= prevItems[thread]) {
-									success[j] = false;
-								}
-								prevItems[thread] = item;
-							}
-						}
-						else {
-							int items[6];
-							int k;
-							for (k = 0; k < 4090; ) {
-								if (std::size_t dequeued = q.wait_dequeue_bulk_timed(tok, items, 6, 1000)) {
-									for (std::size_t x = 0; x != dequeued; ++x) {
-										item = items[x];
-										int thread = item >> 16;
-										item &= 0xffff;
-										if (item <= prevItems[thread]) {
-											success[j] = false;
-										}
-										prevItems[thread] = item;
-									}
-									k += (int)dequeued;
-								}
-							}
-							for (; k != 4096; ++k) {
-								if (!q.wait_dequeue_timed(tok, item, std::chrono::hours(1))) {
-									success[j] = false;
-								}
-								int thread = item >> 16;
-								item &= 0xffff;
-								if (item <= prevItems[thread]) {
-									success[j] = false;
-								}
-								prevItems[thread] = item;
-							}
-						}
-					}, i);
-				}
+					return ThrowingMovable(made++);
+				});
 			}
-			for (int i = 0; i != THREADS; ++i) {
-				threads[i].join();
+			catch (int) {
+				threw = true;
 			}
+			ASSERT_OR_FAIL(threw);
+			ASSERT_OR_FAIL(q.size_approx() == 0);
+			ASSERT_OR_FAIL(ThrowingMovable::ctorCount() == ThrowingMovable::destroyCount());
 			
-			for (int i = 0; i != THREADS; ++i) {
-				ASSERT_OR_FAIL(success[i]);
+			made = 0;
+			ASSERT_OR_FAIL(q.enqueue_bulk_generate(tok, 3, [&]() { return ThrowingMovable(made++); }));
+			ThrowingMovable result(-1);
+			for (int i = 0; i != 3; ++i) {
+				ASSERT_OR_FAIL(q.try_dequeue(result));
+				ASSERT_OR_FAIL(result.id == i);
 			}
-			ASSERT_OR_FAIL(q.size_approx() == 0);
+			ASSERT_OR_FAIL(!q.try_dequeue(result));
+		}
+		
+		// Blocking
+		{
+			BlockingConcurrentQueue<Emplaceable, Traits> q;
+			ProducerToken tok(q);
+			ASSERT_OR_FAIL(q.emplace(1, 2));
+			ASSERT_OR_FAIL(q.try_emplace(tok, 3, 4));
 			
-			int item;
-			ConsumerToken tok(q);
-			ASSERT_OR_FAIL(!q.wait_dequeue_timed(tok, item, 0));
+			Emplaceable item;
+			q.wait_dequeue(item);
+			ASSERT_OR_FAIL(item.id == 3 || item.id == 7);
+			q.wait_dequeue(item);
+			ASSERT_OR_FAIL(item.id == 3 || item.id == 7);
+			ASSERT_OR_FAIL(!q.try_dequeue(item));
+			
+			BlockingConcurrentQueue<int, Traits> q2;
+			int next = 0;
+			ASSERT_OR_FAIL(q2.enqueue_bulk_generate(5, [&]() { return next++; }));
+			int items[5];
+			ASSERT_OR_FAIL(q2.wait_dequeue_bulk(items, 5) == 5);
+			for (int i = 0; i != 5; ++i) {
+				ASSERT_OR_FAIL(items[i] == i);
+			}
 		}
 		
 		return true;